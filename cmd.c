@@ -32,6 +32,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 #include "config.h"
 #include "proclib.h"
 #include "ipc.h"
@@ -40,6 +41,7 @@
 #include "hashtable.h"
 #include "xdr.h"
 #include "cmd-pkt.h"
+#include "trace.h"
 
 struct DatareqCmd {
    struct CMD_XDRCommandInfo *cmd;
@@ -77,17 +79,126 @@ struct CMDResponseCb {
    void *arg;
    enum IPC_CB_TYPE cb_type;
    void *to_evt;
+   unsigned int timeout;
    ProcessData *proc;
    struct CMDResponseCb *next;
 };
 
-struct DataReqParams {
-   struct IPC_OpaqueStruct *dest;
+// Outgoing message that was sent in fragments.  The message is held so
+//  that pieces the receiver reports as missing can be retransmitted.
+struct CMDFragTx {
+   uint32_t cmd;
+   uint32_t ipcref;
+   struct sockaddr_in dest;
+   char *data;
+   size_t len;
+   void *to_evt;
+   ProcessData *proc;
+   struct CMDFragTx *next;
+};
+
+// Replies collected while the commands of a batch are dispatched
+struct CMDBatchReply {
+   struct sockaddr_in dest;
+   uint32_t ipcref;
+   struct IPC_OpaqueStruct *msgs;
+   int count;
+   int alloc;
+   size_t bytes;
+};
+
+// A remote process receiving pushes of a published struct type
+struct CMDSubscriber {
+   struct sockaddr_in addr;
+   unsigned int period;
+   struct timeval due;
+   struct timeval expires;
+   struct CMDSubscriber *next;
+};
+
+// A struct type pushed to subscribers from a single populator run
+struct CMDPublication {
+   uint32_t type;
+   unsigned int period;
+   uint32_t seq;
+   struct timeval now;
+   void *evt;
+   struct CMDSubscriber *subs;
+   struct ProcessData *proc;
+   struct CMDPublication *next;
+};
+
+// A local subscription to a struct type published by another process
+struct CMDSubscription {
+   struct sockaddr_in addr;
    uint32_t type;
+   unsigned int period;
+   struct timeval due;
+   IPC_telemetry_callback cb;
+   void *arg;
+   void *renew_evt;
+   struct ProcessData *proc;
+   struct CMDSubscription *next;
+};
+
+// Incoming message being reassembled from fragments
+struct CMDFragRx {
+   uint32_t cmd;
+   uint32_t ipcref;
+   struct sockaddr_in host;
+   struct CMD_RxBuffer *msg;
+   uint8_t *have;
+   uint32_t fragCnt;
+   uint32_t recvd;
+   int nacks;
+   int fd;
+   void *to_evt;
+   ProcessData *proc;
+   struct CMDFragRx *next;
+};
+
+/// Initial buffer size for a multi-struct data request response
+#define CMD_RESP_BUILDER_INIT_SIZE 4096
+
+// Builds a multi-struct data request response in its final encoded form,
+//  so every struct is encoded exactly once directly into place
+struct CMDRespBuilder {
+   char *buff;
+   size_t len;
+   size_t alloc;
+   int32_t count;
+   int failed;
+};
+
+// A data request that stays alive until every populator has reported or
+//  its deadline passes
+struct CMDDataReq {
    struct ProcessData *proc;
+   struct IPC_Command cmd;
+   struct sockaddr_in from;
+   struct CMDRespBuilder bld;
    int direct_resp;
-   struct IPC_Command *cmd;
-   struct sockaddr_in *from;
+   int pending;
+   int refcnt;
+   int sent;
+   int dispatching;
+   void *deadline_evt;
+   struct CMD_PopulatorHandle *handles;
+   struct CMDDataReq *next;
+};
+
+struct DataReqParams {
+   struct CMDDataReq *req;
+   uint32_t type;
+   struct XDR_StructDefinition *def;
+};
+
+struct CMD_PopulatorHandle {
+   XDR_tx_struct cb;
+   struct DataReqParams params;
+   struct ProcessData *proc;
+   uint32_t type;
+   struct CMD_PopulatorHandle *next;
 };
 
 struct Command {
@@ -101,14 +212,156 @@ struct CommandCbArg {
    struct ProcessData *proc;
    struct CMDResponseCb *resp;
    struct IPC_Heartbeat beats;
+   struct CMDFragTx *fragTx;
+   struct CMDFragRx *fragRx;
+   size_t fragRxBytes;
+   struct CMDBatchReply *batch;
+   struct CMDPublication *pubs;
+   struct CMDSubscription *subs;
+   struct CMDDataReq *dataReqs;
+   unsigned int popDeadline;
 };
 
 struct CMD_XDRCommandInfo *CMD_xdr_cmd_by_number(uint32_t num);
 static void fakeStatusCommand(int socket, unsigned char cmd, void * data,
       size_t dataLen, struct sockaddr_in * src);
+static void cmd_handle_fragment(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd);
+static void cmd_handle_fragment_nack(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd);
+static void cmd_handle_batch(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd);
+static void cmd_handle_subscribe(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd);
+static void cmd_handle_unsubscribe(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd);
+static void cmd_handle_telemetry(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd);
+static void cmd_publication_free(struct CMDPublication *pub);
+static void cmd_subscription_free(struct CMDSubscription *sub);
+static void cmd_data_req_orphan(struct CMDDataReq *req);
+static void telemetry_populate_cb(void *data, void *arg, uint32_t error);
+static void cmd_frag_tx_free(struct CMDFragTx *tx);
+static void cmd_frag_rx_free(struct CMDFragRx *rx);
 
 static ProcessData *cmdGProc = NULL;
 
+/// Maximum number of idle receive buffers kept in the pool
+#define CMD_RXBUFF_POOL_MAX 4
+
+static struct CMD_RxBuffer *rxBuffPool = NULL;
+static int rxBuffPoolLen = 0;
+static pthread_mutex_t rxBuffMutex = PTHREAD_MUTEX_INITIALIZER;
+static struct CMD_RxBuffer *rxBuffCurrent = NULL;
+
+static struct CMD_RxBuffer *cmd_rxbuff_get(void)
+{
+   struct CMD_RxBuffer *buff;
+
+   pthread_mutex_lock(&rxBuffMutex);
+   buff = rxBuffPool;
+   if (buff) {
+      rxBuffPool = buff->next;
+      rxBuffPoolLen--;
+   }
+   pthread_mutex_unlock(&rxBuffMutex);
+
+   if (!buff) {
+      buff = malloc(sizeof(*buff) + MAX_IP_PACKET_SIZE);
+      if (!buff)
+         return NULL;
+      buff->data = (unsigned char*)(buff + 1);
+      buff->size = MAX_IP_PACKET_SIZE;
+   }
+
+   buff->len = 0;
+   buff->refcnt = 1;
+   buff->next = NULL;
+   buff->data[0] = 0;
+
+   return buff;
+}
+
+struct CMD_RxBuffer *CMD_rxbuff_retain(struct CMD_RxBuffer *buff)
+{
+   if (buff)
+      __sync_add_and_fetch(&buff->refcnt, 1);
+   return buff;
+}
+
+struct CMD_RxBuffer *CMD_rxbuff_retain_current(void)
+{
+   return CMD_rxbuff_retain(rxBuffCurrent);
+}
+
+void CMD_rxbuff_release(struct CMD_RxBuffer *buff)
+{
+   if (!buff || __sync_sub_and_fetch(&buff->refcnt, 1) > 0)
+      return;
+
+   pthread_mutex_lock(&rxBuffMutex);
+   if (rxBuffPoolLen < CMD_RXBUFF_POOL_MAX &&
+         buff->size == MAX_IP_PACKET_SIZE) {
+      buff->next = rxBuffPool;
+      rxBuffPool = buff;
+      rxBuffPoolLen++;
+      buff = NULL;
+   }
+   pthread_mutex_unlock(&rxBuffMutex);
+
+   free(buff);
+}
+
+// Allocates a buffer large enough for a reassembled message.  These
+//  buffers are never placed back in the pool.
+static struct CMD_RxBuffer *cmd_rxbuff_alloc(size_t size)
+{
+   struct CMD_RxBuffer *buff;
+
+   buff = malloc(sizeof(*buff) + size);
+   if (!buff)
+      return NULL;
+
+   memset(buff, 0, sizeof(*buff));
+   buff->data = (unsigned char*)(buff + 1);
+   buff->size = size;
+   buff->refcnt = 1;
+
+   return buff;
+}
+
+static void cmd_rxbuff_pool_cleanup(void)
+{
+   struct CMD_RxBuffer *buff;
+
+   pthread_mutex_lock(&rxBuffMutex);
+   while ((buff = rxBuffPool)) {
+      rxBuffPool = buff->next;
+      free(buff);
+   }
+   rxBuffPoolLen = 0;
+   pthread_mutex_unlock(&rxBuffMutex);
+}
+
+// Reads a datagram into a pooled buffer.  Returns NULL if nothing was read.
+static struct CMD_RxBuffer *cmd_rxbuff_read(int socket)
+{
+   struct CMD_RxBuffer *buff = cmd_rxbuff_get();
+   int len;
+
+   if (!buff)
+      return NULL;
+
+   len = socket_read(socket, buff->data, MAX_IP_PACKET_SIZE, &buff->src);
+   if (len <= 0) {
+      CMD_rxbuff_release(buff);
+      return NULL;
+   }
+   buff->len = len;
+
+   return buff;
+}
+
 static void CMD_hash_cleanup(void)
 {
    struct DatareqCmd *node;
@@ -128,110 +381,898 @@ static void CMD_hash_cleanup(void)
    }
 }
 
-void heartbeat_populator(void *arg, XDR_tx_struct cb, void *cb_args)
+void heartbeat_populator(void *arg, XDR_tx_struct cb, void *cb_args)
+{
+   struct CommandCbArg *cmds = (struct CommandCbArg*)arg;
+
+   if (!cmds)
+      return;
+
+   cmds->beats.heartbeats++;
+   cb(&cmds->beats, cb_args, IPC_RESULTCODE_SUCCESS);
+}
+
+// Sends a successful response whose data union is already encoded
+static void cmd_response_encoded(struct ProcessData *proc,
+      struct IPC_Command *cmd, const char *data, size_t dataLen,
+      struct sockaddr_in *dest)
+{
+   struct IPC_ResponseHeader hdr;
+   size_t len = 0;
+   char *buff;
+
+   buff = malloc(dataLen + IPC_RESP_HDR_SIZE);
+   if (!buff)
+      return;
+
+   hdr.cmd = IPC_CMDS_RESPONSE;
+   hdr.ipcref = cmd->ipcref;
+   hdr.result = IPC_RESULTCODE_SUCCESS;
+   if (IPC_ResponseHeader_encode(&hdr, buff, &len, IPC_RESP_HDR_SIZE,
+            NULL) < 0) {
+      free(buff);
+      return;
+   }
+
+   memcpy(buff + len, data, dataLen);
+   CMD_send_xdr(proc, buff, len + dataLen, dest);
+}
+
+static int cmd_resp_builder_reserve(struct CMDRespBuilder *bld, size_t extra)
+{
+   size_t alloc = bld->alloc;
+   char *buff;
+
+   if (bld->failed)
+      return -1;
+   if (bld->len + extra <= bld->alloc)
+      return 0;
+
+   while (alloc < bld->len + extra)
+      alloc *= 2;
+   buff = realloc(bld->buff, alloc);
+   if (!buff) {
+      bld->failed = 1;
+      return -1;
+   }
+   bld->buff = buff;
+   bld->alloc = alloc;
+
+   return 0;
+}
+
+// Writes the response header and OpaqueStructArr prefix.  The array
+//  length is backpatched once all the structs are in.
+static int cmd_resp_builder_init(struct CMDRespBuilder *bld,
+      struct IPC_Command *cmd)
+{
+   struct IPC_ResponseHeader hdr;
+   uint32_t type = IPC_TYPES_OPAQUE_STRUCT_ARR;
+   size_t used = 0;
+
+   memset(bld, 0, sizeof(*bld));
+   bld->alloc = CMD_RESP_BUILDER_INIT_SIZE;
+   bld->buff = malloc(bld->alloc);
+   if (!bld->buff)
+      return -1;
+
+   hdr.cmd = IPC_CMDS_RESPONSE;
+   hdr.ipcref = cmd->ipcref;
+   hdr.result = IPC_RESULTCODE_SUCCESS;
+   IPC_ResponseHeader_encode(&hdr, bld->buff, &used, bld->alloc, NULL);
+   bld->len = used;
+   XDR_encode_uint32(&type, bld->buff + bld->len, &used, sizeof(type), NULL);
+   bld->len += used + sizeof(int32_t);
+
+   return 0;
+}
+
+// Appends one OpaqueStruct holding data encoded as a type-prefixed
+//  union.  Returns the encoded union, which lives inside the builder.
+static char *cmd_resp_builder_add(struct CMDRespBuilder *bld, void *data,
+      uint32_t type, size_t *encLen)
+{
+   struct XDR_Union un;
+   size_t lenOff, needed = 0, used;
+   int32_t len;
+
+   un.type = type;
+   un.data = data;
+
+   if (cmd_resp_builder_reserve(bld, sizeof(int32_t) + 256) < 0)
+      return NULL;
+   lenOff = bld->len;
+
+   if (XDR_encode_union(&un, bld->buff + lenOff + sizeof(int32_t), &needed,
+            bld->alloc - lenOff - sizeof(int32_t), NULL) < 0) {
+      if (needed <= bld->alloc - lenOff - sizeof(int32_t) ||
+            cmd_resp_builder_reserve(bld, sizeof(int32_t) + needed) < 0)
+         return NULL;
+      needed = 0;
+      if (XDR_encode_union(&un, bld->buff + lenOff + sizeof(int32_t),
+               &needed, bld->alloc - lenOff - sizeof(int32_t), NULL) < 0)
+         return NULL;
+   }
+
+   // Opaque data is padded to a multiple of four bytes
+   len = needed;
+   XDR_encode_int32(&len, bld->buff + lenOff, &used, sizeof(len), NULL);
+   bld->len = lenOff + sizeof(int32_t) + needed;
+   if (cmd_resp_builder_reserve(bld, 3) < 0)
+      return NULL;
+   while (bld->len % 4)
+      bld->buff[bld->len++] = 0;
+   bld->count++;
+
+   if (encLen)
+      *encLen = needed;
+   return bld->buff + lenOff + sizeof(int32_t);
+}
+
+// Appends one OpaqueStruct whose contents are already encoded
+static void cmd_resp_builder_add_encoded(struct CMDRespBuilder *bld,
+      const char *enc, size_t encLen)
+{
+   size_t used;
+   int32_t len = encLen;
+
+   if (cmd_resp_builder_reserve(bld, sizeof(int32_t) + encLen + 3) < 0)
+      return;
+
+   XDR_encode_int32(&len, bld->buff + bld->len, &used, sizeof(len), NULL);
+   bld->len += sizeof(int32_t);
+   memcpy(bld->buff + bld->len, enc, encLen);
+   bld->len += encLen;
+   while (bld->len % 4)
+      bld->buff[bld->len++] = 0;
+   bld->count++;
+}
+
+// Backpatches the array length and sends the response.  The builder's
+//  buffer is handed off to the send path.
+static void cmd_resp_builder_send(struct CMDRespBuilder *bld,
+      struct ProcessData *proc, struct IPC_Command *cmd,
+      struct sockaddr_in *dest)
+{
+   size_t used;
+
+   if (bld->failed) {
+      free(bld->buff);
+      bld->buff = NULL;
+      IPC_error(proc, cmd, IPC_RESULTCODE_ALLOCATION_ERR, dest);
+      return;
+   }
+
+   XDR_encode_int32(&bld->count,
+         bld->buff + IPC_RESP_HDR_SIZE + sizeof(uint32_t), &used,
+         sizeof(int32_t), NULL);
+   CMD_send_xdr(proc, bld->buff, bld->len, dest);
+   bld->buff = NULL;
+}
+
+void data_req_populate_cb(void *data, void *arg, uint32_t error)
+{
+   struct DataReqParams *params;
+   struct CMDDataReq *req;
+   struct IPC_PopulatorError err;
+   struct IPC_OpaqueStruct enc;
+   const char *encoded;
+   size_t encLen = 0;
+
+   if (!arg || !data)
+      return;
+   params = (struct DataReqParams*)arg;
+   req = params->req;
+   if (!req || req->sent || !req->proc)
+      return;
+
+   if (req->direct_resp) {
+      if (error != IPC_RESULTCODE_SUCCESS)
+         IPC_error(req->proc, &req->cmd, error, &req->from);
+      else if (params->def && XDR_populator_is_cached(params->type)) {
+         enc = CMD_struct_to_opaque_struct(data, params->type);
+         if (!enc.data)
+            return;
+         XDR_populator_cache_store(params->def, enc.data, enc.length);
+         cmd_response_encoded(req->proc, &req->cmd, enc.data, enc.length,
+               &req->from);
+         free(enc.data);
+      }
+      else
+         IPC_response(req->proc, &req->cmd, params->type,
+               data, &req->from);
+   }
+   else {
+      if (error != IPC_RESULTCODE_SUCCESS) {
+         err.type = params->type;
+         err.error = error;
+         cmd_resp_builder_add(&req->bld, &err, IPC_TYPES_POPULATOR_ERROR,
+               NULL);
+      }
+      else {
+         encoded = cmd_resp_builder_add(&req->bld, data, params->type,
+               &encLen);
+         if (encoded)
+            XDR_populator_cache_store(params->def, encoded, encLen);
+      }
+   }
+}
+
+static void cmd_data_req_release(struct CMDDataReq *req)
+{
+   struct CMDDataReq **itr;
+
+   if (--req->refcnt > 0)
+      return;
+
+   if (req->proc) {
+      for (itr = &req->proc->cmds->dataReqs; *itr; itr = &(*itr)->next) {
+         if (*itr == req) {
+            *itr = req->next;
+            break;
+         }
+      }
+      if (req->deadline_evt)
+         EVT_sched_remove(PROC_evt(req->proc), req->deadline_evt);
+   }
+
+   free(req->bld.buff);
+   free(req);
+}
+
+// Detaches a request from its process during cleanup.  Populators still
+//  holding handles can complete them safely, nothing more is sent.
+static void cmd_data_req_orphan(struct CMDDataReq *req)
+{
+   req->proc->cmds->dataReqs = req->next;
+   req->next = NULL;
+   if (req->deadline_evt)
+      EVT_sched_remove(PROC_evt(req->proc), req->deadline_evt);
+   req->deadline_evt = NULL;
+   req->proc = NULL;
+   req->sent = 1;
+}
+
+// Sends the response once, reporting any populator that has not finished
+static void cmd_data_req_finish(struct CMDDataReq *req)
+{
+   struct CMD_PopulatorHandle *handle;
+   struct IPC_PopulatorError err;
+
+   if (req->sent || !req->proc)
+      return;
+
+   if (req->direct_resp) {
+      if (req->pending)
+         IPC_error(req->proc, &req->cmd, IPC_RESULTCODE_POPULATOR_TIMEOUT,
+               &req->from);
+   }
+   else {
+      for (handle = req->handles; handle; handle = handle->next) {
+         err.type = handle->params.type;
+         err.error = IPC_RESULTCODE_POPULATOR_TIMEOUT;
+         cmd_resp_builder_add(&req->bld, &err, IPC_TYPES_POPULATOR_ERROR,
+               NULL);
+      }
+      cmd_resp_builder_send(&req->bld, req->proc, &req->cmd, &req->from);
+   }
+
+   req->sent = 1;
+   if (req->deadline_evt)
+      EVT_sched_remove(PROC_evt(req->proc), req->deadline_evt);
+   req->deadline_evt = NULL;
+}
+
+static int data_req_deadline_cb(void *arg)
+{
+   struct CMDDataReq *req = (struct CMDDataReq*)arg;
+
+   DBG_print(DBG_LEVEL_WARN, "Data request %u missed its deadline with %d "
+         "populators outstanding\n", req->cmd.ipcref, req->pending);
+   req->deadline_evt = NULL;
+   cmd_data_req_finish(req);
+
+   return EVENT_REMOVE;
+}
+
+struct CMD_PopulatorHandle *CMD_populator_defer(XDR_tx_struct cb,
+      void *cb_arg)
+{
+   struct CMD_PopulatorHandle *handle;
+   struct DataReqParams *params;
+   struct CMDPublication *pub;
+
+   if (!cb_arg)
+      return NULL;
+
+   handle = malloc(sizeof(*handle));
+   if (!handle)
+      return NULL;
+   memset(handle, 0, sizeof(*handle));
+   handle->cb = cb;
+
+   if (cb == &data_req_populate_cb) {
+      params = (struct DataReqParams*)cb_arg;
+      if (!params->req || params->req->sent) {
+         free(handle);
+         return NULL;
+      }
+      handle->params = *params;
+      params->req->pending++;
+      params->req->refcnt++;
+      handle->next = params->req->handles;
+      params->req->handles = handle;
+   }
+   else if (cb == &telemetry_populate_cb) {
+      // The publication may be gone by the time the data arrives, so
+      //  look it up again on completion
+      pub = (struct CMDPublication*)cb_arg;
+      handle->proc = pub->proc;
+      handle->type = pub->type;
+   }
+   else {
+      free(handle);
+      return NULL;
+   }
+
+   return handle;
+}
+
+void CMD_populator_complete(struct CMD_PopulatorHandle *handle, void *data,
+      uint32_t error)
+{
+   struct CMD_PopulatorHandle **itr;
+   struct CMDDataReq *req;
+   struct CMDPublication *pub;
+
+   if (!handle)
+      return;
+
+   if (handle->cb == &data_req_populate_cb) {
+      req = handle->params.req;
+      for (itr = &req->handles; *itr; itr = &(*itr)->next) {
+         if (*itr == handle) {
+            *itr = handle->next;
+            break;
+         }
+      }
+
+      if (req->sent)
+         DBG_print(DBG_LEVEL_INFO, "Populator for 0x%08x finished after "
+               "data request %u was answered\n", handle->params.type,
+               req->cmd.ipcref);
+      else
+         data_req_populate_cb(data, &handle->params, error);
+
+      // While still dispatching, the handler finishes the request itself
+      if (--req->pending == 0 && !req->dispatching)
+         cmd_data_req_finish(req);
+      cmd_data_req_release(req);
+   }
+   else if (handle->cb == &telemetry_populate_cb && handle->proc->cmds) {
+      for (pub = handle->proc->cmds->pubs; pub; pub = pub->next)
+         if (pub->type == handle->type)
+            break;
+      if (pub)
+         telemetry_populate_cb(data, pub, error);
+   }
+
+   free(handle);
+}
+
+void CMD_set_populator_deadline(struct ProcessData *proc, unsigned int ms)
+{
+   if (proc && proc->cmds)
+      proc->cmds->popDeadline = ms;
+}
+
+void cmd_handle_data_req(struct ProcessData *proc, struct IPC_Command *cmd,
+      struct sockaddr_in *from, void *arg, int fd)
+{
+   struct IPC_DataReq *ipcReq;
+   int i;
+   struct CMDDataReq *req;
+   struct XDR_StructDefinition *def = NULL;
+   struct DataReqParams params;
+   const char *cached;
+   size_t cachedLen;
+
+   if (cmd->parameters.type != IPC_TYPES_DATAREQ) {
+      IPC_error(proc, cmd, IPC_RESULTCODE_INCORRECT_PARAMETER_TYPE, from);
+      return;
+   }
+
+   ipcReq = (struct IPC_DataReq*)cmd->parameters.data;
+   if (!ipcReq || !ipcReq->reqs || ipcReq->length <= 0 ||
+         ipcReq->length > 1024) {
+      IPC_response(proc, cmd, IPC_TYPES_VOID, NULL, from);
+      return;
+   }
+
+   req = malloc(sizeof(*req));
+   if (!req || cmd_resp_builder_init(&req->bld, cmd) < 0) {
+      free(req);
+      IPC_error(proc, cmd, IPC_RESULTCODE_ALLOCATION_ERR, from);
+      return;
+   }
+
+   req->proc = proc;
+   req->cmd = *cmd;
+   req->cmd.parameters.type = IPC_TYPES_VOID;
+   req->cmd.parameters.data = NULL;
+   req->from = *from;
+   req->direct_resp = 0;
+   req->pending = 0;
+   req->refcnt = 1;
+   req->sent = 0;
+   req->dispatching = 1;
+   req->deadline_evt = NULL;
+   req->handles = NULL;
+   req->next = proc->cmds->dataReqs;
+   proc->cmds->dataReqs = req;
+   params.req = req;
+
+   for (i = 0; i < ipcReq->length; i++) {
+      def = XDR_definition_for_type(ipcReq->reqs[i]);
+      if (!def || !def->populate)
+         continue;
+
+      if (0 == i && 1 == ipcReq->length)
+         req->direct_resp = 1;
+
+      // Serve recent results straight from the encoded cache
+      cached = XDR_populator_cache_lookup(def, &cachedLen);
+      if (cached && req->direct_resp) {
+         cmd_response_encoded(proc, cmd, cached, cachedLen, from);
+         continue;
+      }
+      if (cached) {
+         cmd_resp_builder_add_encoded(&req->bld, cached, cachedLen);
+         continue;
+      }
+
+      params.type = ipcReq->reqs[i];
+      params.def = def;
+      def->populate(def->populate_arg, &data_req_populate_cb, &params);
+   }
+   req->dispatching = 0;
+
+   // Asynchronous populators finish the request when the last one reports
+   if (!req->pending) {
+      if (!req->direct_resp)
+         cmd_data_req_finish(req);
+      req->sent = 1;
+   }
+   else
+      req->deadline_evt = EVT_sched_add(PROC_evt(proc),
+            EVT_ms2tv(proc->cmds->popDeadline ? proc->cmds->popDeadline :
+               IPC_POPULATOR_DEADLINE_MS), &data_req_deadline_cb, req);
+
+   cmd_data_req_release(req);
+}
+
+static int cmd_same_addr(struct sockaddr_in *a, struct sockaddr_in *b)
+{
+   return a->sin_port == b->sin_port &&
+      a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+static void cmd_publication_free(struct CMDPublication *pub)
+{
+   struct CMDPublication **itr;
+   struct CMDSubscriber *sub;
+
+   for (itr = &pub->proc->cmds->pubs; *itr; itr = &(*itr)->next) {
+      if (*itr == pub) {
+         *itr = pub->next;
+         break;
+      }
+   }
+
+   if (pub->evt)
+      EVT_sched_remove(PROC_evt(pub->proc), pub->evt);
+   while ((sub = pub->subs)) {
+      pub->subs = sub->next;
+      free(sub);
+   }
+   free(pub);
+}
+
+// Runs at the fastest rate any subscriber asked for
+static void cmd_publication_set_period(struct CMDPublication *pub)
+{
+   struct CMDSubscriber *sub;
+   unsigned int period = 0;
+
+   for (sub = pub->subs; sub; sub = sub->next)
+      if (!period || sub->period < period)
+         period = sub->period;
+
+   if (period && period != pub->period) {
+      pub->period = period;
+      EVT_sched_update(PROC_evt(pub->proc), pub->evt, EVT_ms2tv(period));
+   }
+}
+
+// Called once per populator run, fans the encoded sample out to every
+//  subscriber that is due
+static void telemetry_populate_cb(void *data, void *arg, uint32_t error)
+{
+   struct CMDPublication *pub = (struct CMDPublication*)arg;
+   struct CMDSubscriber *sub;
+   struct IPC_OpaqueStruct enc;
+   struct IPC_Telemetry tel;
+   struct IPC_Command cmd;
+   struct timeval period;
+   char *buff, *copy;
+   size_t len = 0;
+
+   if (!pub || !data || error != IPC_RESULTCODE_SUCCESS)
+      return;
+
+   enc = CMD_struct_to_opaque_struct(data, pub->type);
+   if (!enc.data)
+      return;
+
+   tel.seq = pub->seq;
+   tel.length = enc.length;
+   tel.data = enc.data;
+   cmd.cmd = IPC_CMDS_TELEMETRY;
+   cmd.ipcref = pub->seq;
+   cmd.parameters.type = IPC_TYPES_TELEMETRY;
+   cmd.parameters.data = &tel;
+
+   buff = malloc(enc.length + IPC_FRAG_HDR_SIZE);
+   if (!buff || IPC_Command_encode(&cmd, buff, &len,
+            enc.length + IPC_FRAG_HDR_SIZE, NULL) < 0) {
+      free(buff);
+      free(enc.data);
+      return;
+   }
+
+   for (sub = pub->subs; sub; sub = sub->next) {
+      if (timercmp(&sub->due, &pub->now, >))
+         continue;
+      period = EVT_ms2tv(sub->period);
+      timeradd(&sub->due, &period, &sub->due);
+      if (timercmp(&sub->due, &pub->now, <))
+         timeradd(&pub->now, &period, &sub->due);
+
+      copy = malloc(len);
+      if (!copy)
+         continue;
+      memcpy(copy, buff, len);
+      CMD_send_xdr(pub->proc, copy, len, &sub->addr);
+   }
+
+   free(buff);
+   free(enc.data);
+}
+
+static int publication_tick_cb(void *arg)
+{
+   struct CMDPublication *pub = (struct CMDPublication*)arg;
+   struct CMDSubscriber **itr, *sub;
+   struct XDR_StructDefinition *def;
+   struct timeval slack;
+   int due = 0;
+
+   EVT_get_monotonic_time(PROC_evt(pub->proc), &pub->now);
+
+   for (itr = &pub->subs; *itr; ) {
+      sub = *itr;
+      if (timercmp(&sub->expires, &pub->now, <)) {
+         DBG_print(DBG_LEVEL_INFO, "Subscription to 0x%08x from %s:%d "
+               "expired\n", pub->type, inet_ntoa(sub->addr.sin_addr),
+               ntohs(sub->addr.sin_port));
+         *itr = sub->next;
+         free(sub);
+         continue;
+      }
+      itr = &sub->next;
+   }
+
+   if (!pub->subs) {
+      pub->evt = NULL;
+      cmd_publication_free(pub);
+      return EVENT_REMOVE;
+   }
+   cmd_publication_set_period(pub);
+
+   // Allow half a period of timer jitter when deciding who is due
+   slack = EVT_ms2tv(pub->period / 2);
+   timeradd(&pub->now, &slack, &slack);
+   for (sub = pub->subs; sub; sub = sub->next)
+      if (!timercmp(&sub->due, &slack, >))
+         due = 1;
+   if (!due)
+      return EVENT_KEEP;
+
+   pub->now = slack;
+   pub->seq++;
+   def = XDR_definition_for_type(pub->type);
+   if (def && def->populate)
+      def->populate(def->populate_arg, &telemetry_populate_cb, pub);
+
+   return EVENT_KEEP;
+}
+
+static void cmd_handle_subscribe(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd)
+{
+   struct IPC_Subscribe *req;
+   struct XDR_StructDefinition *def;
+   struct CMDPublication *pub;
+   struct CMDSubscriber *sub;
+   struct timeval now, lease;
+   unsigned int lease_ms;
+
+   if (cmd->parameters.type != IPC_TYPES_SUBSCRIBE || !cmd->parameters.data) {
+      IPC_error(proc, cmd, IPC_RESULTCODE_INCORRECT_PARAMETER_TYPE, src);
+      return;
+   }
+   req = (struct IPC_Subscribe*)cmd->parameters.data;
+
+   def = XDR_definition_for_type(req->type);
+   if (!def || !def->populate) {
+      IPC_error(proc, cmd, IPC_RESULTCODE_UNSUPPORTED, src);
+      return;
+   }
+
+   for (pub = proc->cmds->pubs; pub; pub = pub->next)
+      if (pub->type == req->type)
+         break;
+
+   if (!pub) {
+      pub = malloc(sizeof(*pub));
+      if (!pub) {
+         IPC_error(proc, cmd, IPC_RESULTCODE_ALLOCATION_ERR, src);
+         return;
+      }
+      memset(pub, 0, sizeof(*pub));
+      pub->type = req->type;
+      pub->proc = proc;
+      pub->period = req->period_ms < IPC_SUB_MIN_PERIOD_MS ?
+         IPC_SUB_MIN_PERIOD_MS : req->period_ms;
+      pub->evt = EVT_sched_add(PROC_evt(proc), EVT_ms2tv(pub->period),
+            &publication_tick_cb, pub);
+      pub->next = proc->cmds->pubs;
+      proc->cmds->pubs = pub;
+   }
+
+   for (sub = pub->subs; sub; sub = sub->next)
+      if (cmd_same_addr(&sub->addr, src))
+         break;
+
+   EVT_get_monotonic_time(PROC_evt(proc), &now);
+   if (!sub) {
+      sub = malloc(sizeof(*sub));
+      if (!sub) {
+         IPC_error(proc, cmd, IPC_RESULTCODE_ALLOCATION_ERR, src);
+         return;
+      }
+      memset(sub, 0, sizeof(*sub));
+      sub->addr = *src;
+      sub->due = now;
+      sub->next = pub->subs;
+      pub->subs = sub;
+   }
+
+   sub->period = req->period_ms < IPC_SUB_MIN_PERIOD_MS ?
+      IPC_SUB_MIN_PERIOD_MS : req->period_ms;
+   lease_ms = req->lease_ms ? req->lease_ms : IPC_SUB_DEFAULT_LEASE_MS;
+   if (lease_ms > IPC_SUB_MAX_LEASE_MS)
+      lease_ms = IPC_SUB_MAX_LEASE_MS;
+   lease = EVT_ms2tv(lease_ms);
+   timeradd(&now, &lease, &sub->expires);
+   cmd_publication_set_period(pub);
+
+   IPC_success(proc, cmd, src);
+}
+
+static void cmd_handle_unsubscribe(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd)
+{
+   struct IPC_Subscribe *req;
+   struct CMDPublication *pub;
+   struct CMDSubscriber **itr, *sub;
+
+   if (cmd->parameters.type != IPC_TYPES_SUBSCRIBE || !cmd->parameters.data) {
+      IPC_error(proc, cmd, IPC_RESULTCODE_INCORRECT_PARAMETER_TYPE, src);
+      return;
+   }
+   req = (struct IPC_Subscribe*)cmd->parameters.data;
+
+   for (pub = proc->cmds->pubs; pub; pub = pub->next) {
+      if (pub->type != req->type)
+         continue;
+      for (itr = &pub->subs; *itr; itr = &(*itr)->next) {
+         if (cmd_same_addr(&(*itr)->addr, src)) {
+            sub = *itr;
+            *itr = sub->next;
+            free(sub);
+            break;
+         }
+      }
+      if (!pub->subs)
+         cmd_publication_free(pub);
+      break;
+   }
+
+   IPC_success(proc, cmd, src);
+}
+
+// The publisher sends at the fastest rate any local callback asked for, so
+//  each callback is throttled to its own period here
+static int cmd_subscription_due(struct CMDSubscription *sub,
+      struct timeval *now)
+{
+   struct timeval period, slack;
+
+   // Allow half a period of jitter, as the publisher does
+   slack = EVT_ms2tv(sub->period / 2);
+   timeradd(now, &slack, &slack);
+   if (timercmp(&sub->due, &slack, >))
+      return 0;
+
+   period = EVT_ms2tv(sub->period);
+   timeradd(&sub->due, &period, &sub->due);
+   if (timercmp(&sub->due, now, <))
+      timeradd(now, &period, &sub->due);
+
+   return 1;
+}
+
+static void cmd_handle_telemetry(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd)
+{
+   struct IPC_Telemetry *tel;
+   struct CMDSubscription *sub, *next;
+   struct XDR_Union un;
+   struct timeval now;
+   size_t used = 0;
+
+   if (cmd->parameters.type != IPC_TYPES_TELEMETRY || !cmd->parameters.data)
+      return;
+   tel = (struct IPC_Telemetry*)cmd->parameters.data;
+   if (!tel->data || tel->length <= 0)
+      return;
+
+   memset(&un, 0, sizeof(un));
+   if (XDR_decode_union(tel->data, &un, &used, tel->length, NULL) < 0) {
+      DBG_print(DBG_LEVEL_WARN, "Failed to decode telemetry from %s:%d\n",
+            inet_ntoa(src->sin_addr), ntohs(src->sin_port));
+      return;
+   }
+
+   EVT_get_monotonic_time(PROC_evt(proc), &now);
+   for (sub = proc->cmds->subs; sub; sub = next) {
+      next = sub->next;
+      if (sub->type == un.type && cmd_same_addr(&sub->addr, src) &&
+            cmd_subscription_due(sub, &now))
+         sub->cb(proc, sub->arg, un.type, un.data, src);
+   }
+
+   XDR_free_union(&un);
+}
+
+// The publisher keeps one period per subscribing address, so it is asked
+//  for the fastest one among this process' callbacks for the type
+static unsigned int cmd_subscription_period(struct CMDSubscription *sub)
 {
-   struct CommandCbArg *cmds = (struct CommandCbArg*)arg;
+   struct CMDSubscription *itr;
+   unsigned int period = sub->period;
 
-   if (!cmds)
-      return;
+   for (itr = sub->proc->cmds->subs; itr; itr = itr->next)
+      if (itr->type == sub->type && cmd_same_addr(&itr->addr, &sub->addr) &&
+            itr->period < period)
+         period = itr->period;
 
-   cmds->beats.heartbeats++;
-   cb(&cmds->beats, cb_args, IPC_RESULTCODE_SUCCESS);
+   return period;
 }
 
-void data_req_populate_cb(void *data, void *arg, uint32_t error)
+static void cmd_send_subscribe(struct CMDSubscription *sub, uint32_t command)
 {
-   struct DataReqParams *params;
-   struct IPC_PopulatorError err;
+   struct IPC_Subscribe req;
 
-   if (!arg || !data)
-      return;
-   params = (struct DataReqParams*)arg;
-   if (!params->dest)
-      return;
+   req.type = sub->type;
+   req.period_ms = cmd_subscription_period(sub);
+   req.lease_ms = IPC_SUB_DEFAULT_LEASE_MS;
+   IPC_command(sub->proc, command, &req, IPC_TYPES_SUBSCRIBE, sub->addr,
+         NULL, NULL, IPC_CB_TYPE_RAW, 0);
+}
 
-   if (params->direct_resp) {
-      if (error != IPC_RESULTCODE_SUCCESS)
-         IPC_error(params->proc, params->cmd, error, params->from);
-      else
-         IPC_response(params->proc, params->cmd, params->type,
-               data, params->from);
-   }
-   else {
-      if (error != IPC_RESULTCODE_SUCCESS) {
-         err.type = params->type;
-         err.error = error;
-         *params->dest = CMD_struct_to_opaque_struct(&err,
-               IPC_TYPES_POPULATOR_ERROR);
+// Renews the lease well before the publisher expires it
+static int subscription_renew_cb(void *arg)
+{
+   cmd_send_subscribe((struct CMDSubscription*)arg, IPC_CMDS_SUBSCRIBE);
+
+   return EVENT_KEEP;
+}
+
+static void cmd_subscription_free(struct CMDSubscription *sub)
+{
+   struct CMDSubscription **itr;
+
+   for (itr = &sub->proc->cmds->subs; *itr; itr = &(*itr)->next) {
+      if (*itr == sub) {
+         *itr = sub->next;
+         break;
       }
-      else
-         *params->dest = CMD_struct_to_opaque_struct(data, params->type);
    }
+
+   if (sub->renew_evt)
+      EVT_sched_remove(PROC_evt(sub->proc), sub->renew_evt);
+   free(sub);
 }
 
-void cmd_handle_data_req(struct ProcessData *proc, struct IPC_Command *cmd,
-      struct sockaddr_in *from, void *arg, int fd)
+int CMD_add_subscription(struct ProcessData *proc, struct sockaddr_in dest,
+      uint32_t type, unsigned int period_ms, IPC_telemetry_callback cb,
+      void *arg)
 {
-   struct IPC_DataReq *req;
-   int i;
-   struct IPC_OpaqueStructArr resp;
-   struct XDR_StructDefinition *def = NULL;
-   struct DataReqParams params;
+   struct CMDSubscription *sub;
 
-   if (cmd->parameters.type != IPC_TYPES_DATAREQ) {
-      IPC_error(proc, cmd, IPC_RESULTCODE_INCORRECT_PARAMETER_TYPE, from);
-      return;
-   }
+   if (!proc || !proc->cmds || !cb)
+      return -1;
 
-   req = (struct IPC_DataReq*)cmd->parameters.data;
-   if (!req || !req->reqs || req->length <= 0 || req->length > 1024) {
-      IPC_response(proc, cmd, IPC_TYPES_VOID, NULL, from);
-      return;
-   }
+   sub = malloc(sizeof(*sub));
+   if (!sub)
+      return -1;
+   memset(sub, 0, sizeof(*sub));
+   sub->addr = dest;
+   sub->type = type;
+   sub->period = period_ms;
+   sub->cb = cb;
+   sub->arg = arg;
+   sub->proc = proc;
+   sub->renew_evt = EVT_sched_add(PROC_evt(proc),
+         EVT_ms2tv(IPC_SUB_DEFAULT_LEASE_MS / 2), &subscription_renew_cb, sub);
+   sub->next = proc->cmds->subs;
+   proc->cmds->subs = sub;
+
+   cmd_send_subscribe(sub, IPC_CMDS_SUBSCRIBE);
 
-   params.proc = proc;
-   params.cmd = cmd;
-   params.from = from;
-   params.direct_resp = 0;
-   resp.structs = malloc(sizeof(struct IPC_OpaqueStruct) * req->length);
-   if (!resp.structs)
-      IPC_error(proc, cmd, IPC_RESULTCODE_ALLOCATION_ERR, from);
-   memset(resp.structs, 0,  sizeof(struct IPC_OpaqueStruct) * req->length);
-   resp.length = 0;
+   return 0;
+}
 
-   for (i = 0; req && i < req->length && req->reqs; i++) {
-      def = XDR_definition_for_type(req->reqs[i]);
-      if (!def || !def->populate)
-         continue;
+int CMD_remove_subscription(struct ProcessData *proc, struct sockaddr_in dest,
+      uint32_t type, IPC_telemetry_callback cb, void *arg)
+{
+   struct CMDSubscription *sub, *others;
 
-      if (0 == i && 1 == req->length)
-         params.direct_resp = 1;
+   if (!proc || !proc->cmds)
+      return -1;
 
-      params.dest = &resp.structs[resp.length];
-      params.type = req->reqs[i];
-      def->populate(def->populate_arg, &data_req_populate_cb, &params);
-      if (resp.structs[resp.length].data)
-         resp.length++;
-   }
+   for (sub = proc->cmds->subs; sub; sub = sub->next)
+      if (sub->type == type && sub->cb == cb && sub->arg == arg &&
+            cmd_same_addr(&sub->addr, &dest))
+         break;
+   if (!sub)
+      return -1;
+
+   // Only cancel with the publisher once no local callbacks remain
+   for (others = proc->cmds->subs; others; others = others->next)
+      if (others != sub && others->type == type &&
+            cmd_same_addr(&others->addr, &dest))
+         break;
+   if (!others)
+      cmd_send_subscribe(sub, IPC_CMDS_UNSUBSCRIBE);
 
-   if (!params.direct_resp)
-      IPC_response(proc, cmd, IPC_TYPES_OPAQUE_STRUCT_ARR, &resp, from);
+   cmd_subscription_free(sub);
 
-   for (i = 0; req && i < req->length && req->reqs; i++)
-      if (resp.structs[i].data)
-         free(resp.structs[i].data);
+   // Let the publisher slow down to what the remaining callbacks want
+   if (others)
+      cmd_send_subscribe(others, IPC_CMDS_SUBSCRIBE);
 
-   free(resp.structs);
+   return 0;
 }
 
 static int multicast_cmd_handler_cb(int socket, char type, void * arg)
 {
-   unsigned char data[MAX_IP_PACKET_SIZE];
    struct MulticastCommand *cmd = NULL;
    struct McastCommandState *state = (struct McastCommandState*)arg;
-   size_t dataLen;
-   struct sockaddr_in src;
-   data[0] = 0;
+   struct CMD_RxBuffer *buff, *prev;
+   unsigned char *data;
 
    if (!state)
       return EVENT_KEEP;
@@ -239,17 +1280,22 @@ static int multicast_cmd_handler_cb(int socket, char type, void * arg)
    // should only be read events, but make sure
    if (type == EVENT_FD_READ) {
       // read from the socket to get the command and its data
-      dataLen = socket_read(socket, data, MAX_IP_PACKET_SIZE, &src);
+      buff = cmd_rxbuff_read(socket);
 
       // make sure something was actually read
-      if (dataLen > 0) {
+      if (buff) {
+         data = buff->data;
          DBG_print(DBG_LEVEL_INFO, "MCast Received command 0x%02x", *data);
 
+         prev = rxBuffCurrent;
+         rxBuffCurrent = buff;
          for (cmd = state->cmds; cmd; cmd = cmd->next) {
             if (cmd->cmdNum < 0 || cmd->cmdNum == *data)
                cmd->callback(cmd->callbackParam, socket, *data, &data[1],
-                  dataLen - 1, &src);
+                  buff->len - 1, &buff->src);
          }
+         rxBuffCurrent = prev;
+         CMD_rxbuff_release(buff);
       }
    }
 
@@ -404,6 +1450,17 @@ void cmd_cleanup_cb_state(struct CommandCbArg *st, struct EventState *evt_loop)
       st->mcast = state->next;
       free(state);
    }
+
+   while (st->dataReqs)
+      cmd_data_req_orphan(st->dataReqs);
+   while (st->pubs)
+      cmd_publication_free(st->pubs);
+   while (st->subs)
+      cmd_subscription_free(st->subs);
+   while (st->fragTx)
+      cmd_frag_tx_free(st->fragTx);
+   while (st->fragRx)
+      cmd_frag_rx_free(st->fragRx);
 }
 
 // Structure to hold a single command
@@ -482,6 +1539,14 @@ int cmd_handler_init(const char * procName, struct ProcessData *proc,
    *cmds_ptr = cmds;
 
    CMD_set_xdr_cmd_handler(IPC_CMDS_DATA_REQ, &cmd_handle_data_req, cmds);
+   CMD_set_xdr_cmd_handler(IPC_CMDS_FRAGMENT, &cmd_handle_fragment, cmds);
+   CMD_set_xdr_cmd_handler(IPC_CMDS_FRAGMENT_NACK, &cmd_handle_fragment_nack,
+         cmds);
+   CMD_set_xdr_cmd_handler(IPC_CMDS_BATCH, &cmd_handle_batch, cmds);
+   CMD_set_xdr_cmd_handler(IPC_CMDS_SUBSCRIBE, &cmd_handle_subscribe, cmds);
+   CMD_set_xdr_cmd_handler(IPC_CMDS_UNSUBSCRIBE, &cmd_handle_unsubscribe,
+         cmds);
+   CMD_set_xdr_cmd_handler(IPC_CMDS_TELEMETRY, &cmd_handle_telemetry, cmds);
    XDR_register_populator(&heartbeat_populator, cmds, IPC_TYPES_HEARTBEAT);
    cmds->proc = proc;
    if (procName) {
@@ -575,59 +1640,71 @@ static void cmd_handle_xdr_response(ProcessData *proc,
    free(state);
 }
 
-int cmd_handler_cb(int socket, char type, void * arg)
+// Dispatches a complete XDR command or response packet
+static void cmd_dispatch_xdr(ProcessData *proc, int socket, char *data,
+      size_t dataLen, struct sockaddr_in *src)
 {
-   ProcessData *proc = (ProcessData*)arg;
-   unsigned char data[MAX_IP_PACKET_SIZE];
-   struct Command *cmd = NULL;
    struct CommandCbArg *cmds = proc->cmds;
-   size_t dataLen, used = 0;
-   struct sockaddr_in src;
    struct IPC_Command xdr_cmd;
    struct CMD_XDRCommandInfo *cmd_info;
+   size_t used = 0;
    uint32_t cmd_num;
-   data[0] = 0;
+
+   if (XDR_decode_uint32(data, &cmd_num, &used, dataLen, NULL) < 0)
+      DBG_print(DBG_LEVEL_WARN, "Failed to decode XDR uint32 of "
+            "length %lu\n", dataLen);
+   if (cmd_num == IPC_CMDS_RESPONSE) {
+      cmds->beats.responses++;
+      cmd_handle_xdr_response(proc, data, dataLen, src);
+   }
+   else if (IPC_Command_decode(data, &xdr_cmd, &used, dataLen, NULL) < 0) {
+      cmds->beats.commands++;
+      DBG_print(DBG_LEVEL_WARN, "Failed to decode XDR command of "
+            "length %lu\n", dataLen);
+   }
+   else {
+      cmds->beats.commands++;
+      TRACE("xdr command %u ipcref %u", xdr_cmd.cmd, xdr_cmd.ipcref);
+      cmd_info = CMD_xdr_cmd_by_number(xdr_cmd.cmd);
+      if (cmd_info && cmd_info->handler)
+         cmd_info->handler(cmds->proc, &xdr_cmd, src, cmd_info->arg, socket);
+      else if (cmd_info)
+         IPC_error(proc, &xdr_cmd, IPC_RESULTCODE_UNSUPPORTED, src);
+
+      XDR_free_union(&xdr_cmd.parameters);
+   }
+}
+
+int cmd_handler_cb(int socket, char type, void * arg)
+{
+   ProcessData *proc = (ProcessData*)arg;
+   unsigned char *data;
+   struct Command *cmd = NULL;
+   struct CommandCbArg *cmds = proc->cmds;
+   size_t dataLen;
+   struct CMD_RxBuffer *buff, *prev;
    cmdGProc = proc;
 
    // should only be read events, but make sure
    if (type == EVENT_FD_READ) {
       // read from the socket to get the command and it's data
-      dataLen = socket_read(socket, data, MAX_IP_PACKET_SIZE, &src);
+      buff = cmd_rxbuff_read(socket);
 
       // make sure something was actually read
-      if (dataLen > 0) {
+      if (buff) {
+         data = buff->data;
+         dataLen = buff->len;
+         prev = rxBuffCurrent;
+         rxBuffCurrent = buff;
+
          // Command 0 was never used.  Now it is used to tell the difference
          //  between the old command format and the newer XDR format
-         if (*data == 0) {
-            if (XDR_decode_uint32((char*)data, &cmd_num,
-                     &used, dataLen, NULL) < 0)
-               DBG_print(DBG_LEVEL_WARN, "Failed to decode XDR uint32 of "
-                     "length %lu\n", dataLen);
-            if (cmd_num == IPC_CMDS_RESPONSE) {
-               cmds->beats.responses++;
-               cmd_handle_xdr_response(proc, (char*)data, dataLen, &src);
-            }
-            else if (IPC_Command_decode((char*)data, &xdr_cmd,
-                     &used, dataLen, NULL) < 0) {
-               cmds->beats.commands++;
-               DBG_print(DBG_LEVEL_WARN, "Failed to decode XDR command of "
-                     "length %lu\n", dataLen);
-            }
-            else {
-               cmds->beats.commands++;
-               cmd_info = CMD_xdr_cmd_by_number(xdr_cmd.cmd);
-               if (cmd_info && cmd_info->handler)
-                  cmd_info->handler(cmds->proc, &xdr_cmd, &src,
-                        cmd_info->arg, socket);
-               else if (cmd_info)
-                  IPC_error(proc, &xdr_cmd, IPC_RESULTCODE_UNSUPPORTED, &src);
-
-               XDR_free_union(&xdr_cmd.parameters);
-            }
-         }
+         if (*data == 0)
+            cmd_dispatch_xdr(proc, socket, (char*)data, dataLen, &buff->src);
          else {
             cmds->beats.commands++;
             cmd = cmds->cmds + *data;
+            TRACE("command 0x%02x length %zu", *data, dataLen);
             DBG_print(DBG_LEVEL_INFO, "Received command 0x%02x (%d - %d)",
                                        *data, cmd->uid, cmd->group);
 
@@ -637,9 +1714,12 @@ int cmd_handler_cb(int socket, char type, void * arg)
                DBG_print(DBG_LEVEL_WARN, "Protected commands are not supported\n");
             } else {
                // Un-protected command, nothing out of the ordinary here
-               (*(cmd->cmd_cb))(socket, *data, data+1, dataLen-1, &src);
+               (*(cmd->cmd_cb))(socket, *data, data+1, dataLen-1, &buff->src);
             }
          }
+
+         rxBuffCurrent = prev;
+         CMD_rxbuff_release(buff);
       }
    }
 
@@ -648,20 +1728,19 @@ int cmd_handler_cb(int socket, char type, void * arg)
 
 int tx_cmd_handler_cb(int socket, char type, void * arg)
 {
-   unsigned char data[MAX_IP_PACKET_SIZE];
    // struct ProcessData *proc = (struct ProcessData*)arg;
-   size_t dataLen;
-   struct sockaddr_in src;
-   data[0] = 0;
+   struct CMD_RxBuffer *buff;
 
    // should only be read events, but make sure
    if (type == EVENT_FD_READ) {
       // read from the socket to get the command and it's data
-      dataLen = socket_read(socket, data, MAX_IP_PACKET_SIZE, &src);
+      buff = cmd_rxbuff_read(socket);
 
       // make sure something was actually read
-      if (dataLen > 0) {
-         DBG_print(DBG_LEVEL_INFO, "Received TX command response 0x%02x", data[0]);
+      if (buff) {
+         DBG_print(DBG_LEVEL_INFO, "Received TX command response 0x%02x",
+               buff->data[0]);
+         CMD_rxbuff_release(buff);
       }
    }
 
@@ -696,6 +1775,8 @@ void cmd_handler_cleanup(struct CommandCbArg **goner)
    }
    free(cmds);
    *goner = NULL;
+
+   cmd_rxbuff_pool_cleanup();
 }
 
 int CMD_iterate_structs(char *src, size_t len, CMD_struct_itr itr_cb, void *arg,
@@ -1314,14 +2395,11 @@ struct IPC_OpaqueStruct CMD_struct_to_opaque_struct(void *src, uint32_t type)
    return result;
 }
 
-static int response_timeout_cb(void *arg)
+// Removes a pending response callback and reports a timeout to it
+static void cmd_response_expire(struct CMDResponseCb *state)
 {
-   struct CMDResponseCb *state = (struct CMDResponseCb*)arg;
    struct CMDResponseCb **itr;
 
-   if (!arg)
-      return EVENT_REMOVE;
-
    for (itr = &state->proc->cmds->resp; itr && (*itr); itr = &(*itr)->next) {
       if (*itr == state) {
          *itr = state->next;
@@ -1330,12 +2408,35 @@ static int response_timeout_cb(void *arg)
    }
 
    state->cb(state->proc, 1, state->arg, NULL, 0, state->cb_type);
-   state->to_evt = NULL;
    free(state);
+}
+
+static int response_timeout_cb(void *arg)
+{
+   struct CMDResponseCb *state = (struct CMDResponseCb*)arg;
+
+   if (!arg)
+      return EVENT_REMOVE;
+
+   state->to_evt = NULL;
+   cmd_response_expire(state);
 
    return EVENT_REMOVE;
 }
 
+static struct CMDResponseCb *cmd_find_response_cb(ProcessData *proc,
+      uint32_t id, struct sockaddr_in *host)
+{
+   struct CMDResponseCb *state;
+
+   for (state = proc->cmds->resp; state; state = state->next)
+      if (state->id == id && state->host.sin_port == host->sin_port &&
+            state->host.sin_addr.s_addr == host->sin_addr.s_addr)
+         return state;
+
+   return NULL;
+}
+
 void CMD_add_response_cb(ProcessData *proc, uint32_t id,
       struct sockaddr_in host,
       IPC_command_callback cb, void *arg,
@@ -1355,6 +2456,7 @@ void CMD_add_response_cb(ProcessData *proc, uint32_t id,
    state->cb = cb;
    state->arg = arg;
    state->cb_type = cb_type;
+   state->timeout = timeout;
    state->proc = proc;
    state->next = st->resp;
    st->resp = state;
@@ -1364,6 +2466,464 @@ void CMD_add_response_cb(ProcessData *proc, uint32_t id,
             response_timeout_cb, state);
 }
 
+// Pushes back the timeout of a pending response while its fragments are
+//  still arriving
+static void cmd_response_keepalive(ProcessData *proc, uint32_t id,
+      struct sockaddr_in *host)
+{
+   struct CMDResponseCb *state = cmd_find_response_cb(proc, id, host);
+
+   if (state && state->to_evt && state->timeout)
+      EVT_sched_update(PROC_evt(proc), state->to_evt,
+            EVT_ms2tv(state->timeout));
+}
+
+static int cmd_send_fragment(struct CMDFragTx *tx, uint32_t offset)
+{
+   struct IPC_Fragment frag;
+   struct IPC_Command cmd;
+   size_t len = 0;
+   char *buff;
+
+   frag.cmd = tx->cmd;
+   frag.ipcref = tx->ipcref;
+   frag.total_length = tx->len;
+   frag.offset = offset;
+   frag.length = tx->len - offset;
+   if (frag.length > IPC_FRAG_SIZE)
+      frag.length = IPC_FRAG_SIZE;
+   frag.data = tx->data + offset;
+
+   cmd.cmd = IPC_CMDS_FRAGMENT;
+   cmd.ipcref = tx->ipcref;
+   cmd.parameters.type = IPC_TYPES_FRAGMENT;
+   cmd.parameters.data = &frag;
+
+   buff = malloc(IPC_FRAG_SIZE + IPC_FRAG_HDR_SIZE);
+   if (!buff)
+      return -1;
+
+   if (IPC_Command_encode(&cmd, buff, &len,
+            IPC_FRAG_SIZE + IPC_FRAG_HDR_SIZE, NULL) < 0) {
+      free(buff);
+      return -1;
+   }
+
+   return PROC_cmd_raw_sockaddr(tx->proc, buff, len, &tx->dest);
+}
+
+static void cmd_frag_tx_free(struct CMDFragTx *tx)
+{
+   struct CMDFragTx **itr;
+
+   for (itr = &tx->proc->cmds->fragTx; *itr; itr = &(*itr)->next) {
+      if (*itr == tx) {
+         *itr = tx->next;
+         break;
+      }
+   }
+
+   if (tx->to_evt)
+      EVT_sched_remove(PROC_evt(tx->proc), tx->to_evt);
+   free(tx->data);
+   free(tx);
+}
+
+static int frag_tx_expire_cb(void *arg)
+{
+   struct CMDFragTx *tx = (struct CMDFragTx*)arg;
+
+   tx->to_evt = NULL;
+   cmd_frag_tx_free(tx);
+
+   return EVENT_REMOVE;
+}
+
+static struct CMDFragTx *cmd_find_frag_tx(struct CommandCbArg *st,
+      uint32_t cmd, uint32_t ipcref, struct sockaddr_in *host)
+{
+   struct CMDFragTx *tx;
+
+   for (tx = st->fragTx; tx; tx = tx->next)
+      if (tx->cmd == cmd && tx->ipcref == ipcref &&
+            tx->dest.sin_port == host->sin_port &&
+            tx->dest.sin_addr.s_addr == host->sin_addr.s_addr)
+         return tx;
+
+   return NULL;
+}
+
+// Sends everything collected for a batch as a single datagram
+static void cmd_batch_flush(ProcessData *proc, struct CMDBatchReply *reply)
+{
+   struct IPC_Command cmd;
+   struct IPC_Batch batch;
+   char *buff;
+   size_t len = 0;
+   int i;
+
+   if (!reply->count)
+      return;
+
+   if (reply->count == 1) {
+      PROC_cmd_raw_sockaddr(proc, reply->msgs[0].data, reply->msgs[0].length,
+            &reply->dest);
+      reply->count = 0;
+      reply->bytes = 0;
+      return;
+   }
+
+   batch.length = reply->count;
+   batch.msgs = reply->msgs;
+   cmd.cmd = IPC_CMDS_BATCH;
+   cmd.ipcref = reply->ipcref;
+   cmd.parameters.type = IPC_TYPES_BATCH;
+   cmd.parameters.data = &batch;
+
+   buff = malloc(reply->bytes + IPC_BATCH_HDR_SIZE);
+   if (buff && IPC_Command_encode(&cmd, buff, &len,
+            reply->bytes + IPC_BATCH_HDR_SIZE, NULL) >= 0)
+      PROC_cmd_raw_sockaddr(proc, buff, len, &reply->dest);
+   else {
+      DBG_print(DBG_LEVEL_WARN, "Failed to encode batch of %d replies\n",
+            reply->count);
+      free(buff);
+   }
+
+   for (i = 0; i < reply->count; i++)
+      free(reply->msgs[i].data);
+   reply->count = 0;
+   reply->bytes = 0;
+}
+
+// Adds an outgoing message to the batch reply if it is headed to the
+//  batch's sender.  Returns 1 if the batch took ownership of buff.
+static int cmd_batch_collect(ProcessData *proc, struct CMDBatchReply *reply,
+      char *buff, size_t len, struct sockaddr_in *dest)
+{
+   struct IPC_OpaqueStruct *msgs;
+   size_t need = sizeof(int32_t) + len + (4 - (len % 4)) % 4;
+
+   if (dest->sin_port != reply->dest.sin_port ||
+         dest->sin_addr.s_addr != reply->dest.sin_addr.s_addr)
+      return 0;
+
+   if (reply->bytes + need > IPC_FRAG_SIZE - IPC_BATCH_HDR_SIZE) {
+      cmd_batch_flush(proc, reply);
+      if (need > IPC_FRAG_SIZE - IPC_BATCH_HDR_SIZE)
+         return 0;
+   }
+
+   if (reply->count == reply->alloc) {
+      msgs = realloc(reply->msgs,
+            sizeof(*msgs) * (reply->alloc ? reply->alloc * 2 : 8));
+      if (!msgs)
+         return 0;
+      reply->msgs = msgs;
+      reply->alloc = reply->alloc ? reply->alloc * 2 : 8;
+   }
+
+   reply->msgs[reply->count].length = len;
+   reply->msgs[reply->count].data = buff;
+   reply->count++;
+   reply->bytes += need;
+
+   return 1;
+}
+
+static void cmd_handle_batch(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd)
+{
+   struct IPC_Batch *batch;
+   struct CMDBatchReply reply, *prev;
+   size_t used;
+   uint32_t cmd_num;
+   int i;
+
+   if (cmd->parameters.type != IPC_TYPES_BATCH || !cmd->parameters.data)
+      return;
+   batch = (struct IPC_Batch*)cmd->parameters.data;
+
+   memset(&reply, 0, sizeof(reply));
+   reply.dest = *src;
+   reply.ipcref = cmd->ipcref;
+   prev = proc->cmds->batch;
+   proc->cmds->batch = &reply;
+
+   for (i = 0; i < batch->length && batch->msgs; i++) {
+      if (!batch->msgs[i].data || batch->msgs[i].length <= 0)
+         continue;
+      if (XDR_decode_uint32(batch->msgs[i].data, &cmd_num, &used,
+               batch->msgs[i].length, NULL) < 0 || cmd_num == IPC_CMDS_BATCH) {
+         DBG_print(DBG_LEVEL_WARN, "Skipping invalid batch entry %d from "
+               "%s:%d\n", i, inet_ntoa(src->sin_addr), ntohs(src->sin_port));
+         continue;
+      }
+      cmd_dispatch_xdr(proc, fd, batch->msgs[i].data, batch->msgs[i].length,
+            src);
+   }
+
+   proc->cmds->batch = prev;
+   cmd_batch_flush(proc, &reply);
+   free(reply.msgs);
+}
+
+int CMD_send_xdr(ProcessData *proc, char *buff, size_t len,
+      struct sockaddr_in *dest)
+{
+   struct CMDFragTx *tx;
+   size_t used;
+   uint32_t offset;
+
+   if (proc->cmds && proc->cmds->batch &&
+         cmd_batch_collect(proc, proc->cmds->batch, buff, len, dest))
+      return len;
+
+   if (len <= IPC_MAX_DATAGRAM_SIZE || !proc->cmds)
+      return PROC_cmd_raw_sockaddr(proc, buff, len, dest);
+
+   if (len > IPC_FRAG_MAX_MSG_SIZE) {
+      DBG_print(DBG_LEVEL_WARN, "Dropping %lu byte message, larger than the "
+            "%d byte limit\n", len, IPC_FRAG_MAX_MSG_SIZE);
+      free(buff);
+      return -1;
+   }
+
+   tx = malloc(sizeof(*tx));
+   if (!tx) {
+      free(buff);
+      return -1;
+   }
+   memset(tx, 0, sizeof(*tx));
+
+   // Both commands and responses start with the command number and ipcref
+   XDR_decode_uint32(buff, &tx->cmd, &used, len, NULL);
+   XDR_decode_uint32(buff + used, &tx->ipcref, &used, len - used, NULL);
+   tx->dest = *dest;
+   tx->data = buff;
+   tx->len = len;
+   tx->proc = proc;
+
+   // Replace any older message still held under the same key
+   while ((tx->next = cmd_find_frag_tx(proc->cmds, tx->cmd, tx->ipcref,
+               dest)))
+      cmd_frag_tx_free(tx->next);
+
+   tx->next = proc->cmds->fragTx;
+   proc->cmds->fragTx = tx;
+   tx->to_evt = EVT_sched_add(PROC_evt(proc), EVT_ms2tv(IPC_FRAG_TX_HOLD_MS),
+         &frag_tx_expire_cb, tx);
+
+   for (offset = 0; offset < len; offset += IPC_FRAG_SIZE)
+      cmd_send_fragment(tx, offset);
+
+   return len;
+}
+
+static void cmd_handle_fragment_nack(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd)
+{
+   struct IPC_FragmentNack *nack;
+   struct CMDFragTx *tx;
+   int i;
+
+   if (cmd->parameters.type != IPC_TYPES_FRAGMENT_NACK ||
+         !cmd->parameters.data)
+      return;
+   nack = (struct IPC_FragmentNack*)cmd->parameters.data;
+
+   tx = cmd_find_frag_tx(proc->cmds, nack->cmd, nack->ipcref, src);
+   if (!tx) {
+      DBG_print(DBG_LEVEL_INFO, "Retransmit request for expired message "
+            "%u\n", nack->ipcref);
+      return;
+   }
+
+   for (i = 0; i < nack->length && nack->offsets; i++)
+      if (nack->offsets[i] < tx->len && !(nack->offsets[i] % IPC_FRAG_SIZE))
+         cmd_send_fragment(tx, nack->offsets[i]);
+
+   if (tx->to_evt)
+      EVT_sched_update(PROC_evt(proc), tx->to_evt,
+            EVT_ms2tv(IPC_FRAG_TX_HOLD_MS));
+}
+
+static void cmd_frag_rx_free(struct CMDFragRx *rx)
+{
+   struct CMDFragRx **itr;
+   struct CommandCbArg *st = rx->proc->cmds;
+
+   for (itr = &st->fragRx; *itr; itr = &(*itr)->next) {
+      if (*itr == rx) {
+         *itr = rx->next;
+         break;
+      }
+   }
+
+   if (rx->to_evt)
+      EVT_sched_remove(PROC_evt(rx->proc), rx->to_evt);
+   if (rx->msg) {
+      st->fragRxBytes -= rx->msg->size;
+      CMD_rxbuff_release(rx->msg);
+   }
+   free(rx->have);
+   free(rx);
+}
+
+// Called when no fragments have arrived for a while.  Requests the
+//  missing pieces, or gives up after IPC_FRAG_MAX_NACKS attempts.
+static int frag_rx_timeout_cb(void *arg)
+{
+   struct CMDFragRx *rx = (struct CMDFragRx*)arg;
+   struct CMDResponseCb *resp;
+   struct IPC_FragmentNack nack;
+   uint32_t offsets[IPC_FRAG_MAX_NACK_LEN];
+   uint32_t i;
+
+   if (++rx->nacks > IPC_FRAG_MAX_NACKS) {
+      DBG_print(DBG_LEVEL_WARN, "Gave up reassembling message %u from %s:%d "
+            "(%u of %u fragments)\n", rx->ipcref, inet_ntoa(rx->host.sin_addr),
+            ntohs(rx->host.sin_port), rx->recvd, rx->fragCnt);
+
+      // Fail the pending request now instead of waiting out its timeout
+      resp = NULL;
+      if (rx->cmd == IPC_CMDS_RESPONSE)
+         resp = cmd_find_response_cb(rx->proc, rx->ipcref, &rx->host);
+      if (resp && resp->to_evt) {
+         EVT_sched_remove(PROC_evt(rx->proc), resp->to_evt);
+         resp->to_evt = NULL;
+         cmd_response_expire(resp);
+      }
+
+      rx->to_evt = NULL;
+      cmd_frag_rx_free(rx);
+      return EVENT_REMOVE;
+   }
+
+   nack.cmd = rx->cmd;
+   nack.ipcref = rx->ipcref;
+   nack.length = 0;
+   nack.offsets = offsets;
+   for (i = 0; i < rx->fragCnt && nack.length < IPC_FRAG_MAX_NACK_LEN; i++)
+      if (!rx->have[i])
+         offsets[nack.length++] = i * IPC_FRAG_SIZE;
+
+   IPC_command(rx->proc, IPC_CMDS_FRAGMENT_NACK, &nack,
+         IPC_TYPES_FRAGMENT_NACK, rx->host, NULL, NULL, IPC_CB_TYPE_RAW, 0);
+
+   return EVENT_KEEP;
+}
+
+static struct CMDFragRx *cmd_frag_rx_create(ProcessData *proc,
+      struct IPC_Fragment *frag, struct sockaddr_in *src, int fd)
+{
+   struct CommandCbArg *st = proc->cmds;
+   struct CMDFragRx *rx;
+
+   if (st->fragRxBytes + frag->total_length > IPC_FRAG_REASSEMBLY_MAX) {
+      DBG_print(DBG_LEVEL_WARN, "Reassembly memory exhausted, dropping "
+            "message %u from %s:%d\n", frag->ipcref, inet_ntoa(src->sin_addr),
+            ntohs(src->sin_port));
+      return NULL;
+   }
+
+   rx = malloc(sizeof(*rx));
+   if (!rx)
+      return NULL;
+   memset(rx, 0, sizeof(*rx));
+
+   rx->cmd = frag->cmd;
+   rx->ipcref = frag->ipcref;
+   rx->host = *src;
+   rx->fd = fd;
+   rx->proc = proc;
+   rx->fragCnt = (frag->total_length + IPC_FRAG_SIZE - 1) / IPC_FRAG_SIZE;
+   rx->have = calloc(rx->fragCnt, 1);
+   rx->msg = cmd_rxbuff_alloc(frag->total_length);
+   if (!rx->have || !rx->msg) {
+      if (rx->msg)
+         CMD_rxbuff_release(rx->msg);
+      free(rx->have);
+      free(rx);
+      return NULL;
+   }
+   rx->msg->len = frag->total_length;
+   rx->msg->src = *src;
+   st->fragRxBytes += rx->msg->size;
+
+   rx->next = st->fragRx;
+   st->fragRx = rx;
+   rx->to_evt = EVT_sched_add(PROC_evt(proc), EVT_ms2tv(IPC_FRAG_NACK_MS),
+         &frag_rx_timeout_cb, rx);
+
+   return rx;
+}
+
+static void cmd_handle_fragment(struct ProcessData *proc,
+      struct IPC_Command *cmd, struct sockaddr_in *src, void *arg, int fd)
+{
+   struct IPC_Fragment *frag;
+   struct CMDFragRx *rx;
+   struct CMD_RxBuffer *msg, *prev;
+   uint32_t idx;
+
+   if (cmd->parameters.type != IPC_TYPES_FRAGMENT || !cmd->parameters.data)
+      return;
+   frag = (struct IPC_Fragment*)cmd->parameters.data;
+
+   // Validate the fragment geometry before trusting any of it
+   if (frag->total_length <= IPC_FRAG_SIZE ||
+         frag->total_length > IPC_FRAG_MAX_MSG_SIZE ||
+         frag->offset >= frag->total_length ||
+         (frag->offset % IPC_FRAG_SIZE) || !frag->data ||
+         frag->length != (frag->total_length - frag->offset > IPC_FRAG_SIZE ?
+            IPC_FRAG_SIZE : frag->total_length - frag->offset)) {
+      DBG_print(DBG_LEVEL_WARN, "Dropping malformed fragment from %s:%d\n",
+            inet_ntoa(src->sin_addr), ntohs(src->sin_port));
+      return;
+   }
+
+   for (rx = proc->cmds->fragRx; rx; rx = rx->next)
+      if (rx->cmd == frag->cmd && rx->ipcref == frag->ipcref &&
+            rx->host.sin_port == src->sin_port &&
+            rx->host.sin_addr.s_addr == src->sin_addr.s_addr)
+         break;
+
+   if (rx && rx->msg->len != frag->total_length) {
+      // The key was reused for a new message
+      cmd_frag_rx_free(rx);
+      rx = NULL;
+   }
+   if (!rx)
+      rx = cmd_frag_rx_create(proc, frag, src, fd);
+   if (!rx)
+      return;
+
+   idx = frag->offset / IPC_FRAG_SIZE;
+   if (!rx->have[idx]) {
+      memcpy(rx->msg->data + frag->offset, frag->data, frag->length);
+      rx->have[idx] = 1;
+      rx->recvd++;
+   }
+   rx->nacks = 0;
+   EVT_sched_update(PROC_evt(proc), rx->to_evt, EVT_ms2tv(IPC_FRAG_NACK_MS));
+   if (rx->cmd == IPC_CMDS_RESPONSE)
+      cmd_response_keepalive(proc, rx->ipcref, src);
+
+   if (rx->recvd < rx->fragCnt)
+      return;
+
+   // Complete, process the message as if it arrived in a single datagram
+   msg = CMD_rxbuff_retain(rx->msg);
+   cmd_frag_rx_free(rx);
+
+   prev = rxBuffCurrent;
+   rxBuffCurrent = msg;
+   cmd_dispatch_xdr(proc, fd, (char*)msg->data, msg->len, &msg->src);
+   rxBuffCurrent = prev;
+   CMD_rxbuff_release(msg);
+}
+
 int CMD_set_cmd_handler(struct CommandCbArg *cmd,
             int cmdNum, CMD_handler_t handler, uint32_t uid,
             uint32_t group, uint32_t protection)
@@ -108,6 +108,43 @@ void cmd_cleanup_cb_state(struct CommandCbArg *st, struct EventState *evt_loop);
 
 int tx_cmd_handler_cb(int socket, char type, void * arg);
 
+/**
+ * Reference counted buffer that holds a received command datagram.
+ * Buffers come from a shared pool and are returned to it when the last
+ * reference is released.  The command handlers only hold a reference
+ * while the callback runs.  A handler that needs the raw packet after it
+ * returns (e.g., to hand it off to a worker thread or a deferred event)
+ * must take its own reference with CMD_rxbuff_retain_current().
+ */
+struct CMD_RxBuffer {
+   unsigned char *data;
+   size_t len;
+   size_t size;
+   struct sockaddr_in src;
+   int refcnt;
+   struct CMD_RxBuffer *next;
+};
+
+/**
+ * Takes a reference to the buffer holding the command that is currently
+ * being dispatched.  Only valid from within a command callback.
+ *
+ * @return The buffer, or NULL if no command is being dispatched.
+ */
+extern struct CMD_RxBuffer *CMD_rxbuff_retain_current(void);
+
+/**
+ * Takes an additional reference to a receive buffer.  Safe to call from
+ * any thread.
+ */
+extern struct CMD_RxBuffer *CMD_rxbuff_retain(struct CMD_RxBuffer *buff);
+
+/**
+ * Drops a reference to a receive buffer.  The buffer is returned to the
+ * pool when the last reference is released.  Safe to call from any thread.
+ */
+extern void CMD_rxbuff_release(struct CMD_RxBuffer *buff);
+
 typedef void (*CMD_struct_itr)(uint32_t type, struct XDR_StructDefinition *,
       char *buff, size_t len, void *arg1, int arg2, const char *parent);
 extern int CMD_iterate_structs(char *src, size_t len, CMD_struct_itr itr_cb,
@@ -178,6 +215,67 @@ extern void CMD_register_error(struct CMD_ErrorInfo *errs);
 extern void CMD_register_errors(struct CMD_ErrorInfo *errs);
 extern const char *CMD_error_message(uint32_t id);
 extern struct IPC_OpaqueStruct CMD_struct_to_opaque_struct(void *src, uint32_t type);
+/**
+ * Sends an encoded XDR command or response.  Messages too large for one
+ * datagram (IPC_MAX_DATAGRAM_SIZE) are split into IPC_FRAG_SIZE fragments
+ * that the receiver reassembles before dispatching.  Only peers that
+ * support fragmentation can receive such messages.  Ownership of buff
+ * passes to this function.
+ *
+ * @return The number of bytes sent or queued, or a negative value on error.
+ */
+extern int CMD_send_xdr(struct ProcessData *proc, char *buff, size_t len,
+      struct sockaddr_in *dest);
+/// Handle used by a populator to deliver its struct after returning
+struct CMD_PopulatorHandle;
+
+/**
+ * Called from inside a populator, in place of invoking its tx callback,
+ * when the data will only be ready later (for example after an I2C read
+ * or a child process).  The request that ran the populator waits for the
+ * handle to be completed or for its deadline to pass.
+ *
+ * @param cb The tx callback passed to the populator
+ * @param cb_arg The callback argument passed to the populator
+ *
+ * @return The handle to complete, or NULL if the caller does not support
+ *         asynchronous completion and cb must be called immediately
+ */
+extern struct CMD_PopulatorHandle *CMD_populator_defer(
+      void (*cb)(void *data, void *arg, uint32_t error), void *cb_arg);
+/**
+ * Delivers the result of a deferred populator and frees the handle.  The
+ * data is only read during the call.  Results that arrive after the
+ * request's deadline are discarded.
+ */
+extern void CMD_populator_complete(struct CMD_PopulatorHandle *handle,
+      void *data, uint32_t error);
+/**
+ * Sets how long a data request waits for deferred populators before
+ * answering, reporting the missing structs as POPULATOR_TIMEOUT errors.
+ * A value of 0 restores IPC_POPULATOR_DEADLINE_MS.
+ */
+extern void CMD_set_populator_deadline(struct ProcessData *proc,
+      unsigned int ms);
+/**
+ * Records a local subscription and sends the first proc-subscribe to the
+ * publisher.  The lease is renewed automatically until the subscription
+ * is removed.
+ *
+ * @return 0 on success, negative on error
+ */
+extern int CMD_add_subscription(struct ProcessData *proc,
+      struct sockaddr_in dest, uint32_t type, unsigned int period_ms,
+      IPC_telemetry_callback cb, void *arg);
+/**
+ * Removes a subscription added with CMD_add_subscription.  The publisher
+ * is told to stop once no local callbacks remain for the type.
+ *
+ * @return 0 on success, negative if no matching subscription exists
+ */
+extern int CMD_remove_subscription(struct ProcessData *proc,
+      struct sockaddr_in dest, uint32_t type, IPC_telemetry_callback cb,
+      void *arg);
 extern void CMD_add_response_cb(struct ProcessData *proc, uint32_t id,
       struct sockaddr_in host,
       IPC_command_callback cb, void *arg,
@@ -0,0 +1,192 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file crc32c.c CRC-32C (Castagnoli) checksum source file.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_HW_X86
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_HW_ARM
+#endif
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82F63B78
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *data, size_t len);
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static crc32c_fn crc32c_impl = NULL;
+static int crc32c_is_hw = 0;
+
+// Slicing-by-8, consuming eight bytes per step
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *data, size_t len)
+{
+   uint32_t lo, hi;
+
+   while (len && ((uintptr_t)data & 7)) {
+      crc = crc32c_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+      len--;
+   }
+
+   while (len >= 8) {
+      memcpy(&lo, data, sizeof(lo));
+      memcpy(&hi, data + 4, sizeof(hi));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      lo = __builtin_bswap32(lo);
+      hi = __builtin_bswap32(hi);
+#endif
+      lo ^= crc;
+      crc = crc32c_table[7][lo & 0xFF] ^
+            crc32c_table[6][(lo >> 8) & 0xFF] ^
+            crc32c_table[5][(lo >> 16) & 0xFF] ^
+            crc32c_table[4][lo >> 24] ^
+            crc32c_table[3][hi & 0xFF] ^
+            crc32c_table[2][(hi >> 8) & 0xFF] ^
+            crc32c_table[1][(hi >> 16) & 0xFF] ^
+            crc32c_table[0][hi >> 24];
+      data += 8;
+      len -= 8;
+   }
+
+   while (len--)
+      crc = crc32c_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+   return crc;
+}
+
+#if defined(CRC32C_HW_X86)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t len)
+{
+   while (len && ((uintptr_t)data & 7)) {
+      crc = _mm_crc32_u8(crc, *data++);
+      len--;
+   }
+
+#if defined(__x86_64__)
+   uint64_t crc64 = crc, word;
+
+   while (len >= 8) {
+      memcpy(&word, data, sizeof(word));
+      crc64 = _mm_crc32_u64(crc64, word);
+      data += 8;
+      len -= 8;
+   }
+   crc = (uint32_t)crc64;
+#endif
+
+   while (len >= 4) {
+      uint32_t word32;
+
+      memcpy(&word32, data, sizeof(word32));
+      crc = _mm_crc32_u32(crc, word32);
+      data += 4;
+      len -= 4;
+   }
+
+   while (len--)
+      crc = _mm_crc32_u8(crc, *data++);
+
+   return crc;
+}
+
+static int crc32c_hw_present(void)
+{
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(CRC32C_HW_ARM)
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *data, size_t len)
+{
+   uint64_t word;
+
+   while (len && ((uintptr_t)data & 7)) {
+      crc = __crc32cb(crc, *data++);
+      len--;
+   }
+
+   while (len >= 8) {
+      memcpy(&word, data, sizeof(word));
+      crc = __crc32cd(crc, word);
+      data += 8;
+      len -= 8;
+   }
+
+   while (len--)
+      crc = __crc32cb(crc, *data++);
+
+   return crc;
+}
+
+static int crc32c_hw_present(void)
+{
+   return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static void crc32c_init(void)
+{
+   uint32_t crc;
+   int i, j;
+
+   for (i = 0; i < 256; i++) {
+      crc = i;
+      for (j = 0; j < 8; j++)
+         crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+      crc32c_table[0][i] = crc;
+   }
+   for (i = 0; i < 256; i++)
+      for (j = 1; j < 8; j++)
+         crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+               crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+
+   crc32c_impl = &crc32c_sw;
+#if defined(CRC32C_HW_X86) || defined(CRC32C_HW_ARM)
+   if (crc32c_hw_present()) {
+      crc32c_impl = &crc32c_hw;
+      crc32c_is_hw = 1;
+   }
+#endif
+}
+
+uint32_t CRC32C_update(uint32_t crc, const void *data, size_t len)
+{
+   pthread_once(&crc32c_once, &crc32c_init);
+
+   return ~(*crc32c_impl)(~crc, (const uint8_t*)data, len);
+}
+
+int CRC32C_hardware(void)
+{
+   pthread_once(&crc32c_once, &crc32c_init);
+
+   return crc32c_is_hw;
+}
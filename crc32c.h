@@ -0,0 +1,56 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file crc32c.h CRC-32C (Castagnoli) checksum header file.
+ *
+ * Uses the SSE4.2 or ARMv8 CRC32 instructions when the processor has them
+ * and a table driven implementation otherwise.  All implementations produce
+ * the same values.
+ */
+#ifndef LIBPROC_CRC32C_H
+#define LIBPROC_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Extends a CRC-32C over more data.
+ *
+ * @param crc  0 to start a new checksum, or the result of a previous call
+ *             to continue one.
+ * @param data The data to checksum.
+ * @param len  Number of bytes in data.
+ *
+ * @return The CRC-32C of everything passed so far.
+ */
+uint32_t CRC32C_update(uint32_t crc, const void *data, size_t len);
+
+/**
+ * @return Non-zero if CRC32C_update uses processor CRC instructions.
+ */
+int CRC32C_hardware(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdint.h>
+#include <stddef.h>
 #include <limits.h>
 #include <string.h>
 #include <stdlib.h>
@@ -24,38 +25,147 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <arpa/inet.h>
 #include "proclib.h"
 #include "debug.h"
 #include "critical.h"
 #include "util.h"
+#include "hashtable.h"
+#include "crc32c.h"
 
 #define CS_FILE_DIRECTORY "/critical_state"
 #define CS_FILE_PREFIX "crit-state"
 #define NUM_COPIES 4
 #define CLEANUP_INTERVAL 6
+#define CS_MAP_SUFFIX "map"
+#define CS_MAP_SLOTS 2
 
 struct CriticalEntry {
    uint32_t seqNumHigh;
    uint32_t seqNumLow;
-   uint8_t reserved[8];
+   uint8_t checksumType;
+   uint8_t reserved[7];
    uint8_t state[CRITICAL_STATE_MAX_LEN];
-   uint8_t md5[MD5_DIGEST_LENGTH];
+   uint8_t checksum[CS_CHECKSUM_LEN];
 } __attribute__((packed));
 
+union CSChecksumCtx {
+   MD5_CTX md5;
+   uint32_t crc;
+};
+
+struct CSChecksumOps {
+   void (*init)(union CSChecksumCtx *ctx);
+   void (*update)(union CSChecksumCtx *ctx, const void *data, size_t len);
+   void (*final)(union CSChecksumCtx *ctx, uint8_t *sum);
+};
+
+// Mapped file of one critical state directory
+struct CSFileMap {
+   void *map;
+   int legacy_files;
+};
+
+struct CSStateExt {
+   struct CSState *cs;
+   struct CSFileMap files[CRITICAL_STATE_NUM_FILES];
+   int debounce_ms;
+   int pending;
+   struct EventState *evt;
+   void *flush_evt;
+   // CRC32C of cs->state, to catch corruption of the in-memory copy
+   uint32_t state_crc;
+   enum CSChecksumType checksum;
+};
+
 struct CleanupNode {
    char *file;
    struct CleanupNode *next;
 };
 
 extern struct CSState *proc_get_cs_state(ProcessData *proc);
+extern struct CSStateExt *proc_get_cs_ext(ProcessData *proc);
+
+static void cs_md5_init(union CSChecksumCtx *ctx)
+{
+   MD5Init(&ctx->md5);
+}
 
-static void cleanup_old_state(struct CSFileState *fs, const char *proc_name)
+static void cs_md5_update(union CSChecksumCtx *ctx, const void *data,
+      size_t len)
+{
+   MD5Update(&ctx->md5, (unsigned char*)data, len);
+}
+
+static void cs_md5_final(union CSChecksumCtx *ctx, uint8_t *sum)
+{
+   MD5Final(sum, &ctx->md5);
+}
+
+static void cs_crc32c_init(union CSChecksumCtx *ctx)
+{
+   ctx->crc = 0;
+}
+
+static void cs_crc32c_update(union CSChecksumCtx *ctx, const void *data,
+      size_t len)
+{
+   ctx->crc = CRC32C_update(ctx->crc, data, len);
+}
+
+// The CRC is stored in network byte order, followed by zeros
+static void cs_crc32c_final(union CSChecksumCtx *ctx, uint8_t *sum)
+{
+   uint32_t crc = htonl(ctx->crc);
+
+   memset(sum, 0, CS_CHECKSUM_LEN);
+   memcpy(sum, &crc, sizeof(crc));
+}
+
+// Indexed by the checksum type recorded in each entry
+static const struct CSChecksumOps cs_checksums[] = {
+   [CS_CHECKSUM_MD5] = { &cs_md5_init, &cs_md5_update, &cs_md5_final },
+   [CS_CHECKSUM_CRC32C] = { &cs_crc32c_init, &cs_crc32c_update,
+         &cs_crc32c_final },
+};
+
+static const struct CSChecksumOps *cs_checksum_ops(unsigned int type)
+{
+   if (type >= sizeof(cs_checksums) / sizeof(cs_checksums[0]) ||
+         !cs_checksums[type].init)
+      return NULL;
+
+   return &cs_checksums[type];
+}
+
+static int cs_checksum(unsigned int type, const void *data, size_t len,
+      uint8_t *sum)
+{
+   const struct CSChecksumOps *ops = cs_checksum_ops(type);
+   union CSChecksumCtx ctx;
+
+   if (!ops)
+      return -1;
+
+   ops->init(&ctx);
+   ops->update(&ctx, data, len);
+   ops->final(&ctx, sum);
+
+   return 0;
+}
+
+static void cleanup_old_state(struct CSFileState *fs, struct CSFileMap *fm,
+      const char *proc_name)
 {
    char full_path[PATH_MAX];
    char prefix[PATH_MAX];
    DIR *dir = NULL;
    struct dirent *ent = NULL;
    struct CleanupNode *curr, *head = NULL;
+   int kept_legacy = 0;
 
    if (!fs->curr_file)
       return;
@@ -75,7 +185,14 @@ static void cleanup_old_state(struct CSFileState *fs, const char *proc_name)
       if (strncmp(prefix, ent->d_name, strlen(prefix)))
          continue;
       sprintf(full_path, "%s/%s", fs->directory, ent->d_name);
-      if (fs->curr_file && !strcmp(full_path, fs->curr_file))
+      if (fs->curr_file && !strcmp(full_path, fs->curr_file)) {
+         // A legacy current file is only stale once the map replaces it
+         if (strcmp(ent->d_name + strlen(prefix), CS_MAP_SUFFIX))
+            kept_legacy = 1;
+         continue;
+      }
+      // The mapped file is updated in place and never replaced
+      if (!strcmp(ent->d_name + strlen(prefix), CS_MAP_SUFFIX))
          continue;
 
       curr = malloc(sizeof(*curr));
@@ -86,6 +203,7 @@ static void cleanup_old_state(struct CSFileState *fs, const char *proc_name)
 
    closedir(dir);
 
+   fm->legacy_files = kept_legacy;
    while((curr = head)) {
       head = curr->next;
       if (curr->file) {
@@ -97,8 +215,8 @@ static void cleanup_old_state(struct CSFileState *fs, const char *proc_name)
    fs->generation = 0;
 }
 
-static int write_cs_file(struct CSFileState *fs, const char *proc_name,
-   struct CriticalEntry *ent)
+static int write_cs_file(struct CSFileState *fs, struct CSFileMap *fm,
+   const char *proc_name, struct CriticalEntry *ent)
 {
    char file_name[PATH_MAX];
    int fd;
@@ -131,22 +249,99 @@ static int write_cs_file(struct CSFileState *fs, const char *proc_name,
    fs->curr_file = strdup(file_name);
 
    if (++fs->generation > CLEANUP_INTERVAL)
-      cleanup_old_state(fs, proc_name);
+      cleanup_old_state(fs, fm, proc_name);
 
    return 0;
 }
 
+// Opens (creating if needed) the file whose slots are updated in place
+static struct CriticalEntry *open_cs_map(struct CSFileState *fs,
+      struct CSFileMap *fm, const char *proc_name)
+{
+   char file_name[PATH_MAX];
+   struct CriticalEntry *map;
+   struct stat st;
+   size_t len = CS_MAP_SLOTS * sizeof(struct CriticalEntry);
+   int fd;
+
+   if (fm->map)
+      return (struct CriticalEntry*)fm->map;
+
+   sprintf(file_name, "%s/%s-%s.%s.%s", fs->directory, CS_FILE_PREFIX,
+          proc_name, fs->prefix, CS_MAP_SUFFIX);
+
+   fd = open(file_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+   if (fd < 0) {
+      ERR_REPORT(DBG_LEVEL_WARN, "failed to open CS file %s: %s\n",
+                        file_name, strerror(errno));
+      return NULL;
+   }
+
+   if (fstat(fd, &st) < 0 || (st.st_size < len && ftruncate(fd, len) < 0)) {
+      ERR_REPORT(DBG_LEVEL_WARN, "failed to size CS file %s: %s\n",
+                        file_name, strerror(errno));
+      close(fd);
+      return NULL;
+   }
+
+   map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED) {
+      ERR_REPORT(DBG_LEVEL_WARN, "failed to map CS file %s: %s\n",
+                        file_name, strerror(errno));
+      return NULL;
+   }
+
+   fm->map = map;
+   if (fs->curr_file)
+      free(fs->curr_file);
+   fs->curr_file = strdup(file_name);
+
+   return map;
+}
+
+// Overwrites the older of the two mapped slots.  The newer slot is left
+//  intact, so an interrupted write can only lose the entry being written.
+static int write_cs_map(struct CSFileState *fs, struct CSFileMap *fm,
+   const char *proc_name, struct CriticalEntry *ent, uint64_t seq)
+{
+   struct CriticalEntry *map = open_cs_map(fs, fm, proc_name);
+
+   if (!map)
+      return -1;
+
+   memcpy(&map[seq % CS_MAP_SLOTS], ent, sizeof(*ent));
+   if (msync(map, CS_MAP_SLOTS * sizeof(*ent), MS_SYNC) < 0) {
+      ERR_REPORT(DBG_LEVEL_WARN, "failed to sync CS file %s: %s\n",
+                        fs->curr_file, strerror(errno));
+      return -2;
+   }
+
+   // Files from before the map existed are stale once it holds the newest
+   if (fm->legacy_files)
+      cleanup_old_state(fs, fm, proc_name);
+
+   return 0;
+}
+
+static void close_cs_map(struct CSFileMap *fm)
+{
+   if (fm->map)
+      munmap(fm->map, CS_MAP_SLOTS * sizeof(struct CriticalEntry));
+   fm->map = NULL;
+}
+
 static int process_critical_entry(struct CSState *cs, struct CriticalEntry *ent)
 {
-   MD5_CTX md5Ctx;
-   unsigned char md5[MD5_DIGEST_LENGTH];
+   uint8_t sum[CS_CHECKSUM_LEN];
    uint64_t seq;
 
-   MD5Init(&md5Ctx);
-   MD5Update(&md5Ctx, (unsigned char*) ent, sizeof(*ent) - sizeof(ent->md5));
-   MD5Final(md5, &md5Ctx);
+   // Entries written before checksumType existed have it zeroed, i.e. MD5
+   if (cs_checksum(ent->checksumType, ent, offsetof(struct CriticalEntry,
+            checksum), sum) < 0)
+      return 0;
 
-   if (memcmp(ent->md5, md5, sizeof(md5)))
+   if (memcmp(ent->checksum, sum, sizeof(sum)))
       return 0;
 
    seq = ntohl(ent->seqNumHigh);
@@ -161,9 +356,6 @@ static int process_critical_entry(struct CSState *cs, struct CriticalEntry *ent)
 
    cs->state_version = seq;
    memcpy(cs->state, ent->state, sizeof(cs->state));
-   MD5Init(&md5Ctx);
-   MD5Update(&md5Ctx, (unsigned char*) cs->state, sizeof(cs->state));
-   MD5Final(cs->md5, &md5Ctx);
 
    return 1;
 }
@@ -204,7 +396,7 @@ static int load_critical_state_file(struct CSState *cs, const char *file)
 }
 
 static int load_critical_state_directory(struct CSState *cs,
-   struct CSFileState *fs)
+   struct CSFileState *fs, struct CSFileMap *fm)
 {
    char full_path[PATH_MAX];
    char prefix[PATH_MAX];
@@ -228,6 +420,8 @@ static int load_critical_state_directory(struct CSState *cs,
          continue;
 
       sprintf(full_path, "%s/%s", fs->directory, ent->d_name);
+      if (strcmp(ent->d_name + strlen(prefix), CS_MAP_SUFFIX))
+         fm->legacy_files++;
       if (load_critical_state_file(cs, full_path) > 0) {
          rd_cnt++;
          if (fs->curr_file)
@@ -241,25 +435,35 @@ static int load_critical_state_directory(struct CSState *cs,
    return rd_cnt;
 }
 
-static int load_critical_state(struct CSState *cs)
+static int load_critical_state(struct CSStateExt *ext)
 {
+   struct CSState *cs = ext->cs;
    int i;
 
    cs->state_version = 0;
    for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++)
-      load_critical_state_directory(cs, &cs->files[i]);
+      load_critical_state_directory(cs, &cs->files[i], &ext->files[i]);
+   ext->state_crc = CRC32C_update(0, cs->state, sizeof(cs->state));
 
    cs->dirty = 0;
 
    return 0;
 }
 
-void critical_state_init(struct CSState *cs, const char *name)
+struct CSStateExt *critical_state_init(struct CSState *cs, const char *name)
 {
+   struct CSStateExt *ext;
    int i;
 
    memset(cs, 0, sizeof(*cs));
+   ext = calloc(1, sizeof(*ext));
+   if (!ext) {
+      ERRNO_WARN("Failed to allocate critical state");
+      return NULL;
+   }
+   ext->cs = cs;
    cs->name = name;
+   ext->checksum = CS_CHECKSUM_CRC32C;
 
    for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
       sprintf(cs->files[i].prefix, "%c", 'a' + i);
@@ -268,23 +472,32 @@ void critical_state_init(struct CSState *cs, const char *name)
 
    UTIL_ensure_dir(CS_FILE_DIRECTORY);
 
-   load_critical_state(cs);
+   load_critical_state(ext);
 
    for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++)
-      cleanup_old_state(&cs->files[i], name);
+      cleanup_old_state(&cs->files[i], &ext->files[i], name);
+
+   return ext;
 }
 
-void critical_state_cleanup(struct CSState *cs)
+void critical_state_cleanup(struct CSState *cs, struct CSStateExt *ext)
 {
    int i;
 
-   if (!cs)
+   if (!cs || !ext)
       return;
 
+   if (ext->flush_evt && ext->evt)
+      EVT_sched_remove(ext->evt, ext->flush_evt);
+   ext->flush_evt = NULL;
+   if (ext->pending)
+      critical_state_flush(ext);
+
    for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++)
-      cleanup_old_state(&cs->files[i], cs->name);
+      cleanup_old_state(&cs->files[i], &ext->files[i], cs->name);
 
    for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+      close_cs_map(&ext->files[i]);
       if (cs->files[i].curr_file)
          free(cs->files[i].curr_file);
       cs->files[i].curr_file = NULL;
@@ -292,38 +505,32 @@ void critical_state_cleanup(struct CSState *cs)
          free(cs->files[i].directory);
       cs->files[i].directory = NULL;
    }
+   free(ext);
 }
 
-int PROC_save_critical_state(ProcessData *proc, void *state, int len)
+// Durably writes cs->state as a new version to every directory
+int critical_state_flush(struct CSStateExt *ext)
 {
+   struct CSState *cs = ext->cs;
    struct CriticalEntry ent;
    int i;
-   MD5_CTX md5;
-   struct CSState *cs;
-
-   if (len > sizeof(ent.state) || len <= 0)
-      return -1;
-
-   if (!proc)
-      return -2;
-
-   cs = proc_get_cs_state(proc);
-   if (!cs)
-      return -10;
 
    memset(&ent, 0, sizeof(ent));
-   memcpy(&ent.state, state, len);
+   memcpy(&ent.state, cs->state, sizeof(ent.state));
 
+   ext->pending = 0;
    cs->state_version++;
    ent.seqNumHigh = htonl( (cs->state_version >> 32) & 0xFFFFFFFF);
    ent.seqNumLow = htonl(cs->state_version & 0xFFFFFFFF);
 
-   MD5Init(&md5);
-   MD5Update(&md5, (unsigned char*) &ent, sizeof(ent) - sizeof(ent.md5));
-   MD5Final(ent.md5, &md5);
+   ent.checksumType = ext->checksum;
+   cs_checksum(ent.checksumType, &ent, offsetof(struct CriticalEntry,
+            checksum), ent.checksum);
 
    for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
-      if (write_cs_file(&cs->files[i], cs->name, &ent) < 0) {
+      if (write_cs_map(&cs->files[i], &ext->files[i], cs->name, &ent,
+               cs->state_version) < 0 &&
+            write_cs_file(&cs->files[i], &ext->files[i], cs->name, &ent) < 0) {
          if (i == 0)
             return -3;
          else {
@@ -333,45 +540,121 @@ int PROC_save_critical_state(ProcessData *proc, void *state, int len)
       }
    }
 
-   memcpy(cs->state, &ent.state, sizeof(ent.state));
-   MD5Init(&md5);
-   MD5Update(&md5, (unsigned char*) cs->state, sizeof(cs->state));
-   MD5Final(cs->md5, &md5);
+   return 0;
+}
+
+static int critical_state_flush_cb(void *arg)
+{
+   struct CSStateExt *ext = (struct CSStateExt*)arg;
+
+   ext->flush_evt = NULL;
+   if (ext->pending && critical_state_flush(ext) < 0)
+      DBG_print(DBG_LEVEL_WARN, "Failed to write debounced critical state\n");
+
+   return EVENT_REMOVE;
+}
+
+int PROC_critical_state_debounce(ProcessData *proc, int ms)
+{
+   struct CSStateExt *ext;
+
+   if (!proc || ms < 0)
+      return -1;
+
+   ext = proc_get_cs_ext(proc);
+   if (!ext)
+      return -10;
+
+   ext->debounce_ms = ms;
+   if (!ms && ext->pending) {
+      if (ext->flush_evt)
+         EVT_sched_remove(ext->evt, ext->flush_evt);
+      ext->flush_evt = NULL;
+      return critical_state_flush(ext);
+   }
+
+   return 0;
+}
+
+int PROC_save_critical_state(ProcessData *proc, void *state, int len)
+{
+   struct CSStateExt *ext;
+   struct CSState *cs;
+   int res;
+
+   if (len > CRITICAL_STATE_MAX_LEN || len <= 0)
+      return -1;
+
+   if (!proc)
+      return -2;
+
+   cs = proc_get_cs_state(proc);
+   ext = proc_get_cs_ext(proc);
+   if (!cs || !ext)
+      return -10;
+
+   memset(cs->state, 0, sizeof(cs->state));
+   memcpy(cs->state, state, len);
+   ext->state_crc = CRC32C_update(0, cs->state, sizeof(cs->state));
+   ext->pending = 1;
+
+   // Coalesce bursts of saves into one write per interval
+   if (ext->debounce_ms > 0) {
+      if (!ext->flush_evt) {
+         ext->evt = PROC_evt(proc);
+         ext->flush_evt = EVT_sched_add(ext->evt,
+               EVT_ms2tv(ext->debounce_ms), &critical_state_flush_cb, ext);
+         if (ext->flush_evt)
+            EVT_sched_set_name(ext->flush_evt, "Critical State Flush");
+      }
+      if (ext->flush_evt)
+         return len;
+   }
+
+   res = critical_state_flush(ext);
+   if (res < 0)
+      return res;
 
    return len;
 }
 
+int PROC_critical_state_checksum(ProcessData *proc,
+      enum CSChecksumType type)
+{
+   struct CSStateExt *ext = proc_get_cs_ext(proc);
+
+   if (!ext)
+      return -10;
+   if (!cs_checksum_ops(type))
+      return -1;
+
+   ext->checksum = type;
+   return 0;
+}
+
 int PROC_read_critical_state(ProcessData *proc, void *state, int len)
 {
    struct CSState *cs = proc_get_cs_state(proc);
-   MD5_CTX md5Ctx;
-   unsigned char md5[MD5_DIGEST_LENGTH];
+   struct CSStateExt *ext = proc_get_cs_ext(proc);
 
-   if (!cs)
+   if (!cs || !ext)
       return -10;
 
    // Load state if it is marked as dirty
    if (cs->dirty) {
-      if (load_critical_state(cs) < 0)
+      if (load_critical_state(ext) < 0)
          return -1;
    }
 
    if (cs->dirty)
       return -2;
 
-   MD5Init(&md5Ctx);
-   MD5Update(&md5Ctx, (unsigned char*) &cs->state, sizeof(cs->state));
-   MD5Final(md5, &md5Ctx);
-
    // If checksum fails, reload state
-   if (memcmp(md5, &cs->md5, sizeof(md5))) {
-      if (load_critical_state(cs) < 0)
+   if (CRC32C_update(0, cs->state, sizeof(cs->state)) != ext->state_crc) {
+      if (load_critical_state(ext) < 0)
          return -3;
 
-      MD5Init(&md5Ctx);
-      MD5Update(&md5Ctx, (unsigned char*) &cs->state, sizeof(cs->state));
-      MD5Final(md5, &md5Ctx);
-      if (memcmp(md5, &cs->md5, sizeof(md5)))
+      if (CRC32C_update(0, cs->state, sizeof(cs->state)) != ext->state_crc)
          return -4;
    }
 
@@ -383,3 +666,652 @@ int PROC_read_critical_state(ProcessData *proc, void *state, int len)
 
    return len;
 }
+
+#define CSJ_FILE_PREFIX "crit-journal"
+#define CSJ_MAGIC 0x43534A31
+#define CSJ_FLAG_DELETED 1
+#define CSJ_HASH_SIZE 127
+#define CSJ_SNAP_SUFFIX "snap"
+#define CSJ_LOG_SUFFIX "log."
+// Compact once the log is this large and twice the size of the live state
+#define CSJ_COMPACT_MIN (256 * 1024)
+
+struct CSJRecord {
+   uint32_t magic;
+   uint32_t seqNumHigh;
+   uint32_t seqNumLow;
+   uint16_t keyLen;
+   uint8_t checksumType;
+   uint8_t flags;
+   uint32_t valLen;
+   uint8_t checksum[CS_CHECKSUM_LEN];
+} __attribute__((packed));
+
+struct CSJEntry {
+   uint64_t seq;
+   uint32_t len;
+   int deleted;
+   uint8_t *val;
+   char key[];
+};
+
+struct CSJCompaction {
+   struct CSJournal *journal;
+   uint8_t *buff;
+   size_t len;
+   uint32_t gen;
+   char *snapFiles[CRITICAL_STATE_NUM_FILES];
+   int written[CRITICAL_STATE_NUM_FILES];
+};
+
+struct CSJournal {
+   ProcessData *proc;
+   struct HashTable *entries;
+   uint64_t seq;
+   enum CSChecksumType checksum;
+   char *base[CRITICAL_STATE_NUM_FILES];
+   int logFd[CRITICAL_STATE_NUM_FILES];
+   uint32_t logGen, oldestGen[CRITICAL_STATE_NUM_FILES];
+   size_t logBytes, liveBytes;
+   struct CSJCompaction *compaction;
+};
+
+static size_t csj_hash_func(void *key)
+{
+   const unsigned char *str = (const unsigned char*)key;
+   size_t hash = 5381;
+
+   while (*str)
+      hash = hash * 33 + *str++;
+
+   return hash;
+}
+
+static int csj_cmp_key(void *key1, void *key2)
+{
+   return !strcmp((const char*)key1, (const char*)key2);
+}
+
+static void *csj_key_for_data(void *data)
+{
+   return ((struct CSJEntry*)data)->key;
+}
+
+static void csj_entry_free(void *data)
+{
+   struct CSJEntry *ent = (struct CSJEntry*)data;
+
+   free(ent->val);
+   free(ent);
+}
+
+static int csj_record_checksum(struct CSJRecord *rec, const char *key,
+      const void *val, uint8_t *sum)
+{
+   const struct CSChecksumOps *ops = cs_checksum_ops(rec->checksumType);
+   union CSChecksumCtx ctx;
+
+   if (!ops)
+      return -1;
+
+   ops->init(&ctx);
+   ops->update(&ctx, rec, offsetof(struct CSJRecord, checksum));
+   ops->update(&ctx, key, ntohs(rec->keyLen));
+   ops->update(&ctx, val, ntohl(rec->valLen));
+   ops->final(&ctx, sum);
+
+   return 0;
+}
+
+static void csj_fill_record(struct CSJournal *j, struct CSJRecord *rec,
+      uint64_t seq, const char *key, size_t keyLen, const void *val,
+      uint32_t len, int flags)
+{
+   rec->magic = htonl(CSJ_MAGIC);
+   rec->seqNumHigh = htonl((seq >> 32) & 0xFFFFFFFF);
+   rec->seqNumLow = htonl(seq & 0xFFFFFFFF);
+   rec->keyLen = htons(keyLen);
+   rec->checksumType = j->checksum;
+   rec->flags = flags;
+   rec->valLen = htonl(len);
+   csj_record_checksum(rec, key, val, rec->checksum);
+}
+
+// Keeps a record if it is newer than what is already known for its key
+static int csj_apply(struct CSJournal *j, uint64_t seq, const char *key,
+      size_t keyLen, const void *val, uint32_t len, int deleted)
+{
+   struct CSJEntry *ent;
+   char keyBuff[UINT8_MAX + 1];
+   uint8_t *copy = NULL;
+
+   memcpy(keyBuff, key, keyLen);
+   keyBuff[keyLen] = 0;
+
+   ent = HASH_find_key(j->entries, keyBuff);
+   if (ent && ent->seq >= seq)
+      return 0;
+
+   if (len) {
+      copy = malloc(len);
+      if (!copy)
+         return -1;
+      memcpy(copy, val, len);
+   }
+
+   if (!ent) {
+      ent = calloc(1, sizeof(*ent) + keyLen + 1);
+      if (!ent) {
+         free(copy);
+         return -1;
+      }
+      memcpy(ent->key, keyBuff, keyLen + 1);
+      HASH_add_data(j->entries, ent);
+   }
+   else if (!ent->deleted)
+      j->liveBytes -= sizeof(struct CSJRecord) + keyLen + ent->len;
+
+   free(ent->val);
+   ent->val = copy;
+   ent->len = len;
+   ent->seq = seq;
+   ent->deleted = deleted;
+   if (!deleted)
+      j->liveBytes += sizeof(struct CSJRecord) + keyLen + len;
+   if (seq > j->seq)
+      j->seq = seq;
+
+   return 0;
+}
+
+// Loads every intact record from a snapshot or log.  Reading stops at the
+//  first record that fails its checks, which is where a torn append ends.
+static int csj_load_file(struct CSJournal *j, const char *file)
+{
+   struct CSJRecord rec;
+   struct stat st;
+   uint8_t sum[CS_CHECKSUM_LEN];
+   uint8_t *buff, *pos, *end;
+   uint32_t keyLen, valLen;
+   uint64_t seq;
+   int fd, cnt = 0;
+
+   if ((fd = open(file, O_RDONLY)) < 0) {
+      ERR_REPORT(DBG_LEVEL_WARN, "failed to open %s: %s\n",
+               file, strerror(errno));
+      return -1;
+   }
+   if (fstat(fd, &st) < 0 || !st.st_size) {
+      close(fd);
+      return 0;
+   }
+
+   buff = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (buff == MAP_FAILED) {
+      ERR_REPORT(DBG_LEVEL_WARN, "failed to map %s: %s\n",
+               file, strerror(errno));
+      return -1;
+   }
+
+   end = buff + st.st_size;
+   for (pos = buff; pos + sizeof(rec) <= end; cnt++) {
+      memcpy(&rec, pos, sizeof(rec));
+      keyLen = ntohs(rec.keyLen);
+      valLen = ntohl(rec.valLen);
+      if (ntohl(rec.magic) != CSJ_MAGIC || !keyLen || keyLen > UINT8_MAX ||
+            valLen > CS_JOURNAL_MAX_VALUE ||
+            sizeof(rec) + keyLen + valLen > end - pos)
+         break;
+
+      if (csj_record_checksum(&rec, (char*)pos + sizeof(rec),
+            pos + sizeof(rec) + keyLen, sum) < 0 ||
+            memcmp(sum, rec.checksum, sizeof(sum)))
+         break;
+
+      seq = ntohl(rec.seqNumHigh);
+      seq <<= 32;
+      seq |= (uint32_t)ntohl(rec.seqNumLow);
+      csj_apply(j, seq, (char*)pos + sizeof(rec), keyLen,
+            pos + sizeof(rec) + keyLen, valLen,
+            rec.flags & CSJ_FLAG_DELETED);
+
+      pos += sizeof(rec) + keyLen + valLen;
+   }
+
+   if (pos != end)
+      DBG_print(DBG_LEVEL_WARN, "ignoring %ld damaged bytes at the end of "
+            "%s\n", (long)(end - pos), file);
+
+   munmap(buff, st.st_size);
+   return cnt;
+}
+
+static int csj_serialize_cb(void *data, void *arg)
+{
+   struct CSJEntry *ent = (struct CSJEntry*)data;
+   struct CSJCompaction *comp = (struct CSJCompaction*)arg;
+   size_t keyLen = strlen(ent->key);
+
+   if (ent->deleted)
+      return 0;
+
+   csj_fill_record(comp->journal, (struct CSJRecord*)(comp->buff + comp->len),
+         ent->seq,
+         ent->key, keyLen, ent->val, ent->len, 0);
+   comp->len += sizeof(struct CSJRecord);
+   memcpy(comp->buff + comp->len, ent->key, keyLen);
+   comp->len += keyLen;
+   memcpy(comp->buff + comp->len, ent->val, ent->len);
+   comp->len += ent->len;
+
+   return 0;
+}
+
+static int csj_purge_deleted_cb(void *data, void *arg)
+{
+   struct CSJEntry *ent = (struct CSJEntry*)data;
+
+   if (!ent->deleted)
+      return 0;
+
+   csj_entry_free(ent);
+   return 1;
+}
+
+static int csj_open_log(struct CSJournal *j, int i, uint32_t gen)
+{
+   char file[PATH_MAX];
+
+   snprintf(file, sizeof(file), "%s.%s%u", j->base[i], CSJ_LOG_SUFFIX, gen);
+   if (j->logFd[i] >= 0)
+      close(j->logFd[i]);
+   j->logFd[i] = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+   if (j->logFd[i] < 0) {
+      ERR_REPORT(DBG_LEVEL_WARN, "failed to open %s: %s\n",
+               file, strerror(errno));
+      return -1;
+   }
+
+   return 0;
+}
+
+// Writes a snapshot to a temporary file and renames it into place
+static int csj_write_snapshot(const char *snap, const uint8_t *buff,
+      size_t len)
+{
+   char tmp[PATH_MAX];
+   ssize_t wr;
+   size_t done = 0;
+   int fd;
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", snap);
+   fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd < 0)
+      return -1;
+
+   while (done < len) {
+      wr = write(fd, buff + done, len - done);
+      if (wr <= 0) {
+         close(fd);
+         unlink(tmp);
+         return -2;
+      }
+      done += wr;
+   }
+
+   if (fdatasync(fd) < 0 || close(fd) < 0 || rename(tmp, snap) < 0) {
+      unlink(tmp);
+      return -3;
+   }
+
+   return 0;
+}
+
+static int csj_compaction_job(void *arg)
+{
+   struct CSJCompaction *comp = (struct CSJCompaction*)arg;
+   int i, res = 0;
+
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+      if (!comp->snapFiles[i])
+         continue;
+      if (csj_write_snapshot(comp->snapFiles[i], comp->buff, comp->len) < 0)
+         res = -1;
+      else
+         comp->written[i] = 1;
+   }
+
+   return res;
+}
+
+static void csj_compaction_free(struct CSJCompaction *comp)
+{
+   int i;
+
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++)
+      free(comp->snapFiles[i]);
+   free(comp->buff);
+   free(comp);
+}
+
+// Logs older than the new snapshot are no longer needed in each directory
+//  the snapshot reached.  Other directories keep theirs.
+static void csj_compaction_done(struct CSJournal *j, struct CSJCompaction *comp,
+      int res)
+{
+   char file[PATH_MAX];
+   uint32_t gen;
+   int i;
+
+   j->compaction = NULL;
+   if (res < 0)
+      DBG_print(DBG_LEVEL_WARN, "critical journal snapshot failed, keeping "
+            "logs\n");
+
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+      if (!comp->written[i])
+         continue;
+      for (gen = j->oldestGen[i]; gen != comp->gen; gen++) {
+         snprintf(file, sizeof(file), "%s.%s%u", j->base[i], CSJ_LOG_SUFFIX,
+               gen);
+         unlink(file);
+      }
+      j->oldestGen[i] = comp->gen;
+   }
+}
+
+static int csj_compaction_cb(void *arg, int retval)
+{
+   struct CSJCompaction *comp = (struct CSJCompaction*)arg;
+
+   // The journal may have been closed while the snapshot was written
+   if (comp->journal)
+      csj_compaction_done(comp->journal, comp, retval);
+   csj_compaction_free(comp);
+
+   return 0;
+}
+
+// Captures the live state and switches appends to a new log generation
+static struct CSJCompaction *csj_start_compaction(struct CSJournal *j)
+{
+   struct CSJCompaction *comp;
+   char file[PATH_MAX];
+   int i;
+
+   comp = calloc(1, sizeof(*comp));
+   if (!comp)
+      return NULL;
+   comp->journal = j;
+   comp->buff = malloc(j->liveBytes ? j->liveBytes : 1);
+   if (!comp->buff) {
+      free(comp);
+      return NULL;
+   }
+
+   HASH_iterate_arg_table(j->entries, &csj_purge_deleted_cb, NULL);
+   HASH_iterate_arg_table(j->entries, &csj_serialize_cb, comp);
+
+   comp->gen = j->logGen + 1;
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+      if (csj_open_log(j, i, comp->gen) < 0)
+         continue;
+      snprintf(file, sizeof(file), "%s.%s", j->base[i], CSJ_SNAP_SUFFIX);
+      comp->snapFiles[i] = strdup(file);
+   }
+   j->logGen = comp->gen;
+   j->logBytes = 0;
+   j->compaction = comp;
+
+   return comp;
+}
+
+int PROC_journal_compact(struct CSJournal *j)
+{
+   struct CSJCompaction *comp;
+
+   if (!j)
+      return -1;
+   if (j->compaction)
+      return 0;
+
+   comp = csj_start_compaction(j);
+   if (!comp)
+      return -1;
+
+   if (PROC_thread_job_submit(j->proc, &csj_compaction_job, comp,
+            &csj_compaction_cb, comp, PROC_JOB_PRIO_LOW, NULL) < 0)
+      csj_compaction_cb(comp, csj_compaction_job(comp));
+
+   return 0;
+}
+
+static void csj_load_directory(struct CSJournal *j, int idx,
+      const char *directory, const char *prefix)
+{
+   char full_path[PATH_MAX];
+   DIR *dir = NULL;
+   struct dirent *ent = NULL;
+   const char *suffix;
+   unsigned long gen;
+
+   dir = opendir(directory);
+   if (!dir) {
+      ERR_REPORT(DBG_LEVEL_WARN, "failed to opendir %s: %s\n",
+               directory, strerror(errno));
+      return;
+   }
+
+   while ((ent = readdir(dir))) {
+      if (strncmp(prefix, ent->d_name, strlen(prefix)))
+         continue;
+      suffix = ent->d_name + strlen(prefix);
+
+      if (!strncmp(suffix, CSJ_LOG_SUFFIX, strlen(CSJ_LOG_SUFFIX))) {
+         gen = strtoul(suffix + strlen(CSJ_LOG_SUFFIX), NULL, 10);
+         if (gen >= j->logGen)
+            j->logGen = gen;
+         if (gen < j->oldestGen[idx])
+            j->oldestGen[idx] = gen;
+      }
+      else if (strcmp(suffix, CSJ_SNAP_SUFFIX))
+         continue;
+
+      snprintf(full_path, sizeof(full_path), "%s/%s", directory, ent->d_name);
+      csj_load_file(j, full_path);
+   }
+
+   closedir(dir);
+}
+
+struct CSJournal *PROC_journal_open(ProcessData *proc, const char *name)
+{
+   struct CSJournal *j;
+   struct CSState *cs;
+   struct CSStateExt *ext;
+   struct CSJCompaction *comp;
+   char prefix[PATH_MAX];
+   int i;
+
+   if (!proc || !name || !*name || strchr(name, '/'))
+      return NULL;
+   cs = proc_get_cs_state(proc);
+   ext = proc_get_cs_ext(proc);
+   if (!cs || !ext)
+      return NULL;
+
+   j = calloc(1, sizeof(*j));
+   if (!j)
+      return NULL;
+   j->proc = proc;
+   j->checksum = ext->checksum;
+   j->entries = HASH_create_table(CSJ_HASH_SIZE, &csj_hash_func,
+         &csj_cmp_key, &csj_key_for_data);
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+      j->logFd[i] = -1;
+      j->oldestGen[i] = UINT32_MAX;
+      snprintf(prefix, sizeof(prefix), "%s/%s-%s-%s.%s", cs->files[i].directory,
+            CSJ_FILE_PREFIX, cs->name ? cs->name : "", name,
+            cs->files[i].prefix);
+      j->base[i] = strdup(prefix);
+   }
+   if (!j->entries) {
+      PROC_journal_close(j);
+      return NULL;
+   }
+
+   // Both copies are merged; the newest intact record for each key wins
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+      snprintf(prefix, sizeof(prefix), "%s-%s-%s.%s.", CSJ_FILE_PREFIX,
+            cs->name ? cs->name : "", name, cs->files[i].prefix);
+      csj_load_directory(j, i, cs->files[i].directory, prefix);
+   }
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++)
+      if (j->oldestGen[i] > j->logGen)
+         j->oldestGen[i] = j->logGen;
+
+   // Start from a fresh snapshot so damaged tails are never appended to
+   comp = csj_start_compaction(j);
+   if (!comp) {
+      PROC_journal_close(j);
+      return NULL;
+   }
+   csj_compaction_cb(comp, csj_compaction_job(comp));
+
+   return j;
+}
+
+// Appends a record to one directory's log.  A failed or short write is cut
+//  back off, since loading stops at the first torn record and would lose
+//  every record after it.
+static int csj_write_record(struct CSJournal *j, int i, struct iovec *iov,
+      size_t total)
+{
+   off_t end;
+   ssize_t wr;
+
+   if (j->logFd[i] < 0)
+      return -1;
+
+   end = lseek(j->logFd[i], 0, SEEK_END);
+   wr = writev(j->logFd[i], iov, 3);
+   if (wr == (ssize_t)total)
+      return 0;
+
+   ERR_REPORT(DBG_LEVEL_WARN, "bad/short write to %s log: %s\n",
+         j->base[i], wr < 0 ? strerror(errno) : "short write");
+   if (wr > 0 && (end < 0 || ftruncate(j->logFd[i], end) < 0)) {
+      // Nothing more can go in this log.  The next compaction starts a
+      //  new one.
+      ERR_REPORT(DBG_LEVEL_WARN, "failed to remove torn record from %s "
+            "log: %s\n", j->base[i], strerror(errno));
+      close(j->logFd[i]);
+      j->logFd[i] = -1;
+   }
+
+   return -1;
+}
+
+static int csj_append(struct CSJournal *j, const char *key, const void *val,
+      uint32_t len, int flags)
+{
+   struct CSJRecord rec;
+   struct iovec iov[3];
+   size_t keyLen, total;
+   int i, stored = 0;
+
+   if (!j || !key || (len && !val))
+      return -1;
+   keyLen = strlen(key);
+   if (!keyLen || keyLen > UINT8_MAX || len > CS_JOURNAL_MAX_VALUE)
+      return -1;
+
+   csj_fill_record(j, &rec, j->seq + 1, key, keyLen, val, len, flags);
+   iov[0].iov_base = &rec;
+   iov[0].iov_len = sizeof(rec);
+   iov[1].iov_base = (void*)key;
+   iov[1].iov_len = keyLen;
+   iov[2].iov_base = (void*)val;
+   iov[2].iov_len = len;
+   total = sizeof(rec) + keyLen + len;
+
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++)
+      if (csj_write_record(j, i, iov, total) == 0)
+         stored++;
+   if (!stored)
+      return -3;
+
+   // Loading merges the directories, so one stored copy makes it durable
+   if (csj_apply(j, j->seq + 1, key, keyLen, val, len, flags) < 0)
+      return -4;
+   j->logBytes += total;
+
+   if (j->logBytes > CSJ_COMPACT_MIN && j->logBytes > 2 * j->liveBytes)
+      PROC_journal_compact(j);
+
+   if (stored < CRITICAL_STATE_NUM_FILES)
+      return -5;
+   return 0;
+}
+
+int PROC_journal_put(struct CSJournal *j, const char *key, const void *val,
+      uint32_t len)
+{
+   return csj_append(j, key, val, len, 0);
+}
+
+int PROC_journal_delete(struct CSJournal *j, const char *key)
+{
+   struct CSJEntry *ent;
+
+   if (!j || !key)
+      return -1;
+
+   ent = HASH_find_key(j->entries, (void*)key);
+   if (!ent || ent->deleted)
+      return 0;
+
+   return csj_append(j, key, NULL, 0, CSJ_FLAG_DELETED);
+}
+
+const void *PROC_journal_get(struct CSJournal *j, const char *key,
+      uint32_t *len)
+{
+   struct CSJEntry *ent;
+
+   if (!j || !key)
+      return NULL;
+
+   ent = HASH_find_key(j->entries, (void*)key);
+   if (!ent || ent->deleted)
+      return NULL;
+
+   if (len)
+      *len = ent->len;
+   return ent->val ? ent->val : (const void*)ent->key;
+}
+
+void PROC_journal_close(struct CSJournal *j)
+{
+   int i;
+
+   if (!j)
+      return;
+
+   // A snapshot still being written finishes on its own
+   if (j->compaction)
+      j->compaction->journal = NULL;
+
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+      if (j->logFd[i] >= 0)
+         close(j->logFd[i]);
+      free(j->base[i]);
+   }
+
+   if (j->entries) {
+      HASH_extract(j->entries, &csj_entry_free);
+      HASH_free_table(j->entries);
+   }
+   free(j);
+}
@@ -19,6 +19,7 @@
 #define CRITICAL_H
 
 #include "md5.h"
+#include "crc32c.h"
 #include <limits.h>
 
 struct CSFileState {
@@ -30,6 +31,15 @@ struct CSFileState {
 
 #define CRITICAL_STATE_MAX_LEN 224
 #define CRITICAL_STATE_NUM_FILES 2
+/// Bytes reserved for the checksum in each stored entry
+#define CS_CHECKSUM_LEN 16
+
+/// Checksum algorithms for critical state.  The value is stored with each
+///  entry, so it must never be renumbered.
+enum CSChecksumType {
+   CS_CHECKSUM_MD5 = 0,
+   CS_CHECKSUM_CRC32C = 1,
+};
 
 struct CSState {
    uint64_t state_version;
@@ -37,10 +47,18 @@ struct CSState {
    int dirty;
    struct CSFileState files[CRITICAL_STATE_NUM_FILES];
    uint8_t state[CRITICAL_STATE_MAX_LEN];
+   // Unused, kept so the struct keeps its size
    unsigned char md5[MD5_DIGEST_LENGTH];
 };
 
-extern void critical_state_init(struct CSState *cs, const char *name);
-extern void critical_state_cleanup(struct CSState *cs);
+/// Critical state added after CSState's layout was fixed.  It is allocated
+///  separately so CSState, and the ProcessData holding it, keep their size.
+struct CSStateExt;
+
+extern struct CSStateExt *critical_state_init(struct CSState *cs,
+      const char *name);
+extern void critical_state_cleanup(struct CSState *cs,
+      struct CSStateExt *ext);
+extern int critical_state_flush(struct CSStateExt *ext);
 
 #endif
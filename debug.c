@@ -28,18 +28,860 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "debug.h"
 #include "eventTimer.h"
 
 /// Message buffer length
 #define MESSAGE_BUFF_LENGTH 1024
+/// Space in an asynchronous log slot for the format string and arguments
+#define DBG_ASYNC_DATA_LEN 480
+/// Space kept free for later arguments when copying a string argument
+#define DBG_ASYNC_STR_RESERVE 64
+/// How long exit() waits for the log thread to let go of the ring
+#define DBG_ASYNC_EXIT_WAIT_MS 100
+/// Longest conversion specification the asynchronous formatter rebuilds
+#define DBG_SPEC_LEN 48
 
 /// Default level of debug message printing
 static int gDBGLevel = DBG_LEVEL_WARN;
 static struct EventTimer *gDBGTimer = NULL;
+static char gDBGName[64] = "";
+
+// Tags for the arguments captured in an asynchronous log record
+enum DBGArgTag {
+   DBG_TAG_INT = 'i', DBG_TAG_UINT = 'u', DBG_TAG_DOUBLE = 'd',
+   DBG_TAG_LDOUBLE = 'L', DBG_TAG_PTR = 'p', DBG_TAG_STR = 's',
+};
+
+// What a conversion specification consumes from the argument list
+enum DBGArgKind {
+   DBG_KIND_NONE, DBG_KIND_INT, DBG_KIND_UINT, DBG_KIND_CHAR,
+   DBG_KIND_DOUBLE, DBG_KIND_LDOUBLE, DBG_KIND_PTR, DBG_KIND_STR,
+   DBG_KIND_COUNT, DBG_KIND_ERRNO, DBG_KIND_PERCENT, DBG_KIND_UNSUPPORTED,
+};
+
+struct DBGSpec {
+   const char *start, *end;
+   char widthStar, precStar;
+   char len[3];
+   char conv;
+   enum DBGArgKind kind;
+};
+
+// A message waiting to be formatted by the log thread.  data holds the
+//  format string followed by the captured arguments, or the finished
+//  message when it had to be formatted up front.
+struct DBGLogRecord {
+   int level;
+   int err;
+   char syserr;
+   char hasTime;
+   char preformatted;
+   char truncated;
+   struct timeval when;
+   const char *func, *file;
+   unsigned long line;
+   uint16_t argOff, argLen;
+   char data[DBG_ASYNC_DATA_LEN];
+};
+
+struct DBGLogSlot {
+   size_t seq;
+   struct DBGLogRecord rec;
+};
+
+struct DBGAsyncLog {
+   struct DBGLogSlot *slots;
+   size_t mask;
+   size_t head;
+   size_t tail;
+   unsigned long dropped;
+   int stop;
+   // Futex word, set while the log thread waits for messages
+   int sleeping;
+   // Set while someone is writing out messages from the ring
+   int draining;
+   int fd;
+   pthread_t thread;
+};
+
+static struct DBGAsyncLog *gDBGAsync = NULL;
+static int gDBGAsyncWriters = 0;
+static int gDBGAtforkRegistered = 0;
+
+// Parses the conversion specification starting at the '%' at p
+static void dbg_parse_spec(const char *p, struct DBGSpec *spec)
+{
+   int l = 0;
+
+   memset(spec, 0, sizeof(*spec));
+   spec->start = p++;
+   spec->kind = DBG_KIND_UNSUPPORTED;
+
+   while (*p && strchr("-+ #0'I", *p))
+      p++;
+   if (*p == '*') {
+      spec->widthStar = 1;
+      p++;
+   }
+   else {
+      while (*p >= '0' && *p <= '9')
+         p++;
+      // Positional arguments are not supported
+      if (*p == '$') {
+         spec->end = p + 1;
+         return;
+      }
+   }
+   if (*p == '.') {
+      p++;
+      if (*p == '*') {
+         spec->precStar = 1;
+         p++;
+      }
+      else
+         while (*p >= '0' && *p <= '9')
+            p++;
+   }
+   while (*p && l < 2 && strchr("hlqLjzZt", *p))
+      spec->len[l++] = *p++;
+
+   spec->conv = *p;
+   spec->end = *p ? p + 1 : p;
+
+   switch (spec->conv) {
+      case 'd': case 'i':
+         spec->kind = DBG_KIND_INT;
+         break;
+      case 'o': case 'u': case 'x': case 'X':
+         spec->kind = DBG_KIND_UINT;
+         break;
+      case 'c':
+         if (!l)
+            spec->kind = DBG_KIND_CHAR;
+         break;
+      case 'e': case 'E': case 'f': case 'F':
+      case 'g': case 'G': case 'a': case 'A':
+         if (!l || !strcmp(spec->len, "l"))
+            spec->kind = DBG_KIND_DOUBLE;
+         else if (!strcmp(spec->len, "L"))
+            spec->kind = DBG_KIND_LDOUBLE;
+         break;
+      case 's':
+         if (!l)
+            spec->kind = DBG_KIND_STR;
+         break;
+      case 'p':
+         spec->kind = DBG_KIND_PTR;
+         break;
+      case 'n':
+         spec->kind = DBG_KIND_COUNT;
+         break;
+      case 'm':
+         spec->kind = DBG_KIND_ERRNO;
+         break;
+      case '%':
+         spec->kind = DBG_KIND_PERCENT;
+         break;
+   }
+}
+
+static int dbg_put_arg(struct DBGLogRecord *rec, char tag, const void *val,
+      size_t len)
+{
+   if (rec->argOff + rec->argLen + 1 + len > sizeof(rec->data))
+      return -1;
+
+   rec->data[rec->argOff + rec->argLen] = tag;
+   memcpy(&rec->data[rec->argOff + rec->argLen + 1], val, len);
+   rec->argLen += 1 + len;
+
+   return 0;
+}
+
+static int dbg_put_star(struct DBGLogRecord *rec, va_list *ap)
+{
+   long long val = va_arg(*ap, int);
+
+   return dbg_put_arg(rec, DBG_TAG_INT, &val, sizeof(val));
+}
+
+static long long dbg_get_signed(const char *len, va_list *ap)
+{
+   if (!strcmp(len, "hh"))
+      return (signed char)va_arg(*ap, int);
+   if (!strcmp(len, "h"))
+      return (short)va_arg(*ap, int);
+   if (!strcmp(len, "l"))
+      return va_arg(*ap, long);
+   if (!strcmp(len, "ll") || !strcmp(len, "q") || !strcmp(len, "L"))
+      return va_arg(*ap, long long);
+   if (!strcmp(len, "j"))
+      return va_arg(*ap, intmax_t);
+   if (!strcmp(len, "z") || !strcmp(len, "Z"))
+      return va_arg(*ap, ssize_t);
+   if (!strcmp(len, "t"))
+      return va_arg(*ap, ptrdiff_t);
+   return va_arg(*ap, int);
+}
+
+static unsigned long long dbg_get_unsigned(const char *len, va_list *ap)
+{
+   if (!strcmp(len, "hh"))
+      return (unsigned char)va_arg(*ap, unsigned int);
+   if (!strcmp(len, "h"))
+      return (unsigned short)va_arg(*ap, unsigned int);
+   if (!strcmp(len, "l"))
+      return va_arg(*ap, unsigned long);
+   if (!strcmp(len, "ll") || !strcmp(len, "q") || !strcmp(len, "L"))
+      return va_arg(*ap, unsigned long long);
+   if (!strcmp(len, "j"))
+      return va_arg(*ap, uintmax_t);
+   if (!strcmp(len, "z") || !strcmp(len, "Z"))
+      return va_arg(*ap, size_t);
+   if (!strcmp(len, "t"))
+      return va_arg(*ap, ptrdiff_t);
+   return va_arg(*ap, unsigned int);
+}
+
+// Copies the format string and its arguments into the record.  Returns -1
+//  when the format uses something that can only be formatted up front.
+static int dbg_capture(struct DBGLogRecord *rec, const char *fmt,
+      va_list args)
+{
+   struct DBGSpec spec;
+   va_list ap;
+   const char *p, *str;
+   size_t fmtLen, space;
+   long long ival;
+   unsigned long long uval;
+   double dval;
+   long double ldval;
+   void *pval;
+   uint16_t slen;
+   int full = 0;
+
+   fmtLen = strlen(fmt);
+   if (fmtLen >= sizeof(rec->data) / 2)
+      return -1;
+   memcpy(rec->data, fmt, fmtLen + 1);
+   rec->argOff = fmtLen + 1;
+   rec->argLen = 0;
+
+   va_copy(ap, args);
+   for (p = fmt; *p; ) {
+      if (*p != '%') {
+         p++;
+         continue;
+      }
+      dbg_parse_spec(p, &spec);
+      p = spec.end;
+      if (spec.kind == DBG_KIND_UNSUPPORTED) {
+         va_end(ap);
+         return -1;
+      }
+
+      // Once a value does not fit the rest of the message is cut off, but
+      //  the arguments still have to be consumed in order
+      if (spec.widthStar && (full || dbg_put_star(rec, &ap) < 0))
+         full = 1;
+      if (spec.precStar && (full || dbg_put_star(rec, &ap) < 0))
+         full = 1;
+
+      switch (spec.kind) {
+         case DBG_KIND_INT:
+            ival = dbg_get_signed(spec.len, &ap);
+            full = full ||
+               dbg_put_arg(rec, DBG_TAG_INT, &ival, sizeof(ival)) < 0;
+            break;
+         case DBG_KIND_UINT:
+            uval = dbg_get_unsigned(spec.len, &ap);
+            full = full ||
+               dbg_put_arg(rec, DBG_TAG_UINT, &uval, sizeof(uval)) < 0;
+            break;
+         case DBG_KIND_CHAR:
+            ival = va_arg(ap, int);
+            full = full ||
+               dbg_put_arg(rec, DBG_TAG_INT, &ival, sizeof(ival)) < 0;
+            break;
+         case DBG_KIND_DOUBLE:
+            dval = va_arg(ap, double);
+            full = full ||
+               dbg_put_arg(rec, DBG_TAG_DOUBLE, &dval, sizeof(dval)) < 0;
+            break;
+         case DBG_KIND_LDOUBLE:
+            ldval = va_arg(ap, long double);
+            full = full ||
+               dbg_put_arg(rec, DBG_TAG_LDOUBLE, &ldval, sizeof(ldval)) < 0;
+            break;
+         case DBG_KIND_PTR:
+            pval = va_arg(ap, void*);
+            full = full ||
+               dbg_put_arg(rec, DBG_TAG_PTR, &pval, sizeof(pval)) < 0;
+            break;
+         case DBG_KIND_COUNT:
+            (void)va_arg(ap, void*);
+            break;
+         case DBG_KIND_STR:
+            str = va_arg(ap, const char*);
+            if (!str)
+               str = "(null)";
+            if (full)
+               break;
+            space = sizeof(rec->data) - rec->argOff - rec->argLen;
+            if (space < 1 + sizeof(slen) + 1) {
+               full = 1;
+               break;
+            }
+            space -= 1 + sizeof(slen) + 1;
+            if (space > DBG_ASYNC_STR_RESERVE)
+               space -= DBG_ASYNC_STR_RESERVE;
+            slen = strnlen(str, space);
+            rec->data[rec->argOff + rec->argLen] = DBG_TAG_STR;
+            memcpy(&rec->data[rec->argOff + rec->argLen + 1], &slen,
+                  sizeof(slen));
+            memcpy(&rec->data[rec->argOff + rec->argLen + 1 + sizeof(slen)],
+                  str, slen);
+            rec->data[rec->argOff + rec->argLen + 1 + sizeof(slen) + slen] =
+               0;
+            rec->argLen += 1 + sizeof(slen) + slen + 1;
+            break;
+         default:
+            break;
+      }
+   }
+   va_end(ap);
+   rec->truncated = full;
+
+   return 0;
+}
+
+// Pulls the next captured argument, checking it has the expected tag
+static const char *dbg_next_arg(struct DBGLogRecord *rec, size_t *off,
+      char tag)
+{
+   const char *val;
+   uint16_t slen;
+
+   if (*off >= rec->argLen || rec->data[rec->argOff + *off] != tag)
+      return NULL;
+
+   val = &rec->data[rec->argOff + *off + 1];
+   switch (tag) {
+      case DBG_TAG_INT:
+      case DBG_TAG_UINT:
+         *off += 1 + sizeof(long long);
+         break;
+      case DBG_TAG_DOUBLE:
+         *off += 1 + sizeof(double);
+         break;
+      case DBG_TAG_LDOUBLE:
+         *off += 1 + sizeof(long double);
+         break;
+      case DBG_TAG_PTR:
+         *off += 1 + sizeof(void*);
+         break;
+      case DBG_TAG_STR:
+         memcpy(&slen, val, sizeof(slen));
+         *off += 1 + sizeof(slen) + slen + 1;
+         val += sizeof(slen);
+         break;
+   }
+
+   return val;
+}
+
+// Formats a captured message by replaying each conversion with its value
+static void dbg_replay(struct DBGLogRecord *rec, char *out, size_t outLen)
+{
+   struct DBGSpec spec;
+   char fmt[DBG_SPEC_LEN];
+   const char *p, *q, *arg;
+   size_t used = 0, off = 0, flen;
+   long long star[2], ival;
+   unsigned long long uval;
+   double dval;
+   long double ldval;
+   void *pval;
+   int nstar, i, len;
+
+   out[0] = 0;
+   for (p = rec->data; *p && used + 1 < outLen; ) {
+      if (*p != '%') {
+         out[used++] = *p++;
+         out[used] = 0;
+         continue;
+      }
+
+      dbg_parse_spec(p, &spec);
+      p = spec.end;
+      if (spec.kind == DBG_KIND_PERCENT) {
+         out[used++] = '%';
+         out[used] = 0;
+         continue;
+      }
+      if (spec.kind == DBG_KIND_ERRNO) {
+         len = snprintf(&out[used], outLen - used, "%s", strerror(rec->err));
+         used += len < 0 ? 0 : len;
+         if (used >= outLen)
+            used = outLen - 1;
+         continue;
+      }
+      if (spec.kind == DBG_KIND_COUNT)
+         continue;
+
+      nstar = 0;
+      if (spec.widthStar) {
+         if (!(arg = dbg_next_arg(rec, &off, DBG_TAG_INT)))
+            break;
+         memcpy(&star[nstar++], arg, sizeof(long long));
+      }
+      if (spec.precStar) {
+         if (!(arg = dbg_next_arg(rec, &off, DBG_TAG_INT)))
+            break;
+         memcpy(&star[nstar++], arg, sizeof(long long));
+      }
+
+      // Rebuild the specification with '*' replaced by the captured values
+      //  and integers widened to long long
+      flen = 0;
+      i = 0;
+      for (q = spec.start; q < spec.end && flen + 24 < sizeof(fmt); q++) {
+         if (*q == '*') {
+            if (q > spec.start && q[-1] == '.' && star[i] < 0)
+               flen--;
+            else
+               flen += sprintf(&fmt[flen], "%lld", star[i]);
+            i++;
+         }
+         else if (strchr("hlqLjzZt", *q) &&
+               (spec.kind == DBG_KIND_INT || spec.kind == DBG_KIND_UINT))
+            continue;
+         else if (q == spec.end - 1 &&
+               (spec.kind == DBG_KIND_INT || spec.kind == DBG_KIND_UINT))
+            flen += sprintf(&fmt[flen], "ll%c", *q);
+         else
+            fmt[flen++] = *q;
+      }
+      fmt[flen] = 0;
+
+      len = 0;
+      switch (spec.kind) {
+         case DBG_KIND_INT:
+         case DBG_KIND_CHAR:
+            if (!(arg = dbg_next_arg(rec, &off, DBG_TAG_INT)))
+               goto done;
+            memcpy(&ival, arg, sizeof(ival));
+            if (spec.kind == DBG_KIND_CHAR)
+               len = snprintf(&out[used], outLen - used, fmt, (int)ival);
+            else
+               len = snprintf(&out[used], outLen - used, fmt, ival);
+            break;
+         case DBG_KIND_UINT:
+            if (!(arg = dbg_next_arg(rec, &off, DBG_TAG_UINT)))
+               goto done;
+            memcpy(&uval, arg, sizeof(uval));
+            len = snprintf(&out[used], outLen - used, fmt, uval);
+            break;
+         case DBG_KIND_DOUBLE:
+            if (!(arg = dbg_next_arg(rec, &off, DBG_TAG_DOUBLE)))
+               goto done;
+            memcpy(&dval, arg, sizeof(dval));
+            len = snprintf(&out[used], outLen - used, fmt, dval);
+            break;
+         case DBG_KIND_LDOUBLE:
+            if (!(arg = dbg_next_arg(rec, &off, DBG_TAG_LDOUBLE)))
+               goto done;
+            memcpy(&ldval, arg, sizeof(ldval));
+            len = snprintf(&out[used], outLen - used, fmt, ldval);
+            break;
+         case DBG_KIND_PTR:
+            if (!(arg = dbg_next_arg(rec, &off, DBG_TAG_PTR)))
+               goto done;
+            memcpy(&pval, arg, sizeof(pval));
+            len = snprintf(&out[used], outLen - used, fmt, pval);
+            break;
+         case DBG_KIND_STR:
+            if (!(arg = dbg_next_arg(rec, &off, DBG_TAG_STR)))
+               goto done;
+            len = snprintf(&out[used], outLen - used, fmt, arg);
+            break;
+         default:
+            break;
+      }
+      used += len < 0 ? 0 : len;
+      if (used >= outLen)
+         used = outLen - 1;
+   }
+
+done:
+   if (rec->truncated && *p)
+      snprintf(&out[used], outLen - used, "...");
+}
+
+static void dbg_async_write(struct DBGAsyncLog *log, struct DBGLogRecord *rec)
+{
+   char msg[MESSAGE_BUFF_LENGTH];
+   char line[MESSAGE_BUFF_LENGTH + 512];
+   int len = 0, hdr = 0;
+
+   if (rec->preformatted) {
+      strncpy(msg, rec->data, sizeof(msg));
+      msg[sizeof(msg) - 1] = 0;
+   }
+   else
+      dbg_replay(rec, msg, sizeof(msg));
+
+   // Files get the same name and pid prefix syslog would add
+   if (log->fd >= 0) {
+      hdr = snprintf(line, sizeof(line), "%s[%d]: ", gDBGName, (int)getpid());
+      if (hdr < 0)
+         hdr = 0;
+   }
+
+   if (rec->syserr && rec->hasTime)
+      len = snprintf(&line[hdr], sizeof(line) - hdr,
+            "%lu,%06lu: %s - %s in %s() at %s:%lu",
+            rec->when.tv_sec, rec->when.tv_usec, strerror(rec->err), msg,
+            rec->func, rec->file, rec->line);
+   else if (rec->syserr)
+      len = snprintf(&line[hdr], sizeof(line) - hdr, "%s - %s in %s() at %s:%lu",
+            strerror(rec->err), msg, rec->func, rec->file, rec->line);
+   else if (rec->hasTime)
+      len = snprintf(&line[hdr], sizeof(line) - hdr, "%lu.%06lu: %s",
+            rec->when.tv_sec, rec->when.tv_usec, msg);
+   else
+      len = snprintf(&line[hdr], sizeof(line) - hdr, "%s", msg);
+   if (len < 0)
+      return;
+   len += hdr;
+   if (len >= (int)sizeof(line))
+      len = sizeof(line) - 1;
+
+   if (log->fd < 0) {
+      syslog(rec->level, "%s", line);
+      return;
+   }
+
+   if (len + 1 < (int)sizeof(line) && (len == 0 || line[len - 1] != '\n'))
+      line[len++] = '\n';
+   if (write(log->fd, line, len) < 0)
+      return;
+}
+
+// Writes out every published message, returning how many there were
+static int dbg_async_drain(struct DBGAsyncLog *log)
+{
+   struct DBGLogSlot *slot;
+   int count = 0;
+
+   for (;;) {
+      slot = &log->slots[log->head & log->mask];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != log->head + 1)
+         break;
+
+      dbg_async_write(log, &slot->rec);
+      __atomic_store_n(&slot->seq, log->head + log->mask + 1,
+            __ATOMIC_RELEASE);
+      log->head++;
+      count++;
+   }
+
+   return count;
+}
+
+// Whether the next message in the ring has been published
+static int dbg_async_pending(struct DBGAsyncLog *log)
+{
+   struct DBGLogSlot *slot = &log->slots[log->head & log->mask];
+
+   return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == log->head + 1;
+}
+
+// Takes the consumer side of the ring.  Fails when it is already taken.
+static int dbg_async_claim(struct DBGAsyncLog *log)
+{
+   int idle = 0;
+
+   return __atomic_compare_exchange_n(&log->draining, &idle, 1, 0,
+         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void dbg_async_wake(struct DBGAsyncLog *log)
+{
+   if (__atomic_exchange_n(&log->sleeping, 0, __ATOMIC_SEQ_CST))
+      syscall(SYS_futex, &log->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void *dbg_async_thread(void *arg)
+{
+   struct DBGAsyncLog *log = (struct DBGAsyncLog*)arg;
+   int count;
+
+   for (;;) {
+      // The exit handler took the ring over
+      if (!dbg_async_claim(log))
+         break;
+      count = dbg_async_drain(log);
+      if (!count && __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE)) {
+         dbg_async_drain(log);
+         __atomic_store_n(&log->draining, 0, __ATOMIC_RELEASE);
+         break;
+      }
+      __atomic_store_n(&log->draining, 0, __ATOMIC_RELEASE);
+      if (count)
+         continue;
+
+      // Announce the sleep before looking at the ring again, so a writer
+      //  either sees the flag or its message is seen here
+      __atomic_store_n(&log->sleeping, 1, __ATOMIC_SEQ_CST);
+      if (dbg_async_pending(log) ||
+            __atomic_load_n(&log->stop, __ATOMIC_SEQ_CST)) {
+         __atomic_store_n(&log->sleeping, 0, __ATOMIC_RELAXED);
+         continue;
+      }
+      syscall(SYS_futex, &log->sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+   }
+
+   return NULL;
+}
+
+// Claims a ring slot for a message.  Returns NULL when the ring is full.
+static struct DBGLogSlot *dbg_async_reserve(struct DBGAsyncLog *log,
+      size_t *pos)
+{
+   struct DBGLogSlot *slot;
+   size_t seq;
+   intptr_t dif;
+
+   *pos = __atomic_load_n(&log->tail, __ATOMIC_RELAXED);
+   for (;;) {
+      slot = &log->slots[*pos & log->mask];
+      seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      dif = (intptr_t)seq - (intptr_t)*pos;
+      if (dif == 0) {
+         if (__atomic_compare_exchange_n(&log->tail, pos, *pos + 1, 1,
+                  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return slot;
+      }
+      else if (dif < 0)
+         return NULL;
+      else
+         *pos = __atomic_load_n(&log->tail, __ATOMIC_RELAXED);
+   }
+}
+
+// Queues a message on the asynchronous log.  Returns -1 when the log is not
+//  running, so the caller falls back to synchronous output.
+static int dbg_async_log(int level, int err, const char *func,
+      const char *file, unsigned long line, const char *fmt, va_list ap)
+{
+   struct DBGAsyncLog *log;
+   struct DBGLogSlot *slot;
+   struct DBGLogRecord *rec;
+   va_list cp;
+   size_t pos;
+   int res = 0;
+
+   __atomic_add_fetch(&gDBGAsyncWriters, 1, __ATOMIC_ACQUIRE);
+   log = __atomic_load_n(&gDBGAsync, __ATOMIC_ACQUIRE);
+   if (!log) {
+      res = -1;
+      goto out;
+   }
+
+   slot = dbg_async_reserve(log, &pos);
+   if (!slot) {
+      __atomic_add_fetch(&log->dropped, 1, __ATOMIC_RELAXED);
+      goto out;
+   }
+
+   rec = &slot->rec;
+   rec->level = level;
+   rec->err = err;
+   rec->syserr = func != NULL;
+   rec->func = func;
+   rec->file = file;
+   rec->line = line;
+   rec->hasTime = 0;
+   if (gDBGTimer) {
+      gDBGTimer->get_gmt_time(gDBGTimer, &rec->when);
+      rec->hasTime = 1;
+   }
+
+   va_copy(cp, ap);
+   rec->preformatted = 0;
+   rec->truncated = 0;
+   if (dbg_capture(rec, fmt, ap) < 0) {
+      errno = err;
+      vsnprintf(rec->data, sizeof(rec->data), fmt, cp);
+      rec->data[sizeof(rec->data) - 1] = 0;
+      rec->preformatted = 1;
+   }
+   va_end(cp);
+
+   __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (__atomic_load_n(&log->sleeping, __ATOMIC_RELAXED))
+      dbg_async_wake(log);
+
+out:
+   __atomic_sub_fetch(&gDBGAsyncWriters, 1, __ATOMIC_RELEASE);
+   return res;
+}
+
+// A forked child has no log thread, so it goes back to synchronous output
+static void dbg_async_atfork_child(void)
+{
+   gDBGAsync = NULL;
+   gDBGAsyncWriters = 0;
+}
+
+// Takes the log out of service, waiting out any caller still filling in a
+//  slot, and tells the log thread to finish
+static struct DBGAsyncLog *dbg_async_retire(void)
+{
+   struct DBGAsyncLog *log;
+
+   log = __atomic_exchange_n(&gDBGAsync, NULL, __ATOMIC_ACQ_REL);
+   if (!log)
+      return NULL;
+
+   while (__atomic_load_n(&gDBGAsyncWriters, __ATOMIC_ACQUIRE))
+      sched_yield();
+
+   __atomic_store_n(&log->stop, 1, __ATOMIC_SEQ_CST);
+   dbg_async_wake(log);
+
+   return log;
+}
+
+// Joining the log thread inside exit() can hang, so the exiting thread
+//  takes the ring over and writes out what is left itself.  The thread and
+//  memory go away with the process.
+static void dbg_async_exit(void)
+{
+   struct timespec pause = { 0, 1000000L };
+   struct DBGAsyncLog *log;
+   int i;
+
+   log = dbg_async_retire();
+   if (!log)
+      return;
+
+   for (i = 0; !dbg_async_claim(log); i++) {
+      if (i >= DBG_ASYNC_EXIT_WAIT_MS)
+         return;
+      nanosleep(&pause, NULL);
+   }
+   dbg_async_drain(log);
+
+   if (log->dropped)
+      syslog(DBG_LEVEL_WARN, "%lu debug messages were dropped",
+            log->dropped);
+   if (log->fd >= 0)
+      close(log->fd);
+}
+
+int DBG_async_start(size_t slots, const char *path)
+{
+   struct DBGAsyncLog *log;
+   sigset_t all, old;
+   size_t i, count = 1;
+
+   if (__atomic_load_n(&gDBGAsync, __ATOMIC_ACQUIRE))
+      return 0;
+
+   if (!slots)
+      slots = DBG_ASYNC_DEFAULT_SLOTS;
+   while (count < slots)
+      count <<= 1;
+
+   log = (struct DBGAsyncLog*)calloc(1, sizeof(*log));
+   if (!log)
+      return -1;
+   log->slots = (struct DBGLogSlot*)malloc(sizeof(*log->slots) * count);
+   if (!log->slots) {
+      free(log);
+      return -1;
+   }
+   for (i = 0; i < count; i++)
+      log->slots[i].seq = i;
+   log->mask = count - 1;
+
+   log->fd = -1;
+   if (path) {
+      log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+      if (log->fd < 0) {
+         ERR_REPORT(DBG_LEVEL_WARN, "Failed to open log file %s", path);
+         free(log->slots);
+         free(log);
+         return -1;
+      }
+   }
+
+   // Signals are left to the event loop thread
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &old);
+   i = pthread_create(&log->thread, NULL, &dbg_async_thread, log);
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   if (i) {
+      if (log->fd >= 0)
+         close(log->fd);
+      free(log->slots);
+      free(log);
+      return -1;
+   }
+
+   if (!gDBGAtforkRegistered) {
+      pthread_atfork(NULL, NULL, &dbg_async_atfork_child);
+      atexit(&dbg_async_exit);
+      gDBGAtforkRegistered = 1;
+   }
+   __atomic_store_n(&gDBGAsync, log, __ATOMIC_RELEASE);
+
+   return 0;
+}
+
+void DBG_async_stop(void)
+{
+   struct DBGAsyncLog *log;
+
+   log = dbg_async_retire();
+   if (!log)
+      return;
+
+   pthread_join(log->thread, NULL);
+
+   if (log->dropped)
+      syslog(DBG_LEVEL_WARN, "%lu debug messages were dropped",
+            log->dropped);
+   if (log->fd >= 0)
+      close(log->fd);
+   free(log->slots);
+   free(log);
+}
+
+unsigned long DBG_async_dropped(void)
+{
+   struct DBGAsyncLog *log = __atomic_load_n(&gDBGAsync, __ATOMIC_ACQUIRE);
+
+   return log ? __atomic_load_n(&log->dropped, __ATOMIC_RELAXED) : 0;
+}
 
 // Debug output function
-void DBG_print(int level, const char *fmt, ...)
+void (DBG_print)(int level, const char *fmt, ...)
 {
    va_list ap;
    char buff[MESSAGE_BUFF_LENGTH];
@@ -51,7 +893,11 @@ void DBG_print(int level, const char *fmt, ...)
 
    // Read in the variable arguments and print the message to the log
    va_start(ap, fmt);
-   if (gDBGTimer) {
+   if (__atomic_load_n(&gDBGAsync, __ATOMIC_RELAXED) &&
+         dbg_async_log(level, errno, NULL, NULL, 0, fmt, ap) == 0) {
+      // Queued for the log thread
+   }
+   else if (gDBGTimer) {
       vsnprintf(&buff[0], sizeof(buff), fmt, ap);
       buff[sizeof(buff)-1] = 0;
 
@@ -74,6 +920,10 @@ void DBG_setLevel(int newLevel)
 // Initialize debug interface
 void DBG_init(const char * procName)
 {
+   if (procName) {
+      strncpy(gDBGName, procName, sizeof(gDBGName));
+      gDBGName[sizeof(gDBGName) - 1] = 0;
+   }
    openlog(procName, LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER);
 }
 
@@ -94,8 +944,14 @@ void DBG_syserr(unsigned long line, const char *func, const char *file,
       return;
    }
 
-   // Read in the variable arguments to the buffer
    va_start(ap, fmt);
+   if (__atomic_load_n(&gDBGAsync, __ATOMIC_RELAXED) &&
+         dbg_async_log(level, errno, func, file, line, fmt, ap) == 0) {
+      va_end(ap);
+      return;
+   }
+
+   // Read in the variable arguments to the buffer
    vsnprintf(&buff[0], sizeof(buff), fmt, ap);
    buff[sizeof(buff)-1] = 0;
    va_end(ap);
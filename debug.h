@@ -25,6 +25,7 @@
 #define DEBUG_H
 
 #include <errno.h>
+#include <stddef.h>
 #include <syslog.h>
 
 #ifdef __cplusplus
@@ -42,6 +43,20 @@ extern "C" {
 /// Debug level that includes all possible output
 #define DBG_LEVEL_ALL   LOG_DEBUG
 
+/**
+ * Most verbose level compiled into the program.  Calls to DBG_print and
+ * ERR_REPORT with a constant level above this are removed by the compiler.
+ * Define it before including this header, or on the compiler command line
+ * (e.g., -DDBG_COMPILE_LEVEL=DBG_LEVEL_WARN), to strip debug output from
+ * production builds.
+ */
+#ifndef DBG_COMPILE_LEVEL
+#define DBG_COMPILE_LEVEL DBG_LEVEL_ALL
+#endif
+
+/// Default number of messages the asynchronous log can hold
+#define DBG_ASYNC_DEFAULT_SLOTS 256
+
 /**
  *  Issues a debug/error message with a given priority to the log.
  *
@@ -53,6 +68,8 @@ extern "C" {
  *  @param  ...   Parameters of message (like arguments to printf).
  */
 void DBG_print(int level, const char *fmt, ...);
+#define DBG_print(level, ...) do { if ((level) <= DBG_COMPILE_LEVEL) \
+                        DBG_print((level), __VA_ARGS__); } while(0)
 
 /**
  * Sets the level of the debug messages. Any messages up to and including this
@@ -93,6 +110,40 @@ void DBG_set_timer(struct EventTimer *timer);
 void DBG_syserr(unsigned long line, const char *func, const char *file,
       int level, const char *fmt, ...);
 
+/**
+ * Switches DBG_print and DBG_syserr to asynchronous output.  Callers only
+ * capture the timestamp, format string and arguments into a lock-free
+ * ring.  A background thread formats the messages and writes them out.
+ * Messages that arrive while the ring is full are dropped and counted.
+ *
+ * String arguments are copied when the message is queued, so the caller's
+ * buffers do not need to outlive the call.  Messages too large for a ring
+ * slot have their string arguments truncated.  Forked children go back to
+ * synchronous output.  Messages still queued when the process exits are
+ * written out by the exiting thread.
+ *
+ * @param   slots Number of messages the ring can hold, rounded up to a
+ *                power of two.  0 selects DBG_ASYNC_DEFAULT_SLOTS.
+ * @param   path  File to append messages to, or NULL to send them to
+ *                syslog.
+ *
+ * @retval  0 on success
+ * @retval -1 on failure, in which case output stays synchronous
+ */
+int DBG_async_start(size_t slots, const char *path);
+
+/**
+ * Writes out every queued message, stops the background thread and
+ * returns to synchronous output.
+ */
+void DBG_async_stop(void);
+
+/**
+ * @return  The number of messages dropped because the asynchronous ring was
+ *          full.
+ */
+unsigned long DBG_async_dropped(void);
+
 /**
  * \brief A macro for standard debugging during development, should be used
  *  in place of printf and fprintf(stderr, ...).
@@ -112,7 +163,8 @@ void DBG_syserr(unsigned long line, const char *func, const char *file,
  *  function with the expanded parameter list.
  *  The parameters are treated just like arguments to printf.
  */
-#define ERR_REPORT(lvl, ...) do { DBG_syserr(__LINE__, __FUNCTION__, \
+#define ERR_REPORT(lvl, ...) do { if ((lvl) <= DBG_COMPILE_LEVEL) \
+                        DBG_syserr(__LINE__, __FUNCTION__, \
                         __FILE__, (lvl), __VA_ARGS__); } while(0)
 
 /**
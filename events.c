@@ -27,6 +27,7 @@
 #include "eventTimer.h"
 #include "proclib.h"
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/time.h>
@@ -43,15 +44,22 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include <link.h>
 #include "ipc.h"
 #include "json.h"
+#include "hashtable.h"
 #include <inttypes.h>
 #include "pseudo_threads.h"
+#include "trace.h"
 
 #define EDBG_ENV_VAR "LIBPROC_DEBUGGER"
 #define EDBG_VCLK_ENV_VAR "LIBPROC_DEBUGGER_VCLK"
 #define EDBG_GVCLK_ENV_VAR "LIBPROC_DEBUGGER_GVCLK"
 #define RESP_WAIT_MS 300
+// Delta dumps sent between full debugger snapshots unless asked otherwise
+#define EDBG_DEFAULT_FULL_EVERY 100
+// Removed events remembered for a delta dump before forcing a snapshot
+#define EDBG_MAX_REMOVED 1024
 
 // Structure representing a schedule callback
 typedef struct _ScheduleCB
@@ -67,6 +75,7 @@ typedef struct _ScheduleCB
    char breakpoint;
    char critical;
    char inCallback;
+   char dbgDirty;
    char name[128];
 } ScheduleCB;
 
@@ -81,6 +90,7 @@ typedef struct EventCB
    char inCallback[EVENT_MAX];
    char pausable;
    char critical;
+   char dbgDirty;                    // Changed since the last debugger dump
    int fd;                           // The file descriptor which will launch the event 
    char name[128];
    struct EventCB *next;            // The next signal callback
@@ -107,6 +117,21 @@ struct EDBGClient {
    struct EDBGClient *next;
 };
 
+// A callback address resolved to its symbol name, with the numeric id used
+//  for it in dumps that reference symbols by id
+struct EDBGSymbol {
+   void *addr;
+   uint32_t id;
+   struct EDBGSymbol *next;
+   char name[];
+};
+
+// An event removed since the last debugger dump
+struct EDBGRemoved {
+   uintptr_t id;
+   char fd;
+};
+
 struct DeferredEvent {
    EVT_sched_cb cb;
    void *arg;
@@ -130,6 +155,13 @@ struct EventState
    int dbgPort;
    struct ZMQLServer *dbgServer;
    struct IPCBuffer *dbgBuffer;
+   struct EDBGRemoved *dbgRemoved;
+   size_t dbgRemovedLen;
+   int dbg_deltas, dbg_full_every;
+   struct HashTable *dbgSymbols;
+   struct EDBGSymbol *dbgSymList, **dbgSymTail, *dbgSymUnsent;
+   uint32_t dbgSymNext;
+   unsigned long long dbgSymUnloads;
    unsigned long long loop_counter;
    unsigned long long timed_event_counter;
    unsigned long long fd_event_counter;
@@ -148,6 +180,9 @@ struct EventState
    uint8_t break_on_next:1;
    uint8_t dump_every_loop:1;
    uint8_t full_dump_format:1;
+   uint8_t dump_delta:1;
+   uint8_t dbg_force_full:1;
+   uint8_t dump_symbol_ids:1;
    uint8_t in_loop:1;
    struct DeferredEvent *deferred;
    int (*cmds_pending)(void*);
@@ -162,6 +197,9 @@ static EVTHandler *global_evt = NULL;
 
 static void edbg_init(EVTHandler *ctx);
 static void edbg_report_state(EVTHandler *ctx, uint8_t full_format);
+static void edbg_report_update(EVTHandler *ctx);
+static void edbg_note_removed(EVTHandler *ctx, void *id, char fd);
+static void edbg_symbols_flush(EVTHandler *ctx);
 void evt_fd_set_pausable(EVTHandler *ctx, int fd, char pausable);
 extern int ET_default_monotonic(struct EventTimer *et, struct timeval *tv);
 extern char EVT_sched_move_to_mono(EVTHandler *handler, void *eventId);
@@ -402,6 +440,7 @@ static int EVT_remove_internal(struct EventState *ctx, struct EventCB **curr,
    }
 
    ctx->eventCnt[event]--;
+   tmp->dbgDirty = 1;
    tmp->cb[event] = NULL;
    tmp->cleanup[event] = NULL;
    tmp->arg[event] = NULL;
@@ -437,6 +476,7 @@ static int EVT_remove_internal(struct EventState *ctx, struct EventCB **curr,
          ctx->critical_fd_count--;
 
       *curr = tmp->next;
+      edbg_note_removed(ctx, tmp, 1);
       free(tmp);
    }
 
@@ -461,6 +501,9 @@ void EVT_free_handler(EVTHandler *ctx)
 
    if (ctx->dbgBuffer)
       ipc_destroy_buffer(&ctx->dbgBuffer);
+   if (ctx->dbgRemoved)
+      free(ctx->dbgRemoved);
+   edbg_symbols_flush(ctx);
    if (ctx->dbgServer)
       zmql_destroy_tcp_server(&ctx->dbgServer);
 
@@ -600,6 +643,7 @@ char EVT_fd_add_with_cleanup(EVTHandler *ctx, int fd, int event,
    curr->cb[event] = cb;
    curr->cleanup[event] = cleanup_cb;
    curr->arg[event] = p;
+   curr->dbgDirty = 1;
 
    if (curr->inCallback[event])
       curr->inCallback[event] = 2;
@@ -783,7 +827,7 @@ static void edbg_breakpoint(EVTHandler *ctx)
 {
    ctx->debuggerState = EDBG_STOPPED;
    ctx->break_on_next = 0;
-   edbg_report_state(ctx, ctx->full_dump_format);
+   edbg_report_update(ctx);
 }
 
 static int evt_process_timed_event(EVTHandler *ctx,
@@ -800,6 +844,8 @@ static int evt_process_timed_event(EVTHandler *ctx,
    // Pop event from the queue
    ctx->timed_event_counter++;
    curProc->count++;
+   curProc->dbgDirty = 1;
+   TRACE("timed event %p(%p)", curProc->callback, curProc->arg);
 
    // Call the callback and see if it wants to be kept
    curProc->inCallback = 1;
@@ -816,6 +862,7 @@ static int evt_process_timed_event(EVTHandler *ctx,
          ctx->critical_sched_count--;
 
       if (curProc != &ctx->null_evt) {
+         edbg_note_removed(ctx, curProc, 0);
          free(curProc);
       }
    }
@@ -843,6 +890,8 @@ int evt_process_fd_event(EVTHandler *ctx, struct EventCB **evtCurr, int event,
 
    if ((*evtCurr)->cb[event]) {
       (*evtCurr)->counts[event]++;
+      (*evtCurr)->dbgDirty = 1;
+      TRACE("fd event %d type %d", (*evtCurr)->fd, event);
       (*evtCurr)->inCallback[event] = 1;
       keep = (*(*evtCurr)->cb[event])((*evtCurr)->fd, event,
                         (*evtCurr)->arg[event]);
@@ -1102,7 +1151,7 @@ next_loop_iteration:
       ctx->loop_counter++;
 
       if (real_event && ctx->dump_every_loop)
-         edbg_report_state(ctx, ctx->full_dump_format);
+         edbg_report_update(ctx);
    }
 
    ctx->in_loop = 0;
@@ -1185,6 +1234,7 @@ void *EVT_sched_add(EVTHandler *handler, struct timeval time,
    newSchedCB->arg = arg;
    newSchedCB->queue = handler->queue;
    newSchedCB->critical = 1;
+   newSchedCB->dbgDirty = 1;
 
    if (0 == ps_pqueue_insert(newSchedCB->queue, newSchedCB)){
      handler->critical_sched_count++;
@@ -1224,6 +1274,7 @@ void *EVT_sched_add_with_timestep(EVTHandler *handler, struct timeval time,
    newSchedCB->arg = arg;
    newSchedCB->queue = handler->queue;
    newSchedCB->critical = 1;
+   newSchedCB->dbgDirty = 1;
 
    if (0 == ps_pqueue_insert(newSchedCB->queue, newSchedCB)){
       handler->critical_sched_count++;
@@ -1246,6 +1297,7 @@ void EVT_sched_set_critical(EVTHandler *handler, void *eventId, int critical)
       handler->critical_sched_count++;
 
    evt->critical = critical;
+   evt->dbgDirty = 1;
 }
 
 /**
@@ -1274,14 +1326,18 @@ void *EVT_sched_remove(EVTHandler *handler, void *eventId)
 
    if (SIZE_MAX == evt->pos) {
       result = evt->arg;
-      if (evt != &handler->null_evt)
+      if (evt != &handler->null_evt) {
+         edbg_note_removed(handler, evt, 0);
          free(evt);
+      }
    }
    else if (0 == ps_pqueue_remove(evt->queue, eventId)) {
       evt->pos = SIZE_MAX;
       result = evt->arg;
-      if (evt != &handler->null_evt)
+      if (evt != &handler->null_evt) {
+         edbg_note_removed(handler, evt, 0);
          free(evt);
+      }
    }
 
    return result;
@@ -1313,6 +1369,7 @@ char EVT_sched_update(EVTHandler *handler, void *eventId, struct timeval time)
 
    timeradd(&evt->scheduleTime, &time, &evt->nextAwake);
    evt->timeStep = time;
+   evt->dbgDirty = 1;
    if (!evt->inCallback)
       ps_pqueue_change_priority(evt->queue, evt->nextAwake, evt);
    else
@@ -1329,6 +1386,7 @@ void EVT_sched_make_breakpoint(EVTHandler *handler, void *eventId)
       return;
 
    evt->breakpoint = 1;
+   evt->dbgDirty = 1;
 }
 
 char EVT_sched_move_to_mono(EVTHandler *handler, void *eventId)
@@ -1347,6 +1405,7 @@ char EVT_sched_move_to_mono(EVTHandler *handler, void *eventId)
    if (evt->critical)
       handler->critical_sched_count--;
    evt->critical = 0;
+   evt->dbgDirty = 1;
 
    return 0;
 }
@@ -1381,6 +1440,7 @@ char EVT_sched_update_partial_credit(EVTHandler *handler, void *eventId,
       evt->nextAwake = now;
 
    evt->timeStep = time;
+   evt->dbgDirty = 1;
    if (!evt->inCallback)
       ps_pqueue_change_priority(evt->queue, evt->nextAwake, evt);
    else
@@ -1398,6 +1458,7 @@ void EVT_sched_set_name(void *eventId, const char *fmt, ...)
    vsnprintf(evt->name, sizeof(evt->name), fmt, ap);
    va_end(ap);
    evt->name[sizeof(evt->name) - 1] = 0;
+   evt->dbgDirty = 1;
 }
 
 void EVT_fd_set_critical(EVTHandler *ctx, int fd, int critical)
@@ -1411,6 +1472,7 @@ void EVT_fd_set_critical(EVTHandler *ctx, int fd, int critical)
          else if (!curr->critical && critical)
             ctx->critical_fd_count++;
          curr->critical = critical;
+         curr->dbgDirty = 1;
       }
    }
 }
@@ -1426,6 +1488,7 @@ void EVT_fd_set_name(EVTHandler *ctx, int fd, const char *fmt, ...)
          vsnprintf(curr->name, sizeof(curr->name), fmt, ap);
          va_end(ap);
          curr->name[sizeof(curr->name) - 1] = 0;
+         curr->dbgDirty = 1;
       }
    }
 }
@@ -1603,7 +1666,7 @@ static int edbg_dump_cb(void *arg)
 {
    EVTHandler *ctx = (EVTHandler*)arg;
 
-   edbg_report_state(ctx, ctx->full_dump_format);
+   edbg_report_update(ctx);
 
    return EVENT_KEEP;
 }
@@ -1612,6 +1675,7 @@ static int edbg_client_msg(struct ZMQLClient *client, const void *data,
       size_t dataLen, void *arg)
 {
    EVTHandler *ctx = (EVTHandler*)arg;
+   struct JSONDoc doc;
    char *cmd = NULL;
    char *func = NULL;
    int steps;
@@ -1619,7 +1683,9 @@ static int edbg_client_msg(struct ZMQLClient *client, const void *data,
    ScheduleCB *evt;
    size_t i;
 
-   if (json_get_string_prop(data, dataLen, "command", &cmd) < 0)
+   // Parse once and look each property up in the index
+   if (json_parse(&doc, data, dataLen) < 0 ||
+         json_doc_get_string(&doc, "command", &cmd) < 0)
       return 0;
 
    if (!strcasecmp(cmd, "run")) {
@@ -1629,7 +1695,8 @@ static int edbg_client_msg(struct ZMQLClient *client, const void *data,
          EVT_sched_remove(ctx, ctx->breakpoint_evt);
       ctx->breakpoint_evt = NULL;
 
-      json_get_int_prop(data, dataLen, "ms", &steps);
+      steps = 0;
+      json_doc_get_int(&doc, "ms", &steps);
       if (steps > 0) {
          ctx->breakpoint_evt = EVT_sched_add(ctx, EVT_ms2tv(steps),
                &edbg_breakpoint_cb, ctx);
@@ -1646,22 +1713,40 @@ static int edbg_client_msg(struct ZMQLClient *client, const void *data,
       ctx->steps_to_break = 1;
       ctx->break_on_next = 1;
       ctx->dbg_step = 1;
-      if (json_get_int_prop(data, dataLen, "steps", &steps) >= 0) {
+      if (json_doc_get_int(&doc, "steps", &steps) >= 0) {
          ctx->steps_to_break = steps;
       }
    }
    else if (!strcasecmp(cmd, "start_dumping_every_loop")) {
       ctx->dump_every_loop = 1;
+      steps = 0;
+      json_doc_get_int(&doc, "delta", &steps);
+      if (steps > 0 && !ctx->dump_delta) {
+         ctx->dump_delta = 1;
+         ctx->dbg_force_full = 1;
+      }
+      else if (steps <= 0)
+         ctx->dump_delta = 0;
+      steps = 0;
+      json_doc_get_int(&doc, "full_every", &steps);
+      ctx->dbg_full_every = steps > 0 ? steps : EDBG_DEFAULT_FULL_EVERY;
    }
    else if (!strcasecmp(cmd, "stop_dumping_every_loop")) {
       ctx->dump_every_loop = 0;
+      ctx->dump_delta = 0;
+   }
+   else if (!strcasecmp(cmd, "dump_symbol_ids")) {
+      steps = 0;
+      json_doc_get_int(&doc, "enable", &steps);
+      ctx->dump_symbol_ids = steps > 0;
+      ctx->dbg_force_full = 1;
    }
    else if (!strcasecmp(cmd, "dump_now")) {
       edbg_report_state(ctx, 1);
    }
    else if (!strcasecmp(cmd, "periodic_dump")) {
       steps = 0;
-      json_get_int_prop(data, dataLen, "ms", &steps);
+      json_doc_get_int(&doc, "ms", &steps);
       if (ctx->dump_evt)
          EVT_sched_remove(ctx, ctx->dump_evt);
       ctx->dump_evt = NULL;
@@ -1677,7 +1762,7 @@ static int edbg_client_msg(struct ZMQLClient *client, const void *data,
    else if (!strcasecmp(cmd, "set_fd_breakpoint") || 
             !strcasecmp(cmd, "clear_fd_breakpoint") ) {
       steps = 0;
-      json_get_int_prop(data, dataLen, "fd", &steps);
+      json_doc_get_int(&doc, "fd", &steps);
       if (steps > 2) {
          if (!strcasecmp(cmd, "set_fd_breakpoint"))
             evt_fd_set_paused(ctx, steps, 1);
@@ -1688,19 +1773,17 @@ static int edbg_client_msg(struct ZMQLClient *client, const void *data,
    else if (!strcasecmp(cmd, "set_timed_breakpoint") || 
             !strcasecmp(cmd, "clear_timed_breakpoint") ) {
       evt = NULL;
-      if (json_get_ptr_prop(data, dataLen, "id", &id) >= 0) {
+      if (json_doc_get_ptr(&doc, "id", &id) >= 0) {
          for (i = 1; !evt && i <=  ps_pqueue_size(ctx->queue); i++)
             if (ctx->queue->d[i] == id)
                evt = id;
       }
-      else if (json_get_string_prop(data, dataLen, "function", &func) >= 0) {
-         if (func) {
-            id = dlsym(RTLD_DEFAULT, func);
-            free(func);
-            for (i = 1; id && !evt && i <=  ps_pqueue_size(ctx->queue); i++)
-               if ( ((ScheduleCB*)ctx->queue->d[i])->callback == id)
-                  evt = ctx->queue->d[i];
-         }
+      else if (json_doc_get_string(&doc, "function", &func) >= 0) {
+         id = dlsym(RTLD_DEFAULT, func);
+         free(func);
+         for (i = 1; id && !evt && i <=  ps_pqueue_size(ctx->queue); i++)
+            if ( ((ScheduleCB*)ctx->queue->d[i])->callback == id)
+               evt = ctx->queue->d[i];
       }
 
       if (evt) {
@@ -1708,6 +1791,7 @@ static int edbg_client_msg(struct ZMQLClient *client, const void *data,
             evt->breakpoint = 1;
          if (!strcasecmp(cmd, "clear_timed_breakpoint"))
             evt->breakpoint = 0;
+         evt->dbgDirty = 1;
       }
    }
    else {
@@ -1784,23 +1868,141 @@ static void edbg_init(EVTHandler *ctx)
    evt_fd_set_pausable(ctx, zmql_server_socket(ctx->dbgServer), 0);
 }
 
-static const char *get_function_name(void *func_addr)
+static size_t edbg_symbol_hash_func(void *key)
+{
+   return ((uintptr_t)key) >> 4;
+}
+
+static int edbg_symbol_cmp_key(void *key1, void *key2)
+{
+   return key1 == key2;
+}
+
+static void *edbg_symbol_key_for_data(void *data)
 {
+   return ((struct EDBGSymbol*)data)->addr;
+}
+
+// Looks up the symbol for a callback address, resolving it with dladdr the
+//  first time the address is seen
+static struct EDBGSymbol *edbg_symbol(EVTHandler *ctx, void *func_addr)
+{
+   struct EDBGSymbol *sym;
+   const char *name = "";
    Dl_info info;
 
-   if (!dladdr(func_addr, &info)) {
+   if (!ctx->dbgSymbols) {
+      ctx->dbgSymbols = HASH_create_table(37, &edbg_symbol_hash_func,
+            &edbg_symbol_cmp_key, &edbg_symbol_key_for_data);
+      if (!ctx->dbgSymbols)
+         return NULL;
+      ctx->dbgSymTail = &ctx->dbgSymList;
+   }
+
+   sym = (struct EDBGSymbol*)HASH_find_key(ctx->dbgSymbols, func_addr);
+   if (sym)
+      return sym;
+
+   if (!dladdr(func_addr, &info))
       perror("dladdr");
-      return "";
+   else if (info.dli_sname)
+      name = info.dli_sname;
+
+   sym = (struct EDBGSymbol*)malloc(sizeof(*sym) + strlen(name) + 1);
+   if (!sym)
+      return NULL;
+   sym->addr = func_addr;
+   sym->id = ++ctx->dbgSymNext;
+   sym->next = NULL;
+   strcpy(sym->name, name);
+   if (HASH_add_data(ctx->dbgSymbols, sym) < 0) {
+      free(sym);
+      return NULL;
    }
 
-   if (!info.dli_sname)
-      return "";
+   // New symbols are appended, so the unsent ones are always a tail
+   *ctx->dbgSymTail = sym;
+   ctx->dbgSymTail = &sym->next;
+   if (!ctx->dbgSymUnsent)
+      ctx->dbgSymUnsent = sym;
+
+   return sym;
+}
+
+static void edbg_symbols_flush(EVTHandler *ctx)
+{
+   struct EDBGSymbol *sym;
+
+   while ((sym = ctx->dbgSymList)) {
+      ctx->dbgSymList = sym->next;
+      free(sym);
+   }
+   if (ctx->dbgSymbols)
+      HASH_free_table(ctx->dbgSymbols);
+   ctx->dbgSymbols = NULL;
+   ctx->dbgSymTail = &ctx->dbgSymList;
+   ctx->dbgSymUnsent = NULL;
+}
+
+// Only the first object is visited, its counters cover the whole process
+static int edbg_dl_unloads(struct dl_phdr_info *info, size_t size, void *data)
+{
+   if (size >= offsetof(struct dl_phdr_info, dlpi_subs) +
+         sizeof(info->dlpi_subs))
+      *(unsigned long long*)data = info->dlpi_subs;
+   return 1;
+}
+
+// Drops the cached symbols once a shared object has been unloaded, since
+//  their addresses may now hold other code.  Ids keep counting up, so the
+//  ones a debugger already knows are never reused for a different name.
+static void edbg_symbols_validate(EVTHandler *ctx)
+{
+   unsigned long long unloads = 0;
+
+   dl_iterate_phdr(&edbg_dl_unloads, &unloads);
+   if (unloads == ctx->dbgSymUnloads)
+      return;
+
+   ctx->dbgSymUnloads = unloads;
+   edbg_symbols_flush(ctx);
+}
+
+static const char *get_function_name(EVTHandler *ctx, void *func_addr)
+{
+   struct EDBGSymbol *sym = edbg_symbol(ctx, func_addr);
+
+   return sym ? sym->name : "";
+}
+
+static uint32_t get_function_id(EVTHandler *ctx, void *func_addr)
+{
+   struct EDBGSymbol *sym = edbg_symbol(ctx, func_addr);
+
+   return sym ? sym->id : 0;
+}
 
-   return info.dli_sname;
+// Writes the id to name table for symbols not yet sent, or for every symbol
+//  when all is set
+static void edbg_report_symbols(struct IPCBuffer *json, EVTHandler *ctx,
+      int all)
+{
+   struct EDBGSymbol *sym;
+   int first = 1;
+
+   sym = all ? ctx->dbgSymList : ctx->dbgSymUnsent;
+   ipc_printf_buffer(json, "  \"symbols\": {");
+   for (; sym; sym = sym->next) {
+      ipc_printf_buffer(json, "%s\"%u\":\"%s\"", first ? "" : ", ",
+            sym->id, sym->name);
+      first = 0;
+   }
+   ipc_printf_buffer(json, "},\n");
+   ctx->dbgSymUnsent = NULL;
 }
 
-static void edbg_report_timed_event(struct IPCBuffer *json, ScheduleCB *data,
-         struct timeval *cur_time, int first)
+static void edbg_report_timed_event(struct IPCBuffer *json, EVTHandler *ctx,
+         ScheduleCB *data, struct timeval *cur_time, int first)
 {
    struct timeval remain;
    const char *rem_sign = "";
@@ -1816,15 +2018,27 @@ static void edbg_report_timed_event(struct IPCBuffer *json, ScheduleCB *data,
       ipc_printf_buffer(json,
          ",\n");
 
-   ipc_printf_buffer(json,
-         "    {\n"
-         "      \"id\":%"PRIdPTR",\n"
-         "      \"name\":\"%s\",\n"
-         "      \"function\":\"%s\",\n"
-         "      \"critical\":%d,\n",
-         (uintptr_t)data,
-         data->name[0] ? data->name : get_function_name((void *)data->callback),
-         get_function_name((void *)data->callback), data->critical);
+   // With symbol ids an unnamed event leaves its name to the function id
+   if (ctx->dump_symbol_ids)
+      ipc_printf_buffer(json,
+            "    {\n"
+            "      \"id\":%"PRIdPTR",\n"
+            "      \"name\":\"%s\",\n"
+            "      \"function_id\":%u,\n"
+            "      \"critical\":%d,\n",
+            (uintptr_t)data, data->name,
+            get_function_id(ctx, (void *)data->callback), data->critical);
+   else
+      ipc_printf_buffer(json,
+            "    {\n"
+            "      \"id\":%"PRIdPTR",\n"
+            "      \"name\":\"%s\",\n"
+            "      \"function\":\"%s\",\n"
+            "      \"critical\":%d,\n",
+            (uintptr_t)data,
+            data->name[0] ? data->name :
+               get_function_name(ctx, (void *)data->callback),
+            get_function_name(ctx, (void *)data->callback), data->critical);
 
    ipc_printf_buffer(json,
          "      \"time_remaining\":%s%ld.%06ld,\n"
@@ -1841,6 +2055,7 @@ static void edbg_report_timed_event(struct IPCBuffer *json, ScheduleCB *data,
          "    }",
          data->timeStep.tv_sec,
          (long)data->timeStep.tv_usec, (uintptr_t)data->arg, data->count);
+   data->dbgDirty = 0;
 }
 
 static void edbg_report_timed_events(struct IPCBuffer *json, EVTHandler *ctx,
@@ -1852,28 +2067,31 @@ static void edbg_report_timed_events(struct IPCBuffer *json, EVTHandler *ctx,
    ipc_printf_buffer(json, "  \"timed_events\": [\n");
 
    if (ctx->next_timed_event) {
-      edbg_report_timed_event(json, ctx->next_timed_event, cur_time, first);
+      edbg_report_timed_event(json, ctx, ctx->next_timed_event, cur_time, first);
       first = 0;
    }
 
    for (i = 1; i <=  ps_pqueue_size(ctx->queue); i++) {
-      edbg_report_timed_event(json, (ScheduleCB *)ctx->queue->d[i],
+      edbg_report_timed_event(json, ctx, (ScheduleCB *)ctx->queue->d[i],
             cur_time, first);
       first = 0;
    }
    ipc_printf_buffer(json, "\n  ],\n");
 }
 
-static void edbg_report_fd_event(struct IPCBuffer *json, struct EventCB *data,
-      int first)
+// Returns 1 if the event was reported.  Events whose fd can't be resolved
+//  stay dirty so the next delta tries again.
+static int edbg_report_fd_event(struct IPCBuffer *json, EVTHandler *ctx,
+      struct EventCB *data, int first)
 {
+   static const char *handlers[EVENT_MAX] = { "read", "write", "error" };
    char fd_path_buff[32];
    char filename[1024];
-   int len;
+   int len, event;
 
    sprintf(fd_path_buff, "/proc/self/fd/%d", data->fd);
    if ((len = readlink(fd_path_buff, filename, 1023)) < 0)
-      return;
+      return 0;
    filename[len] = 0;
 
    if (!first)
@@ -1889,17 +2107,16 @@ static void edbg_report_fd_event(struct IPCBuffer *json, struct EventCB *data,
          (uintptr_t)data, data->name[0] ? data->name : filename,
          filename, (uintptr_t)data->arg);
 
-   if (data->cb[EVENT_FD_READ])
-      ipc_printf_buffer(json, "      \"read_handler\":\"%s\",\n",
-            get_function_name(data->cb[EVENT_FD_READ]));
-
-   if (data->cb[EVENT_FD_WRITE])
-      ipc_printf_buffer(json, "      \"write_handler\":\"%s\",\n",
-            get_function_name(data->cb[EVENT_FD_WRITE]));
-
-   if (data->cb[EVENT_FD_ERROR])
-      ipc_printf_buffer(json, "      \"error_handler\":\"%s\",\n",
-            get_function_name(data->cb[EVENT_FD_ERROR]));
+   for (event = 0; event < EVENT_MAX; event++) {
+      if (!data->cb[event])
+         continue;
+      if (ctx->dump_symbol_ids)
+         ipc_printf_buffer(json, "      \"%s_handler_id\":%u,\n",
+               handlers[event], get_function_id(ctx, data->cb[event]));
+      else
+         ipc_printf_buffer(json, "      \"%s_handler\":\"%s\",\n",
+               handlers[event], get_function_name(ctx, data->cb[event]));
+   }
 
    ipc_printf_buffer(json,
          "      \"pausable\":%s,\n"
@@ -1921,6 +2138,9 @@ static void edbg_report_fd_event(struct IPCBuffer *json, struct EventCB *data,
          "    }",
          data->counts[EVENT_FD_READ], data->counts[EVENT_FD_WRITE],
          data->counts[EVENT_FD_ERROR], data->fd);
+   data->dbgDirty = 0;
+
+   return 1;
 }
 
 static void edbg_report_fd_events(struct IPCBuffer *json, EVTHandler *ctx)
@@ -1931,28 +2151,18 @@ static void edbg_report_fd_events(struct IPCBuffer *json, EVTHandler *ctx)
    ipc_printf_buffer(json, "  \"fd_events\": [\n");
 
    for (i = 0; i < ctx->hashSize; i++)
-      for (curr = ctx->events[i]; curr; curr = curr->next) {
-         edbg_report_fd_event(json, curr, first);
-         first = 0;
-      }
+      for (curr = ctx->events[i]; curr; curr = curr->next)
+         if (edbg_report_fd_event(json, ctx, curr, first))
+            first = 0;
 
    if (!first)
       ipc_printf_buffer(json, "\n");
    ipc_printf_buffer(json, "  ],\n");
 }
 
-static void edbg_report_state(EVTHandler *ctx, uint8_t full_format)
+// Writes the fields common to every state report
+static void edbg_report_header(EVTHandler *ctx)
 {
-   struct timeval curr_time;
-
-   if (!ctx || !ctx->dbgServer || !ctx->dbgBuffer)
-      return;
-   if (zmql_client_count(ctx->dbgServer) == 0)
-      return;
-
-   EVT_get_monotonic_time(ctx, &curr_time);
-
-   // Fill the buffer with state information
    ipc_reset_buffer(ctx->dbgBuffer);
    ipc_printf_buffer(ctx->dbgBuffer,
          "{\n  \"loop_steps\": %llu,\n  \"dbg_state\": \"%s\",\n  "
@@ -1977,10 +2187,33 @@ static void edbg_report_state(EVTHandler *ctx, uint8_t full_format)
             (uintptr_t)ctx->next_fd_event );
       }
    }
+}
+
+static void edbg_report_state(EVTHandler *ctx, uint8_t full_format)
+{
+   struct timeval curr_time;
+
+   if (!ctx || !ctx->dbgServer || !ctx->dbgBuffer)
+      return;
+   if (zmql_client_count(ctx->dbgServer) == 0)
+      return;
+
+   EVT_get_monotonic_time(ctx, &curr_time);
+   edbg_symbols_validate(ctx);
+
+   // Fill the buffer with state information
+   edbg_report_header(ctx);
 
    if (full_format) {
       edbg_report_timed_events(ctx->dbgBuffer, ctx, &curr_time);
       edbg_report_fd_events(ctx->dbgBuffer, ctx);
+      if (ctx->dump_symbol_ids)
+         edbg_report_symbols(ctx->dbgBuffer, ctx, 1);
+
+      // Every entry was just reported, so the next delta starts from here
+      ctx->dbgRemovedLen = 0;
+      ctx->dbg_force_full = 0;
+      ctx->dbg_deltas = 0;
    }
 
    ipc_printf_buffer(ctx->dbgBuffer, "  \"current_time\": %ld.%06ld\n}",
@@ -1990,6 +2223,125 @@ static void edbg_report_state(EVTHandler *ctx, uint8_t full_format)
    zmql_broadcast_buffer(ctx->dbgServer, ctx->dbgBuffer);
 }
 
+// Remembers an event being freed so the next delta dump can report it
+static void edbg_note_removed(EVTHandler *ctx, void *id, char fd)
+{
+   struct EDBGRemoved *removed;
+
+   if (!ctx->dump_delta || ctx->dbg_force_full || !ctx->dbgServer)
+      return;
+
+   if (!ctx->dbgRemoved) {
+      ctx->dbgRemoved = (struct EDBGRemoved*)malloc(
+            sizeof(*removed) * EDBG_MAX_REMOVED);
+      ctx->dbgRemovedLen = 0;
+   }
+   if (!ctx->dbgRemoved || ctx->dbgRemovedLen >= EDBG_MAX_REMOVED) {
+      ctx->dbg_force_full = 1;
+      return;
+   }
+
+   removed = &ctx->dbgRemoved[ctx->dbgRemovedLen++];
+   removed->id = (uintptr_t)id;
+   removed->fd = fd;
+}
+
+static void edbg_report_removed(struct IPCBuffer *json, EVTHandler *ctx,
+      char fd)
+{
+   size_t i;
+   int first = 1;
+
+   ipc_printf_buffer(json, "  \"removed_%s_events\": [",
+         fd ? "fd" : "timed");
+   for (i = 0; i < ctx->dbgRemovedLen; i++) {
+      if (ctx->dbgRemoved[i].fd != fd)
+         continue;
+      ipc_printf_buffer(json, "%s%"PRIdPTR, first ? "" : ", ",
+            ctx->dbgRemoved[i].id);
+      first = 0;
+   }
+   ipc_printf_buffer(json, "],\n");
+}
+
+// Reports only the events that changed since the previous dump, using the
+//  same per-event format as a full dump.  Removals are listed first so a
+//  reused address is seen as a removal followed by an addition.
+static void edbg_report_delta(EVTHandler *ctx)
+{
+   struct timeval curr_time;
+   struct EventCB *curr;
+   ScheduleCB *evt;
+   size_t i;
+   int first = 1;
+
+   EVT_get_monotonic_time(ctx, &curr_time);
+   edbg_symbols_validate(ctx);
+
+   edbg_report_header(ctx);
+   ipc_printf_buffer(ctx->dbgBuffer, "  \"delta\": true,\n");
+   edbg_report_removed(ctx->dbgBuffer, ctx, 0);
+   edbg_report_removed(ctx->dbgBuffer, ctx, 1);
+   ctx->dbgRemovedLen = 0;
+
+   ipc_printf_buffer(ctx->dbgBuffer, "  \"timed_events\": [\n");
+   if (ctx->next_timed_event && ctx->next_timed_event->dbgDirty) {
+      edbg_report_timed_event(ctx->dbgBuffer, ctx, ctx->next_timed_event,
+            &curr_time, first);
+      first = 0;
+   }
+   for (i = 1; i <=  ps_pqueue_size(ctx->queue); i++) {
+      evt = (ScheduleCB *)ctx->queue->d[i];
+      if (!evt->dbgDirty)
+         continue;
+      edbg_report_timed_event(ctx->dbgBuffer, ctx, evt, &curr_time, first);
+      first = 0;
+   }
+   ipc_printf_buffer(ctx->dbgBuffer, "\n  ],\n");
+
+   first = 1;
+   ipc_printf_buffer(ctx->dbgBuffer, "  \"fd_events\": [\n");
+   for (i = 0; i < (size_t)ctx->hashSize; i++)
+      for (curr = ctx->events[i]; curr; curr = curr->next) {
+         if (!curr->dbgDirty)
+            continue;
+         if (edbg_report_fd_event(ctx->dbgBuffer, ctx, curr, first))
+            first = 0;
+      }
+   if (!first)
+      ipc_printf_buffer(ctx->dbgBuffer, "\n");
+   ipc_printf_buffer(ctx->dbgBuffer, "  ],\n");
+   if (ctx->dump_symbol_ids)
+      edbg_report_symbols(ctx->dbgBuffer, ctx, 0);
+
+   ipc_printf_buffer(ctx->dbgBuffer, "  \"current_time\": %ld.%06ld\n}",
+                   curr_time.tv_sec, (long)curr_time.tv_usec);
+
+   zmql_broadcast_buffer(ctx->dbgServer, ctx->dbgBuffer);
+}
+
+// Sends the state report for a loop step, breakpoint or periodic dump.  In
+//  delta mode this is a delta, with a full snapshot every dbg_full_every
+//  reports so clients that missed something resynchronize.
+static void edbg_report_update(EVTHandler *ctx)
+{
+   if (!ctx->dump_delta || !ctx->full_dump_format || ctx->dbg_force_full ||
+         ctx->dbg_deltas >= ctx->dbg_full_every) {
+      edbg_report_state(ctx, ctx->full_dump_format);
+      return;
+   }
+
+   if (!ctx->dbgServer || !ctx->dbgBuffer)
+      return;
+   if (zmql_client_count(ctx->dbgServer) == 0) {
+      ctx->dbg_force_full = 1;
+      return;
+   }
+
+   ctx->dbg_deltas++;
+   edbg_report_delta(ctx);
+}
+
 void EVT_set_debugger_port(EVTHandler *handler, int port)
 {
    handler->dbgPort = port;
@@ -2003,6 +2355,7 @@ void evt_fd_set_pausable(EVTHandler *ctx, int fd, char pausable)
    for (curr = ctx->events[fd % ctx->hashSize]; curr; curr = curr->next) {
       if (curr->fd == fd) {
          curr->pausable = pausable;
+         curr->dbgDirty = 1;
 
          for (event = 0; event < EVENT_MAX; event++) {
             if (curr->cb[event] &&
@@ -2022,6 +2375,7 @@ void evt_fd_set_paused(EVTHandler *ctx, int fd, char paused)
 
    for (curr = ctx->events[fd % ctx->hashSize]; curr; curr = curr->next) {
       if (curr->fd == fd) {
+         curr->dbgDirty = 1;
          for (event = 0; event < EVENT_MAX; event++) {
             curr->breakpoint[event] = paused;
             if (curr->cb[event] &&
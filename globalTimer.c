@@ -3,12 +3,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <unistd.h>
+#include <errno.h>
 #include <semaphore.h>
 #include <sys/mman.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 
 /*
  * Global Shared Timer support
@@ -21,21 +27,22 @@
  *
  * The synchronization is based on a shared memory region accessible via
  * a file in the filesystem.  The region is laid out as follows:
- *     1. Event Loop Mutex - A semaphore used to allow only one process to execute a non-debug event at a time.
- *     2. Time Barrier - A semaphore used as a barrier to inform processes when the global time has advanced and given them the opportunity to compete for the event loop mutex, as appropiate.
+ *     1. Magic and capacity - Identify the layout so stale files are reinitialized
+ *     2. Event Loop Mutex - A semaphore used to allow only one process to execute a non-debug event at a time.
  *     3. Current Time - the current simulated global time
- *     4. Number of processes - the number of entries in the process array
- *     5. Process Info Array - An array of timer data, one for each process
- *          a.  Next time - The next virtual time the process needs to run
- *          b.  Active - A flag that marks active processes.  Used to recover from processes that don't exit the system cleanly
- *          c.  Mutex held - A boolean flag indicating if the process currently holds the event look mutex
- *          d.  process id
+ *     4. Number of processes - the number of participants currently joined
+ *     5. Tournament Tree - For each internal node, the slot with the smallest next time below it
+ *     6. Process Info Array - An array of timer data, one slot per participant
+ *          a.  Next time - The next virtual time the process needs to run, or GVIRT_IDLE
+ *          b.  Wake - A futex word the process sleeps on while waiting for its turn
+ *          c.  Runnable - Set when the global time reaches the process's next time
+ *          d.  Mutex held - A boolean flag indicating if the process currently holds the event look mutex
+ *          e.  process id, 0 for a free slot
  *
  * A process must hold the event loop mutex prior to executing any global
  * time-dependent event loop activities.  This ensures only one time step is
  * taken at a time.  Additionally, the event loop mutex must be held to
- * update any of the data in the shared memory segment except to set the
- * active flag to 1.
+ * update any of the data in the shared memory segment.
  *
  * Initializing shared memory.
  * Shared memory is initialized by the first process entering the global
@@ -43,38 +50,49 @@
  * the same time, the posix advisory file locking mechanism (flock) is used.
  *
  * The per-process portion of the shared memory is initialized prior to
- * entering the event loop.  This requires obtaining the mutex, adding an entry
- * for the new process, synchronizing the new process's virtual clock with the
- * global clock, and advancing to the barrier.
+ * entering the event loop.  This requires obtaining the mutex, claiming a free
+ * slot for the new process, and synchronizing the new process's virtual clock
+ * with the global clock.
  *
- * Barrier operation
- * The barrier is implemented with a semaphore.  Prior to releasing the mutex
- * the current process updates the global time by iterating through the shared
- * memory data structure to find the next smallest time.  It also calls up() on
- * the semaphore once for each active process, including itself.  It marks the
- * process with the smallest time as inactive to help cull processes that
- * may have crashed.  After releasing the mutex it waits at the barrier, which
- * should result in being immediately let through the barrier.
+ * Advancing the clock
+ * Prior to releasing the mutex the current process stores its next time in
+ * its slot and updates the tournament tree along the path from its leaf to
+ * the root, which takes log(MAX_PROCS) steps.  The root then names the
+ * process with the smallest next time, which becomes the global time.  Only
+ * the processes whose next time equals the global time are marked runnable
+ * and woken through their futex.  Everyone else keeps sleeping.
  *
- * Once through the barrier all processes in the system compete for the mutex.
+ * A process that is due keeps its next time in the tree until it has taken
+ * its turn, so the global time can't advance past it.  If a due process
+ * doesn't take its turn within GVIRT_REAP_MS, a waiting process checks whether
+ * it still exists and removes it if it crashed.
  */
 
-#define MAX_PROCS 128
+/// Participant slots.  Must be a power of two.
+#define MAX_PROCS 4096
+#define GVIRT_MAGIC 0x47565432
+/// Next time of a slot that isn't waiting on the clock
+#define GVIRT_IDLE UINT64_MAX
+/// How long a waiting process sleeps before checking for crashed peers
+#define GVIRT_REAP_MS 1000
 
 struct SharedProcessState {
-   struct timeval next_time;
-   int active;
+   uint64_t next_time;
+   uint32_t wake;
+   int runnable;
    int holds_mutex;
    int thief;
    pid_t pid;
 };
 
 struct SharedState {
+   uint32_t magic;
+   uint32_t max_procs;
    sem_t evt_mutex;
-   sem_t barrier;
    struct timeval curr_time;
    int num_procs;
    int time_thief;
+   uint32_t winner[MAX_PROCS];
    struct SharedProcessState procs[MAX_PROCS];
 };
 
@@ -94,11 +112,171 @@ int et_gvirt_get_time(struct EventTimer *et, struct timeval *time);
 void et_gvirt_set_time(struct EventTimer *et, struct timeval *time);
 void et_gvirt_inc_time(struct EventTimer *et, struct timeval *time);
 
+static uint64_t gvirt_key(const struct timeval *tv)
+{
+   return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static struct timeval gvirt_tv(uint64_t key)
+{
+   struct timeval tv;
+
+   tv.tv_sec = key / 1000000;
+   tv.tv_usec = key % 1000000;
+   return tv;
+}
+
+// Slot with the smallest next time below a tree node.  Nodes at or above
+//  MAX_PROCS are the leaves themselves.
+static uint32_t gvirt_node_slot(struct SharedState *state, uint32_t node)
+{
+   if (node >= MAX_PROCS)
+      return node - MAX_PROCS;
+   return state->winner[node];
+}
+
+static uint32_t gvirt_play(struct SharedState *state, uint32_t node)
+{
+   uint32_t left = gvirt_node_slot(state, node * 2);
+   uint32_t right = gvirt_node_slot(state, node * 2 + 1);
+
+   if (state->procs[right].next_time < state->procs[left].next_time)
+      return right;
+   return left;
+}
+
+// Replays the matches on the path from a slot's leaf to the root
+static void gvirt_update(struct SharedState *state, uint32_t slot)
+{
+   uint32_t node;
+
+   for (node = (slot + MAX_PROCS) / 2; node >= 1; node /= 2)
+      state->winner[node] = gvirt_play(state, node);
+}
+
+static void gvirt_init_tree(struct SharedState *state)
+{
+   uint32_t node;
+
+   for (node = 0; node < MAX_PROCS; node++)
+      state->procs[node].next_time = GVIRT_IDLE;
+   for (node = MAX_PROCS - 1; node >= 1; node--)
+      state->winner[node] = gvirt_play(state, node);
+}
+
+// Collects the slots whose next time is at or before key
+static int gvirt_find_due(struct SharedState *state, uint32_t node,
+      uint64_t key, uint32_t *slots, int cnt)
+{
+   if (state->procs[gvirt_node_slot(state, node)].next_time > key)
+      return cnt;
+
+   if (node >= MAX_PROCS) {
+      slots[cnt++] = node - MAX_PROCS;
+      return cnt;
+   }
+
+   cnt = gvirt_find_due(state, node * 2, key, slots, cnt);
+   return gvirt_find_due(state, node * 2 + 1, key, slots, cnt);
+}
+
+static void gvirt_wake(struct SharedProcessState *proc)
+{
+   __atomic_store_n(&proc->runnable, 1, __ATOMIC_SEQ_CST);
+   __atomic_add_fetch(&proc->wake, 1, __ATOMIC_SEQ_CST);
+   syscall(SYS_futex, &proc->wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Moves the global time to the smallest next time and wakes the processes
+//  due then.  Must hold the event mutex.
+static void gvirt_advance(struct SharedState *state)
+{
+   static uint32_t due[MAX_PROCS];
+   uint64_t next;
+   int i, cnt;
+
+   if (state->time_thief)
+      return;
+
+   next = state->procs[state->winner[1]].next_time;
+   if (next == GVIRT_IDLE)
+      return;
+
+   state->curr_time = gvirt_tv(next);
+   cnt = gvirt_find_due(state, 1, next, due, 0);
+   for (i = 0; i < cnt; i++)
+      if (!state->procs[due[i]].runnable)
+         gvirt_wake(&state->procs[due[i]]);
+}
+
+static void gvirt_remove(struct SharedState *state,
+      struct SharedProcessState *proc)
+{
+   proc->pid = 0;
+   proc->runnable = 0;
+   proc->next_time = GVIRT_IDLE;
+   gvirt_update(state, proc - state->procs);
+   state->num_procs--;
+}
+
+// Drops due processes that no longer exist so the clock can move on
+static void gvirt_reap(struct VirtualGlobalEventTimer *et)
+{
+   static uint32_t due[MAX_PROCS];
+   struct SharedState *state = et->state;
+   struct SharedProcessState *proc;
+   int i, cnt, reaped = 0;
+
+   if (sem_trywait(&state->evt_mutex) < 0)
+      return;
+
+   cnt = gvirt_find_due(state, 1, gvirt_key(&state->curr_time), due, 0);
+   for (i = 0; i < cnt; i++) {
+      proc = &state->procs[due[i]];
+      if (proc == et->my_state || !proc->pid)
+         continue;
+      if (kill(proc->pid, 0) < 0 && errno == ESRCH) {
+         DBG_print(DBG_LEVEL_WARN, "Removing exited process %d from the "
+               "global clock\n", proc->pid);
+         if (state->time_thief == proc->pid)
+            state->time_thief = 0;
+         gvirt_remove(state, proc);
+         reaped = 1;
+      }
+   }
+
+   if (reaped)
+      gvirt_advance(state);
+
+   sem_post(&state->evt_mutex);
+}
+
+// Sleeps until the global time reaches this process's next time
+static void gvirt_wait(struct VirtualGlobalEventTimer *et)
+{
+   struct SharedProcessState *me = et->my_state;
+   struct timespec timeout;
+   uint32_t seq;
+
+   while (1) {
+      seq = __atomic_load_n(&me->wake, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&me->runnable, __ATOMIC_SEQ_CST))
+         return;
+
+      timeout.tv_sec = GVIRT_REAP_MS / 1000;
+      timeout.tv_nsec = (GVIRT_REAP_MS % 1000) * 1000000;
+      if (syscall(SYS_futex, &me->wake, FUTEX_WAIT, seq, &timeout,
+               NULL, 0) < 0 && errno == ETIMEDOUT)
+         gvirt_reap(et);
+   }
+}
+
 static int setup_shared_state(struct VirtualGlobalEventTimer *self)
 {
    int res;
    struct stat finfo;
    int init = 0;
+   uint32_t slot;
 
    if (!self || !self->state_file)
       return -1;
@@ -131,15 +309,9 @@ static int setup_shared_state(struct VirtualGlobalEventTimer *self)
          close(self->state_fd);
          return -1;
       }
-      if (fstat(self->state_fd, &finfo) == -1) {
-         ERRNO_WARN("Failed to re-stat global state file");
-         close(self->state_fd);
-         close(self->state_fd);
-         return -1;
-      }
    }
 
-   self->state = (struct SharedState*)mmap(NULL, finfo.st_size,
+   self->state = (struct SharedState*)mmap(NULL, sizeof(struct SharedState),
          PROT_READ | PROT_WRITE, MAP_SHARED, self->state_fd, 0);
    if (self->state == (void*)-1) {
       ERRNO_WARN("Failed to map timer shared memory");
@@ -147,21 +319,24 @@ static int setup_shared_state(struct VirtualGlobalEventTimer *self)
       return -1;
    }
 
+   // Files left behind with another layout are started over
+   if (self->state->magic != GVIRT_MAGIC ||
+         self->state->max_procs != MAX_PROCS)
+      init = 1;
+
    if (init) {
+      memset(self->state, 0, sizeof(*self->state));
       if (-1 == sem_init(&self->state->evt_mutex, 1, 1)) {
          ERRNO_WARN("Failed to initialize event mutex");
          munmap(self->state, sizeof(*self->state));
          close(self->state_fd);
          return -1;
       }
-      if (-1 == sem_init(&self->state->barrier, 1, 0)) {
-         ERRNO_WARN("Failed to initialize barrier");
-         munmap(self->state, sizeof(*self->state));
-         close(self->state_fd);
-         return -1;
-      }
+      gvirt_init_tree(self->state);
       self->state->num_procs = 0;
       gettimeofday(&self->state->curr_time, NULL);
+      self->state->max_procs = MAX_PROCS;
+      self->state->magic = GVIRT_MAGIC;
    }
 
    if (-1 == sem_wait(&self->state->evt_mutex)) {
@@ -171,11 +346,28 @@ static int setup_shared_state(struct VirtualGlobalEventTimer *self)
       return -1;
    }
 
-   self->my_state = &self->state->procs[self->state->num_procs++];
-   self->my_state->next_time = self->state->curr_time;
-   self->my_state->active = 1;
+   for (slot = 0; slot < MAX_PROCS; slot++)
+      if (!self->state->procs[slot].pid)
+         break;
+   if (slot == MAX_PROCS) {
+      DBG_print(DBG_LEVEL_WARN, "Global clock already has %d processes\n",
+            MAX_PROCS);
+      sem_post(&self->state->evt_mutex);
+      flock(self->state_fd, LOCK_UN);
+      munmap(self->state, sizeof(*self->state));
+      close(self->state_fd);
+      return -1;
+   }
+
+   self->my_state = &self->state->procs[slot];
+   self->my_state->next_time = gvirt_key(&self->state->curr_time);
+   self->my_state->runnable = 1;
    self->my_state->holds_mutex = 1;
+   self->my_state->thief = 0;
    self->my_state->pid = getpid();
+   gvirt_update(self->state, slot);
+   self->state->num_procs++;
+   self->time = self->state->curr_time;
 
    flock(self->state_fd, LOCK_UN);
 
@@ -184,46 +376,41 @@ static int setup_shared_state(struct VirtualGlobalEventTimer *self)
 
 static int cleanup_shared_state(struct VirtualGlobalEventTimer *self)
 {
-   int i, cnt = 0, del_file = 0;
-
-   self->my_state->active = 0;
-
-   // release the barrier if we hold the event mutex
-   if (self->my_state->holds_mutex) {
-      if (self->my_state->pid == self->state->time_thief &&
-            self->state->time_thief)
-         self->state->time_thief = 0;
-      self->my_state->pid = 0;
-
-      del_file = 1;
-      for (i = 0; i < self->state->num_procs; i++) {
-         if (self->state->procs[i].pid > 0 && self->state->procs[i].active) {
-            sem_post(&self->state->barrier);
-            cnt++;
-         }
-      }
-      self->my_state->holds_mutex = 0;
-      sem_post(&self->state->evt_mutex);
+   struct SharedState *state = self->state;
+   int remaining;
+
+   // The tree can only change while holding the event mutex
+   if (!self->my_state->holds_mutex)
+      while (-1 == sem_wait(&state->evt_mutex))
+         ;
+
+   if (state->time_thief == self->my_state->pid)
+      state->time_thief = 0;
+   gvirt_remove(state, self->my_state);
+   remaining = state->num_procs;
+
+   // Let the processes due next take their turn
+   gvirt_advance(state);
+   self->my_state->holds_mutex = 0;
+   sem_post(&state->evt_mutex);
+
+   // The last process out removes the file.  Joining processes hold the
+   //  flock until they are counted, so the count can be trusted here.
+   if (remaining == 0) {
       flock(self->state_fd, LOCK_EX);
+      if (state->num_procs == 0) {
+         sem_destroy(&state->evt_mutex);
+         state->magic = 0;
+         unlink(self->state_file);
+      }
+      flock(self->state_fd, LOCK_UN);
    }
 
-   self->my_state->pid = 0;
-
-   if (cnt == 0 && del_file) {
-      sem_destroy(&self->state->evt_mutex);
-      sem_destroy(&self->state->barrier);
-   }
-
-   munmap(self->state, sizeof(*self->state));
+   munmap(state, sizeof(*state));
    self->state = NULL;
    close(self->state_fd);
    self->state_fd = 0;
 
-   if (cnt == 0 && del_file) {
-      flock(self->state_fd, LOCK_UN);
-      unlink(self->state_file);
-   }
-
    free(self->state_file);
 
    return 0;
@@ -234,6 +421,7 @@ int ET_gvirt_block(struct EventTimer *e, struct timeval *nextAwake,
 {
    struct timeval diffTime, curTime, *blockTime = NULL;
    struct VirtualGlobalEventTimer *et = (struct VirtualGlobalEventTimer *)e;
+   uint64_t next;
    
    // Set amount of time to block on select.
    // When time is "paused" we don't attempt to advance the virtual clock.
@@ -251,32 +439,17 @@ int ET_gvirt_block(struct EventTimer *e, struct timeval *nextAwake,
             et->paused == VIRT_CLK_STOLEN) ) {
       assert(et->my_state->holds_mutex);
       // Finished with a trip through the global loop.
-      // Update local time
-      et->my_state->next_time = *nextAwake;
-
-      // Compute next global time
-      int smallest = -1;
-      int proc_cnt = 0;
-      for (int i = 0; i < et->state->num_procs; i++) {
-         if (et->state->procs[i].pid > 0 && et->state->procs[i].active) {
-            proc_cnt++;
-            if (smallest < 0 || timercmp(&et->state->procs[i].next_time,
-                     &et->state->procs[smallest].next_time, <))
-               smallest = i;
-         }
-      }
-      assert(smallest >= 0);
-
-      if (!et->state->time_thief) {
-         // Update global state with next time
-         et->state->curr_time = et->state->procs[smallest].next_time;
-         // Mark next process as inactive to detect crashes
-         et->state->procs[smallest].active = 0;
-
-         // Release the barrier
-         for (int i = 0; i < proc_cnt; i++)
-            sem_post(&et->state->barrier);
-      }
+      // Update local time.  Events already late run at the current time
+      //  rather than moving the global clock backwards.
+      next = gvirt_key(nextAwake);
+      if (next < gvirt_key(&et->state->curr_time))
+         next = gvirt_key(&et->state->curr_time);
+      et->my_state->next_time = next;
+      et->my_state->runnable = 0;
+      gvirt_update(et->state, et->my_state - et->state->procs);
+
+      // Compute next global time and wake whoever is due
+      gvirt_advance(et->state);
 
       // Release the event mutex for competition
       et->my_state->thief = 0;
@@ -285,7 +458,7 @@ int ET_gvirt_block(struct EventTimer *e, struct timeval *nextAwake,
       et->my_state->holds_mutex = 0;
       sem_post(&et->state->evt_mutex);
 
-      // If we are stealing time then we skip the barrier and just block
+      // If we are stealing time then we skip the wait and just block
       //  without updating the global clock's idea of time
       if (et->my_state->thief) {
          int res;
@@ -301,31 +474,19 @@ int ET_gvirt_block(struct EventTimer *e, struct timeval *nextAwake,
          // re-lock the event mutex prior to returning to the event loop
          while (-1 == sem_wait(&et->state->evt_mutex))
             ;
+         et->my_state->runnable = 1;
+         et->my_state->holds_mutex = 1;
          return res;
       }
 
-      // Wait at the barrier
-      while(1) {
-         int res = sem_wait(&et->state->barrier);
-
-         if (res < 0)
-            continue;
-
-         // Through the barrier.  Get the event loop mutex
-         while (-1 == sem_wait(&et->state->evt_mutex))
-            ;
+      // Sleep until woken for our time, then get the event loop mutex
+      gvirt_wait(et);
+      while (-1 == sem_wait(&et->state->evt_mutex))
+         ;
 
-         et_gvirt_set_time(&et->et, &et->state->curr_time);
-         assert(timercmp(nextAwake, &et->my_state->next_time, ==));
-         // Check to see if it is time to run through our loop
-         if (timercmp(nextAwake, &et->state->curr_time, >)) {
-            sem_post(&et->state->evt_mutex);
-            continue;
-         }
-         et->my_state->active = 1;
-         et->my_state->holds_mutex = 1;
-         break;
-      }
+      et_gvirt_set_time(&et->et, &et->state->curr_time);
+      assert(et->my_state->next_time == gvirt_key(&et->state->curr_time));
+      et->my_state->holds_mutex = 1;
 
       // At this point we hold the event loop mutex and can take a turn through
       //  the loop
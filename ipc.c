@@ -683,6 +683,14 @@ size_t ipc_buffer_size(struct IPCBuffer *buffer)
    return buffer->dataLen;
 }
 
+const char *ipc_buffer_data(struct IPCBuffer *buffer)
+{
+   if (!buffer || !buffer->dataLen)
+      return NULL;
+
+   return buffer->data;
+}
+
 static int ipc_blocking_command(char *txbuff, size_t txlen,
       struct sockaddr_in dest, IPC_command_callback cb, void *arg,
       enum IPC_CB_TYPE cb_type, unsigned int timeout)
@@ -701,6 +709,35 @@ static int ipc_blocking_command(char *txbuff, size_t txlen,
    return CMD_resolve_callback(NULL, cb, arg, cb_type, rxbuff, rxlen);
 }
 
+static uint32_t next_cmd_ref = 1;
+
+// Encodes cmd into a newly allocated buffer, growing it if needed
+static char *ipc_encode_command(struct IPC_Command *cmd, size_t *len)
+{
+   char *buff;
+   size_t buff_len = 1024;
+
+   buff = malloc(buff_len);
+   if (!buff)
+      return NULL;
+
+   if (IPC_Command_encode(cmd, buff, len, buff_len, NULL) < 0) {
+      free(buff);
+      if (*len <= buff_len)
+         return NULL;
+      buff_len = *len;
+      buff = malloc(buff_len);
+      if (!buff)
+         return NULL;
+      if (IPC_Command_encode(cmd, buff, len, buff_len, NULL) < 0) {
+         free(buff);
+         return NULL;
+      }
+   }
+
+   return buff;
+}
+
 static int IPC_command_internal(ProcessData *proc, uint32_t command,
       void *params,
       uint32_t param_type,
@@ -708,34 +745,18 @@ static int IPC_command_internal(ProcessData *proc, uint32_t command,
       enum IPC_CB_TYPE cb_type, unsigned int timeout)
 {
    struct IPC_Command cmd;
-   static uint32_t next_cmd_ref = 1;
    char *buff;
-   size_t len;
+   size_t len = 0;
    int res;
-   size_t buff_len = 1024;
     //steps to encode the command
 
    cmd.cmd = command;
    cmd.ipcref = next_cmd_ref++;
    cmd.parameters.type = param_type;
    cmd.parameters.data = params;
-   buff = malloc(buff_len);
-
-   if (IPC_Command_encode(&cmd, buff, &len, buff_len, NULL) < 0) {
-      if (len > buff_len) {
-         free(buff);
-         buff_len = len;
-         buff = malloc(buff_len);
-         if (!buff)
-            return -1;
-         if (IPC_Command_encode(&cmd, buff, &len, len, NULL) < 0) {
-            free(buff);
-            return -1;
-         }
-      }
-      else
-         return -1;
-   }
+   buff = ipc_encode_command(&cmd, &len);
+   if (!buff)
+      return -1;
 
    if (!proc) {
       res = ipc_blocking_command(buff, len, dest, cb, arg, cb_type, timeout);
@@ -744,7 +765,7 @@ static int IPC_command_internal(ProcessData *proc, uint32_t command,
    }
     //before this, find address 
 
-   PROC_cmd_raw_sockaddr(proc, buff, len, &dest);
+   CMD_send_xdr(proc, buff, len, &dest);
    if (cb)
       CMD_add_response_cb(proc, cmd.ipcref, dest, cb, arg,
             cb_type, timeout);
@@ -811,6 +832,150 @@ static int IPC_multi_command_internal(ProcessData *proc, uint32_t command,
 }
 #endif
 
+int IPC_subscribe(ProcessData *proc, struct sockaddr_in dest,
+      uint32_t type, unsigned int period_ms, IPC_telemetry_callback cb,
+      void *arg)
+{
+   return CMD_add_subscription(proc, dest, type, period_ms, cb, arg);
+}
+
+int IPC_unsubscribe(ProcessData *proc, struct sockaddr_in dest,
+      uint32_t type, IPC_telemetry_callback cb, void *arg)
+{
+   return CMD_remove_subscription(proc, dest, type, cb, arg);
+}
+
+struct IPC_BatchEntry {
+   uint32_t ipcref;
+   IPC_command_callback cb;
+   void *arg;
+   enum IPC_CB_TYPE cb_type;
+   unsigned int timeout;
+};
+
+struct IPC_CommandBatch {
+   ProcessData *proc;
+   struct sockaddr_in dest;
+   struct IPC_Batch batch;
+   struct IPC_BatchEntry *entries;
+   int alloc;
+};
+
+struct IPC_CommandBatch *IPC_batch_create(ProcessData *proc,
+      struct sockaddr_in dest)
+{
+   struct IPC_CommandBatch *res;
+
+   if (!proc)
+      return NULL;
+
+   res = malloc(sizeof(*res));
+   if (!res)
+      return NULL;
+   memset(res, 0, sizeof(*res));
+   res->proc = proc;
+   res->dest = dest;
+
+   return res;
+}
+
+int IPC_batch_add(struct IPC_CommandBatch *batch, uint32_t command,
+      void *params, uint32_t param_type,
+      IPC_command_callback cb, void *arg,
+      enum IPC_CB_TYPE cb_type, unsigned int timeout)
+{
+   struct IPC_Command cmd;
+   struct IPC_OpaqueStruct *msgs;
+   struct IPC_BatchEntry *entries;
+   size_t len = 0;
+   char *buff;
+   int alloc;
+
+   if (!batch || command == IPC_CMDS_BATCH)
+      return -1;
+
+   if (batch->batch.length == batch->alloc) {
+      alloc = batch->alloc ? batch->alloc * 2 : 8;
+      msgs = realloc(batch->batch.msgs, sizeof(*msgs) * alloc);
+      if (!msgs)
+         return -1;
+      batch->batch.msgs = msgs;
+      entries = realloc(batch->entries, sizeof(*entries) * alloc);
+      if (!entries)
+         return -1;
+      batch->entries = entries;
+      batch->alloc = alloc;
+   }
+
+   cmd.cmd = command;
+   cmd.ipcref = next_cmd_ref++;
+   cmd.parameters.type = param_type;
+   cmd.parameters.data = params;
+   buff = ipc_encode_command(&cmd, &len);
+   if (!buff)
+      return -1;
+
+   batch->batch.msgs[batch->batch.length].length = len;
+   batch->batch.msgs[batch->batch.length].data = buff;
+   batch->entries[batch->batch.length].ipcref = cmd.ipcref;
+   batch->entries[batch->batch.length].cb = cb;
+   batch->entries[batch->batch.length].arg = arg;
+   batch->entries[batch->batch.length].cb_type = cb_type;
+   batch->entries[batch->batch.length].timeout = timeout;
+   batch->batch.length++;
+
+   return 0;
+}
+
+int IPC_batch_send(struct IPC_CommandBatch *batch)
+{
+   struct IPC_Command cmd;
+   struct IPC_BatchEntry *entry;
+   size_t len = 0;
+   char *buff;
+   int i;
+
+   if (!batch)
+      return -1;
+
+   if (batch->batch.length > 0) {
+      cmd.cmd = IPC_CMDS_BATCH;
+      cmd.ipcref = next_cmd_ref++;
+      cmd.parameters.type = IPC_TYPES_BATCH;
+      cmd.parameters.data = &batch->batch;
+      buff = ipc_encode_command(&cmd, &len);
+      if (!buff) {
+         IPC_batch_free(batch);
+         return -1;
+      }
+
+      CMD_send_xdr(batch->proc, buff, len, &batch->dest);
+      for (i = 0; i < batch->batch.length; i++) {
+         entry = &batch->entries[i];
+         if (entry->cb)
+            CMD_add_response_cb(batch->proc, entry->ipcref, batch->dest,
+                  entry->cb, entry->arg, entry->cb_type, entry->timeout);
+      }
+   }
+
+   IPC_batch_free(batch);
+   return 0;
+}
+
+void IPC_batch_free(struct IPC_CommandBatch *batch)
+{
+   int i;
+
+   if (!batch)
+      return;
+
+   for (i = 0; i < batch->batch.length; i++)
+      free(batch->batch.msgs[i].data);
+   free(batch->batch.msgs);
+   free(batch->entries);
+   free(batch);
+}
+
 int IPC_command_blocking(uint32_t command, void *params,
       uint32_t param_type,
       struct sockaddr_in dest, IPC_command_callback cb, void *arg,
@@ -958,7 +1123,7 @@ void IPC_response(struct ProcessData *proc, struct IPC_Command *cmd,
          return;
    }
 
-   PROC_cmd_raw_sockaddr(proc, buff, len, dest);
+   CMD_send_xdr(proc, buff, len, dest);
 }
 
 void IPC_success(struct ProcessData *proc, struct IPC_Command *cmd,
@@ -987,5 +1152,5 @@ void IPC_error(struct ProcessData *proc, struct IPC_Command *cmd,
       return;
    }
 
-   PROC_cmd_raw_sockaddr(proc, buff, len, dest);
+   CMD_send_xdr(proc, buff, len, dest);
 }
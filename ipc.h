@@ -38,6 +38,41 @@ extern "C" {
 
 /// Maximum size of an IP packet
 #define MAX_IP_PACKET_SIZE 65535
+
+/// Largest payload of a single UDP datagram over IPv4
+#define IPC_MAX_DATAGRAM_SIZE (MAX_IP_PACKET_SIZE - 20 - 8)
+/// Size of each piece of a fragmented XDR message.  Only messages that
+///  don't fit in one datagram are fragmented, so peers that predate
+///  fragmentation still receive everything they could before.
+#define IPC_FRAG_SIZE 32768
+/// Space reserved for the command and fragment headers in each fragment
+#define IPC_FRAG_HDR_SIZE 64
+/// Largest message that will be fragmented or reassembled
+#define IPC_FRAG_MAX_MSG_SIZE (4 * 1024 * 1024)
+/// Total memory a process will commit to partially reassembled messages
+#define IPC_FRAG_REASSEMBLY_MAX (8 * 1024 * 1024)
+/// Idle time, in ms, before the receiver requests missing fragments
+#define IPC_FRAG_NACK_MS 100
+/// Number of retransmit requests sent before a reassembly is abandoned
+#define IPC_FRAG_MAX_NACKS 5
+/// Maximum number of missing fragments listed in one retransmit request
+#define IPC_FRAG_MAX_NACK_LEN 128
+/// Time, in ms, a sender holds a fragmented message for retransmission
+#define IPC_FRAG_TX_HOLD_MS 5000
+/// Encoded size of a response's cmd, ipcref and result fields
+#define IPC_RESP_HDR_SIZE 12
+/// Space reserved for the command and array headers of a batch envelope
+#define IPC_BATCH_HDR_SIZE 32
+
+/// Default time, in ms, a data request waits for deferred populators
+#define IPC_POPULATOR_DEADLINE_MS 1000
+
+/// Fastest rate, in ms, at which subscribed telemetry is pushed
+#define IPC_SUB_MIN_PERIOD_MS 10
+/// Lease granted to a subscriber that does not ask for one, in ms
+#define IPC_SUB_DEFAULT_LEASE_MS 10000
+/// Longest lease a publisher will grant, in ms
+#define IPC_SUB_MAX_LEASE_MS 300000
 struct IPC_DataReq;
 
 /**
@@ -275,6 +310,16 @@ int ipc_append_buffer(struct IPCBuffer *buffer, const void *data, int len);
   */
 size_t ipc_buffer_size(struct IPCBuffer *buffer);
 
+/**
+  * Returns the bytes held in the buffer.  The pointer is only valid until
+  * the buffer is next modified.
+  *
+  * @param buffer The buffer whose contents you want
+  *
+  * @return The buffer's data, or NULL if it is empty
+  */
+const char *ipc_buffer_data(struct IPCBuffer *buffer);
+
 typedef size_t (*ipc_buffer_cb)(const char *data, size_t dataLen, void *arg);
 /**
   * This function processes data contained in a buffer via a callback function.
@@ -296,6 +341,7 @@ struct IPC_Command;
 enum IPC_CB_TYPE { IPC_CB_TYPE_COOKED = 1, IPC_CB_TYPE_RAW = 2 };
 
 typedef void (*IPC_command_callback)(struct ProcessData *proc, int timeout, void *arg, char *resp_buff, size_t resp_len, enum IPC_CB_TYPE cb_type);
+typedef void (*IPC_telemetry_callback)(struct ProcessData *proc, void *arg, uint32_t type, void *data, struct sockaddr_in *src);
 
 extern int IPC_command_blocking(uint32_t command,
       void *params, uint32_t param_type,
@@ -315,6 +361,64 @@ extern int IPC_data(struct ProcessData*,
 extern int IPC_data_local(struct ProcessData*, 
       const char *dest, IPC_command_callback cb, void *,
       enum IPC_CB_TYPE cb_type, unsigned int timeout, ...);
+
+/**
+ * Subscribes to periodic pushes of a struct type from another process.
+ * The publisher runs the struct's populator once per period and sends the
+ * result to every subscriber, replacing repeated IPC_data polls.  The
+ * lease is renewed in the background until IPC_unsubscribe is called.
+ *
+ * @param proc The subscribing process
+ * @param dest The address of the publishing process
+ * @param type The XDR type of the struct to receive
+ * @param period_ms Requested delivery period.  Several subscriptions to
+ *    the same type and publisher each get their own period.
+ * @param cb Called with the decoded struct on each delivery
+ * @param arg Passed through to cb
+ *
+ * @return 0 on success, negative on error
+ */
+extern int IPC_subscribe(struct ProcessData *proc, struct sockaddr_in dest,
+      uint32_t type, unsigned int period_ms, IPC_telemetry_callback cb,
+      void *arg);
+/// Cancels a subscription made with IPC_subscribe
+extern int IPC_unsubscribe(struct ProcessData *proc, struct sockaddr_in dest,
+      uint32_t type, IPC_telemetry_callback cb, void *arg);
+
+/// Commands accumulated to be sent to one destination in a single datagram
+struct IPC_CommandBatch;
+
+/**
+ * Starts a batch of commands for a single destination.  The commands are
+ * dispatched in order by the receiver and their responses are returned
+ * together, where they fit in one datagram.
+ *
+ * @param proc The process the commands are sent from
+ * @param dest The address every command in the batch is sent to
+ *
+ * @return The new batch, or NULL on error
+ */
+extern struct IPC_CommandBatch *IPC_batch_create(struct ProcessData *proc,
+      struct sockaddr_in dest);
+/**
+ * Adds a command to a batch.  The parameters match IPC_command, and the
+ * callback is invoked with the response to this command alone.
+ *
+ * @return 0 on success, negative on error
+ */
+extern int IPC_batch_add(struct IPC_CommandBatch *batch, uint32_t command,
+      void *params, uint32_t param_type,
+      IPC_command_callback cb, void *,
+      enum IPC_CB_TYPE cb_type, unsigned int timeout);
+/**
+ * Sends every command in the batch and frees it.
+ *
+ * @return 0 on success, negative on error
+ */
+extern int IPC_batch_send(struct IPC_CommandBatch *batch);
+/// Frees a batch without sending it
+extern void IPC_batch_free(struct IPC_CommandBatch *batch);
+
 extern void IPC_response(struct ProcessData *proc, struct IPC_Command *cmd,
       uint32_t param_type, void *params, struct sockaddr_in *dest);
 extern void IPC_error(struct ProcessData *proc, struct IPC_Command *cmd,
@@ -6,48 +6,75 @@
 
 #define is_whitespace(c) ((c)==' ' || (c)=='\t' || (c)=='\n' || (c)=='\r')
 
-typedef void (*json_itr_cb)(const char *prop, const char *val, void*);
-
 enum JSONParserMode { START_OBJ, END_OBJ, START_PROP, END_PROP, END_JSON,
     KEY_QUOTED_ACCUM, VAL_QUOTED_ACCUM, KVP_SEP, START_VAL, VAL_ACCUM };
 enum JSONParserResult { PARSE_GOOD, PARSE_NO_ROOT_OBJ, PARSE_STRAY_OBJ,
    PARSE_UNKNOWN_ERR, PARSE_STRAY_END_OBJ, PARSE_STRAY_QUOTE,
    PARSE_STRAY_COLIN};
 
-static void json_setup_cb(const char *key_start, const char *key_end,
-      const char *val_start, const char *val_end, json_itr_cb itr, void *arg)
+static unsigned int json_key_hash(const char *key, int len)
 {
-   char key[512], val[2048];
-   int len;
-
-   len = key_end - key_start - 1;
-   if (len >= sizeof(key))
-      len = sizeof(key) - 1;
+   uint32_t hash = 2166136261u;
 
-   memcpy(key, key_start + 1, len);
-   key[len] = 0;
+   while (len-- > 0)
+      hash = (hash ^ (unsigned char)*key++) * 16777619u;
 
-   if (*val_start == '"') {
-      len = val_end - val_start - 1;
-      if (len >= sizeof(val))
-         len = sizeof(val) - 1;
+   return hash & (JSON_DOC_BUCKETS - 1);
+}
 
-      memcpy(val, val_start + 1, len);
+static struct JSONProp *json_doc_find(const struct JSONDoc *doc,
+      const char *key, int len)
+{
+   unsigned int bucket = json_key_hash(key, len);
+   const struct JSONProp *prop;
+
+   // Open addressing.  The table is twice the maximum property count so
+   //  there is always an empty bucket to stop on.
+   while (doc->buckets[bucket]) {
+      prop = &doc->props[doc->buckets[bucket] - 1];
+      if (prop->keyLen == len && !memcmp(prop->key, key, len))
+         return (struct JSONProp*)prop;
+      bucket = (bucket + 1) & (JSON_DOC_BUCKETS - 1);
    }
-   else {
-      len = val_end - val_start + 1;
-      if (len >= sizeof(val))
-         len = sizeof(val) - 1;
 
-      memcpy(val, val_start, len);
+   return NULL;
+}
+
+// Records the location of one top level property in the index
+static void json_setup_cb(const char *key_start, const char *key_end,
+      const char *val_start, const char *val_end, struct JSONDoc *doc)
+{
+   struct JSONProp *prop;
+   const char *key = key_start + 1;
+   int keyLen = key_end - key_start - 1;
+   unsigned int bucket;
+
+   // Later duplicates replace earlier ones
+   prop = json_doc_find(doc, key, keyLen);
+   if (!prop) {
+      if (doc->count >= JSON_MAX_PROPS)
+         return;
+      prop = &doc->props[doc->count++];
+      prop->key = key;
+      prop->keyLen = keyLen;
+      bucket = json_key_hash(key, keyLen);
+      while (doc->buckets[bucket])
+         bucket = (bucket + 1) & (JSON_DOC_BUCKETS - 1);
+      doc->buckets[bucket] = doc->count;
    }
-   val[len] = 0;
 
-   itr(key, val, arg);
+   if (*val_start == '"') {
+      prop->val = val_start + 1;
+      prop->valLen = val_end - val_start - 1;
+   }
+   else {
+      prop->val = val_start;
+      prop->valLen = val_end - val_start + 1;
+   }
 }
 
 static enum JSONParserResult json_iterate_props(const char *json, int len,
-      json_itr_cb itr, void *arg)
+      struct JSONDoc *doc)
 {
    enum JSONParserMode mode = START_OBJ;
    const char *curr, *key_start = NULL, *key_end = NULL;
@@ -63,7 +90,7 @@ static enum JSONParserResult json_iterate_props(const char *json, int len,
             if (mode == VAL_ACCUM) {
                val_end = curr - 1;
                mode = END_PROP;
-               json_setup_cb(key_start, key_end, val_start, val_end, itr, arg);
+               json_setup_cb(key_start, key_end, val_start, val_end, doc);
             }
             break;
 
@@ -78,7 +105,7 @@ static enum JSONParserResult json_iterate_props(const char *json, int len,
             if (mode == VAL_ACCUM) {
                val_end = curr - 1;
                mode = END_PROP;
-               json_setup_cb(key_start, key_end, val_start, val_end, itr, arg);
+               json_setup_cb(key_start, key_end, val_start, val_end, doc);
             }
 
             if (mode == START_PROP || mode == END_PROP)
@@ -104,7 +131,7 @@ static enum JSONParserResult json_iterate_props(const char *json, int len,
             else if (mode == VAL_QUOTED_ACCUM) {
                val_end = curr;
                mode = END_PROP;
-               json_setup_cb(key_start, key_end, val_start, val_end, itr, arg);
+               json_setup_cb(key_start, key_end, val_start, val_end, doc);
             }
             else
                return PARSE_STRAY_QUOTE;
@@ -114,7 +141,7 @@ static enum JSONParserResult json_iterate_props(const char *json, int len,
             if (mode == VAL_ACCUM) {
                val_end = curr - 1;
                mode = END_PROP;
-               json_setup_cb(key_start, key_end, val_start, val_end, itr, arg);
+               json_setup_cb(key_start, key_end, val_start, val_end, doc);
             }
 
             if (mode == END_PROP) {
@@ -150,122 +177,131 @@ static enum JSONParserResult json_iterate_props(const char *json, int len,
    return PARSE_UNKNOWN_ERR;
 }
 
-struct JStrItr {
-   const char *prop;
-   char *val;
-};
+int json_parse(struct JSONDoc *doc, const char *json, int len)
+{
+   enum JSONParserResult err;
 
-struct JIntItr {
-   const char *prop;
-   int val;
-   int found;
-};
+   if (!doc || !json)
+      return -1;
 
-static void json_int_itr_cb(const char *prop, const char *val, void *arg)
-{
-   struct JIntItr *params = (struct JIntItr*)arg;
+   memset(doc->buckets, 0, sizeof(doc->buckets));
+   doc->count = 0;
 
-   if (params && params->prop && !strcmp(params->prop, prop)) {
-      params->val = atol(val);
-      params->found = 1;
+   err = json_iterate_props(json, len, doc);
+   if (err != PARSE_GOOD) {
+      printf("JSON Parsing failed with error %d\n", err);
+      printf("   %.*s\n", len, json);
+      return -(int)err;
    }
+
+   return 0;
 }
 
-static void json_str_itr_cb(const char *prop, const char *val, void *arg)
+static const struct JSONProp *json_doc_prop(const struct JSONDoc *doc,
+      const char *prop)
 {
-   struct JStrItr *params = (struct JStrItr*)arg;
+   if (!doc || !prop)
+      return NULL;
 
-   if (params && params->prop && !strcmp(params->prop, prop))
-      params->val = strdup(val);
+   return json_doc_find(doc, prop, strlen(prop));
 }
 
-int json_get_string_prop(const char *json, int len, const char *prop,
+int json_doc_get_string(const struct JSONDoc *doc, const char *prop,
       char **out)
 {
-   struct JStrItr params;
-   enum JSONParserResult err;
+   const struct JSONProp *val;
+   char *str;
 
-   if (!json || !prop || !out)
+   if (!out)
       return -1;
 
-   params.prop = prop;
-   params.val = NULL;
+   val = json_doc_prop(doc, prop);
+   if (!val)
+      return -2;
 
-   err = json_iterate_props(json, len, json_str_itr_cb, &params);
-   if (err != PARSE_GOOD) {
-      if (params.val)
-         free(params.val);
-      printf("JSON Parsing failed with error %d\n", err);
-      printf("   %s\n", json);
-      return -(int)err;
-   }
+   str = malloc(val->valLen + 1);
+   if (!str)
+      return -1;
+   memcpy(str, val->val, val->valLen);
+   str[val->valLen] = 0;
 
-   *out = params.val;
+   *out = str;
    return 0;
 }
 
-int json_get_int_prop(const char *json, int len, const char *prop, int *out)
+int json_doc_get_int(const struct JSONDoc *doc, const char *prop, int *out)
 {
-   struct JIntItr params;
-   enum JSONParserResult err;
+   const struct JSONProp *val;
 
-   if (!json || !prop || !out)
+   if (!out)
       return -1;
 
-   params.prop = prop;
-   params.val = 0;
-   params.found = 0;
+   val = json_doc_prop(doc, prop);
+   if (!val)
+      return -2;
 
-   err = json_iterate_props(json, len, json_int_itr_cb, &params);
-   if (err != PARSE_GOOD) {
-      printf("JSON Parsing failed with error %d\n", err);
-      return -(int)err;
-   }
+   // A successful parse guarantees a delimiter follows the value
+   *out = strtol(val->val, NULL, 10);
+   return 0;
+}
+
+int json_doc_get_ptr(const struct JSONDoc *doc, const char *prop, void **out)
+{
+   const struct JSONProp *val;
 
-   if (!params.found)
+   if (!out)
+      return -1;
+
+   val = json_doc_prop(doc, prop);
+   if (!val)
       return -2;
 
-   *out = params.val;
+   *out = (void*)(intptr_t)strtoll(val->val, NULL, 0);
    return 0;
 }
 
-struct JPtrItr {
-   const char *prop;
-   void *val;
-   int found;
-};
-
-static void json_ptr_itr_cb(const char *prop, const char *val, void *arg)
+int json_get_string_prop(const char *json, int len, const char *prop,
+      char **out)
 {
-   struct JPtrItr *params = (struct JPtrItr*)arg;
+   struct JSONDoc doc;
+   int res;
 
-   if (params && params->prop && !strcmp(params->prop, prop)) {
-      params->val = (void*)(intptr_t)strtoll(val, NULL, 0);
-      params->found = 1;
-   }
+   if (!json || !prop || !out)
+      return -1;
+
+   if ((res = json_parse(&doc, json, len)) < 0)
+      return res;
+
+   // Missing string properties have always been reported as NULL
+   *out = NULL;
+   res = json_doc_get_string(&doc, prop, out);
+   return res == -2 ? 0 : res;
 }
 
-int json_get_ptr_prop(const char *json, int len, const char *prop, void **out)
+int json_get_int_prop(const char *json, int len, const char *prop, int *out)
 {
-   struct JPtrItr params;
-   enum JSONParserResult err;
+   struct JSONDoc doc;
+   int res;
 
    if (!json || !prop || !out)
       return -1;
 
-   params.prop = prop;
-   params.val = NULL;
-   params.found = 0;
+   if ((res = json_parse(&doc, json, len)) < 0)
+      return res;
 
-   err = json_iterate_props(json, len, json_ptr_itr_cb, &params);
-   if (err != PARSE_GOOD) {
-      printf("JSON Parsing failed with error %d\n", err);
-      return -(int)err;
-   }
+   return json_doc_get_int(&doc, prop, out);
+}
 
-   if (!params.found)
-      return -2;
+int json_get_ptr_prop(const char *json, int len, const char *prop, void **out)
+{
+   struct JSONDoc doc;
+   int res;
 
-   *out = params.val;
-   return 0;
+   if (!json || !prop || !out)
+      return -1;
+
+   if ((res = json_parse(&doc, json, len)) < 0)
+      return res;
+
+   return json_doc_get_ptr(&doc, prop, out);
 }
@@ -1,6 +1,39 @@
 #ifndef JSON_H
 #define JSON_H
 
+#include <stdint.h>
+
+/// Top level properties indexed by json_parse.  Extras are ignored.
+#define JSON_MAX_PROPS 32
+#define JSON_DOC_BUCKETS (2 * JSON_MAX_PROPS)
+
+/// Location of one property's key and value within the parsed text
+struct JSONProp {
+   const char *key;
+   const char *val;
+   int keyLen;
+   int valLen;
+};
+
+/**
+ * Index of a JSON object's top level properties.  Built once by
+ * json_parse, after which each json_doc_get_* lookup is a hash probe.  The
+ * index points into the original text, which must outlive it.
+ */
+struct JSONDoc {
+   int count;
+   struct JSONProp props[JSON_MAX_PROPS];
+   uint8_t buckets[JSON_DOC_BUCKETS];
+};
+
+extern int json_parse(struct JSONDoc *doc, const char *json, int len);
+extern int json_doc_get_string(const struct JSONDoc *doc, const char *prop,
+      char **out);
+extern int json_doc_get_int(const struct JSONDoc *doc, const char *prop,
+      int *out);
+extern int json_doc_get_ptr(const struct JSONDoc *doc, const char *prop,
+      void **out);
+
 extern int json_get_string_prop(const char *json, int len, const char *prop,
       char **out);
 extern int json_get_int_prop(const char *json, int len, const char *prop,
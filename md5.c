@@ -46,9 +46,12 @@ documentation and/or software.
 #define S43 15
 #define S44 21
 
+#ifdef MD5_REFERENCE
 static void MD5Transform(UINT4 [4], unsigned char [64]);
-static void Encode(unsigned char *, UINT4 *, unsigned int);
 static void Decode(UINT4 *, unsigned char *, unsigned int);
+#endif
+static void MD5Blocks(UINT4 [4], const unsigned char *, size_t);
+static void Encode(unsigned char *, UINT4 *, unsigned int);
 
 static unsigned char PADDING[64] = {
   0x80, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
@@ -115,6 +118,7 @@ unsigned char *input;                                /* input block */
 unsigned int inputLen;                     /* length of input block */
 {
    unsigned int i, index, partLen;
+   size_t blocks;
 
    /* Compute number of bytes mod 64 */
    index = (unsigned int)((context->count[0] >> 3) & 0x3F);
@@ -129,10 +133,11 @@ unsigned int inputLen;                     /* length of input block */
    /* Transform as many times as possible. */
    if (inputLen >= partLen) {
       memcpy((POINTER)&context->buffer[index], (POINTER)input, partLen);
-      MD5Transform (context->state, context->buffer);
+      MD5Blocks (context->state, context->buffer, 1);
 
-      for (i = partLen; i + 63 < inputLen; i += 64)
-         MD5Transform (context->state, &input[i]);
+      blocks = (inputLen - partLen) / 64;
+      MD5Blocks (context->state, &input[partLen], blocks);
+      i = partLen + blocks * 64;
 
       index = 0;
    }
@@ -171,6 +176,152 @@ MD5_CTX *context;                                       /* context */
    memset ((POINTER)context, 0, sizeof (*context));
 }
 
+#ifdef MD5_REFERENCE
+/* Transforms state over consecutive 64 byte blocks with the reference
+  transformation.  Used to benchmark and verify MD5Blocks.
+ */
+static void MD5Blocks (UINT4 state[4], const unsigned char *block,
+      size_t count)
+{
+   for (; count; count--, block += 64)
+      MD5Transform (state, (unsigned char *)block);
+}
+#else
+/* Load a little endian word from a possibly unaligned address.
+ */
+static inline UINT4 MD5Load (const unsigned char *p)
+{
+   UINT4 w;
+
+   memcpy(&w, p, sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+   w = __builtin_bswap32(w);
+#endif
+   return w;
+}
+
+/* F with one fewer operation, and H with the term that doesn't depend on
+  b first.  The two halves of G never share set bits, so they can be added
+  separately and the half that doesn't depend on b starts before b is ready.
+ */
+#define F2(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define H2(x, y, z) ((x) ^ ((y) ^ (z)))
+
+/* The message word and constant are added first, off the critical path.
+ */
+#define STEP(f, a, b, c, d, n, s, ac) { \
+ (a) += MD5Load (&block[(n) * 4]) + (UINT4)(ac); \
+ (a) += f ((b), (c), (d)); \
+ (a) = ROTATE_LEFT ((a), (s)); \
+ (a) += (b); \
+  }
+#define GSTEP(a, b, c, d, n, s, ac) { \
+ (a) += MD5Load (&block[(n) * 4]) + (UINT4)(ac); \
+ (a) += (c) & ~(d); \
+ (a) += (b) & (d); \
+ (a) = ROTATE_LEFT ((a), (s)); \
+ (a) += (b); \
+  }
+
+/* Transforms state over consecutive 64 byte blocks.  Unlike MD5Transform
+  the state stays in registers across blocks, words are loaded straight
+  from the input instead of being decoded into a scratch array, and each
+  step is ordered to shorten its dependency chain.
+ */
+static void MD5Blocks (UINT4 state[4], const unsigned char *block,
+      size_t count)
+{
+   UINT4 a = state[0], b = state[1], c = state[2], d = state[3];
+   UINT4 aa, bb, cc, dd;
+
+   for (; count; count--, block += 64) {
+      aa = a;
+      bb = b;
+      cc = c;
+      dd = d;
+
+      STEP (F2, a, b, c, d,  0, S11, 0xd76aa478);
+      STEP (F2, d, a, b, c,  1, S12, 0xe8c7b756);
+      STEP (F2, c, d, a, b,  2, S13, 0x242070db);
+      STEP (F2, b, c, d, a,  3, S14, 0xc1bdceee);
+      STEP (F2, a, b, c, d,  4, S11, 0xf57c0faf);
+      STEP (F2, d, a, b, c,  5, S12, 0x4787c62a);
+      STEP (F2, c, d, a, b,  6, S13, 0xa8304613);
+      STEP (F2, b, c, d, a,  7, S14, 0xfd469501);
+      STEP (F2, a, b, c, d,  8, S11, 0x698098d8);
+      STEP (F2, d, a, b, c,  9, S12, 0x8b44f7af);
+      STEP (F2, c, d, a, b, 10, S13, 0xffff5bb1);
+      STEP (F2, b, c, d, a, 11, S14, 0x895cd7be);
+      STEP (F2, a, b, c, d, 12, S11, 0x6b901122);
+      STEP (F2, d, a, b, c, 13, S12, 0xfd987193);
+      STEP (F2, c, d, a, b, 14, S13, 0xa679438e);
+      STEP (F2, b, c, d, a, 15, S14, 0x49b40821);
+
+      GSTEP (a, b, c, d,  1, S21, 0xf61e2562);
+      GSTEP (d, a, b, c,  6, S22, 0xc040b340);
+      GSTEP (c, d, a, b, 11, S23, 0x265e5a51);
+      GSTEP (b, c, d, a,  0, S24, 0xe9b6c7aa);
+      GSTEP (a, b, c, d,  5, S21, 0xd62f105d);
+      GSTEP (d, a, b, c, 10, S22,  0x2441453);
+      GSTEP (c, d, a, b, 15, S23, 0xd8a1e681);
+      GSTEP (b, c, d, a,  4, S24, 0xe7d3fbc8);
+      GSTEP (a, b, c, d,  9, S21, 0x21e1cde6);
+      GSTEP (d, a, b, c, 14, S22, 0xc33707d6);
+      GSTEP (c, d, a, b,  3, S23, 0xf4d50d87);
+      GSTEP (b, c, d, a,  8, S24, 0x455a14ed);
+      GSTEP (a, b, c, d, 13, S21, 0xa9e3e905);
+      GSTEP (d, a, b, c,  2, S22, 0xfcefa3f8);
+      GSTEP (c, d, a, b,  7, S23, 0x676f02d9);
+      GSTEP (b, c, d, a, 12, S24, 0x8d2a4c8a);
+
+      STEP (H2, a, b, c, d,  5, S31, 0xfffa3942);
+      STEP (H2, d, a, b, c,  8, S32, 0x8771f681);
+      STEP (H2, c, d, a, b, 11, S33, 0x6d9d6122);
+      STEP (H2, b, c, d, a, 14, S34, 0xfde5380c);
+      STEP (H2, a, b, c, d,  1, S31, 0xa4beea44);
+      STEP (H2, d, a, b, c,  4, S32, 0x4bdecfa9);
+      STEP (H2, c, d, a, b,  7, S33, 0xf6bb4b60);
+      STEP (H2, b, c, d, a, 10, S34, 0xbebfbc70);
+      STEP (H2, a, b, c, d, 13, S31, 0x289b7ec6);
+      STEP (H2, d, a, b, c,  0, S32, 0xeaa127fa);
+      STEP (H2, c, d, a, b,  3, S33, 0xd4ef3085);
+      STEP (H2, b, c, d, a,  6, S34,  0x4881d05);
+      STEP (H2, a, b, c, d,  9, S31, 0xd9d4d039);
+      STEP (H2, d, a, b, c, 12, S32, 0xe6db99e5);
+      STEP (H2, c, d, a, b, 15, S33, 0x1fa27cf8);
+      STEP (H2, b, c, d, a,  2, S34, 0xc4ac5665);
+
+      STEP (I, a, b, c, d,  0, S41, 0xf4292244);
+      STEP (I, d, a, b, c,  7, S42, 0x432aff97);
+      STEP (I, c, d, a, b, 14, S43, 0xab9423a7);
+      STEP (I, b, c, d, a,  5, S44, 0xfc93a039);
+      STEP (I, a, b, c, d, 12, S41, 0x655b59c3);
+      STEP (I, d, a, b, c,  3, S42, 0x8f0ccc92);
+      STEP (I, c, d, a, b, 10, S43, 0xffeff47d);
+      STEP (I, b, c, d, a,  1, S44, 0x85845dd1);
+      STEP (I, a, b, c, d,  8, S41, 0x6fa87e4f);
+      STEP (I, d, a, b, c, 15, S42, 0xfe2ce6e0);
+      STEP (I, c, d, a, b,  6, S43, 0xa3014314);
+      STEP (I, b, c, d, a, 13, S44, 0x4e0811a1);
+      STEP (I, a, b, c, d,  4, S41, 0xf7537e82);
+      STEP (I, d, a, b, c, 11, S42, 0xbd3af235);
+      STEP (I, c, d, a, b,  2, S43, 0x2ad7d2bb);
+      STEP (I, b, c, d, a,  9, S44, 0xeb86d391);
+
+      a += aa;
+      b += bb;
+      c += cc;
+      d += dd;
+   }
+
+   state[0] = a;
+   state[1] = b;
+   state[2] = c;
+   state[3] = d;
+}
+#endif
+
+#ifdef MD5_REFERENCE
 /* MD5 basic transformation. Transforms state based on block.  */
 static void MD5Transform (state, block)
 UINT4 state[4];
@@ -260,6 +411,7 @@ unsigned char block[64];
    /* Zeroize sensitive information. */
    memset ((POINTER)x, 0, sizeof (x));
 }
+#endif
 
 /* Encodes input (UINT4) into output (unsigned char). Assumes len is
   a multiple of 4.
@@ -279,6 +431,7 @@ unsigned int len;
    }
 }
 
+#ifdef MD5_REFERENCE
 /* Decodes input (unsigned char) into output (UINT4). Assumes len is
   a multiple of 4.
  */
@@ -293,3 +446,4 @@ unsigned int len;
       output[i] = ((UINT4)input[j]) | (((UINT4)input[j+1]) << 8) |
          (((UINT4)input[j+2]) << 16) | (((UINT4)input[j+3]) << 24);
 }
+#endif
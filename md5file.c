@@ -0,0 +1,294 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file md5file.c File hashing source file.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "md5file.h"
+#include "proclib.h"
+#include "events.h"
+#include "debug.h"
+
+// Gap left between passes so fd and timed events get to run
+#define MD5_FILE_YIELD_MS 1
+
+struct MD5FileHash {
+   int fd;
+   unsigned char *map;
+   size_t mapLen, offset;
+   unsigned char *buff;
+   MD5_CTX ctx;
+   unsigned char digest[MD5_DIGEST_LENGTH];
+   unsigned int budgetMs;
+   EVTHandler *evt;
+   void *evtId;
+   MD5_file_cb cb;
+   void *arg;
+};
+
+static void md5_file_close(struct MD5FileHash *hash)
+{
+   if (hash->map)
+      munmap(hash->map, hash->mapLen);
+   hash->map = NULL;
+   if (hash->fd >= 0)
+      close(hash->fd);
+   hash->fd = -1;
+   free(hash->buff);
+   hash->buff = NULL;
+}
+
+static void md5_file_free(struct MD5FileHash *hash)
+{
+   md5_file_close(hash);
+   free(hash);
+}
+
+// Maps regular files and falls back to block reads for everything else
+static struct MD5FileHash *md5_file_open(const char *path, int *err)
+{
+   struct MD5FileHash *hash;
+   struct stat st;
+
+   hash = calloc(1, sizeof(*hash));
+   if (!hash) {
+      *err = -ENOMEM;
+      return NULL;
+   }
+
+   MD5Init(&hash->ctx);
+   hash->fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (hash->fd < 0 || fstat(hash->fd, &st) < 0) {
+      *err = -errno;
+      md5_file_free(hash);
+      return NULL;
+   }
+
+   if (S_ISREG(st.st_mode) && st.st_size > 0) {
+      hash->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, hash->fd, 0);
+      if (hash->map == MAP_FAILED)
+         hash->map = NULL;
+      else {
+         hash->mapLen = st.st_size;
+         madvise(hash->map, hash->mapLen, MADV_SEQUENTIAL);
+         close(hash->fd);
+         hash->fd = -1;
+      }
+   }
+
+   if (!hash->map) {
+      hash->buff = malloc(MD5_FILE_BLOCK);
+      if (!hash->buff) {
+         *err = -ENOMEM;
+         md5_file_free(hash);
+         return NULL;
+      }
+   }
+
+   return hash;
+}
+
+// Hashes the next block.  Returns 1 at the end of the file, 0 if there is
+//  more to hash, or a negative errno value.
+static int md5_file_step(struct MD5FileHash *hash)
+{
+   size_t len;
+   ssize_t rd;
+
+   if (hash->map) {
+      len = hash->mapLen - hash->offset;
+      if (len > MD5_FILE_BLOCK)
+         len = MD5_FILE_BLOCK;
+      MD5Update(&hash->ctx, hash->map + hash->offset, len);
+      hash->offset += len;
+      if (hash->offset < hash->mapLen)
+         return 0;
+   }
+   else {
+      do {
+         rd = read(hash->fd, hash->buff, MD5_FILE_BLOCK);
+      } while (rd < 0 && errno == EINTR);
+      if (rd < 0)
+         return -errno;
+      if (rd > 0) {
+         MD5Update(&hash->ctx, hash->buff, rd);
+         hash->offset += rd;
+         return 0;
+      }
+   }
+
+   MD5Final(hash->digest, &hash->ctx);
+   md5_file_close(hash);
+   return 1;
+}
+
+static int md5_file_run(struct MD5FileHash *hash)
+{
+   int res;
+
+   while (!(res = md5_file_step(hash)))
+      ;
+
+   return res < 0 ? res : 0;
+}
+
+int MD5_hash_file(const char *path, unsigned char digest[MD5_DIGEST_LENGTH])
+{
+   struct MD5FileHash *hash;
+   int res;
+
+   if (!path || !digest)
+      return -EINVAL;
+
+   hash = md5_file_open(path, &res);
+   if (!hash)
+      return res;
+
+   res = md5_file_run(hash);
+   if (!res)
+      memcpy(digest, hash->digest, MD5_DIGEST_LENGTH);
+   md5_file_free(hash);
+
+   return res;
+}
+
+static int md5_file_job(void *arg)
+{
+   struct MD5FileHash *hash = (struct MD5FileHash*)arg;
+
+   return md5_file_run(hash);
+}
+
+static int md5_file_job_done(void *arg, int retval)
+{
+   struct MD5FileHash *hash = (struct MD5FileHash*)arg;
+
+   // A job discarded at PROC_cleanup never ran, so there is no digest
+   if (retval == PROC_JOB_DISCARDED)
+      retval = -ECANCELED;
+   hash->cb(hash->arg, retval, retval ? NULL : hash->digest);
+   md5_file_free(hash);
+
+   return 0;
+}
+
+int MD5_hash_file_thread(ProcessData *proc, const char *path,
+      MD5_file_cb cb, void *arg)
+{
+   struct MD5FileHash *hash;
+   int err;
+
+   if (!proc || !path || !cb)
+      return -1;
+
+   hash = md5_file_open(path, &err);
+   if (!hash) {
+      DBG_print(DBG_LEVEL_WARN, "Failed to open %s for hashing: %s\n",
+            path, strerror(-err));
+      return -1;
+   }
+   hash->cb = cb;
+   hash->arg = arg;
+
+   if (PROC_thread_job_submit(proc, &md5_file_job, hash, &md5_file_job_done,
+            hash, PROC_JOB_PRIO_LOW, NULL) < 0) {
+      md5_file_free(hash);
+      return -1;
+   }
+
+   return 0;
+}
+
+static int64_t md5_file_now_ms(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int md5_file_evt_cb(void *arg)
+{
+   struct MD5FileHash *hash = (struct MD5FileHash*)arg;
+   int64_t deadline = md5_file_now_ms() + hash->budgetMs;
+   int res;
+
+   do {
+      res = md5_file_step(hash);
+   } while (!res && md5_file_now_ms() < deadline);
+
+   if (!res) {
+      // Measured from now, so a long pass can't make the next one due at once
+      EVT_sched_update(hash->evt, hash->evtId, EVT_ms2tv(MD5_FILE_YIELD_MS));
+      return EVENT_KEEP;
+   }
+
+   hash->evtId = NULL;
+   hash->cb(hash->arg, res < 0 ? res : 0, res < 0 ? NULL : hash->digest);
+   md5_file_free(hash);
+
+   return EVENT_REMOVE;
+}
+
+struct MD5FileHash *MD5_hash_file_evt(EVTHandler *evt, const char *path,
+      unsigned int budgetMs, MD5_file_cb cb, void *arg)
+{
+   struct MD5FileHash *hash;
+   int err;
+
+   if (!evt || !path || !cb)
+      return NULL;
+
+   hash = md5_file_open(path, &err);
+   if (!hash) {
+      DBG_print(DBG_LEVEL_WARN, "Failed to open %s for hashing: %s\n",
+            path, strerror(-err));
+      return NULL;
+   }
+   hash->cb = cb;
+   hash->arg = arg;
+   hash->evt = evt;
+   hash->budgetMs = budgetMs;
+
+   hash->evtId = EVT_sched_add(evt, EVT_ms2tv(0), &md5_file_evt_cb, hash);
+   if (!hash->evtId) {
+      md5_file_free(hash);
+      return NULL;
+   }
+   EVT_sched_set_name(hash->evtId, "MD5 %s", path);
+
+   return hash;
+}
+
+void MD5_hash_file_cancel(struct MD5FileHash *hash)
+{
+   if (!hash)
+      return;
+
+   if (hash->evtId)
+      EVT_sched_remove(hash->evt, hash->evtId);
+   md5_file_free(hash);
+}
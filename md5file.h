@@ -0,0 +1,107 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file md5file.h File hashing header file.
+ *
+ * Computes the MD5 of whole files without a small-buffer read() loop.
+ * Regular files are memory mapped; anything that can't be mapped is read
+ * in large blocks.  Hashing can run to completion, on the process's worker
+ * pool, or a slice at a time from the event loop.
+ */
+#ifndef LIBPROC_MD5FILE_H
+#define LIBPROC_MD5FILE_H
+
+#include "md5.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ProcessData;
+struct EventState;
+struct MD5FileHash;
+
+/// Bytes hashed between time budget checks, and the read() size when a
+///  file can't be mapped
+#define MD5_FILE_BLOCK (1024 * 1024)
+
+/**
+ * Called when an asynchronous hash finishes.
+ *
+ * @param arg    The argument passed when the hash was started.
+ * @param result 0 on success, or a negative errno value.  -ECANCELED if
+ *               the process was cleaned up before the hash ran.
+ * @param digest The file's MD5, or NULL when result is non-zero.  Only valid
+ *               for the duration of the call.
+ */
+typedef void (*MD5_file_cb)(void *arg, int result,
+      const unsigned char *digest);
+
+/**
+ * Hashes a file, blocking until it has been read.
+ *
+ * @param path   The file to hash.
+ * @param digest Receives the file's MD5.
+ *
+ * @retval  0 on success
+ * @retval <0 a negative errno value
+ */
+int MD5_hash_file(const char *path, unsigned char digest[MD5_DIGEST_LENGTH]);
+
+/**
+ * Hashes a file on the process's worker pool.  The callback runs in the
+ * event loop once hashing finishes, including when it fails.
+ *
+ * @param proc The process data pointer.
+ * @param path The file to hash.
+ * @param cb   Completion callback.
+ * @param arg  Passed to cb.
+ *
+ * @retval  0 if the job was queued
+ * @retval -1 on failure, in which case cb is never called
+ */
+int MD5_hash_file_thread(struct ProcessData *proc, const char *path,
+      MD5_file_cb cb, void *arg);
+
+/**
+ * Hashes a file from the event loop, spending no more than roughly
+ * budgetMs on each pass before letting other events run.
+ *
+ * @param evt      The event handler.
+ * @param path     The file to hash.
+ * @param budgetMs Milliseconds of hashing per pass, 0 for a single block.
+ * @param cb       Completion callback.
+ * @param arg      Passed to cb.
+ *
+ * @return A handle for MD5_hash_file_cancel, or NULL on failure, in which
+ *  case cb is never called.
+ */
+struct MD5FileHash *MD5_hash_file_evt(struct EventState *evt,
+      const char *path, unsigned int budgetMs, MD5_file_cb cb, void *arg);
+
+/**
+ * Stops a hash started with MD5_hash_file_evt.  The callback is not called.
+ * The handle must not be used once the callback has run.
+ */
+void MD5_hash_file_cancel(struct MD5FileHash *hash);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -31,6 +31,8 @@
 #include <polysat/ipc.h>
 #include <polysat/cmd.h>
 #include <polysat/md5.h>
+#include <polysat/md5file.h>
+#include <polysat/crc32c.h>
 #include <polysat/telm_dict.h>
 #include <polysat/plugin.h>
 #include <polysat/pseudo_threads.h>
@@ -44,18 +44,37 @@
 #include <time.h>
 #include "critical.h"
 #include <pthread.h>
+#include <limits.h>
 #include "ipc.h"
 #include "pseudo_threads.h"
 #include "cmd-pkt.h"
-
-#define READ_BUFF_MIN 4096
-#define READ_BUFF_MAX (READ_BUFF_MIN * 4)
+#include "hashtable.h"
+#include "trace.h"
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/signalfd.h>
+
+#define READ_BUFF_SIZE (4096 * 4)
+#define SPLICE_CHUNK (64 * 1024)
 #define WATCHDOG_VALIDATE_SECS 30
+// Set to "syslog" or a file path to log from a background thread
+#define ASYNC_LOG_ENV_VAR "LIBPROC_ASYNC_LOG"
+// Set to a file path to record a binary trace of the process
+#define TRACE_ENV_VAR "LIBPROC_TRACE"
 
 static int signalWriteFD = -1;
+// Signals the handler couldn't queue because the signal pipe was full.
+//  Each is delivered once, without its siginfo, after the pipe drains.
+static volatile sig_atomic_t signalDropped[NSIG];
+// Signals blocked for the signalfd.  Forked children get them unblocked.
+static sigset_t signalFdBlocked;
+static pthread_once_t signalFdAtfork = PTHREAD_ONCE_INIT;
 
 static int sigchld_handler(int, void*);
 static int setup_signal_fd(ProcessData *proc);
+static void write_queue_free(void *data);
+static void thread_pool_destroy(ProcessData *proc);
 
 //When a socket is written to, this is the call back that is called
 static int socket_write_cb(int fd, char type, void * arg);
@@ -64,6 +83,7 @@ static int socket_write_cb(int fd, char type, void * arg);
 struct ProcSignalCB
 {
    PROC_signal_cb cb;      /* A pointer to the signal callback function */
+   PROC_signal_info_cb infoCb; /* Used instead of cb when set */
    void *arg;                /* The arguments to pass */
    int sigNum;             /* The signal number to respond to */
    int recvdCnt;
@@ -80,7 +100,6 @@ struct ProcSignalCB
 struct ProcWriteNode {
    uint8_t *data;
    uint32_t len;
-   int fd;
    int freeMem;
    proc_nb_write_cb cb;
    void *arg;
@@ -88,6 +107,21 @@ struct ProcWriteNode {
    struct ProcWriteNode *next;
 };
 
+/* Maximum number of pending buffers coalesced into a single writev */
+#define WRITE_QUEUE_MAX_IOV 64
+
+/* Per-fd queue of pending writes.  Queues live in the process' writeQueues
+ * hash table, keyed by fd + 1, and exist only while the fd has writes pending.
+ * offset counts the bytes of the head node that have already been written.
+ */
+struct ProcWriteQueue {
+   int fd;
+   uint32_t offset;
+   struct ProcessData *proc;
+   struct ProcWriteNode *head;
+   struct ProcWriteNode *tail;
+};
+
 
 /** Returns the EVTHandler context for the process.  Needed to directly call
   * EVT_* functions.
@@ -106,6 +140,13 @@ struct CSState *proc_get_cs_state(ProcessData *proc)
    return &proc->criticalState;
 }
 
+struct CSStateExt *proc_get_cs_ext(ProcessData *proc)
+{
+   if (!proc)
+      return NULL;
+   return proc->criticalStateExt;
+}
+
 static ProcessData *watchProc = NULL;
 static int proc_cmd_sockaddr_internal(ProcessData *proc, int fd, unsigned char cmd, void *data, size_t dataLen, struct sockaddr_in *dest);
 int proc_cmd_sockaddr_raw_internal(ProcessData *proc, int fd, void *data,
@@ -221,6 +262,7 @@ ProcessData *PROC_init_xdr_hashsize(const char *procName, enum WatchdogMode wdMo
    ProcessData *proc;
    char filepath[80];
    char oldname[80];
+   const char *asyncLog, *tracePath;
    int fd;
    FILE *inp;
    int oldPid = -1;
@@ -250,6 +292,12 @@ ProcessData *PROC_init_xdr_hashsize(const char *procName, enum WatchdogMode wdMo
    // Configure the debug interface
    DBG_init(proc->name);
    DBG_setLevel(DBG_LEVEL_WARN);
+   asyncLog = getenv(ASYNC_LOG_ENV_VAR);
+   if (asyncLog && asyncLog[0])
+      DBG_async_start(0, strcmp(asyncLog, "syslog") ? asyncLog : NULL);
+   tracePath = getenv(TRACE_ENV_VAR);
+   if (tracePath && tracePath[0] && !TRACE_enabled)
+      TRACE_open(tracePath, 0, proc->name);
 
    // write .proc file (file pid.proc contains process name)
    if (proc->name) {
@@ -353,7 +401,8 @@ ProcessData *PROC_init_xdr_hashsize(const char *procName, enum WatchdogMode wdMo
    // Register process with the s/w watchdog (make sure to send null byte!)
    PROC_wd_enable(proc);
 
-   critical_state_init(&proc->criticalState, proc->name);
+   proc->criticalStateExt = critical_state_init(&proc->criticalState,
+         proc->name);
 #if TIME_TEST
    gettimeofday(&endTime, NULL);
    timersub(&endTime, &startTime, &totalTime);
@@ -380,16 +429,33 @@ void PROC_wd_enable(ProcessData *proc) {
 void PROC_cleanup(ProcessData *proc)
 {
    char filepath[80];
+   ProcChild *child;
 
    if (!proc) //Already clean
       return;
 
    cmd_cleanup_cb_state(proc->cmds, proc->evtHandler);
-   critical_state_cleanup(&proc->criticalState);
+   critical_state_cleanup(&proc->criticalState, proc->criticalStateExt);
+   proc->criticalStateExt = NULL;
+   thread_pool_destroy(proc);
+   for (child = proc->childHead; child; child = child->next)
+      if (child->pidFd >= 0)
+         close(child->pidFd);
+   if (proc->children)
+      HASH_free_table(proc->children);
 
    // Clear errno to prevent false errors
    errno = 0;
    EVT_free_handler(proc->evtHandler);
+   if (proc->writeQueues) {
+      HASH_extract(proc->writeQueues, &write_queue_free);
+      HASH_free_table(proc->writeQueues);
+   }
+   if (proc->sigFd >= 0) {
+      close(proc->sigFd);
+      pthread_sigmask(SIG_UNBLOCK, &proc->sigFdMask, NULL);
+      sigemptyset(&signalFdBlocked);
+   }
    close(proc->sigPipe[0]);
    ERRNO_WARN("close sigPipe[0] error: ");
    close(proc->sigPipe[1]);
@@ -419,10 +485,13 @@ void PROC_cleanup(ProcessData *proc)
    }
 
    struct ProcSignalCB *curr;
+   int sig;
 
-   while((curr = proc->signalCBHead)) {
-      proc->signalCBHead = curr->next;
-      free(curr);
+   for (sig = 0; sig < NSIG; sig++) {
+      while((curr = proc->signalCBs[sig])) {
+         proc->signalCBs[sig] = curr->next;
+         free(curr);
+      }
    }
 
    cmd_handler_cleanup(&proc->cmds);
@@ -433,6 +502,7 @@ void PROC_cleanup(ProcessData *proc)
 static void validate_pipe_flush(ProcChild *child)
 {
    struct ProcChild **curr;
+   int i;
    //Child is never null when passed in
    if (child->state != CHILD_STATE_FLUSH_PIPES)
       return;
@@ -452,16 +522,107 @@ static void validate_pipe_flush(ProcChild *child)
          // Found the parent; unlink and free the child
          *curr = child->next;
          child->next = NULL;
-         if (child->streamState[0].buff)
-            free(child->streamState[0].buff);
-         if (child->streamState[1].buff)
-            free(child->streamState[1].buff);
+         for (i = 0; i < 2; i++) {
+            if (child->streamState[i].buff)
+               free(child->streamState[i].buff);
+            if (child->redirectFd[i] >= 0)
+               close(child->redirectFd[i]);
+         }
          free(child);
          break;
       }
    }
 }
 
+static size_t child_hash_func(void *key)
+{
+   return (size_t)(intptr_t)key;
+}
+
+static int child_cmp_key(void *key1, void *key2)
+{
+   return ((intptr_t)key1) == ((intptr_t)key2);
+}
+
+static void *child_key_for_data(void *data)
+{
+   return (void*)(intptr_t)((ProcChild*)data)->procId;
+}
+
+// Records a reaped child's exit and starts flushing its pipes
+static void child_exited(ProcChild *child, int exitStatus,
+      struct rusage *rusage)
+{
+   HASH_remove_data(child->parentData->children, child);
+   if (child->pidFd >= 0) {
+      EVT_fd_force_remove(child->parentData->evtHandler, child->pidFd,
+            EVENT_FD_READ);
+      close(child->pidFd);
+      child->pidFd = -1;
+   }
+
+   child->rusage = *rusage;
+   child->exitStatus = exitStatus;
+   child->state = CHILD_STATE_FLUSH_PIPES;
+   validate_pipe_flush(child);
+}
+
+// A child's pidfd becomes readable when that child exits
+static int child_pidfd_cb(int fd, char type, void *arg)
+{
+   ProcChild *child = (ProcChild*)arg;
+   struct rusage rusage;
+   int exitStatus;
+   pid_t cpid;
+
+   cpid = wait4(child->procId, &exitStatus, WNOHANG, &rusage);
+   if (cpid == 0)
+      return EVENT_KEEP;
+   if (cpid < 0) {
+      ERRNO_WARN("Error with wait4");
+      return EVENT_KEEP;
+   }
+
+   // Keep the pidfd open until the death callback has run, so a child it
+   //  respawns can't be handed the same fd number while this event is
+   //  still being dispatched
+   child->pidFd = -1;
+   child_exited(child, exitStatus, &rusage);
+   close(fd);
+   return EVENT_REMOVE;
+}
+
+// Tracks a new child's exit with a pidfd when the kernel supports it
+static void child_track(ProcessData *proc, ProcChild *child)
+{
+   child->pidFd = -1;
+
+   if (!proc->children) {
+      proc->children = HASH_create_table(37, &child_hash_func,
+            &child_cmp_key, &child_key_for_data);
+      if (!proc->children) {
+         DBG_print(DBG_LEVEL_WARN, "Failed to allocate child table\n");
+         return;
+      }
+   }
+   HASH_add_data(proc->children, child);
+
+#ifdef SYS_pidfd_open
+   child->pidFd = syscall(SYS_pidfd_open, child->procId, 0);
+   if (child->pidFd < 0)
+      return;
+   fcntl(child->pidFd, F_SETFD, FD_CLOEXEC);
+
+   EVT_fd_add(proc->evtHandler, child->pidFd, EVENT_FD_READ,
+         child_pidfd_cb, child);
+   EVT_fd_set_name(proc->evtHandler, child->pidFd,
+         "child %u exit", child->procId);
+   EVT_fd_set_critical(proc->evtHandler, child->pidFd, 0);
+#endif
+}
+
+// Reaps children whose exit wasn't already seen through their pidfd,
+//  including ones proclib didn't create
 static int sigchld_handler(int signum, void *param)
 {
    ProcessData *proc = (ProcessData*)param;
@@ -469,7 +630,7 @@ static int sigchld_handler(int signum, void *param)
    pid_t cpid;
    struct rusage rusage;
    int exitStatus;
-   struct ProcChild *curr, *tmp;
+   ProcChild *child;
 
    do {
       cpid = wait4(-1, &exitStatus, WNOHANG, &rusage);
@@ -478,36 +639,55 @@ static int sigchld_handler(int signum, void *param)
          if (ECHILD != errno)
             ERRNO_WARN("Error with wait4");
       }
-      else if (cpid > 0) {
-         for(curr = proc->childHead; curr; curr = tmp) {
-            // Use tmp for iteration in case child is deallocated
-            tmp = curr->next;
-            if (curr->procId != cpid || curr->state == CHILD_STATE_DONE)
-               continue;
-
-            curr->rusage = rusage;
-            curr->exitStatus = exitStatus;
-            curr->state = CHILD_STATE_FLUSH_PIPES;
-            validate_pipe_flush(curr);
-         }
+      else if (cpid > 0 && proc->children) {
+         child = HASH_find_key(proc->children, (void*)(intptr_t)cpid);
+         if (child && child->state != CHILD_STATE_DONE)
+            child_exited(child, exitStatus, &rusage);
       }
    } while(more);
    return EVENT_KEEP;
 }
 
-int signal_fd_cb(int fd, char type, void *arg)
+static void signal_dispatch(ProcessData *proc, struct signalfd_siginfo *info)
 {
-   ProcessData *proc = (ProcessData*)arg;
-   int rd, signum;
-   static char rdBuff[sizeof(signum)];
-   static int rdLen = 0;
    struct ProcSignalCB **curr, *sigTmp;
+   int signum = info->ssi_signo;
    int keep;
 
+   if (signum <= 0 || signum >= NSIG)
+      return;
+
+   for (curr = &proc->signalCBs[signum]; *curr; ) {
+      sigTmp = *curr;
+      sigTmp->recvdCnt++;
+      //cb is assigned in PROC_signal
+      if (sigTmp->infoCb)
+         keep = (*sigTmp->infoCb)(info, sigTmp->arg);
+      else
+         keep = (*sigTmp->cb)(signum, sigTmp->arg);
+
+      if (EVENT_REMOVE == keep) {
+         *curr = sigTmp->next;
+         free(sigTmp);
+      }
+      else
+         curr = &sigTmp->next;
+   }
+}
+
+// Signals are read as signalfd_siginfo records from either the signalfd or
+//  the signal pipe, in batches
+int signal_fd_cb(int fd, char type, void *arg)
+{
+   ProcessData *proc = (ProcessData*)arg;
+   struct signalfd_siginfo infos[16];
+   int rd, i, signum;
+
    do {
-      rd = read(proc->sigPipe[0], &rdBuff[rdLen], sizeof(rdBuff) - rdLen);
-      // more = rd > 0 || (-1 == rd && EAGAIN == errno);
-      if (-1 >= rd && EAGAIN != errno) {
+      rd = read(fd, infos, sizeof(infos));
+      if (-1 >= rd) {
+         if (EAGAIN == errno || EINTR == errno)
+            break;
          ERRNO_WARN("signal fd error, closing:");
          return EVENT_REMOVE;
       }
@@ -516,58 +696,94 @@ int signal_fd_cb(int fd, char type, void *arg)
          return EVENT_REMOVE;
       }
 
-      rdLen += rd;
-      if (rdLen == sizeof(rdBuff)) {
-         rdLen = 0;
-         memcpy(&signum, rdBuff, sizeof(rdBuff));
-
-         for (curr = &proc->signalCBHead; *curr; ) {
-            sigTmp = *curr;
-
-            if (sigTmp->sigNum == signum) {
-               sigTmp->recvdCnt++;
-               //cb is assigned in PROC_signal
-               keep = (*sigTmp->cb)(signum, sigTmp->arg);
-
-               if (EVENT_REMOVE == keep) {
-                  *curr = sigTmp->next;
-                  free(sigTmp);
-               }
-               else
-                  curr = &sigTmp->next;
-            }
-            else
-               curr = &sigTmp->next;
-         }
-      }
-   } while(0);
+      for (i = 0; i < rd / (int)sizeof(infos[0]); i++)
+         signal_dispatch(proc, &infos[i]);
+   } while(rd == sizeof(infos));
+
+   if (fd != proc->sigPipe[0])
+      return EVENT_KEEP;
+
+   // The pipe has drained, so collapse the overflowed signals into one each
+   for (signum = 1; signum < NSIG; signum++) {
+      if (!signalDropped[signum])
+         continue;
+      signalDropped[signum] = 0;
+      DBG_print(DBG_LEVEL_WARN, "Signal pipe overflowed, collapsing "
+            "repeated signal %d\n", signum);
+      memset(&infos[0], 0, sizeof(infos[0]));
+      infos[0].ssi_signo = signum;
+      signal_dispatch(proc, &infos[0]);
+   }
 
    return EVENT_KEEP;
 }
 
 static void PROC_signal_handler(int sigNum, siginfo_t *si, void *p)
 {
-   if (signalWriteFD != -1)
-      if(write(signalWriteFD, &sigNum, sizeof(sigNum)) < sizeof(sigNum) )
-      	ERRNO_WARN("Write error");
+   struct signalfd_siginfo info;
+
+   if (signalWriteFD == -1)
+      return;
+
+   // Same record the signalfd produces, written atomically into the pipe
+   memset(&info, 0, sizeof(info));
+   info.ssi_signo = sigNum;
+   if (si) {
+      info.ssi_errno = si->si_errno;
+      info.ssi_code = si->si_code;
+      info.ssi_pid = si->si_pid;
+      info.ssi_uid = si->si_uid;
+      info.ssi_status = si->si_status;
+      info.ssi_int = si->si_int;
+      info.ssi_ptr = (uintptr_t)si->si_ptr;
+   }
+   // The write end never blocks.  A full pipe marks the signal for delivery
+   //  once the pipe drains.
+   if (write(signalWriteFD, &info, sizeof(info)) < (ssize_t)sizeof(info))
+      signalDropped[sigNum] = 1;
+}
+
+static void signal_fd_atfork_child(void)
+{
+   pthread_sigmask(SIG_UNBLOCK, &signalFdBlocked, NULL);
+}
+
+static void signal_fd_register_atfork(void)
+{
+   sigemptyset(&signalFdBlocked);
+   pthread_atfork(NULL, NULL, &signal_fd_atfork_child);
 }
 
 static int setup_signal_fd(ProcessData *proc)
 {
    int currFlags;
-   int res;
+   int res, i;
+
+   proc->sigFd = -1;
+   sigemptyset(&proc->sigFdMask);
    if (-1 != signalWriteFD)
       return 0;
 
+   pthread_once(&signalFdAtfork, &signal_fd_register_atfork);
+   proc->sigFd = signalfd(-1, &proc->sigFdMask, SFD_NONBLOCK | SFD_CLOEXEC);
+   if (proc->sigFd >= 0) {
+      EVT_fd_add(proc->evtHandler, proc->sigFd,
+            EVENT_FD_READ, signal_fd_cb, proc);
+      EVT_fd_set_name(proc->evtHandler, proc->sigFd, "Signal FD");
+      EVT_fd_set_critical(proc->evtHandler, proc->sigFd, 0);
+   }
+
    if (0 != pipe(proc->sigPipe))
       return errno;
 
-   // Set the read end of the pipe to non-blocking
-   currFlags = fcntl(proc->sigPipe[0], F_GETFD);
-   if (-1 == currFlags)
-      return -1;
-   if (-1 == fcntl(proc->sigPipe[0], F_SETFD, O_NONBLOCK))
-      return -1;
+   // Set both ends of the pipe to non-blocking so the handler never blocks
+   for (i = 0; i < 2; i++) {
+      currFlags = fcntl(proc->sigPipe[i], F_GETFL);
+      if (-1 == currFlags)
+         return -1;
+      if (-1 == fcntl(proc->sigPipe[i], F_SETFL, currFlags | O_NONBLOCK))
+         return -1;
+   }
 
    signalWriteFD = proc->sigPipe[1];
    res = EVT_fd_add(proc->evtHandler, proc->sigPipe[0],
@@ -577,11 +793,29 @@ static int setup_signal_fd(ProcessData *proc)
    return res;
 }
 
-int PROC_signal(struct ProcessData *proc, int sigNum, PROC_signal_cb cb,
-            void *p)
+// Signals raised by faults must run their handler immediately
+static int signal_needs_handler(int sigNum)
+{
+   switch (sigNum) {
+      case SIGSEGV:
+      case SIGBUS:
+      case SIGFPE:
+      case SIGILL:
+      case SIGTRAP:
+      case SIGSYS:
+      case SIGABRT:
+         return 1;
+   }
+
+   return 0;
+}
+
+static int proc_signal_add(struct ProcessData *proc, int sigNum,
+      PROC_signal_cb cb, PROC_signal_info_cb infoCb, void *p)
 {
    struct ProcSignalCB *curr;
    struct sigaction sa;
+   sigset_t one;
 
    if (-1 == signalWriteFD) {
       DBG_print(DBG_LEVEL_WARN, "Failed to add signal because ProcessData"
@@ -595,17 +829,20 @@ int PROC_signal(struct ProcessData *proc, int sigNum, PROC_signal_cb cb,
       return -1;
    }
 
+   if (sigNum <= 0 || sigNum >= NSIG)
+      return -1;
+
    curr = malloc(sizeof(struct ProcSignalCB));
    if (!curr)
       return -1;
 
    curr->cb = cb;
+   curr->infoCb = infoCb;
    curr->arg = p;
    curr->sigNum = sigNum;
    curr->recvdCnt = 0;
-   curr->next = proc->signalCBHead;
-   proc->signalCBHead = curr;
 
+   // The handler still catches the signal in threads that haven't blocked it
    sa.sa_sigaction = PROC_signal_handler;
    sigfillset(&sa.sa_mask); //Catch all signals
    sa.sa_flags = SA_SIGINFO;
@@ -614,9 +851,40 @@ int PROC_signal(struct ProcessData *proc, int sigNum, PROC_signal_cb cb,
       return -1;
    }
 
+   curr->next = proc->signalCBs[sigNum];
+   proc->signalCBs[sigNum] = curr;
+
+   // Route the signal through the signalfd
+   if (proc->sigFd >= 0 && !signal_needs_handler(sigNum) &&
+         !sigismember(&proc->sigFdMask, sigNum)) {
+      sigaddset(&proc->sigFdMask, sigNum);
+      if (signalfd(proc->sigFd, &proc->sigFdMask, 0) < 0) {
+         ERRNO_WARN("Failed to update signalfd");
+         sigdelset(&proc->sigFdMask, sigNum);
+      }
+      else {
+         sigemptyset(&one);
+         sigaddset(&one, sigNum);
+         sigaddset(&signalFdBlocked, sigNum);
+         pthread_sigmask(SIG_BLOCK, &one, NULL);
+      }
+   }
+
    return 0;
 }
 
+int PROC_signal(struct ProcessData *proc, int sigNum, PROC_signal_cb cb,
+            void *p)
+{
+   return proc_signal_add(proc, sigNum, cb, NULL, p);
+}
+
+int PROC_signal_info(struct ProcessData *proc, int sigNum,
+      PROC_signal_info_cb cb, void *p)
+{
+   return proc_signal_add(proc, sigNum, NULL, cb, p);
+}
+
 static int next_param(char *str, char **start, char **end)
 {
    int inQuote = 0;
@@ -716,6 +984,14 @@ static char **parse_cmd(char *cmd)
    return argv;
 }
 
+// Reports a failure from a vforked child, which can't use stdio
+static void spawn_child_fail(const char *msg, int code)
+{
+   if (write(2, msg, strlen(msg)) < 0)
+      ;
+   _exit(code);
+}
+
 ProcChild *PROC_fork_child(struct ProcessData *proc, const char *cmdFmt, ...)
 {
    va_list ap;
@@ -766,6 +1042,9 @@ ProcChild *PROC_fork_child_fd(struct ProcessData *proc, int inFd_read, int inFd_
    ProcChild *child = NULL;
    char **argv = NULL;
    pid_t childPid;
+   sigset_t allSigs, oldSigs, childSigs;
+   struct sigaction act;
+   int sig;
 
    if(vasprintf(&cmd, cmdFmt, ap) < 0) {
       ERR_REPORT(DBG_LEVEL_WARN, "vasprintf failure\n");
@@ -783,22 +1062,39 @@ ProcChild *PROC_fork_child_fd(struct ProcessData *proc, int inFd_read, int inFd_
    if (!argv || !argv[0])
       goto err_cleanup;
 
-   // Fork off the child process
-   if ( 0 == (childPid = fork())) {
-      // Executing in the child.  Move the pipe FDs into place
+   // The child shares our memory until it execs, so keep signal handlers
+   //  from running in it until they have been reset
+   sigfillset(&allSigs);
+   pthread_sigmask(SIG_SETMASK, &allSigs, &oldSigs);
+   // Signals blocked for the signalfd must not stay blocked in the child
+   childSigs = oldSigs;
+   for (sig = 1; sig < NSIG; sig++)
+      if (proc && proc->sigFd >= 0 && sigismember(&proc->sigFdMask, sig))
+         sigdelset(&childSigs, sig);
+
+   // vfork avoids copying the page tables of large parents
+   if ( 0 == (childPid = vfork())) {
+      // Executing in the child.  Only system calls are safe until exec.
+      for (sig = 1; sig < NSIG; sig++)
+         if (!sigaction(sig, NULL, &act) && act.sa_handler != SIG_IGN &&
+               act.sa_handler != SIG_DFL)
+            signal(sig, SIG_DFL);
+      sigprocmask(SIG_SETMASK, &childSigs, NULL);
+
+      // Move the pipe FDs into place
       if (0 != close(0))
-         exit(1);
+         _exit(1);
       if (0 != close(1))
-         exit(2);
+         _exit(2);
       if (0 != close(2))
-         exit(3);
+         _exit(3);
 
       if (inFd_read > -1 && (-1 == dup2(inFd_read, 0)))
-         exit(4);
+         _exit(4);
       if (outFd_write > -1 && (-1 == dup2(outFd_write, 1)))
-         exit(5);
+         _exit(5);
       if (errFd_write > -1 && (-1 == dup2(errFd_write, 2)))
-         exit(6);
+         _exit(6);
 
       if(inFd_read > -1)
          close(inFd_read);
@@ -814,38 +1110,24 @@ ProcChild *PROC_fork_child_fd(struct ProcessData *proc, int inFd_read, int inFd_
          close(errFd_write);
 
       // Move child into own group for signal isolation
-      setpgrp();
+      setpgid(0, 0);
 
       // Set memory limits it necessary
-      if(mem_limit) {
-         if(setrlimit(RLIMIT_AS, mem_limit) == -1) {
-            ERRNO_WARN("Failure to set memory limit");
-            exit(7);
-         }
-      }
+      if(mem_limit && setrlimit(RLIMIT_AS, mem_limit) == -1)
+         spawn_child_fail("Failure to set memory limit\n", 7);
 
       // Set cpu limits it necessary
-      if(cpu_limit) {
-         if(setrlimit(RLIMIT_CPU, cpu_limit) == -1) {
-            ERRNO_WARN("Failure to set CPU limit");
-            exit(8);
-         }
-      }
-
-      // Retrieve the current pid for the child
-      pid_t childPid = getpid();
+      if(cpu_limit && setrlimit(RLIMIT_CPU, cpu_limit) == -1)
+         spawn_child_fail("Failure to set CPU limit\n", 8);
 
       // Set the nice of the child to the default of 0
-      if(setpriority(PRIO_PROCESS, childPid, 0) == -1) {
-         ERRNO_WARN("Failure to set nice value of child");
-         exit(9);
-      }
+      if(setpriority(PRIO_PROCESS, 0, 0) == -1)
+         spawn_child_fail("Failure to set nice value of child\n", 9);
 
       execvp(argv[0], argv);
-      ERRNO_WARN("Exec failed!");
-      printf("Exec failure: %s\n", strerror(errno));
-      exit(1);
+      spawn_child_fail("Exec failed!\n", 1);
    }
+   pthread_sigmask(SIG_SETMASK, &oldSigs, NULL);
 
    // The forking failed
    if(childPid == -1)
@@ -861,6 +1143,8 @@ ProcChild *PROC_fork_child_fd(struct ProcessData *proc, int inFd_read, int inFd_
    child->state = CHILD_STATE_INIT;
    child->parentData = proc;
    child->procId = childPid;
+   child->redirectFd[0] = -1;
+   child->redirectFd[1] = -1;
 
    // Save the file descriptors for stdout, stderr, and stdin
    // incase parent process wants to write to them.
@@ -870,6 +1154,7 @@ ProcChild *PROC_fork_child_fd(struct ProcessData *proc, int inFd_read, int inFd_
 
    child->next = proc->childHead;
    proc->childHead = child;
+   child_track(proc, child);
 
    // Clean up and return the child
 err_cleanup:
@@ -1041,18 +1326,36 @@ char CHLD_death_notice(ProcChild *child, CHLD_death_cb_t deathCb, void *arg)
    return 0;
 }
 
-static void drain_buffer(ProcChild *child, BufferedStreamState *state,
-      int urgent)
+static int child_stream_index(ProcChild *child, int fd)
+{
+   if (fd == child->stdout_fd)
+      return 0;
+   if (fd == child->stderr_fd)
+      return 1;
+
+   return -1;
+}
+
+// Hands the unread bytes to the callback until it stops consuming.  The
+//  unread data is moved to the front of the buffer before each call, so a
+//  callback that steals the buffer always gets the allocation it points to.
+static void drain_buffer(ProcChild *child, int s, int urgent)
 {
+   BufferedStreamState *state = &child->streamState[s];
    int drainLen = 1;
-   int i;
 
-   if (!state || !state->cb)
+   if (!state->cb)
       return;
 
-  while (drainLen > 0 && state->buffLen > 0) {
-      drainLen = (*state->cb)(child, urgent, state->arg, state->buff,
-            state->buffLen);
+   while (drainLen > 0 && state->buffLen > 0) {
+      if (child->buffStart[s]) {
+         memmove(state->buff, state->buff + child->buffStart[s],
+               state->buffLen);
+         child->buffStart[s] = 0;
+      }
+
+      drainLen = (*state->cb)(child, urgent, state->arg,
+            state->buff, state->buffLen);
       if (drainLen == CHILD_BUFF_ERR)
          break;
       if (drainLen == CHILD_BUFF_STEAL_BUFF) {
@@ -1061,80 +1364,82 @@ static void drain_buffer(ProcChild *child, BufferedStreamState *state,
          break;
       }
       if (drainLen >= state->buffLen) {
-         state->buffLen = 0;
+         child->buffStart[s] = state->buffLen = 0;
          break;
       }
 
-      // Compress the buffer
+      child->buffStart[s] += drainLen;
       state->buffLen -= drainLen;
-      for(i = 0; i < state->buffLen; i++)
-         state->buff[i] = state->buff[i + drainLen];
    }
 }
 
+// Makes room for a read after the unread data.  When the data has reached
+//  the end of the buffer it is moved back to the front once, so callbacks
+//  always see it as one contiguous view.
+static void stream_make_room(ProcChild *child, int s)
+{
+   BufferedStreamState *state = &child->streamState[s];
+
+   if (child->buffStart[s] + state->buffLen < state->buffCap ||
+         !child->buffStart[s])
+      return;
+
+   memmove(state->buff, state->buff + child->buffStart[s], state->buffLen);
+   child->buffStart[s] = 0;
+}
+
 static int child_read_data(int fd, char type, void *arg)
 {
    ProcChild *child = (ProcChild*)arg;
    BufferedStreamState *state = NULL;
-   int readLen;
+   int readLen, tail, s;
 
-   if (fd == child->stdout_fd)
-      state = &child->streamState[0];
-   else if (fd ==  child->stderr_fd)
-      state = &child->streamState[1];
-   else {
+   s = child_stream_index(child, fd);
+   if (s < 0) {
       DBG_print(DBG_LEVEL_WARN, "child_read_data registered for wrong < fd,client>\n");
       return EVENT_REMOVE;
    }
+   state = &child->streamState[s];
 
-   // Is there any space left in the buffer?  If not, expand it
-   if (state->buffLen >= state->buffCap) {
-      if (state->buffCap >= READ_BUFF_MAX) {
-         drain_buffer(child, state, CHILD_BUFF_NOROOM);
-         if (state->buffLen >= state->buffCap) {
-            DBG_print(DBG_LEVEL_WARN, "Failed to drain buffer, dropping data!\n");
-            state->buffLen = 0;
-         }
-      }
+   if (!state->buff) {
+      state->buffCap = READ_BUFF_SIZE;
+      child->buffStart[s] = state->buffLen = 0;
+      state->buff = malloc(state->buffCap);
       if (!state->buff) {
-         state->buffCap = READ_BUFF_MIN;
-         state->buffLen = 0;
-         state->buff = malloc(state->buffCap);
-         if (!state->buff) {
-            DBG_print(DBG_LEVEL_WARN, "no memory for buffer; very bad!\n");
-            exit(1);
-         }
+         DBG_print(DBG_LEVEL_WARN, "no memory for buffer; very bad!\n");
+         exit(1);
       }
-      else if (state->buffLen >= state->buffCap &&
-            state->buffCap < READ_BUFF_MAX) {
-         state->buffCap *= 2;
-         if (state->buffCap > READ_BUFF_MAX)
-            state->buffCap = READ_BUFF_MAX;
-         state->buff = realloc(state->buff, state->buffCap);
-         if (!state->buff) {
-            DBG_print(DBG_LEVEL_WARN, "no memory for realloc buffer; very bad!\n");
-            exit(1);
-         }
+   }
+
+   // Is there any space left in the buffer?  If not, force a drain
+   if (state->buffLen >= state->buffCap) {
+      drain_buffer(child, s, CHILD_BUFF_NOROOM);
+      if (state->buffLen >= state->buffCap) {
+         DBG_print(DBG_LEVEL_WARN, "Failed to drain buffer, dropping data!\n");
+         child->buffStart[s] = state->buffLen = 0;
       }
+      if (!state->buff)
+         return child_read_data(fd, type, arg);
    }
-   assert(state->buffLen < state->buffCap);
+   stream_make_room(child, s);
+   tail = child->buffStart[s] + state->buffLen;
+   assert(tail < state->buffCap);
 
-   readLen = read(fd, &state->buff[state->buffLen],
-         state->buffCap - state->buffLen);
+   readLen = read(fd, &state->buff[tail], state->buffCap - tail);
 
    if (readLen > 0) {
       state->buffLen += readLen;
-      drain_buffer(child, state, CHILD_BUFF_NORM);
+      drain_buffer(child, s, CHILD_BUFF_NORM);
    }
    else if (readLen == 0) {
-      drain_buffer(child, state, CHILD_BUFF_CLOSING);
+      drain_buffer(child, s, CHILD_BUFF_CLOSING);
       if (state->buffLen != 0) {
          DBG_print(DBG_LEVEL_WARN, "Not all bytes read from buffer when closed\n");
       }
       if (state->buff) {
          free(state->buff);
          state->buff = NULL;
-         state->buffCap = state->buffLen = 0;
+         state->buffCap = child->buffStart[s] = state->buffLen = 0;
       }
       CHLD_close_fd(child, fd);
       return EVENT_REMOVE;
@@ -1147,6 +1452,96 @@ static int child_read_data(int fd, char type, void *arg)
    return EVENT_KEEP;
 }
 
+// Moves child output to its redirect file inside the kernel
+static int child_splice_data(int fd, char type, void *arg)
+{
+   ProcChild *child = (ProcChild*)arg;
+   char buff[4096];
+   ssize_t len, written = 0, res;
+   int s;
+
+   s = child_stream_index(child, fd);
+   if (s < 0 || child->redirectFd[s] < 0) {
+      DBG_print(DBG_LEVEL_WARN, "child_splice_data registered for wrong < fd,client>\n");
+      return EVENT_REMOVE;
+   }
+
+   len = splice(fd, NULL, child->redirectFd[s], NULL, SPLICE_CHUNK,
+         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+   if (len < 0 && errno == EINVAL) {
+      // The descriptors don't support splice, copy instead
+      len = read(fd, buff, sizeof(buff));
+      while (len > 0 && written < len) {
+         res = write(child->redirectFd[s], buff + written, len - written);
+         if (res < 0) {
+            len = -1;
+            break;
+         }
+         written += res;
+      }
+   }
+
+   if (len > 0 || (len < 0 && errno == EAGAIN))
+      return EVENT_KEEP;
+
+   if (len < 0)
+      ERRNO_WARN("Child redirect error");
+
+   close(child->redirectFd[s]);
+   child->redirectFd[s] = -1;
+   CHLD_close_fd(child, fd);
+
+   return EVENT_REMOVE;
+}
+
+static char child_redirect(ProcChild *child, int fd, int s,
+      const char *path, const char *name)
+{
+   int res;
+
+   if (!child || !path)
+      return 0;
+   if (fd < 0)
+      return 0;
+   if (!child->parentData)
+      return 1;
+
+   if (child->redirectFd[s] >= 0)
+      close(child->redirectFd[s]);
+   // O_APPEND is avoided because splice() refuses to write to it
+   child->redirectFd[s] = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+         0644);
+   if (child->redirectFd[s] < 0) {
+      ERRNO_WARN("Failed to open child redirect file");
+      return 0;
+   }
+
+   res = EVT_fd_add(child->parentData->evtHandler, fd,
+         EVENT_FD_READ, child_splice_data, child);
+   EVT_fd_set_name(child->parentData->evtHandler, fd,
+         "child %u %s redirect", child->procId, name);
+   EVT_fd_set_critical(child->parentData->evtHandler, fd, 0);
+   return res;
+}
+
+char CHLD_stdout_to_file(ProcChild *child, const char *path)
+{
+   if (!child)
+      return 0;
+
+   return child_redirect(child, child->stdout_fd, 0,
+         path, "stdout");
+}
+
+char CHLD_stderr_to_file(ProcChild *child, const char *path)
+{
+   if (!child)
+      return 0;
+
+   return child_redirect(child, child->stderr_fd, 1,
+         path, "stderr");
+}
+
 char CHLD_stdout_reader(ProcChild *child, CHLD_buf_stream_cb_t cb, void *arg)
 {
    int res;
@@ -1355,39 +1750,135 @@ int PROC_set_multicast_handler(struct ProcessData *proc, const char *service,
    return 0;
 }
 
-static int write_event_callback(int fd, char type, void *arg)
+static void proc_write_callback(int fd, uint8_t *data, uint32_t len, void *arg);
+
+// The hash table ignores NULL keys, so fds are offset by one to keep fd 0
+//  usable
+static void *write_queue_key(int fd)
 {
-   struct ProcessData *proc = (struct ProcessData*)arg;
-   struct ProcWriteNode **curr, *tx;
+   return (void*)((intptr_t)fd + 1);
+}
 
-   // Find the next write node for this fd
-   for (curr = &proc->writeListHead; *curr && (*curr)->fd != fd;
-         curr = &((*curr)->next))
-      ;
+static size_t write_queue_hash_func(void *key)
+{
+   return (size_t)(intptr_t)key;
+}
 
-   // If we were called by mistake (no node on the write list), remove
-   // ourselves
-   if (!*curr)
-      return EVENT_REMOVE;
+static int write_queue_cmp_key(void *key1, void *key2)
+{
+   return ((intptr_t)key1) == ((intptr_t)key2);
+}
 
-   // We can finally perform the write
-   tx = *curr;
-   (tx->cb)(fd, tx->data, tx->len, tx->arg);
+static void *write_queue_key_for_data(void *data)
+{
+   return write_queue_key(((struct ProcWriteQueue*)data)->fd);
+}
 
-   // Cleanup
-   *curr = tx->next;
-   if (tx->freeMem)
-      free(tx->data);
-   free(tx);
+static void write_node_free(struct ProcWriteNode *node)
+{
+   if (node->freeMem && node->data)
+      free(node->data);
+   free(node);
+}
 
-   // Check to see if there are more packets to transmit out this fd
-   while (*curr && (*curr)->fd != fd)
-         curr = &((*curr)->next);
+static void write_queue_free(void *data)
+{
+   struct ProcWriteQueue *queue = (struct ProcWriteQueue*)data;
+   struct ProcWriteNode *node;
 
-   if (!*curr)
-      return EVENT_REMOVE;
+   while ((node = queue->head)) {
+      queue->head = node->next;
+      write_node_free(node);
+   }
+   free(queue);
+}
 
-   return EVENT_KEEP;
+// Pops the head node off the queue and releases it
+static void write_queue_pop(struct ProcWriteQueue *queue)
+{
+   struct ProcWriteNode *node = queue->head;
+
+   queue->head = node->next;
+   if (!queue->head)
+      queue->tail = NULL;
+   queue->offset = 0;
+   write_node_free(node);
+}
+
+// Writes as many consecutive default-callback buffers from the head of the
+// queue as possible with a single writev, resuming any partial write.
+// Returns -1 if the fd is no longer writable, 0 otherwise.
+static int write_queue_flush_raw(struct ProcWriteQueue *queue)
+{
+   struct iovec iov[WRITE_QUEUE_MAX_IOV];
+   struct ProcWriteNode *node;
+   ssize_t written;
+   size_t len;
+   int cnt = 0;
+
+   for (node = queue->head; node && cnt < WRITE_QUEUE_MAX_IOV &&
+         node->cb == &proc_write_callback; node = node->next) {
+      iov[cnt].iov_base = node->data;
+      iov[cnt].iov_len = node->len;
+      if (cnt == 0) {
+         iov[cnt].iov_base = node->data + queue->offset;
+         iov[cnt].iov_len -= queue->offset;
+      }
+      cnt++;
+   }
+
+   written = writev(queue->fd, iov, cnt);
+   if (written < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+         return -1;
+
+      // Unrecoverable error, drop the buffers that failed to go out
+      ERRNO_WARN("Failed to write callback\n");
+      while (cnt-- > 0)
+         write_queue_pop(queue);
+      return 0;
+   }
+
+   while (queue->head && queue->head->cb == &proc_write_callback) {
+      len = queue->head->len - queue->offset;
+      if (written < len) {
+         queue->offset += written;
+         return -1;
+      }
+      written -= len;
+      write_queue_pop(queue);
+      if (--cnt == 0)
+         break;
+   }
+
+   return 0;
+}
+
+static int write_event_callback(int fd, char type, void *arg)
+{
+   struct ProcWriteQueue *queue = (struct ProcWriteQueue*)arg;
+   struct ProcWriteNode *tx;
+
+   while ((tx = queue->head)) {
+      if (tx->cb == &proc_write_callback) {
+         if (write_queue_flush_raw(queue) < 0)
+            return EVENT_KEEP;
+         continue;
+      }
+
+      // Custom callbacks own the write and are invoked once per buffer.
+      //  Only one is run per wakeup since it may fill the fd.
+      (tx->cb)(fd, tx->data, tx->len, tx->arg);
+      write_queue_pop(queue);
+      if (queue->head)
+         return EVENT_KEEP;
+   }
+
+   // Nothing left to transmit out this fd
+   HASH_remove_data(queue->proc->writeQueues, queue);
+   write_queue_free(queue);
+
+   return EVENT_REMOVE;
 }
 
 static void proc_write_callback(int fd, uint8_t *data, uint32_t len, void *arg)
@@ -1406,8 +1897,14 @@ int PROC_nonblocking_write(struct ProcessData *proc, int fd, uint8_t *data, uint
 int PROC_nonblocking_write_callback(struct ProcessData *proc, int fd, uint8_t *data, uint32_t len, proc_nb_write_cb cb, void *arg, int memoryOptions)
 {
    struct ProcWriteNode *newNode;
-   struct ProcWriteNode **curr;
-   int writePending = 0;
+   struct ProcWriteQueue *queue;
+
+   if (!proc->writeQueues) {
+      proc->writeQueues = HASH_create_table(37, &write_queue_hash_func,
+            &write_queue_cmp_key, &write_queue_key_for_data);
+      if (!proc->writeQueues)
+         return -1;
+   }
 
    newNode = malloc(sizeof(*newNode));
    if (!newNode)
@@ -1418,8 +1915,8 @@ int PROC_nonblocking_write_callback(struct ProcessData *proc, int fd, uint8_t *d
    if (memoryOptions == IGNORE_DATA_AFTER_WRITE)
       newNode->freeMem = 0;
 
-   newNode->data = NULL;
-   newNode->len = 0;
+   newNode->data = data;
+   newNode->len = len;
    // Make a copy of the data, if requested
    if (memoryOptions == COPY_DATA_TO_WRITE) {
       newNode->data = malloc(len);
@@ -1428,42 +1925,49 @@ int PROC_nonblocking_write_callback(struct ProcessData *proc, int fd, uint8_t *d
          return -1;
       }
       memcpy(newNode->data, data, len);
-      newNode->len = len;
    }
 
-   newNode->fd = fd;
    newNode->next = NULL;
    newNode->cb = cb;
    newNode->arg = arg;
 
-   // Find the tail of the list and determine if there is a
-   // write pending for this fd
-   for (curr = &proc->writeListHead; *curr; curr = &((*curr)->next))
-      if ((*curr)->fd == newNode->fd)
-         writePending = 1;
+   // Append to the existing queue for this fd, if there is a write pending
+   queue = HASH_find_key(proc->writeQueues, write_queue_key(fd));
+   if (queue) {
+      queue->tail->next = newNode;
+      queue->tail = newNode;
+      return 0;
+   }
 
-   *curr = newNode;
+   queue = malloc(sizeof(*queue));
+   if (!queue) {
+      write_node_free(newNode);
+      return -1;
+   }
+   queue->fd = fd;
+   queue->offset = 0;
+   queue->proc = proc;
+   queue->head = queue->tail = newNode;
 
    // Register the write callback
-   if (!writePending) {
-      if (EVT_fd_add(proc->evtHandler, newNode->fd, EVENT_FD_WRITE,
-               &write_event_callback, proc) < 0) {
-         *curr = NULL;
-         if (newNode->freeMem && newNode->data)
-            free(newNode->data);
-         free(newNode);
-         return -1;
-      }
+   if (EVT_fd_add(proc->evtHandler, fd, EVENT_FD_WRITE,
+            &write_event_callback, queue) < 0) {
+      write_queue_free(queue);
+      return -1;
+   }
+   if (HASH_add_data(proc->writeQueues, queue) < 0) {
+      EVT_fd_remove(proc->evtHandler, fd, EVENT_FD_WRITE);
+      write_queue_free(queue);
+      return -1;
    }
 
    // Success
    return 0;
 }
 
-struct thread_data{
-   int write_fd;
-   int read_fd;
-   pthread_t thread;
+struct ProcThreadJob {
+   struct ProcThreadJob *next;
+   uint32_t id;
    int (*fcn)(void *arg);
    void *fcn_arg;
    int (*cb_fcn)(void *arg, int retval);
@@ -1471,76 +1975,306 @@ struct thread_data{
    int retval;
 };
 
-void *thread_main(void *arg)
+struct ProcJobQueue {
+   struct ProcThreadJob *head, *tail;
+};
+
+struct ProcThreadPool {
+   pthread_mutex_t lock;
+   pthread_cond_t work;
+   struct ProcJobQueue queued[PROC_JOB_PRIO_MAX];
+   struct ProcJobQueue done;
+   pthread_t *threads;
+   int numThreads;
+   int doneFd;
+   uint32_t nextId;
+   int shutdown;
+};
+
+static void job_queue_push(struct ProcJobQueue *q, struct ProcThreadJob *job)
 {
-   struct thread_data *data = (struct thread_data *)arg;
+   job->next = NULL;
+   if (q->tail)
+      q->tail->next = job;
+   else
+      q->head = job;
+   q->tail = job;
+}
 
-   data->retval = data->fcn(data->fcn_arg);
+static struct ProcThreadJob *job_queue_pop(struct ProcJobQueue *q)
+{
+   struct ProcThreadJob *job = q->head;
 
-   //write data to trigger callback in event loop
-   char letter = 'q';
-   if(write(data->write_fd, &letter, sizeof(letter)) < sizeof(letter)) {
-      ERRNO_WARN("Failed to write callback\n");
+   if (job) {
+      q->head = job->next;
+      if (!q->head)
+         q->tail = NULL;
    }
 
-   pthread_exit(data);
+   return job;
+}
+
+// Runs the callbacks of jobs left over when the pool is destroyed, so
+//  their arguments aren't leaked
+static void job_queue_finish(struct ProcJobQueue *q, int started)
+{
+   struct ProcThreadJob *job;
+
+   while ((job = job_queue_pop(q))) {
+      if (job->cb_fcn)
+         job->cb_fcn(job->cb_arg, started ? job->retval : PROC_JOB_DISCARDED);
+      free(job);
+   }
 }
 
-static int thread_cb(int fd, char type, void *data)
+static void *thread_pool_main(void *arg)
 {
-   struct thread_data *ret = (struct thread_data *)data;
+   struct ProcThreadPool *pool = (struct ProcThreadPool *)arg;
+   struct ProcThreadJob *job;
+   uint64_t one = 1;
+   int prio;
+
+   pthread_mutex_lock(&pool->lock);
+   while (!pool->shutdown) {
+      // Highest priority first, FIFO within a priority
+      job = NULL;
+      for (prio = PROC_JOB_PRIO_MAX - 1; !job && prio >= 0; prio--)
+         job = job_queue_pop(&pool->queued[prio]);
+
+      if (!job) {
+         pthread_cond_wait(&pool->work, &pool->lock);
+         continue;
+      }
+      pthread_mutex_unlock(&pool->lock);
 
-   //join thread
-   pthread_join(ret->thread, (void **)&ret);
+      job->retval = job->fcn(job->fcn_arg);
 
-   ret->cb_fcn(ret->cb_arg, ret->retval);
+      pthread_mutex_lock(&pool->lock);
+      job_queue_push(&pool->done, job);
 
-   //clean up pipe
-   close(ret->read_fd);
-   close(ret->write_fd);
-   free(ret);
+      //write data to trigger callback in event loop
+      if (write(pool->doneFd, &one, sizeof(one)) < (ssize_t)sizeof(one)
+            && errno != EAGAIN)
+         ERRNO_WARN("Failed to write callback\n");
+   }
+   pthread_mutex_unlock(&pool->lock);
 
-   return EVENT_REMOVE;
+   return NULL;
 }
 
-int thread_function(ProcessData *proc, void *fcn_ptr, void *arg, void *cb_fcn,
-void *cb_arg)
+static int thread_pool_cb(int fd, char type, void *arg)
 {
-   //wrap data needed for thread in struct
-   struct thread_data *data = malloc(sizeof(struct thread_data));
-   data->cb_fcn = cb_fcn;
-   data->cb_arg = cb_arg;
+   struct ProcThreadPool *pool = (struct ProcThreadPool *)arg;
+   struct ProcJobQueue done;
+   struct ProcThreadJob *job;
+   uint64_t count;
+
+   if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      ERRNO_WARN("Failed to read thread pool completions\n");
+
+   pthread_mutex_lock(&pool->lock);
+   done = pool->done;
+   pool->done.head = pool->done.tail = NULL;
+   pthread_mutex_unlock(&pool->lock);
+
+   while ((job = job_queue_pop(&done))) {
+      if (job->cb_fcn)
+         job->cb_fcn(job->cb_arg, job->retval);
+      free(job);
+   }
+
+   return EVENT_KEEP;
+}
+
+static void thread_pool_destroy(ProcessData *proc)
+{
+   struct ProcThreadPool *pool = proc->threadPool;
+   int i, prio;
+
+   if (!pool)
+      return;
+   proc->threadPool = NULL;
+
+   // Running jobs finish, queued ones are discarded
+   pthread_mutex_lock(&pool->lock);
+   pool->shutdown = 1;
+   pthread_cond_broadcast(&pool->work);
+   pthread_mutex_unlock(&pool->lock);
+
+   for (i = 0; i < pool->numThreads; i++)
+      pthread_join(pool->threads[i], NULL);
+
+   EVT_fd_remove(PROC_evt(proc), pool->doneFd, EVENT_FD_READ);
+   close(pool->doneFd);
+
+   job_queue_finish(&pool->done, 1);
+   for (prio = PROC_JOB_PRIO_MAX - 1; prio >= 0; prio--)
+      job_queue_finish(&pool->queued[prio], 0);
+
+   pthread_cond_destroy(&pool->work);
+   pthread_mutex_destroy(&pool->lock);
+   free(pool->threads);
+   free(pool);
+}
+
+static struct ProcThreadPool *thread_pool_start(ProcessData *proc)
+{
+   struct ProcThreadPool *pool;
    pthread_attr_t attr;
+   sigset_t all, old;
+   int i;
+
+   pool = calloc(1, sizeof(*pool));
+   if (!pool)
+      return NULL;
+
+   pool->numThreads = proc->threadPoolSize > 0 ?
+      proc->threadPoolSize : PROC_THREAD_POOL_DEFAULT_SIZE;
+   pool->threads = calloc(pool->numThreads, sizeof(pthread_t));
+   pool->doneFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   pool->nextId = 1;
+   if (!pool->threads || pool->doneFd < 0) {
+      ERRNO_WARN("Error creating thread pool");
+      if (pool->doneFd >= 0)
+         close(pool->doneFd);
+      free(pool->threads);
+      free(pool);
+      return NULL;
+   }
+   pthread_mutex_init(&pool->lock, NULL);
+   pthread_cond_init(&pool->work, NULL);
+   proc->threadPool = pool;
+
+   EVT_fd_add(PROC_evt(proc), pool->doneFd, EVENT_FD_READ,
+         &thread_pool_cb, pool);
 
-   //create pipe
-   int fd[2];
-   if(pipe(fd)) {
-      ERRNO_WARN("Error creating pipe");
-      goto cleanup;
+   if (pthread_attr_init(&attr) != 0) {
+      pool->numThreads = 0;
+      thread_pool_destroy(proc);
+      return NULL;
+   }
+   if (pthread_attr_setstacksize(&attr, proc->threadStackSize > 0 ?
+            proc->threadStackSize : PROC_THREAD_DEFAULT_STACK) != 0) {
+      DBG_print(DBG_LEVEL_WARN, "Invalid pool thread stack size %zu\n",
+            proc->threadStackSize);
+      pthread_attr_destroy(&attr);
+      // No threads were started, so there are none to join
+      pool->numThreads = 0;
+      thread_pool_destroy(proc);
+      return NULL;
    }
-   data->write_fd = fd[1];
-   data->read_fd = fd[0];
 
-   //wrap info for function to thread in struct
-   data->fcn = fcn_ptr;
-   data->fcn_arg = arg;
+   // Signals are left to the event loop thread
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &old);
+   for (i = 0; i < pool->numThreads; i++)
+      if (pthread_create(&pool->threads[i], &attr, &thread_pool_main, pool))
+         break;
+   pthread_sigmask(SIG_SETMASK, &old, NULL);
+   pthread_attr_destroy(&attr);
 
-   if (pthread_attr_init(&attr) != 0)
-      goto cleanup;
- 
-   if (pthread_attr_setstacksize(&attr, 0x80000) != 0)
-      goto cleanup;
+   pool->numThreads = i;
+   if (!i) {
+      ERR_REPORT(DBG_LEVEL_WARN, "Failed to start any pool threads\n");
+      thread_pool_destroy(proc);
+      return NULL;
+   }
 
-   if(pthread_create(&data->thread, &attr, thread_main, data)){
-      //error creating thread
-      goto cleanup;
+   return pool;
+}
+
+int PROC_thread_pool_config(ProcessData *proc, int threads, size_t stackSize)
+{
+   if (!proc || proc->threadPool)
+      return -1;
+   if (stackSize && stackSize < PTHREAD_STACK_MIN) {
+      DBG_print(DBG_LEVEL_WARN, "Pool thread stack size %zu is below the "
+            "minimum of %zu\n", stackSize, (size_t)PTHREAD_STACK_MIN);
+      return -1;
    }
 
-   //register pipe read with event loop
-   EVT_fd_add(PROC_evt(proc), data->read_fd, EVENT_FD_READ, &thread_cb, data);
+   proc->threadPoolSize = threads;
+   proc->threadStackSize = stackSize;
+
+   return 0;
+}
+
+int PROC_thread_job_submit(ProcessData *proc, int (*fcn)(void *arg),
+      void *arg, int (*cb_fcn)(void *arg, int retval), void *cb_arg,
+      enum ProcJobPriority prio, uint32_t *jobId)
+{
+   struct ProcThreadPool *pool;
+   struct ProcThreadJob *job;
+
+   if (!proc || !fcn || prio < 0 || prio >= PROC_JOB_PRIO_MAX)
+      return -1;
+
+   pool = proc->threadPool;
+   if (!pool && !(pool = thread_pool_start(proc)))
+      return -1;
+
+   job = malloc(sizeof(*job));
+   if (!job)
+      return -1;
+   job->fcn = fcn;
+   job->fcn_arg = arg;
+   job->cb_fcn = cb_fcn;
+   job->cb_arg = cb_arg;
+
+   pthread_mutex_lock(&pool->lock);
+   job->id = pool->nextId++;
+   if (!pool->nextId)
+      pool->nextId = 1;
+   if (jobId)
+      *jobId = job->id;
+   job_queue_push(&pool->queued[prio], job);
+   pthread_cond_signal(&pool->work);
+   pthread_mutex_unlock(&pool->lock);
+
+   return 0;
+}
+
+int PROC_thread_job_cancel(ProcessData *proc, uint32_t jobId)
+{
+   struct ProcThreadPool *pool;
+   struct ProcJobQueue *q;
+   struct ProcThreadJob *job = NULL, *prev;
+   int prio;
+
+   if (!proc || !(pool = proc->threadPool))
+      return -1;
+
+   pthread_mutex_lock(&pool->lock);
+   for (prio = 0; !job && prio < PROC_JOB_PRIO_MAX; prio++) {
+      q = &pool->queued[prio];
+      prev = NULL;
+      for (job = q->head; job && job->id != jobId; job = job->next)
+         prev = job;
+
+      if (job) {
+         if (prev)
+            prev->next = job->next;
+         else
+            q->head = job->next;
+         if (q->tail == job)
+            q->tail = prev;
+      }
+   }
+   pthread_mutex_unlock(&pool->lock);
+
+   if (!job)
+      return -1;
+
+   free(job);
+   return 0;
+}
+
+int thread_function(ProcessData *proc, void *fcn_ptr, void *arg, void *cb_fcn,
+void *cb_arg)
+{
+   if (PROC_thread_job_submit(proc, fcn_ptr, arg, cb_fcn, cb_arg,
+            PROC_JOB_PRIO_NORMAL, NULL) < 0)
+      return 1;
 
    return 0;
-cleanup:
-   free(data);
-   return 1;
 }
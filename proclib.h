@@ -31,6 +31,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <sys/time.h>
 #include <sys/resource.h>
@@ -64,8 +66,10 @@ typedef struct ProcessData {
    //Socket
    int cmdFd, txFd;
    int sigPipe[2];
+   // Unused, kept so the fields after it keep their offsets
    struct ProcSignalCB *signalCBHead;
    struct ProcChild *childHead;
+   // Unused, kept so the fields after it keep their offsets
    struct ProcWriteNode *writeListHead;
    char *name;
    int cmdPort;
@@ -74,6 +78,16 @@ typedef struct ProcessData {
    struct CommandCbArg *cmds;
    struct CSState criticalState;
    enum WatchdogMode wdMode;
+   // Fields below were added in minor versions.  Append only.
+   struct HashTable *writeQueues;
+   struct ProcThreadPool *threadPool;
+   int threadPoolSize;
+   size_t threadStackSize;
+   struct HashTable *children;
+   int sigFd;
+   sigset_t sigFdMask;
+   struct ProcSignalCB *signalCBs[NSIG];
+   struct CSStateExt *criticalStateExt;
 } ProcessData;
 
 /** Returns the EVTHandler context for the process.  Needed to directly call
@@ -232,6 +246,12 @@ void PROC_cleanup(ProcessData *proc);
 /** Signal callback **/
 typedef int (*PROC_signal_cb)(int sig, void *p);
 
+/** Signal callback that receives the signal's details, such as the sender's
+ *  pid in ssi_pid.
+ **/
+typedef int (*PROC_signal_info_cb)(const struct signalfd_siginfo *info,
+      void *p);
+
 /** Register a signal handler
  * @param ctx The event state
  * @param sigNum The signal number
@@ -241,6 +261,20 @@ typedef int (*PROC_signal_cb)(int sig, void *p);
 int PROC_signal(struct ProcessData *proc, int sigNum, PROC_signal_cb cb,
       void *p);
 
+/** Register a signal handler that receives the signal's details.  Signals
+ * are delivered through a signalfd where available, so every queued signal
+ * reaches the callback with its payload.  The signal is then blocked in the
+ * calling thread.  Children created with fork() or PROC_fork_child get it
+ * unblocked again; code that starts programs with posix_spawn() must reset
+ * the mask itself.
+ * @param proc The process state
+ * @param sigNum The signal number
+ * @param cb The signal callback
+ * @param p The parameters
+ */
+int PROC_signal_info(struct ProcessData *proc, int sigNum,
+      PROC_signal_info_cb cb, void *p);
+
 /** Replace the command handler for the given command with a new one.
  * @param proc The process state
  * @param cmdNum The command number to replace
@@ -320,6 +354,80 @@ int PROC_read_critical_state(ProcessData *proc, void *state, int len);
  */
 int PROC_save_critical_state(ProcessData *proc, void *state, int len);
 
+/** Delays critical state writes so a burst of saves becomes one durable
+ *    write at the end of the interval.  Reads always return the latest
+ *    saved state.  Pending state is written when the interval ends, when
+ *    debouncing is turned off, or at PROC_cleanup.
+ * @param proc The process state
+ * @param ms The interval in milliseconds, or 0 to write on every save
+ * @returns 0 on success, or a negative error code
+ */
+int PROC_critical_state_debounce(ProcessData *proc, int ms);
+
+/** Selects the checksum used for critical state written from now on.  The
+ *    default is CS_CHECKSUM_CRC32C.  State written with any supported
+ *    checksum, including MD5 from older versions, is always readable.
+ * @param proc The process state
+ * @param type The checksum algorithm
+ * @returns 0 on success, or a negative error code
+ */
+int PROC_critical_state_checksum(ProcessData *proc,
+      enum CSChecksumType type);
+
+/// Largest value a critical state journal entry can hold
+#define CS_JOURNAL_MAX_VALUE (16 * 1024 * 1024)
+
+struct CSJournal;
+
+/** Opens a named, journaled critical state store.  Unlike
+ *    PROC_save_critical_state the store holds any number of keyed values of
+ *    up to CS_JOURNAL_MAX_VALUE bytes each.  Changes are appended to a
+ *    checksumed log in both critical state directories and the log is
+ *    periodically compacted into a snapshot on the worker pool.  Existing
+ *    snapshots and logs are recovered when the store is opened.
+ * @param proc The process state
+ * @param name Name of the store, unique within the process
+ * @returns The store, or NULL on failure
+ */
+struct CSJournal *PROC_journal_open(ProcessData *proc, const char *name);
+
+/** Stores a value under a key, replacing any existing value.
+ * @param j The store
+ * @param key A NUL terminated key of 1 to 255 bytes
+ * @param val The value to store
+ * @param len The length of the value, not to exceed CS_JOURNAL_MAX_VALUE
+ * @returns 0 on success, or a negative error code.  -5 means the change was
+ *    stored and applied, but could not be written to every directory.
+ */
+int PROC_journal_put(struct CSJournal *j, const char *key, const void *val,
+      uint32_t len);
+
+/** Removes a key from the store.
+ * @returns 0 on success, or a negative error code, as for PROC_journal_put
+ */
+int PROC_journal_delete(struct CSJournal *j, const char *key);
+
+/** Looks up the value stored under a key.  The returned memory belongs to
+ *    the store and remains valid until the key is next changed.
+ * @param j The store
+ * @param key The key to look up
+ * @param len Set to the length of the value, may be NULL
+ * @returns The value, or NULL if the key isn't present
+ */
+const void *PROC_journal_get(struct CSJournal *j, const char *key,
+      uint32_t *len);
+
+/** Starts compacting the log into a snapshot on the worker pool.  This
+ *    happens automatically as the log grows.
+ * @returns 0 on success, or a negative error code
+ */
+int PROC_journal_compact(struct CSJournal *j);
+
+/** Closes the store and frees its memory.  Everything already put is on
+ *    disk and will be recovered by the next PROC_journal_open.
+ */
+void PROC_journal_close(struct CSJournal *j);
+
 #define CHILD_STATE_INIT 1
 #define CHILD_STATE_RUNNING 2
 #define CHILD_STATE_FLUSH_PIPES 3
@@ -334,10 +442,17 @@ struct ProcChild;
 
 typedef void (*CHLD_death_cb_t)(struct ProcChild *child, void *arg);
 
+/** Called with a contiguous view of a child's unread output.  Returns the
+  *  number of bytes consumed.  It is called again with the remaining bytes
+  *  until it consumes nothing.  buff always starts at the beginning of the
+  *  allocation, so CHILD_BUFF_STEAL_BUFF can take ownership of it.
+  **/
 typedef int (*CHLD_buf_stream_cb_t)(struct ProcChild *child, int lastchance,
       void *arg, char *buff, int len);
 
-/** Structure to hold information about proclib created child processes **/
+/** Linear buffer holding a child stream's unread output.  Consumed bytes
+  *  are dropped by moving the rest to the front with memmove().
+  **/
 typedef struct BufferedStreamState {
    CHLD_buf_stream_cb_t cb;
    void *arg;
@@ -357,6 +472,13 @@ typedef struct ProcChild {
    void *deathArg;
 
    struct ProcChild *next;
+
+   // Fields below were added in minor versions.  Append only.
+   int pidFd;
+   // Offset of the unread data in each streamState buffer
+   int buffStart[2];
+   // File each stream is spliced into, or -1
+   int redirectFd[2];
 } ProcChild;
 
 /**
@@ -457,16 +579,96 @@ char CHLD_death_notice(ProcChild *child, CHLD_death_cb_t deathCb, void *arg);
 char CHLD_stdout_reader(ProcChild *child, CHLD_buf_stream_cb_t, void *arg);
 char CHLD_stderr_reader(ProcChild *child, CHLD_buf_stream_cb_t, void *arg);
 
+/** Writes all data a child writes to stdout into a file, replacing any
+  *  existing contents.  The data is moved with splice() where possible.
+  *  When the file doesn't support splice() it is copied through the parent
+  *  with read() and write() instead.
+  **/
+char CHLD_stdout_to_file(ProcChild *child, const char *path);
+
+/** Writes all data a child writes to stderr into a file, replacing any
+  *  existing contents.  The data is moved with splice() where possible.
+  *  When the file doesn't support splice() it is copied through the parent
+  *  with read() and write() instead.
+  **/
+char CHLD_stderr_to_file(ProcChild *child, const char *path);
+
+
+/// Number of worker threads used when PROC_thread_pool_config isn't called
+#define PROC_THREAD_POOL_DEFAULT_SIZE 4
+/// Worker thread stack size used when PROC_thread_pool_config isn't called
+#define PROC_THREAD_DEFAULT_STACK 0x80000
+
+/// Result passed to the callback of a job that never ran because the process
+///  was cleaned up first
+#define PROC_JOB_DISCARDED INT_MIN
+
+/// Order in which queued thread jobs are started
+enum ProcJobPriority {
+   PROC_JOB_PRIO_LOW = 0,
+   PROC_JOB_PRIO_NORMAL = 1,
+   PROC_JOB_PRIO_HIGH = 2,
+   PROC_JOB_PRIO_MAX = 3,
+};
 
 /*
 * Runs the specified function in a different thread
 * @param proc The process data pointer
 * @param fcn_ptr Pointer to the function that will be run
 * @param arg Opaque argument that will be passed to the function
+* @param cb_fcn Called from the event loop with cb_arg and the function's
+*               return value once it finishes
+*
+* The function runs on the process's worker pool at normal priority.
 */
 int thread_function(ProcessData *proc, void *fcn_ptr, void *arg, void *cb_fcn,
 void *cb_arg);
 
+/**
+ * Sets the size of the worker pool used by thread_function and
+ * PROC_thread_job_submit.  The pool starts on the first submitted job, after
+ * which it can no longer be configured.
+ *
+ * @param proc The process data pointer
+ * @param threads Number of worker threads, 0 for the default
+ * @param stackSize Stack size of each worker, 0 for the default.  Must be
+ *                  at least PTHREAD_STACK_MIN.
+ *
+ * @retval  0 on success
+ * @retval -1 if the pool is already running or the stack size is too small
+ */
+int PROC_thread_pool_config(ProcessData *proc, int threads, size_t stackSize);
+
+/**
+ * Queues a function to run on the worker pool.  Completion callbacks run in
+ * the event loop, in the order the jobs finish.  Jobs still queued when
+ * PROC_cleanup is called don't run, but their callbacks are still called
+ * with PROC_JOB_DISCARDED.
+ *
+ * @param proc The process data pointer
+ * @param fcn The function to run on a worker thread
+ * @param arg Opaque argument passed to fcn
+ * @param cb_fcn Called from the event loop with cb_arg and fcn's return
+ *               value, may be NULL
+ * @param cb_arg Opaque argument passed to cb_fcn
+ * @param prio Queued jobs with higher priority start first
+ * @param jobId Set to an id usable with PROC_thread_job_cancel, may be NULL
+ *
+ * @retval  0 on success
+ * @retval -1 on failure
+ */
+int PROC_thread_job_submit(ProcessData *proc, int (*fcn)(void *arg),
+      void *arg, int (*cb_fcn)(void *arg, int retval), void *cb_arg,
+      enum ProcJobPriority prio, uint32_t *jobId);
+
+/**
+ * Removes a job that hasn't started yet.  Its callback is never called.
+ *
+ * @retval  0 if the job was cancelled
+ * @retval -1 if the job has already started or doesn't exist
+ */
+int PROC_thread_job_cancel(ProcessData *proc, uint32_t jobId);
+
 #ifdef __cplusplus
 }
 
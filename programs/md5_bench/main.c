@@ -0,0 +1,177 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Compares libproc's MD5 block function against the reference RFC 1321
+ * implementation, and MD5_hash_file against a small-buffer read() loop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <md5.h>
+#include <md5file.h>
+
+void MD5RefInit(MD5_CTX *);
+void MD5RefUpdate(MD5_CTX *, unsigned char *, unsigned int);
+void MD5RefFinal(unsigned char [MD5_DIGEST_LENGTH], MD5_CTX *);
+
+#define FILE_SIZE (64 * 1024 * 1024)
+
+static const struct {
+   const char *msg;
+   const char *md5;
+} vectors[] = {
+   { "", "d41d8cd98f00b204e9800998ecf8427e" },
+   { "a", "0cc175b9c0f1b6a831c399e269772661" },
+   { "abc", "900150983cd24fb0d6963f7d28e17f72" },
+   { "message digest", "f96b697d7cb7938d525a2f31aaf161d0" },
+   { "abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b" },
+   { "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+      "57edf4a22be3c955ac49da2e2107b67a" },
+};
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void to_hex(const unsigned char *digest, char *hex)
+{
+   int i;
+
+   for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+      sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+// Returns MB/s for hashing len bytes, repeated until at least 0.5s passes
+static double bench(int ref, unsigned char *data, unsigned int len,
+      unsigned char *digest)
+{
+   MD5_CTX ctx;
+   double start = now(), elapsed;
+   uint64_t bytes = 0;
+
+   do {
+      if (ref) {
+         MD5RefInit(&ctx);
+         MD5RefUpdate(&ctx, data, len);
+         MD5RefFinal(digest, &ctx);
+      }
+      else {
+         MD5Init(&ctx);
+         MD5Update(&ctx, data, len);
+         MD5Final(digest, &ctx);
+      }
+      bytes += len;
+   } while ((elapsed = now() - start) < 0.5);
+
+   return bytes / elapsed / 1e6;
+}
+
+static int hash_read_loop(const char *path, unsigned char *digest)
+{
+   unsigned char buff[4096];
+   MD5_CTX ctx;
+   ssize_t rd;
+   int fd;
+
+   fd = open(path, O_RDONLY);
+   if (fd < 0)
+      return -1;
+
+   MD5Init(&ctx);
+   while ((rd = read(fd, buff, sizeof(buff))) > 0)
+      MD5Update(&ctx, buff, rd);
+   MD5Final(digest, &ctx);
+   close(fd);
+
+   return rd < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+   static const unsigned int sizes[] = { 64, 1024, 65536, 16 * 1024 * 1024 };
+   unsigned char digest[MD5_DIGEST_LENGTH], refDigest[MD5_DIGEST_LENGTH];
+   char hex[MD5_DIGEST_LENGTH * 2 + 1], path[] = "/tmp/md5_bench.XXXXXX";
+   unsigned char *data;
+   double ref, opt, start, mapped, loop;
+   unsigned int i;
+   int fd, failed = 0;
+
+   for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+      bench(0, (unsigned char*)vectors[i].msg, strlen(vectors[i].msg), digest);
+      to_hex(digest, hex);
+      if (strcmp(hex, vectors[i].md5)) {
+         printf("FAIL: MD5(\"%s\") = %s, expected %s\n", vectors[i].msg, hex,
+               vectors[i].md5);
+         failed = 1;
+      }
+   }
+
+   data = malloc(FILE_SIZE);
+   if (!data)
+      return 1;
+   srand(1);
+   for (i = 0; i < FILE_SIZE; i++)
+      data[i] = rand();
+
+   printf("%10s %12s %12s %8s\n", "bytes", "ref MB/s", "opt MB/s", "speedup");
+   for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      ref = bench(1, data + 1, sizes[i], refDigest);
+      opt = bench(0, data + 1, sizes[i], digest);
+      if (memcmp(digest, refDigest, sizeof(digest))) {
+         printf("FAIL: digests differ for %u bytes\n", sizes[i]);
+         failed = 1;
+      }
+      printf("%10u %12.1f %12.1f %7.2fx\n", sizes[i], ref, opt, opt / ref);
+   }
+
+   fd = mkstemp(path);
+   if (fd < 0 || write(fd, data, FILE_SIZE) != FILE_SIZE) {
+      perror(path);
+      return 1;
+   }
+   close(fd);
+
+   start = now();
+   if (hash_read_loop(path, refDigest) < 0)
+      failed = 1;
+   loop = now() - start;
+
+   start = now();
+   if (MD5_hash_file(path, digest) < 0 ||
+         memcmp(digest, refDigest, sizeof(digest)))
+      failed = 1;
+   mapped = now() - start;
+
+   printf("%u byte file: 4KB read() loop %.1f ms, MD5_hash_file %.1f ms\n",
+         FILE_SIZE, loop * 1000, mapped * 1000);
+
+   unlink(path);
+   free(data);
+
+   if (failed)
+      printf("FAILED\n");
+   return failed;
+}
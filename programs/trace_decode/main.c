@@ -0,0 +1,212 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Decodes a binary trace file written by TRACE_open() into text, one
+ * record per line, oldest first.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <trace.h>
+
+// Prints one record's format string using its stored arguments
+static void print_record(const char *fmt, const struct TRACE_Record *rec)
+{
+   char spec[64];
+   const char *start;
+   uint32_t arg = 0;
+   double dval;
+   int len;
+
+#define NEXT_ARG() (arg < rec->nargs && arg < TRACE_MAX_ARGS ? \
+                        rec->args[arg++] : 0)
+
+   while (*fmt) {
+      if (*fmt != '%') {
+         putchar(*fmt++);
+         continue;
+      }
+
+      start = fmt++;
+      if (*fmt == '%') {
+         putchar('%');
+         fmt++;
+         continue;
+      }
+
+      // Rebuild the conversion with '*' expanded and a 64-bit length
+      len = 0;
+      spec[len++] = '%';
+      while (*fmt && strchr("-+ #0'I", *fmt) && len < 16)
+         spec[len++] = *fmt++;
+      for (; *fmt == '*' || *fmt == '.' || (*fmt >= '0' && *fmt <= '9');
+            fmt++) {
+         if (*fmt == '*') {
+            int val = (int)NEXT_ARG();
+            if (len < 40)
+               len += snprintf(spec + len, 12, "%d", val);
+         }
+         else if (len < 40)
+            spec[len++] = *fmt;
+      }
+      while (*fmt && strchr("hlqLjzZt", *fmt))
+         fmt++;
+
+      switch (*fmt) {
+         case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            spec[len++] = 'l';
+            spec[len++] = 'l';
+            spec[len++] = *fmt;
+            spec[len] = 0;
+            printf(spec, (long long)NEXT_ARG());
+            break;
+         case 'c':
+            spec[len++] = 'c';
+            spec[len] = 0;
+            printf(spec, (int)NEXT_ARG());
+            break;
+         case 'e': case 'E': case 'f': case 'F':
+         case 'g': case 'G': case 'a': case 'A':
+            spec[len++] = *fmt;
+            spec[len] = 0;
+            dval = 0;
+            if (arg < rec->nargs && arg < TRACE_MAX_ARGS)
+               memcpy(&dval, &rec->args[arg++], sizeof(dval));
+            printf(spec, dval);
+            break;
+         case 's': case 'p':
+            // Only the address of a string is recorded
+            printf("%#llx", (unsigned long long)NEXT_ARG());
+            break;
+         case 'n':
+            NEXT_ARG();
+            break;
+         case 'm':
+            break;
+         default:
+            // Unknown conversion, the recorder stopped here too
+            fputs(start, stdout);
+            fmt = "";
+            continue;
+      }
+      fmt++;
+   }
+#undef NEXT_ARG
+
+   putchar('\n');
+}
+
+int main(int argc, char *argv[])
+{
+   const struct TRACE_FileHeader *hdr;
+   const struct TRACE_Record *records, *rec;
+   const struct TRACE_StrEntry *entry;
+   const char **fmts = NULL;
+   const char *strtab, *fmt;
+   uint64_t written, pos, first;
+   uint32_t off, maxId;
+   struct stat st;
+   int64_t ns;
+   time_t secs;
+   struct tm tm;
+   char tbuff[32];
+   int fd;
+
+   if (argc != 2) {
+      fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+      return 1;
+   }
+
+   fd = open(argv[1], O_RDONLY);
+   if (fd < 0 || fstat(fd, &st) < 0) {
+      perror(argv[1]);
+      return 1;
+   }
+   if (st.st_size < (off_t)sizeof(*hdr)) {
+      fprintf(stderr, "%s: file too short\n", argv[1]);
+      return 1;
+   }
+
+   hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (hdr == MAP_FAILED) {
+      perror("mmap");
+      return 1;
+   }
+
+   if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+         hdr->version != TRACE_VERSION ||
+         hdr->recordSize != sizeof(struct TRACE_Record) ||
+         !hdr->recordCount || (hdr->recordCount & (hdr->recordCount - 1)) ||
+         hdr->strtabUsed > hdr->strtabSize ||
+         hdr->headerSize + (uint64_t)hdr->strtabSize +
+            (uint64_t)hdr->recordCount * hdr->recordSize > st.st_size) {
+      fprintf(stderr, "%s: not a valid trace file\n", argv[1]);
+      return 1;
+   }
+
+   strtab = (const char*)hdr + hdr->headerSize;
+   records = (const struct TRACE_Record*)(strtab + hdr->strtabSize);
+
+   // Index the format strings by id
+   maxId = hdr->nextFmtId;
+   fmts = calloc(maxId + 1, sizeof(*fmts));
+   if (!fmts)
+      return 1;
+   for (off = 0; off + sizeof(*entry) <= hdr->strtabUsed; ) {
+      entry = (const struct TRACE_StrEntry*)(strtab + off);
+      if (!entry->len || off + sizeof(*entry) + entry->len > hdr->strtabUsed)
+         break;
+      if (entry->id <= maxId && !entry->fmt[entry->len - 1])
+         fmts[entry->id] = entry->fmt;
+      off += (sizeof(*entry) + entry->len + 3) & ~3U;
+   }
+
+   printf("# %s[%u] %llu records written, %u kept\n", hdr->procName,
+         hdr->pid, (unsigned long long)hdr->written, hdr->recordCount);
+
+   written = hdr->written;
+   first = written > hdr->recordCount ? written - hdr->recordCount : 0;
+   for (pos = first; pos < written; pos++) {
+      rec = &records[pos & (hdr->recordCount - 1)];
+      // Skip slots that were overwritten or were mid-write
+      if (rec->seq != pos + 1)
+         continue;
+
+      ns = hdr->realBaseNs + ((int64_t)rec->ns - hdr->monoBaseNs);
+      secs = ns / 1000000000LL;
+      localtime_r(&secs, &tm);
+      strftime(tbuff, sizeof(tbuff), "%Y-%m-%d %H:%M:%S", &tm);
+      printf("%s.%09lld ", tbuff, (long long)(ns % 1000000000LL));
+
+      fmt = rec->fmtId <= maxId ? fmts[rec->fmtId] : NULL;
+      if (fmt)
+         print_record(fmt, rec);
+      else
+         printf("<unknown format %u>\n", rec->fmtId);
+   }
+
+   free(fmts);
+   return 0;
+}
@@ -0,0 +1,342 @@
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+#include "../../events.h"
+#include "../../proclib.h"
+#include "../../ipc.h"
+#include "../../cmd.h"
+#include "../../xdr.h"
+extern "C" {
+#include "../../cmd-pkt.h"
+}
+#include "gtest/gtest.h"
+
+namespace {
+
+#define FRAG_TEST_PROC "50310"
+#define FRAG_TEST_REF 77
+#define FRAG_TEST_CMD 0x1F0F0
+
+// Replies with the opaque struct it was sent
+static void echo_handler(struct ProcessData *proc, struct IPC_Command *cmd,
+      struct sockaddr_in *src, void *arg, int fd)
+{
+   IPC_response(proc, cmd, IPC_TYPES_OPAQUE_STRUCT, cmd->parameters.data, src);
+}
+
+static struct CMD_XDRCommandInfo echoCmd = {
+   FRAG_TEST_CMD, IPC_TYPES_OPAQUE_STRUCT, "frag-echo",
+   "Echoes its parameter", NULL, NULL, NULL, NULL
+};
+
+/**
+ * Fragmentation test fixture.  A raw UDP socket plays the remote peer so
+ * the tests can drop, reorder, and inspect individual datagrams.
+ */
+class TestIPCFrag : public ::testing::Test {
+
+   protected:
+
+      virtual void SetUp() {
+         struct sockaddr_in addr;
+         int size = 4 * 1024 * 1024;
+
+         proc = PROC_init(FRAG_TEST_PROC, WD_DISABLED);
+         ASSERT_TRUE(proc != NULL);
+         CMD_register_command(&echoCmd, 1);
+         CMD_set_xdr_cmd_handler(FRAG_TEST_CMD, &echo_handler, NULL);
+
+         memset(&dest, 0, sizeof(dest));
+         dest.sin_family = AF_INET;
+         dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+         dest.sin_port = htons(socket_get_addr_by_name(FRAG_TEST_PROC));
+
+         peer = socket(AF_INET, SOCK_DGRAM, 0);
+         ASSERT_GE(peer, 0);
+         setsockopt(peer, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+         memset(&addr, 0, sizeof(addr));
+         addr.sin_family = AF_INET;
+         addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+         ASSERT_EQ(0, bind(peer, (struct sockaddr*)&addr, sizeof(addr)));
+      }
+
+      virtual void TearDown() {
+         close(peer);
+         PROC_cleanup(proc);
+      }
+
+      // Runs the process' event loop for the given time
+      void run(int ms) {
+         EVT_sched_add(PROC_evt(proc), EVT_ms2tv(ms), &exit_loop, proc);
+         EVT_start_loop(PROC_evt(proc));
+      }
+
+      static int exit_loop(void *arg) {
+         EVT_exit_loop(PROC_evt((struct ProcessData*)arg));
+         return EVENT_REMOVE;
+      }
+
+      void send_cmd(struct IPC_Command *cmd) {
+         std::vector<char> buff(MAX_IP_PACKET_SIZE);
+         size_t len = 0;
+
+         ASSERT_GE(IPC_Command_encode(cmd, &buff[0], &len, buff.size(), NULL),
+               0);
+         ASSERT_EQ((ssize_t)len, sendto(peer, &buff[0], len, 0,
+                  (struct sockaddr*)&dest, sizeof(dest)));
+      }
+
+      void send_fragment(uint32_t cmdNum, uint32_t ref, const char *data,
+            uint32_t total, uint32_t offset) {
+         struct IPC_Fragment frag;
+         struct IPC_Command cmd;
+
+         frag.cmd = cmdNum;
+         frag.ipcref = ref;
+         frag.total_length = total;
+         frag.offset = offset;
+         frag.length = total - offset > IPC_FRAG_SIZE ?
+            IPC_FRAG_SIZE : total - offset;
+         frag.data = (char*)data + offset;
+
+         cmd.cmd = IPC_CMDS_FRAGMENT;
+         cmd.ipcref = ref;
+         cmd.parameters.type = IPC_TYPES_FRAGMENT;
+         cmd.parameters.data = &frag;
+         send_cmd(&cmd);
+      }
+
+      // Encodes an echo command carrying len bytes of a known pattern
+      std::vector<char> echo_req(size_t len) {
+         std::vector<char> data = pattern(len);
+         std::vector<char> buff(len + 64);
+         struct IPC_OpaqueStruct param;
+         struct IPC_Command cmd;
+         size_t used = 0;
+
+         param.length = len;
+         param.data = &data[0];
+         cmd.cmd = FRAG_TEST_CMD;
+         cmd.ipcref = FRAG_TEST_REF;
+         cmd.parameters.type = IPC_TYPES_OPAQUE_STRUCT;
+         cmd.parameters.data = &param;
+         EXPECT_GE(IPC_Command_encode(&cmd, &buff[0], &used, buff.size(),
+                  NULL), 0);
+         buff.resize(used);
+
+         return buff;
+      }
+
+      static std::vector<char> pattern(size_t len) {
+         std::vector<char> data(len);
+         size_t i;
+
+         for (i = 0; i < len; i++)
+            data[i] = i * 7;
+         return data;
+      }
+
+      // Returns the next datagram sent to the peer, or an empty vector
+      std::vector<char> recv_msg(void) {
+         std::vector<char> buff(MAX_IP_PACKET_SIZE);
+         ssize_t len;
+
+         len = recv(peer, &buff[0], buff.size(), MSG_DONTWAIT);
+         buff.resize(len > 0 ? len : 0);
+
+         return buff;
+      }
+
+      struct ProcessData *proc;
+      struct sockaddr_in dest;
+      int peer;
+};
+
+static uint32_t msg_cmd(std::vector<char> &msg)
+{
+   uint32_t cmd = 0;
+   size_t used;
+
+   XDR_decode_uint32(&msg[0], &cmd, &used, msg.size(), NULL);
+   return cmd;
+}
+
+// Size of a response's header and opaque struct length in front of the data
+#define ECHO_RESP_HDR 20
+
+struct RespData {
+   int called;
+   int timeout;
+   std::vector<char> resp;
+};
+
+void resp_cb(struct ProcessData *proc, int timeout, void *arg, char *buff,
+      size_t len, enum IPC_CB_TYPE type)
+{
+   struct RespData *data = (struct RespData *)arg;
+
+   data->called++;
+   data->timeout = timeout;
+   if (buff)
+      data->resp.assign(buff, buff + len);
+   EVT_exit_loop(PROC_evt(proc));
+}
+
+// Messages that fit in one datagram are never fragmented
+TEST_F(TestIPCFrag, SingleDatagram) {
+   std::vector<char> req = echo_req(40000), msg;
+
+   ASSERT_GT(req.size(), (size_t)IPC_FRAG_SIZE);
+   ASSERT_EQ((ssize_t)req.size(), sendto(peer, &req[0], req.size(), 0,
+            (struct sockaddr*)&dest, sizeof(dest)));
+   run(50);
+
+   msg = recv_msg();
+   ASSERT_EQ(ECHO_RESP_HDR + 40000u, msg.size());
+   EXPECT_EQ((uint32_t)IPC_CMDS_RESPONSE, msg_cmd(msg));
+   EXPECT_EQ(0u, recv_msg().size());
+}
+
+// Messages too large for one datagram are reassembled transparently
+TEST_F(TestIPCFrag, Reassembly) {
+   std::vector<char> data = pattern(100000);
+   struct IPC_OpaqueStruct param;
+   struct RespData result;
+
+   param.length = data.size();
+   param.data = &data[0];
+   result.called = result.timeout = 0;
+   ASSERT_GE(IPC_command_local(proc, FRAG_TEST_CMD, &param,
+            IPC_TYPES_OPAQUE_STRUCT, FRAG_TEST_PROC, &resp_cb, &result,
+            IPC_CB_TYPE_RAW, 2000), 0);
+   EVT_start_loop(PROC_evt(proc));
+
+   EXPECT_EQ(1, result.called);
+   EXPECT_EQ(0, result.timeout);
+   ASSERT_EQ(ECHO_RESP_HDR + data.size(), result.resp.size());
+   EXPECT_TRUE(std::equal(data.begin(), data.end(),
+            result.resp.begin() + ECHO_RESP_HDR));
+}
+
+// Missing fragments are requested by the receiver and resent by the sender
+TEST_F(TestIPCFrag, NackRetransmit) {
+   std::vector<char> req = echo_req(100000), data = pattern(100000);
+   std::vector<char> msg, resp;
+   std::vector<uint32_t> missing;
+   std::set<uint32_t> have;
+   struct IPC_Command cmd;
+   struct IPC_FragmentNack nack;
+   struct IPC_Fragment *frag;
+   size_t used;
+   int rounds, dropped = 0;
+   uint32_t i, total = 0;
+
+   // Hold back the first fragment and expect a request for it
+   for (i = IPC_FRAG_SIZE; i < req.size(); i += IPC_FRAG_SIZE)
+      send_fragment(FRAG_TEST_CMD, FRAG_TEST_REF, &req[0], req.size(), i);
+   run(IPC_FRAG_NACK_MS + 50);
+
+   msg = recv_msg();
+   ASSERT_GT(msg.size(), 0u);
+   ASSERT_GE(IPC_Command_decode(&msg[0], &cmd, &used, msg.size(), NULL), 0);
+   ASSERT_EQ((uint32_t)IPC_CMDS_FRAGMENT_NACK, cmd.cmd);
+   ASSERT_EQ((uint32_t)IPC_TYPES_FRAGMENT_NACK, cmd.parameters.type);
+   memcpy(&nack, cmd.parameters.data, sizeof(nack));
+   EXPECT_EQ((uint32_t)FRAG_TEST_REF, nack.ipcref);
+   ASSERT_EQ(1, nack.length);
+   EXPECT_EQ(0u, nack.offsets[0]);
+   XDR_free_union(&cmd.parameters);
+
+   // Completing the request produces a fragmented response
+   send_fragment(FRAG_TEST_CMD, FRAG_TEST_REF, &req[0], req.size(), 0);
+   for (rounds = 0; rounds < 10; rounds++) {
+      run(20);
+      while ((msg = recv_msg()).size()) {
+         ASSERT_GE(IPC_Command_decode(&msg[0], &cmd, &used, msg.size(),
+                  NULL), 0);
+         ASSERT_EQ((uint32_t)IPC_CMDS_FRAGMENT, cmd.cmd);
+         frag = (struct IPC_Fragment*)cmd.parameters.data;
+         EXPECT_EQ((uint32_t)IPC_CMDS_RESPONSE, frag->cmd);
+         EXPECT_EQ((uint32_t)FRAG_TEST_REF, frag->ipcref);
+         total = frag->total_length;
+         resp.resize(total);
+
+         // Drop the second fragment the first time it arrives
+         if (frag->offset == IPC_FRAG_SIZE && !dropped)
+            dropped = 1;
+         else if (!have.count(frag->offset)) {
+            memcpy(&resp[frag->offset], frag->data, frag->length);
+            have.insert(frag->offset);
+         }
+         XDR_free_union(&cmd.parameters);
+      }
+
+      ASSERT_GT(total, 0u);
+      missing.clear();
+      for (i = 0; i < total; i += IPC_FRAG_SIZE)
+         if (!have.count(i))
+            missing.push_back(i);
+      if (missing.empty())
+         break;
+
+      nack.cmd = IPC_CMDS_RESPONSE;
+      nack.ipcref = FRAG_TEST_REF;
+      nack.length = missing.size();
+      nack.offsets = &missing[0];
+      cmd.cmd = IPC_CMDS_FRAGMENT_NACK;
+      cmd.ipcref = FRAG_TEST_REF;
+      cmd.parameters.type = IPC_TYPES_FRAGMENT_NACK;
+      cmd.parameters.data = &nack;
+      send_cmd(&cmd);
+   }
+
+   EXPECT_EQ(1, dropped);
+   EXPECT_TRUE(missing.empty());
+   ASSERT_EQ(ECHO_RESP_HDR + data.size(), total);
+   EXPECT_EQ((uint32_t)IPC_CMDS_RESPONSE, msg_cmd(resp));
+   EXPECT_TRUE(std::equal(data.begin(), data.end(),
+            resp.begin() + ECHO_RESP_HDR));
+}
+
+// Partial messages can't commit more than IPC_FRAG_REASSEMBLY_MAX bytes
+TEST_F(TestIPCFrag, ReassemblyCap) {
+   uint32_t total = IPC_FRAG_REASSEMBLY_MAX / 3 + IPC_FRAG_SIZE;
+   std::vector<char> data(IPC_FRAG_SIZE, 0);
+   std::set<uint32_t> nacked;
+   std::vector<char> msg;
+   struct IPC_Command cmd;
+   size_t used;
+   uint32_t ref;
+
+   ASSERT_LE(total, (uint32_t)IPC_FRAG_MAX_MSG_SIZE);
+
+   // Only the first fragment of each message, so none can complete
+   for (ref = 1; ref <= 3; ref++)
+      send_fragment(IPC_CMDS_DATA_REQ, ref, &data[0], total, 0);
+   // Larger than any message that will be reassembled
+   send_fragment(IPC_CMDS_DATA_REQ, 4, &data[0],
+         IPC_FRAG_MAX_MSG_SIZE + IPC_FRAG_SIZE, 0);
+   run(IPC_FRAG_NACK_MS + 50);
+
+   while ((msg = recv_msg()).size()) {
+      ASSERT_GE(IPC_Command_decode(&msg[0], &cmd, &used, msg.size(), NULL),
+            0);
+      if (cmd.cmd == IPC_CMDS_FRAGMENT_NACK)
+         nacked.insert(((struct IPC_FragmentNack*)
+                  cmd.parameters.data)->ipcref);
+      XDR_free_union(&cmd.parameters);
+   }
+
+   EXPECT_EQ(1u, nacked.count(1));
+   EXPECT_EQ(1u, nacked.count(2));
+   EXPECT_EQ(0u, nacked.count(3));
+   EXPECT_EQ(0u, nacked.count(4));
+}
+
+}
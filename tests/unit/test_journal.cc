@@ -0,0 +1,304 @@
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "../../events.h"
+#include "../../proclib.h"
+#include "gtest/gtest.h"
+
+namespace {
+
+#define JRNL_TEST_PROC "50311"
+
+/**
+ * Journaled critical state fixture.  Both critical state directories are
+ * redirected to fresh temporary directories for each test.
+ */
+class TestJournal : public ::testing::Test {
+
+   protected:
+
+      virtual void SetUp() {
+         int i;
+
+         for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+            char tmpl[] = "/tmp/journal-test.XXXXXX";
+            ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+            dirs[i] = tmpl;
+         }
+         proc = NULL;
+         journal = NULL;
+         open();
+      }
+
+      virtual void TearDown() {
+         int i;
+
+         close();
+         for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++)
+            remove_files(i, "");
+         for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++)
+            rmdir(dirs[i].c_str());
+      }
+
+      void open() {
+         struct CSState *cs;
+         int i;
+
+         proc = PROC_init(JRNL_TEST_PROC, WD_DISABLED);
+         ASSERT_TRUE(proc != NULL);
+         cs = &proc->criticalState;
+         for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+            free(cs->files[i].directory);
+            cs->files[i].directory = strdup(dirs[i].c_str());
+         }
+
+         journal = PROC_journal_open(proc, "db");
+         ASSERT_TRUE(journal != NULL);
+      }
+
+      void close() {
+         PROC_journal_close(journal);
+         journal = NULL;
+         PROC_cleanup(proc);
+         proc = NULL;
+      }
+
+      void reopen() {
+         close();
+         open();
+      }
+
+      // Lets queued thread jobs, such as compactions, finish
+      void run(int ms) {
+         EVT_sched_add(PROC_evt(proc), EVT_ms2tv(ms), &exit_loop, proc);
+         EVT_start_loop(PROC_evt(proc));
+      }
+
+      static int exit_loop(void *arg) {
+         EVT_exit_loop(PROC_evt((struct ProcessData*)arg));
+         return EVENT_REMOVE;
+      }
+
+      // Files in a critical state directory whose name contains match
+      std::vector<std::string> files(int i, const char *match) {
+         std::vector<std::string> res;
+         struct dirent *ent;
+         DIR *dir;
+
+         dir = opendir(dirs[i].c_str());
+         if (!dir)
+            return res;
+         while ((ent = readdir(dir)))
+            if (ent->d_name[0] != '.' && strstr(ent->d_name, match))
+               res.push_back(dirs[i] + "/" + ent->d_name);
+         closedir(dir);
+
+         return res;
+      }
+
+      void remove_files(int i, const char *match) {
+         std::vector<std::string> names = files(i, match);
+         size_t n;
+
+         for (n = 0; n < names.size(); n++)
+            if (unlink(names[n].c_str()) < 0)
+               rmdir(names[n].c_str());
+      }
+
+      void chop_logs(int i, off_t bytes) {
+         std::vector<std::string> logs = files(i, ".log.");
+         struct stat st;
+         size_t n;
+
+         for (n = 0; n < logs.size(); n++) {
+            ASSERT_EQ(0, stat(logs[n].c_str(), &st));
+            ASSERT_EQ(0, truncate(logs[n].c_str(), st.st_size - bytes));
+         }
+      }
+
+      std::string get(const char *key) {
+         const char *val;
+         uint32_t len;
+
+         val = (const char*)PROC_journal_get(journal, key, &len);
+         if (!val)
+            return "<missing>";
+         return std::string(val, len);
+      }
+
+      void put(const char *key, const char *val) {
+         ASSERT_EQ(0, PROC_journal_put(journal, key, val, strlen(val)));
+      }
+
+      struct ProcessData *proc;
+      struct CSJournal *journal;
+      std::string dirs[CRITICAL_STATE_NUM_FILES];
+};
+
+// A torn final record loses only that record
+TEST_F(TestJournal, TornTail) {
+   put("a", "one");
+   put("b", "two");
+   put("c", "three");
+
+   // Damaged in one directory only, the other copy still has it
+   close();
+   chop_logs(0, 2);
+   open();
+   EXPECT_EQ("one", get("a"));
+   EXPECT_EQ("two", get("b"));
+   EXPECT_EQ("three", get("c"));
+
+   put("d", "four");
+   close();
+   for (int i = 0; i < CRITICAL_STATE_NUM_FILES; i++)
+      chop_logs(i, 1);
+   open();
+   EXPECT_EQ("one", get("a"));
+   EXPECT_EQ("three", get("c"));
+   EXPECT_EQ("<missing>", get("d"));
+
+   // The store keeps working after recovering from the damage
+   put("d", "again");
+   reopen();
+   EXPECT_EQ("again", get("d"));
+}
+
+// Deleted keys stay deleted once compaction drops their records
+TEST_F(TestJournal, DeleteAndCompact) {
+   put("a", "keep");
+   put("b", "drop");
+   ASSERT_EQ(0, PROC_journal_delete(journal, "b"));
+   EXPECT_EQ("<missing>", get("b"));
+
+   ASSERT_EQ(0, PROC_journal_compact(journal));
+   run(100);
+   for (int i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+      EXPECT_EQ(1u, files(i, ".snap").size());
+      EXPECT_EQ(1u, files(i, ".log.").size());
+   }
+
+   reopen();
+   EXPECT_EQ("keep", get("a"));
+   EXPECT_EQ("<missing>", get("b"));
+   put("b", "back");
+   reopen();
+   EXPECT_EQ("back", get("b"));
+}
+
+// Both directories are merged, and a directory that misses a compaction
+//  keeps the logs it still depends on
+TEST_F(TestJournal, TwoDirectoryMerge) {
+   std::vector<std::string> logs;
+   unsigned long gen;
+   char blocker[PATH_MAX];
+
+   put("k", "old");
+   put("other", "x");
+
+   // Put a directory where the second copy's next log would be created
+   logs = files(1, ".log.");
+   ASSERT_EQ(1u, logs.size());
+   gen = strtoul(strrchr(logs[0].c_str(), '.') + 1, NULL, 10);
+   snprintf(blocker, sizeof(blocker), "%.*s%lu",
+         (int)(strrchr(logs[0].c_str(), '.') + 1 - logs[0].c_str()),
+         logs[0].c_str(), gen + 1);
+   ASSERT_EQ(0, mkdir(blocker, 0755));
+
+   ASSERT_EQ(0, PROC_journal_compact(journal));
+   run(100);
+   EXPECT_EQ(0, access(logs[0].c_str(), F_OK));
+   // Only the first copy can take it
+   EXPECT_EQ(-5, PROC_journal_put(journal, "k", "new", 3));
+   close();
+   rmdir(blocker);
+
+   // The second copy alone still has everything it saw
+   std::string first = dirs[0];
+   char tmpl[] = "/tmp/journal-test.XXXXXX";
+   ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+   dirs[0] = tmpl;
+   open();
+   EXPECT_EQ("old", get("k"));
+   EXPECT_EQ("x", get("other"));
+   close();
+   remove_files(0, "");
+   rmdir(dirs[0].c_str());
+   dirs[0] = first;
+
+   // Merged, the newer record from the first copy wins
+   open();
+   EXPECT_EQ("new", get("k"));
+   EXPECT_EQ("x", get("other"));
+}
+
+static int block_worker(void *arg)
+{
+   usleep(200000);
+   return 0;
+}
+
+// A compaction still queued when the process is cleaned up is released
+//  without touching the logs
+TEST_F(TestJournal, QueuedCompactionAtCleanup) {
+   ASSERT_EQ(0, PROC_thread_pool_config(proc, 1, 0));
+   put("a", "value");
+   ASSERT_EQ(0, PROC_thread_job_submit(proc, &block_worker, NULL, NULL, NULL,
+            PROC_JOB_PRIO_HIGH, NULL));
+   ASSERT_EQ(0, PROC_journal_compact(journal));
+   close();
+
+   open();
+   EXPECT_EQ("value", get("a"));
+}
+
+
+// A record cut short by a failed write is removed, so later records in the
+//  same log still load
+TEST_F(TestJournal, ShortWrite) {
+   std::vector<std::string> logs;
+   struct rlimit old, lim;
+   struct stat st;
+   off_t size = 0;
+   std::string big(200, 'x');
+   int i;
+
+   put("a", "one");
+   for (i = 0; i < CRITICAL_STATE_NUM_FILES; i++) {
+      logs = files(i, ".log.");
+      ASSERT_EQ(1u, logs.size());
+      ASSERT_EQ(0, stat(logs[0].c_str(), &st));
+      if (st.st_size > size)
+         size = st.st_size;
+   }
+
+   // Leave room for only part of the next record
+   signal(SIGXFSZ, SIG_IGN);
+   ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &old));
+   lim = old;
+   lim.rlim_cur = size + 20;
+   ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &lim));
+   EXPECT_GT(0, PROC_journal_put(journal, "b", big.c_str(), big.size()));
+   ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &old));
+   signal(SIGXFSZ, SIG_DFL);
+   EXPECT_EQ("<missing>", get("b"));
+
+   put("c", "three");
+   close();
+
+   // The first copy alone has everything
+   remove_files(1, "");
+   open();
+   EXPECT_EQ("one", get("a"));
+   EXPECT_EQ("<missing>", get("b"));
+   EXPECT_EQ("three", get("c"));
+}
+
+}
@@ -1,5 +1,10 @@
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "../../events.h"
 #include "../../eventTimer.h"
 #include "../../proclib.h"
@@ -21,10 +26,10 @@ class TestVirtClk : public ::testing::Test {
          state = ET_virt_init(&t1);
          ASSERT_TRUE(state != NULL);
 
-         ET_virt_get_time(state, &t2);
+         state->virt_get_time(state, &t2);
          EXPECT_EQ(t1.tv_sec, t2.tv_sec);
          EXPECT_EQ(t1.tv_usec, t2.tv_usec);
-         EXPECT_EQ(VIRT_CLK_ACTIVE, ET_virt_get_pause(state));
+         EXPECT_EQ(VIRT_CLK_ACTIVE, state->virt_get_pause(state));
       }
 
       virtual void TearDown() {
@@ -39,26 +44,26 @@ TEST_F(TestVirtClk, Set) {
    struct timeval t1, t2;
 
    t1 = EVT_ms2tv(20000);
-   ET_virt_set_time(state, &t1);
-   ET_virt_get_time(state, &t2);
+   state->virt_set_time(state, &t1);
+   state->virt_get_time(state, &t2);
    EXPECT_EQ(t1.tv_sec, t2.tv_sec);
    EXPECT_EQ(t1.tv_usec, t2.tv_usec);
    
    t1 = EVT_ms2tv(-200);
-   ET_virt_set_time(state, &t1);
-   ET_virt_get_time(state, &t2);
+   state->virt_set_time(state, &t1);
+   state->virt_get_time(state, &t2);
    EXPECT_EQ(t1.tv_sec, t2.tv_sec);
    EXPECT_EQ(t1.tv_usec, t2.tv_usec);
    
    t1 = EVT_ms2tv(130);
-   ET_virt_set_time(state, &t1);
-   ET_virt_get_time(state, &t2);
+   state->virt_set_time(state, &t1);
+   state->virt_get_time(state, &t2);
    EXPECT_EQ(t1.tv_sec, t2.tv_sec);
    EXPECT_EQ(t1.tv_usec, t2.tv_usec);
    
    t1 = EVT_ms2tv(0);
-   ET_virt_set_time(state, &t1);
-   ET_virt_get_time(state, &t2);
+   state->virt_set_time(state, &t1);
+   state->virt_get_time(state, &t2);
    EXPECT_EQ(t1.tv_sec, t2.tv_sec);
    EXPECT_EQ(t1.tv_usec, t2.tv_usec);
 }
@@ -67,26 +72,26 @@ TEST_F(TestVirtClk, Set) {
 TEST_F(TestVirtClk, Increment) {
    struct timeval t1, t2, t3;
 
-   ET_virt_get_time(state, &t1);
+   state->virt_get_time(state, &t1);
 
    t3 = EVT_ms2tv(33213);
    timeradd(&t1, &t3, &t1);
-   ET_virt_inc_time(state, &t3);
-   ET_virt_get_time(state, &t2);
+   state->virt_inc_time(state, &t3);
+   state->virt_get_time(state, &t2);
    EXPECT_EQ(t1.tv_sec, t2.tv_sec);
    EXPECT_EQ(t1.tv_usec, t2.tv_usec);
    
    t3 = EVT_ms2tv(200);
    timeradd(&t1, &t3, &t1);
-   ET_virt_inc_time(state, &t3);
-   ET_virt_get_time(state, &t2);
+   state->virt_inc_time(state, &t3);
+   state->virt_get_time(state, &t2);
    EXPECT_EQ(t1.tv_sec, t2.tv_sec);
    EXPECT_EQ(t1.tv_usec, t2.tv_usec);
    
    t3 = EVT_ms2tv(40000);
    timeradd(&t1, &t3, &t1);
-   ET_virt_inc_time(state, &t3);
-   ET_virt_get_time(state, &t2);
+   state->virt_inc_time(state, &t3);
+   state->virt_get_time(state, &t2);
    EXPECT_EQ(t1.tv_sec, t2.tv_sec);
    EXPECT_EQ(t1.tv_usec, t2.tv_usec);   
 }
@@ -94,11 +99,11 @@ TEST_F(TestVirtClk, Increment) {
 // Test pause function
 TEST_F(TestVirtClk, Pause) {
 
-   ET_virt_set_pause(state, VIRT_CLK_PAUSED);
-   EXPECT_EQ(VIRT_CLK_PAUSED, ET_virt_get_pause(state));
+   state->virt_set_pause(state, VIRT_CLK_PAUSED);
+   EXPECT_EQ(VIRT_CLK_PAUSED, state->virt_get_pause(state));
    
-   ET_virt_set_pause(state, VIRT_CLK_ACTIVE);
-   EXPECT_EQ(VIRT_CLK_ACTIVE, ET_virt_get_pause(state));
+   state->virt_set_pause(state, VIRT_CLK_ACTIVE);
+   EXPECT_EQ(VIRT_CLK_ACTIVE, state->virt_get_pause(state));
 }
 
 /**
@@ -209,7 +214,7 @@ int start_pause(void *arg) {
    struct EventState *evt = PROC_evt(proc);
    struct itimerval itv;
 
-   ET_virt_set_pause(EVT_get_evt_timer(evt), VIRT_CLK_PAUSED);
+   EVT_get_evt_timer(evt)->virt_set_pause(EVT_get_evt_timer(evt), VIRT_CLK_PAUSED);
 
    // Create timer to trigger end of pause after 1 second
    memset(&itv, 0, sizeof(struct itimerval));
@@ -256,5 +261,216 @@ TEST_F(TestVirtClkEvt, MultipleEventsWithPause) {
    EXPECT_EQ(t.tv_usec, 0);
 }
 
+#define GVIRT_MAX_ENTRIES 512
+#define GVIRT_MAX_PROCS 4
+
+// Event times recorded by the processes sharing a global virtual clock
+struct GvirtLog {
+   int count;
+   struct {
+      int64_t when;
+      int who;
+   } ent[GVIRT_MAX_ENTRIES];
+   int ticks[GVIRT_MAX_PROCS];
+   int64_t joined[GVIRT_MAX_PROCS];
+};
+
+/**
+ * Global virtual clock fixture.  Participants are forked processes that
+ * record the virtual time of each of their events in shared memory.
+ */
+class TestGlobalVirtClk : public ::testing::Test {
+
+   protected:
+
+      virtual void SetUp() {
+         char tmpl[] = "/tmp/gvirt-test.XXXXXX";
+         int fd;
+
+         fd = mkstemp(tmpl);
+         ASSERT_GE(fd, 0);
+         close(fd);
+         unlink(tmpl);
+         path = tmpl;
+
+         log = (struct GvirtLog*)mmap(NULL, sizeof(*log),
+               PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+         ASSERT_TRUE(log != MAP_FAILED);
+         memset(log, 0, sizeof(*log));
+      }
+
+      virtual void TearDown() {
+         munmap(log, sizeof(*log));
+         unlink(path.c_str());
+      }
+
+      struct Participant {
+         struct ProcessData *proc;
+         struct GvirtLog *log;
+         int who, ticks, delayUs;
+      };
+
+      static int64_t now_us(struct ProcessData *proc) {
+         struct timeval t;
+
+         EVT_get_gmt_time(PROC_evt(proc), &t);
+         return (int64_t)t.tv_sec * 1000000 + t.tv_usec;
+      }
+
+      static int joined(void *arg) {
+         struct Participant *p = (struct Participant*)arg;
+
+         __atomic_store_n(&p->log->joined[p->who], now_us(p->proc),
+               __ATOMIC_SEQ_CST);
+         return EVENT_REMOVE;
+      }
+
+      static int tick(void *arg) {
+         struct Participant *p = (struct Participant*)arg;
+         int slot;
+
+         slot = __atomic_fetch_add(&p->log->count, 1, __ATOMIC_SEQ_CST);
+         if (slot < GVIRT_MAX_ENTRIES) {
+            p->log->ent[slot].when = now_us(p->proc);
+            p->log->ent[slot].who = p->who;
+         }
+         // Keep the clock moving slowly enough for the others to join
+         usleep(p->delayUs);
+
+         if (__atomic_add_fetch(&p->log->ticks[p->who], 1, __ATOMIC_SEQ_CST)
+               >= p->ticks) {
+            EVT_exit_loop(PROC_evt(p->proc));
+            return EVENT_REMOVE;
+         }
+         return EVENT_KEEP;
+      }
+
+      // Forks a process that joins the clock once the gate pipe is closed,
+      //  then runs ticks events periodMs of virtual time apart
+      pid_t participant(const int *gate, int who, int periodMs, int ticks,
+            int delayUs) {
+         struct Participant p;
+         char c;
+         pid_t pid;
+
+         pid = fork();
+         if (pid != 0)
+            return pid;
+
+         if (gate) {
+            close(gate[1]);
+            while (read(gate[0], &c, 1) > 0)
+               ;
+            close(gate[0]);
+         }
+
+         p.proc = PROC_init(NULL, WD_DISABLED);
+         if (!p.proc || EVT_enable_gvirt(PROC_evt(p.proc), path.c_str(),
+                  VIRT_CLK_ACTIVE) < 0)
+            _exit(2);
+         p.log = log;
+         p.who = who;
+         p.ticks = ticks;
+         p.delayUs = delayUs;
+
+         EVT_sched_add(PROC_evt(p.proc), EVT_ms2tv(0), &joined, &p);
+         EVT_sched_add(PROC_evt(p.proc), EVT_ms2tv(periodMs), &tick, &p);
+         EVT_start_loop(PROC_evt(p.proc));
+         PROC_cleanup(p.proc);
+         _exit(0);
+      }
+
+      // Waits up to ms for a process to exit, returning its status or -1
+      static int reap(pid_t pid, int ms) {
+         int status, i;
+
+         for (i = 0; i < ms; i++) {
+            if (waitpid(pid, &status, WNOHANG) == pid)
+               return status;
+            usleep(1000);
+         }
+         kill(pid, SIGKILL);
+         waitpid(pid, &status, 0);
+         return -1;
+      }
+
+      std::string path;
+      struct GvirtLog *log;
+};
+
+// Events from every process run in global time order, each at exactly the
+//  virtual time it was scheduled for
+TEST_F(TestGlobalVirtClk, OrderedWakeups) {
+   const int periods[3] = { 30, 70, 110 };
+   const int ticks = 25;
+   pid_t pids[3];
+   int gate[2], i, n;
+   int64_t last[3];
+
+   ASSERT_EQ(0, pipe(gate));
+   for (i = 0; i < 3; i++) {
+      pids[i] = participant(gate, i, periods[i], ticks, 1000);
+      ASSERT_GT(pids[i], 0);
+   }
+   close(gate[0]);
+   close(gate[1]);
+
+   for (i = 0; i < 3; i++)
+      EXPECT_EQ(0, reap(pids[i], 20000));
+
+   ASSERT_EQ(3 * ticks, log->count);
+   for (i = 0; i < 3; i++) {
+      EXPECT_EQ(ticks, log->ticks[i]);
+      last[i] = log->joined[i];
+   }
+
+   for (n = 0; n < log->count; n++) {
+      i = log->ent[n].who;
+      ASSERT_TRUE(i >= 0 && i < 3);
+      if (n > 0)
+         EXPECT_LE(log->ent[n - 1].when, log->ent[n].when) << "entry " << n;
+      EXPECT_EQ(periods[i] * 1000, log->ent[n].when - last[i])
+         << "process " << i << " entry " << n;
+      last[i] = log->ent[n].when;
+   }
 }
 
+// A participant killed while waiting for its turn is removed, and the clock
+//  moves on for the others
+TEST_F(TestGlobalVirtClk, ReapKilledParticipant) {
+   const int ticks = 30;
+   int64_t due;
+   pid_t victim, survivor;
+   int i, start;
+
+   survivor = participant(NULL, 0, 100, ticks, 20000);
+   ASSERT_GT(survivor, 0);
+   for (i = 0; i < 5000 && !__atomic_load_n(&log->ticks[0], __ATOMIC_SEQ_CST);
+         i++)
+      usleep(1000);
+   ASSERT_GT(log->ticks[0], 0);
+
+   // Waits a virtual second for its only tick
+   victim = participant(NULL, 1, 1000, 1, 0);
+   ASSERT_GT(victim, 0);
+   for (i = 0; i < 5000 && !__atomic_load_n(&log->joined[1], __ATOMIC_SEQ_CST);
+         i++)
+      usleep(1000);
+   ASSERT_NE(0, log->joined[1]);
+   due = log->joined[1] + 1000000;
+
+   // Once the survivor takes a turn, the victim has gone back to waiting
+   start = __atomic_load_n(&log->ticks[0], __ATOMIC_SEQ_CST);
+   while (__atomic_load_n(&log->ticks[0], __ATOMIC_SEQ_CST) < start + 2)
+      usleep(1000);
+   kill(victim, SIGKILL);
+   EXPECT_EQ(SIGKILL, WTERMSIG(reap(victim, 5000)));
+   ASSERT_LT(log->ent[log->count - 1].when, due);
+
+   EXPECT_EQ(0, reap(survivor, 20000));
+   EXPECT_EQ(ticks, log->ticks[0]);
+   EXPECT_EQ(0, log->ticks[1]);
+   EXPECT_GT(log->ent[log->count - 1].when, due);
+}
+
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * @file trace.c Binary trace log source file.
+ */
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include "trace.h"
+#include "debug.h"
+
+#define TRACE_ALIGN(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+// How an argument is pulled from the argument list and widened
+enum TraceArgType {
+   TRACE_T_INT, TRACE_T_UINT, TRACE_T_SCHAR, TRACE_T_UCHAR, TRACE_T_SHORT,
+   TRACE_T_USHORT, TRACE_T_LONG, TRACE_T_ULONG, TRACE_T_LLONG,
+   TRACE_T_ULLONG, TRACE_T_SSIZE, TRACE_T_SIZE, TRACE_T_INTMAX,
+   TRACE_T_UINTMAX, TRACE_T_PTRDIFF, TRACE_T_PTR, TRACE_T_DOUBLE,
+   TRACE_T_LDOUBLE,
+};
+
+struct TraceLog {
+   struct TRACE_FileHeader *hdr;
+   char *strtab;
+   struct TRACE_Record *records;
+   uint64_t mask;
+   size_t mapLen;
+   uint32_t gen;
+};
+
+int TRACE_enabled = 0;
+static struct TraceLog *gTrace = NULL;
+static int gTraceWriters = 0;
+static uint32_t gTraceGen = 0;
+static int gTraceAtforkRegistered = 0;
+static pthread_mutex_t gTraceLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Maps an integer conversion and its length modifier to an argument type
+static int trace_int_type(const char *len, int isSigned)
+{
+   if (!strcmp(len, "hh"))
+      return isSigned ? TRACE_T_SCHAR : TRACE_T_UCHAR;
+   if (!strcmp(len, "h"))
+      return isSigned ? TRACE_T_SHORT : TRACE_T_USHORT;
+   if (!strcmp(len, "l"))
+      return isSigned ? TRACE_T_LONG : TRACE_T_ULONG;
+   if (!strcmp(len, "ll") || !strcmp(len, "q") || !strcmp(len, "L"))
+      return isSigned ? TRACE_T_LLONG : TRACE_T_ULLONG;
+   if (!strcmp(len, "j"))
+      return isSigned ? TRACE_T_INTMAX : TRACE_T_UINTMAX;
+   if (!strcmp(len, "z") || !strcmp(len, "Z"))
+      return isSigned ? TRACE_T_SSIZE : TRACE_T_SIZE;
+   if (!strcmp(len, "t"))
+      return TRACE_T_PTRDIFF;
+   return isSigned ? TRACE_T_INT : TRACE_T_UINT;
+}
+
+// Works out the argument types a format string consumes.  Parsing stops
+//  at the first conversion it does not understand.
+static void trace_parse_site(struct TRACE_Site *site)
+{
+   const char *p = site->fmt;
+   char len[3];
+   int l, n = 0;
+
+#define TRACE_ADD_ARG(t) do { if (n < TRACE_MAX_ARGS) site->types[n] = (t); \
+                              n++; } while(0)
+
+   while (*p) {
+      if (*p++ != '%')
+         continue;
+
+      while (*p && strchr("-+ #0'I", *p))
+         p++;
+      if (*p == '*') {
+         TRACE_ADD_ARG(TRACE_T_INT);
+         p++;
+      }
+      else
+         while (*p >= '0' && *p <= '9')
+            p++;
+      if (*p == '.') {
+         p++;
+         if (*p == '*') {
+            TRACE_ADD_ARG(TRACE_T_INT);
+            p++;
+         }
+         else
+            while (*p >= '0' && *p <= '9')
+               p++;
+      }
+      for (l = 0; *p && l < 2 && strchr("hlqLjzZt", *p); )
+         len[l++] = *p++;
+      len[l] = 0;
+
+      switch (*p) {
+         case 'd': case 'i':
+            TRACE_ADD_ARG(trace_int_type(len, 1));
+            break;
+         case 'o': case 'u': case 'x': case 'X':
+            TRACE_ADD_ARG(trace_int_type(len, 0));
+            break;
+         case 'c':
+            TRACE_ADD_ARG(TRACE_T_INT);
+            break;
+         case 'e': case 'E': case 'f': case 'F':
+         case 'g': case 'G': case 'a': case 'A':
+            TRACE_ADD_ARG(strcmp(len, "L") ? TRACE_T_DOUBLE : TRACE_T_LDOUBLE);
+            break;
+         case 's': case 'p': case 'n':
+            TRACE_ADD_ARG(TRACE_T_PTR);
+            break;
+         case '%': case 'm':
+            break;
+         default:
+            p = "";
+            continue;
+      }
+      p++;
+   }
+#undef TRACE_ADD_ARG
+
+   site->nargs = n < TRACE_MAX_ARGS ? n : TRACE_MAX_ARGS;
+}
+
+// Assigns the site a format id in the current trace file
+static int trace_register(struct TraceLog *log, struct TRACE_Site *site)
+{
+   struct TRACE_StrEntry *entry;
+   size_t len, size;
+   int res = 0;
+
+   pthread_mutex_lock(&gTraceLock);
+   if (__atomic_load_n(&site->gen, __ATOMIC_ACQUIRE) == log->gen)
+      goto out;
+
+   len = strlen(site->fmt) + 1;
+   size = TRACE_ALIGN(sizeof(*entry) + len, 4);
+   if (len > UINT16_MAX ||
+         log->hdr->strtabUsed + size > log->hdr->strtabSize) {
+      res = -1;
+      goto out;
+   }
+
+   trace_parse_site(site);
+   entry = (struct TRACE_StrEntry*)(log->strtab + log->hdr->strtabUsed);
+   entry->id = log->hdr->nextFmtId++;
+   entry->len = len;
+   entry->reserved = 0;
+   memcpy(entry->fmt, site->fmt, len);
+   __atomic_store_n(&log->hdr->strtabUsed, log->hdr->strtabUsed + size,
+         __ATOMIC_RELEASE);
+
+   site->id = entry->id;
+   __atomic_store_n(&site->gen, log->gen, __ATOMIC_RELEASE);
+
+out:
+   pthread_mutex_unlock(&gTraceLock);
+   return res;
+}
+
+void TRACE_record(struct TRACE_Site *site, ...)
+{
+   struct TraceLog *log;
+   struct TRACE_Record *rec;
+   struct timespec now;
+   uint64_t pos;
+   double dval;
+   va_list ap;
+   int i;
+
+   __atomic_add_fetch(&gTraceWriters, 1, __ATOMIC_ACQUIRE);
+   log = __atomic_load_n(&gTrace, __ATOMIC_ACQUIRE);
+   if (!log)
+      goto out;
+   if (__atomic_load_n(&site->gen, __ATOMIC_ACQUIRE) != log->gen &&
+         trace_register(log, site) < 0)
+      goto out;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   pos = __atomic_fetch_add(&log->hdr->written, 1, __ATOMIC_RELAXED);
+   rec = &log->records[pos & log->mask];
+   __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+
+   rec->ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+   rec->fmtId = site->id;
+   rec->nargs = site->nargs;
+
+   va_start(ap, site);
+   for (i = 0; i < site->nargs; i++) {
+      switch (site->types[i]) {
+         case TRACE_T_INT:
+            rec->args[i] = (int64_t)va_arg(ap, int);
+            break;
+         case TRACE_T_UINT:
+            rec->args[i] = va_arg(ap, unsigned int);
+            break;
+         case TRACE_T_SCHAR:
+            rec->args[i] = (int64_t)(signed char)va_arg(ap, int);
+            break;
+         case TRACE_T_UCHAR:
+            rec->args[i] = (unsigned char)va_arg(ap, unsigned int);
+            break;
+         case TRACE_T_SHORT:
+            rec->args[i] = (int64_t)(short)va_arg(ap, int);
+            break;
+         case TRACE_T_USHORT:
+            rec->args[i] = (unsigned short)va_arg(ap, unsigned int);
+            break;
+         case TRACE_T_LONG:
+            rec->args[i] = (int64_t)va_arg(ap, long);
+            break;
+         case TRACE_T_ULONG:
+            rec->args[i] = va_arg(ap, unsigned long);
+            break;
+         case TRACE_T_LLONG:
+            rec->args[i] = (int64_t)va_arg(ap, long long);
+            break;
+         case TRACE_T_ULLONG:
+            rec->args[i] = va_arg(ap, unsigned long long);
+            break;
+         case TRACE_T_SSIZE:
+            rec->args[i] = (int64_t)va_arg(ap, ssize_t);
+            break;
+         case TRACE_T_SIZE:
+            rec->args[i] = va_arg(ap, size_t);
+            break;
+         case TRACE_T_INTMAX:
+            rec->args[i] = (int64_t)va_arg(ap, intmax_t);
+            break;
+         case TRACE_T_UINTMAX:
+            rec->args[i] = va_arg(ap, uintmax_t);
+            break;
+         case TRACE_T_PTRDIFF:
+            rec->args[i] = (int64_t)va_arg(ap, ptrdiff_t);
+            break;
+         case TRACE_T_PTR:
+            rec->args[i] = (uintptr_t)va_arg(ap, void*);
+            break;
+         case TRACE_T_DOUBLE:
+            dval = va_arg(ap, double);
+            memcpy(&rec->args[i], &dval, sizeof(dval));
+            break;
+         case TRACE_T_LDOUBLE:
+            dval = va_arg(ap, long double);
+            memcpy(&rec->args[i], &dval, sizeof(dval));
+            break;
+      }
+   }
+   va_end(ap);
+
+   __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+
+out:
+   __atomic_sub_fetch(&gTraceWriters, 1, __ATOMIC_RELEASE);
+}
+
+// A forked child must not write into its parent's trace file
+static void trace_atfork_child(void)
+{
+   TRACE_enabled = 0;
+   gTrace = NULL;
+   gTraceWriters = 0;
+}
+
+int TRACE_open(const char *path, uint32_t records, const char *procName)
+{
+   struct TraceLog *log;
+   struct TRACE_FileHeader *hdr;
+   struct timespec mono, real;
+   size_t hdrLen, count = 1;
+   int fd;
+
+   if (!path)
+      return -1;
+   TRACE_close();
+
+   if (!records)
+      records = TRACE_DEFAULT_RECORDS;
+   while (count < records)
+      count <<= 1;
+
+   log = (struct TraceLog*)calloc(1, sizeof(*log));
+   if (!log)
+      return -1;
+
+   hdrLen = TRACE_ALIGN(sizeof(*hdr), 64);
+   log->mapLen = hdrLen + TRACE_STRTAB_SIZE + count * sizeof(struct TRACE_Record);
+
+   fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (fd < 0) {
+      ERR_REPORT(DBG_LEVEL_WARN, "Failed to open trace file %s", path);
+      free(log);
+      return -1;
+   }
+   if (ftruncate(fd, log->mapLen) < 0) {
+      ERR_REPORT(DBG_LEVEL_WARN, "Failed to size trace file %s", path);
+      close(fd);
+      free(log);
+      return -1;
+   }
+
+   hdr = (struct TRACE_FileHeader*)mmap(NULL, log->mapLen,
+         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (hdr == MAP_FAILED) {
+      ERR_REPORT(DBG_LEVEL_WARN, "Failed to map trace file %s", path);
+      free(log);
+      return -1;
+   }
+
+   memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+   hdr->version = TRACE_VERSION;
+   hdr->headerSize = hdrLen;
+   hdr->recordSize = sizeof(struct TRACE_Record);
+   hdr->recordCount = count;
+   hdr->strtabSize = TRACE_STRTAB_SIZE;
+   hdr->strtabUsed = 0;
+   hdr->nextFmtId = 1;
+   hdr->pid = getpid();
+   hdr->written = 0;
+   clock_gettime(CLOCK_MONOTONIC, &mono);
+   clock_gettime(CLOCK_REALTIME, &real);
+   hdr->monoBaseNs = (int64_t)mono.tv_sec * 1000000000LL + mono.tv_nsec;
+   hdr->realBaseNs = (int64_t)real.tv_sec * 1000000000LL + real.tv_nsec;
+   if (procName) {
+      strncpy(hdr->procName, procName, sizeof(hdr->procName));
+      hdr->procName[sizeof(hdr->procName) - 1] = 0;
+   }
+
+   log->hdr = hdr;
+   log->strtab = (char*)hdr + hdrLen;
+   log->records = (struct TRACE_Record*)(log->strtab + TRACE_STRTAB_SIZE);
+   log->mask = count - 1;
+
+   pthread_mutex_lock(&gTraceLock);
+   // Generation 0 is what unregistered sites start with
+   if (++gTraceGen == 0)
+      gTraceGen = 1;
+   log->gen = gTraceGen;
+   pthread_mutex_unlock(&gTraceLock);
+
+   if (!gTraceAtforkRegistered) {
+      pthread_atfork(NULL, NULL, &trace_atfork_child);
+      gTraceAtforkRegistered = 1;
+   }
+
+   __atomic_store_n(&gTrace, log, __ATOMIC_RELEASE);
+   TRACE_enabled = 1;
+
+   return 0;
+}
+
+void TRACE_close(void)
+{
+   struct TraceLog *log;
+
+   TRACE_enabled = 0;
+   log = __atomic_exchange_n(&gTrace, NULL, __ATOMIC_ACQ_REL);
+   if (!log)
+      return;
+
+   // Let any record in progress finish before unmapping
+   while (__atomic_load_n(&gTraceWriters, __ATOMIC_ACQUIRE))
+      sched_yield();
+
+   msync(log->hdr, log->mapLen, MS_ASYNC);
+   munmap(log->hdr, log->mapLen);
+   free(log);
+}
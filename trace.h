@@ -0,0 +1,151 @@
+/*
+ * Copyright PolySat, California Polytechnic State University, San Luis Obispo. cubesat@calpoly.edu
+ * This file is part of libproc, a PolySat library.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/**
+ * @file trace.h Binary trace log header file.
+ *
+ * High rate tracing into a memory mapped ring file.  Each TRACE() call
+ * stores a timestamp, the id of its format string and its raw arguments in
+ * a fixed size record.  Formatting happens offline with the trace_decode
+ * program, which reads the format strings from the same file.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Magic string at the start of every trace file
+#define TRACE_MAGIC "LPTRACE1"
+/// Version of the trace file layout
+#define TRACE_VERSION 1
+/// Maximum number of arguments stored with a record
+#define TRACE_MAX_ARGS 5
+/// Number of records kept when TRACE_open is passed 0
+#define TRACE_DEFAULT_RECORDS 65536
+/// Bytes reserved in the file for format strings
+#define TRACE_STRTAB_SIZE (64 * 1024)
+
+/**
+ * Trace file header.  The format string table follows the header and the
+ * record ring follows the table.
+ */
+struct TRACE_FileHeader {
+   char magic[8];
+   uint32_t version;
+   uint32_t headerSize;
+   uint32_t recordSize;
+   uint32_t recordCount;   ///< Power of two
+   uint32_t strtabSize;
+   uint32_t strtabUsed;
+   uint32_t nextFmtId;
+   uint32_t pid;
+   uint64_t written;       ///< Records ever written.  The ring keeps the last recordCount.
+   int64_t monoBaseNs;     ///< CLOCK_MONOTONIC when the file was created
+   int64_t realBaseNs;     ///< CLOCK_REALTIME at the same moment
+   char procName[32];
+};
+
+/**
+ * Format string table entry, padded to a multiple of 4 bytes.
+ */
+struct TRACE_StrEntry {
+   uint32_t id;
+   uint16_t len;           ///< Length of fmt including the terminator
+   uint16_t reserved;
+   char fmt[];
+};
+
+/**
+ * One trace record.  Arguments are widened to 64 bits; doubles are stored
+ * as their bit pattern.
+ */
+struct TRACE_Record {
+   uint64_t seq;           ///< Ring position + 1, 0 while being written
+   uint64_t ns;            ///< CLOCK_MONOTONIC time in nanoseconds
+   uint32_t fmtId;
+   uint32_t nargs;
+   uint64_t args[TRACE_MAX_ARGS];
+};
+
+/**
+ * Per call site state for TRACE().  The format string is parsed and
+ * assigned an id the first time the site is hit.
+ */
+struct TRACE_Site {
+   const char *fmt;
+   uint32_t id;
+   uint32_t gen;
+   uint8_t nargs;
+   uint8_t types[TRACE_MAX_ARGS];
+};
+
+/// Non-zero while a trace file is open
+extern int TRACE_enabled;
+
+/**
+ * Opens (creating or truncating) a trace file and starts recording.
+ *
+ * @param path     The trace file to write.
+ * @param records  Number of records the ring holds, rounded up to a power
+ *                 of two.  0 selects TRACE_DEFAULT_RECORDS.
+ * @param procName Process name stored in the header, may be NULL.
+ *
+ * @retval  0 on success
+ * @retval -1 on failure
+ */
+int TRACE_open(const char *path, uint32_t records, const char *procName);
+
+/**
+ * Stops recording and unmaps the trace file.  The file is left on disk.
+ */
+void TRACE_close(void);
+
+/**
+ * Records one trace entry.  Use the TRACE() macro instead of calling this
+ * directly.  Integer, pointer and floating point conversions are stored;
+ * %s stores only the string's address.
+ */
+void TRACE_record(struct TRACE_Site *site, ...);
+
+/// Counts the arguments passed to TRACE(), up to 16
+#define TRACE_NARGS(...) TRACE_NARGS_(0, ##__VA_ARGS__, \
+      16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define TRACE_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+      _13, _14, _15, _16, n, ...) n
+
+/**
+ * \brief Records a trace entry with a printf style format.  The format must
+ *  be a string literal and may have up to TRACE_MAX_ARGS arguments.  More
+ *  arguments fail to compile instead of being recorded as 0.
+ */
+#define TRACE(fmt, ...) do { \
+      typedef char trace_too_many_args_[ \
+         TRACE_NARGS(__VA_ARGS__) <= TRACE_MAX_ARGS ? 1 : -1] \
+         __attribute__((unused)); \
+      static struct TRACE_Site trace_site_ = { (fmt), 0, 0, 0, { 0 } }; \
+      if (TRACE_enabled) TRACE_record(&trace_site_, ##__VA_ARGS__); \
+   } while(0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
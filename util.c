@@ -16,6 +16,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <string.h>
+#include <errno.h>
 #include <limits.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -350,16 +351,34 @@ int UTIL_ensure_dir(const char *toDir)
 int UTIL_ensure_path(const char *toDir)
 {
    char buff[PATH_MAX];
+   char *curr;
 
    if (UTIL_ensure_dir(toDir))
       return 1;
+   // An empty path has no components to create
+   if (!toDir[0])
+      return 0;
 
-   snprintf(buff, sizeof(buff), "mkdir -p \"%s\"", toDir);
+   // Create each missing component in turn, like mkdir -p.  Done in process
+   //  so no shell inherits the signals libproc blocks for its signalfd.
+   strncpy(buff, toDir, sizeof(buff));
    buff[sizeof(buff)-1] = 0;
+   for (curr = buff + 1; ; curr++) {
+      if (*curr && *curr != '/')
+         continue;
+      if (*curr)
+         *curr = 0;
+      else
+         curr = NULL;
+
+      if (mkdir(buff, 0777) < 0 && errno != EEXIST) {
+         ERR_REPORT(DBG_LEVEL_WARN, "error creating directory");
+         return 0;
+      }
 
-   if(system(buff) == -1) {
-      ERR_REPORT(DBG_LEVEL_WARN, "error running mkdir");
-      return 0;
+      if (!curr)
+         break;
+      *curr = '/';
    }
 
    return UTIL_ensure_dir(toDir);
@@ -9,6 +9,7 @@
 #include "hashtable.h"
 #include <inttypes.h>
 #include <stdarg.h>
+#include <time.h>
 
 #define ASCII2HEX(c) ( ( (c) >= '0' && (c) <= '9' ? (c) - '0' : \
       ((c) >= 'A' && (c) <= 'F' ? (c) - 'A' + 10 : \
@@ -16,6 +17,18 @@
 
 
 static struct HashTable *structHash = NULL;
+// Populator caches, keyed by type.  Kept out of XDR_StructDefinition so
+//  statically generated definition arrays keep their layout.
+static struct HashTable *cacheHash = NULL;
+
+struct XDR_PopulatorCache {
+   uint32_t type;
+   unsigned int max_age;
+   struct timespec stamp;
+   char *data;
+   size_t len;
+   size_t alloc;
+};
 
 static size_t xdr_struct_hash_func(void *key)
 {
@@ -36,11 +49,46 @@ static int xdr_struct_cmp_key(void *key1, void *key2)
    return 0;
 }
 
+static void *xdr_cache_key_for_data(void *data)
+{
+   if (!data)
+      return 0;
+   return (void*)(uintptr_t)(((struct XDR_PopulatorCache*)data)->type);
+}
+
+static void xdr_free_cache(void *data)
+{
+   struct XDR_PopulatorCache *cache = (struct XDR_PopulatorCache*)data;
+
+   free(cache->data);
+   free(cache);
+}
+
+static struct XDR_PopulatorCache *xdr_cache_for_type(uint32_t type)
+{
+   if (!cacheHash)
+      return NULL;
+   return HASH_find_key(cacheHash, (void*)(uintptr_t)type);
+}
+
+static void xdr_clear_cache(uint32_t type)
+{
+   struct XDR_PopulatorCache *cache = xdr_cache_for_type(type);
+
+   if (cache)
+      cache->len = 0;
+}
+
 static void XDR_cleanup(void)
 {
    if (structHash)
       HASH_free_table(structHash);
    structHash = NULL;
+   if (cacheHash) {
+      HASH_extract(cacheHash, &xdr_free_cache);
+      HASH_free_table(cacheHash);
+   }
+   cacheHash = NULL;
 }
 
 void XDR_register_struct(struct XDR_StructDefinition *def)
@@ -80,6 +128,7 @@ void XDR_register_populator(XDR_populate_struct cb, void *arg, uint32_t type)
 
    def->populate = cb;
    def->populate_arg = arg;
+   xdr_clear_cache(type);
 }
 
 void XDR_replace_populator(XDR_populate_struct cb, void *arg, uint32_t type,
@@ -102,6 +151,105 @@ void XDR_replace_populator(XDR_populate_struct cb, void *arg, uint32_t type,
 
    def->populate = cb;
    def->populate_arg = arg;
+   xdr_clear_cache(type);
+}
+
+void XDR_register_cached_populator(XDR_populate_struct cb, void *arg,
+      uint32_t type, unsigned int max_age_ms)
+{
+   struct XDR_PopulatorCache *cache;
+
+   XDR_register_populator(cb, arg, type);
+   if (!XDR_definition_for_type(type))
+      return;
+
+   cache = xdr_cache_for_type(type);
+   if (!max_age_ms) {
+      if (cache)
+         xdr_free_cache(HASH_remove_data(cacheHash, cache));
+      return;
+   }
+
+   if (!cache) {
+      if (!cacheHash) {
+         cacheHash = HASH_create_table(37, &xdr_struct_hash_func,
+               &xdr_struct_cmp_key, &xdr_cache_key_for_data);
+         if (!cacheHash)
+            return;
+      }
+      cache = malloc(sizeof(*cache));
+      if (!cache)
+         return;
+      memset(cache, 0, sizeof(*cache));
+      cache->type = type;
+      if (HASH_add_data(cacheHash, cache) < 0) {
+         free(cache);
+         return;
+      }
+   }
+   cache->max_age = max_age_ms;
+   cache->len = 0;
+}
+
+int XDR_populator_is_cached(uint32_t type)
+{
+   return xdr_cache_for_type(type) != NULL;
+}
+
+const char *XDR_populator_cache_lookup(struct XDR_StructDefinition *def,
+      size_t *len)
+{
+   struct XDR_PopulatorCache *cache;
+   struct timespec now;
+   long age;
+
+   if (!def)
+      return NULL;
+   cache = xdr_cache_for_type(def->type);
+   if (!cache || !cache->len)
+      return NULL;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   age = (now.tv_sec - cache->stamp.tv_sec) * 1000 +
+      (now.tv_nsec - cache->stamp.tv_nsec) / 1000000;
+   if (age < 0 || age >= cache->max_age)
+      return NULL;
+
+   if (len)
+      *len = cache->len;
+   return cache->data;
+}
+
+void XDR_populator_cache_store(struct XDR_StructDefinition *def,
+      const char *data, size_t len)
+{
+   struct XDR_PopulatorCache *cache;
+   char *buff;
+
+   if (!def || !data || !len)
+      return;
+   cache = xdr_cache_for_type(def->type);
+   if (!cache)
+      return;
+
+   if (len > cache->alloc) {
+      buff = realloc(cache->data, len);
+      if (!buff) {
+         cache->len = 0;
+         return;
+      }
+      cache->data = buff;
+      cache->alloc = len;
+   }
+
+   memcpy(cache->data, data, len);
+   cache->len = len;
+   clock_gettime(CLOCK_MONOTONIC, &cache->stamp);
+}
+
+void XDR_populator_cache_invalidate(uint32_t type)
+{
+   xdr_clear_cache(type);
 }
 
 void XDR_set_struct_print_function(XDR_print_func func, uint32_t type)
@@ -138,7 +286,7 @@ int XDR_decode_byte_array(char *src, char **dst, size_t *used,
    memcpy(&byte_len, lenptr, sizeof(byte_len));
    padding = (4 - (byte_len % 4)) % 4;
    *used = 0;
-   if (!dst || byte_len + padding >= max)
+   if (!dst || byte_len + padding > max)
       return -1;
    *used = byte_len + padding;
 
@@ -165,7 +313,7 @@ int XDR_encode_byte_array(char **src, char *dst, size_t *used, size_t max,
    byte_len = *(int32_t*)lenptr;
    padding = (4 - (byte_len % 4)) % 4;
    *used = byte_len + padding;
-   if (!dst || !src || !*src || byte_len + padding >= max)
+   if (!dst || !src || !*src || byte_len + padding > max)
       return -1;
 
    memcpy(dst, *src, byte_len);
@@ -1031,9 +1179,25 @@ void XDR_struct_field_deallocator(void **goner,
 void XDR_struct_array_field_deallocator(void **goner,
       struct XDR_FieldDefinition *field)
 {
+   struct XDR_StructDefinition *def;
+   char *parent;
+   void *elem;
+   int32_t i, len;
+
    if (!goner || !*goner || !field)
       return;
 
+   // Release whatever each element owns before the array itself
+   def = XDR_definition_for_type(field->struct_id);
+   if (def) {
+      parent = (char*)goner - field->offset;
+      memcpy(&len, parent + field->len_offset, sizeof(len));
+      for (i = 0; i < len; i++) {
+         elem = (char*)*goner + i * def->in_memory_size;
+         XDR_struct_free_fields(&elem, def);
+      }
+   }
+
    free(*goner);
    *goner = NULL;
 }
@@ -104,6 +104,28 @@ extern void XDR_register_populator(XDR_populate_struct cb,
       void *arg, uint32_t type);
 extern void XDR_replace_populator(XDR_populate_struct cb, void *arg,
       uint32_t type, XDR_populate_struct *cbOut, void **argOut);
+/**
+ * Registers a populator whose encoded result is cached for max_age_ms.
+ * Data requests that arrive within that window are answered from the
+ * cached bytes instead of running the populator again.  A max_age_ms of
+ * 0 disables the cache.
+ */
+extern void XDR_register_cached_populator(XDR_populate_struct cb,
+      void *arg, uint32_t type, unsigned int max_age_ms);
+/**
+ * Returns the cached encoding of the type's populator result if it is
+ * younger than the cache's max age, NULL otherwise.  The bytes remain
+ * owned by the cache and are valid until the next store or invalidate.
+ */
+extern const char *XDR_populator_cache_lookup(struct XDR_StructDefinition *def,
+      size_t *len);
+/// Replaces the cached encoding of a populator's result, if caching is on
+extern void XDR_populator_cache_store(struct XDR_StructDefinition *def,
+      const char *data, size_t len);
+/// Returns non-zero if the type's populator results are cached
+extern int XDR_populator_is_cached(uint32_t type);
+/// Discards any cached populator result for the type
+extern void XDR_populator_cache_invalidate(uint32_t type);
 extern struct XDR_StructDefinition *XDR_definition_for_type(uint32_t type);
 extern void XDR_set_struct_print_function(XDR_print_func func, uint32_t type);
 extern void XDR_set_field_print_function(XDR_print_field_func func,
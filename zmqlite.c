@@ -5,7 +5,11 @@
 #include "debug.h"
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 
 static int zmql_client_raw_write(struct ZMQLClient *client, const void *data,
@@ -30,6 +34,11 @@ static char ZMQ_HANDSHAKE_DATA[] = { 0x04, 0x1A, 0x05, 'R', 'E', 'A', 'D', 'Y',
                                      'T', 'y', 'p', 'e', 0, 0, 0, 0x04,
                                      'P', 'A', 'I', 'R' };
 #define ZMQ_HANDSHAKE_LEN 28
+static char ZMQ_PUB_HANDSHAKE_DATA[] = { 0x04, 0x19, 0x05, 'R', 'E', 'A', 'D', 'Y',
+                                     0x0B, 'S', 'o', 'c', 'k', 'e', 't', '-',
+                                     'T', 'y', 'p', 'e', 0, 0, 0, 0x03,
+                                     'P', 'U', 'B' };
+#define ZMQ_PUB_HANDSHAKE_LEN 27
 
 #define ZMQ_MORE_DATA 0x1
 #define ZMQ_LONG_SIZE 0x2
@@ -40,6 +49,39 @@ static char ZMQ_HANDSHAKE_DATA[] = { 0x04, 0x1A, 0x05, 'R', 'E', 'A', 'D', 'Y',
 #define ntohll(x) ((1==ntohl(1)) ? (x) : ((uint64_t)ntohl((x) & 0xFFFFFFFF) << 32) | ntohl((x) >> 32))
 #endif
 
+// Maximum number of queued messages written with a single writev
+#define ZMQL_MAX_IOV 64
+// Default number of unsent bytes allowed to queue up for one client
+#define ZMQL_DEFAULT_HWM (1024 * 1024)
+// Longest subscription prefix accepted from a client
+#define ZMQL_MAX_TOPIC_LEN 256
+
+// A fully framed message, shared by every client it is queued on
+struct ZMQLMsg {
+   int refcnt;
+   size_t len;
+   char data[];
+};
+
+struct ZMQLOutNode {
+   struct ZMQLMsg *msg;
+   struct ZMQLOutNode *next;
+};
+
+struct ZMQLTopicSub {
+   struct ZMQLClient *client;
+   int count;
+   struct ZMQLTopicSub *next;
+};
+
+// One byte of a subscription prefix.  Children are kept sorted by byte.
+struct ZMQLTopicNode {
+   unsigned char ch;
+   struct ZMQLTopicNode *children;
+   struct ZMQLTopicNode *sibling;
+   struct ZMQLTopicSub *subs;
+};
+
 struct ZMQLClient {
    int socket;
    enum ZMQLState state;
@@ -51,11 +93,24 @@ struct ZMQLClient {
    zmql_client_message_cb msgCb;
    zmql_client_status_cb connectCb, disconnectCb;
    void *msgArg;
+   struct ZMQLOutNode *outHead, *outTail;
+   size_t outOffset;
+   size_t outBytes;
+   int writeArmed;
+   int writeFailed;
+   enum ZMQLSocketType type;
+   int subCount;
+   unsigned int pubGen;
 };
 
 struct ZMQLServer {
    int socket;
    int clientCount;
+   size_t hwm;
+   enum ZMQLHwmPolicy hwmPolicy;
+   enum ZMQLSocketType type;
+   struct ZMQLTopicNode topics;
+   unsigned int pubGen;
    struct ZMQLClient *clients;
    zmql_client_message_cb msgCb;
    zmql_client_status_cb connectCb, disconnectCb;
@@ -63,6 +118,423 @@ struct ZMQLServer {
    EVTHandler *evt;
 };
 
+static struct ZMQLMsg *zmql_msg_alloc(size_t len)
+{
+   struct ZMQLMsg *msg;
+
+   msg = (struct ZMQLMsg*)malloc(sizeof(*msg) + len);
+   if (!msg)
+      return NULL;
+   msg->refcnt = 1;
+   msg->len = len;
+
+   return msg;
+}
+
+static void zmql_msg_release(struct ZMQLMsg *msg)
+{
+   if (msg && --msg->refcnt == 0)
+      free(msg);
+}
+
+// Writes a ZMTP frame header for a len byte frame, returning its length
+static int zmql_frame_header(char *dst, uint64_t len, int more)
+{
+   uint64_t netLen;
+
+   if (len <= 255) {
+      dst[0] = more ? ZMQ_MORE_DATA : 0;
+      dst[1] = len;
+      return 2;
+   }
+
+   dst[0] = ZMQ_LONG_SIZE | (more ? ZMQ_MORE_DATA : 0);
+   netLen = htonll(len);
+   memcpy(&dst[1], &netLen, sizeof(netLen));
+   return 9;
+}
+
+// Frames the buffer as a single ZMTP message, preceded by a topic frame
+//  when topic is not NULL
+static struct ZMQLMsg *zmql_msg_frame(const void *topic, size_t topicLen,
+      struct IPCBuffer *buff)
+{
+   struct ZMQLMsg *msg;
+   uint64_t len;
+   size_t off = 0;
+
+   len = ipc_buffer_size(buff);
+   msg = zmql_msg_alloc((topic ? 9 + topicLen : 0) + 9 + len);
+   if (!msg)
+      return NULL;
+
+   if (topic) {
+      off += zmql_frame_header(&msg->data[off], topicLen, 1);
+      if (topicLen)
+         memcpy(&msg->data[off], topic, topicLen);
+      off += topicLen;
+   }
+   off += zmql_frame_header(&msg->data[off], len, 0);
+   if (len)
+      memcpy(&msg->data[off], ipc_buffer_data(buff), len);
+   msg->len = off + len;
+
+   return msg;
+}
+
+static void zmql_client_free_queue(struct ZMQLClient *client)
+{
+   struct ZMQLOutNode *node;
+
+   while ((node = client->outHead)) {
+      client->outHead = node->next;
+      zmql_msg_release(node->msg);
+      free(node);
+   }
+   client->outTail = NULL;
+   client->outOffset = 0;
+   client->outBytes = 0;
+}
+
+// A client that can not be written to any more is shut down.  Its read
+//  event then sees the closed socket and destroys it through the usual path.
+static void zmql_client_fail(struct ZMQLClient *client)
+{
+   client->writeFailed = 1;
+   zmql_client_free_queue(client);
+   shutdown(client->socket, SHUT_RDWR);
+}
+
+// Writes as much of the queue as the socket accepts without blocking
+static int zmql_client_flush(struct ZMQLClient *client)
+{
+   struct iovec iov[ZMQL_MAX_IOV];
+   struct ZMQLOutNode *node;
+   size_t offset;
+   ssize_t written;
+   int cnt;
+
+   while (client->outHead) {
+      offset = client->outOffset;
+      for (cnt = 0, node = client->outHead; node && cnt < ZMQL_MAX_IOV;
+            node = node->next, cnt++) {
+         iov[cnt].iov_base = node->msg->data + offset;
+         iov[cnt].iov_len = node->msg->len - offset;
+         offset = 0;
+      }
+
+      written = writev(client->socket, iov, cnt);
+      if (written < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+         ERRNO_WARN("Error writing to zmql client");
+         zmql_client_fail(client);
+         return -1;
+      }
+
+      client->outBytes -= written;
+      while (written > 0 && (node = client->outHead)) {
+         if ((size_t)written < node->msg->len - client->outOffset) {
+            client->outOffset += written;
+            break;
+         }
+         written -= node->msg->len - client->outOffset;
+         client->outOffset = 0;
+         client->outHead = node->next;
+         if (!client->outHead)
+            client->outTail = NULL;
+         zmql_msg_release(node->msg);
+         free(node);
+      }
+
+      if (client->outHead && client->outOffset)
+         return 0;
+   }
+
+   return 0;
+}
+
+static int zmql_client_write_cb(int fd, char type, void *arg)
+{
+   struct ZMQLClient *client = (struct ZMQLClient*)arg;
+
+   zmql_client_flush(client);
+   if (client->outHead)
+      return EVENT_KEEP;
+
+   client->writeArmed = 0;
+   return EVENT_REMOVE;
+}
+
+// Queues a reference to msg on the client and starts writing it
+static int zmql_client_enqueue(struct ZMQLClient *client, struct ZMQLMsg *msg)
+{
+   struct ZMQLOutNode *node;
+   struct ZMQLServer *server = client->server;
+
+   if (client->writeFailed)
+      return -1;
+
+   // Messages never start mid-frame, so only whole messages are dropped
+   if (server->hwm && client->outBytes + msg->len > server->hwm) {
+      if (server->hwmPolicy == ZMQL_HWM_DISCONNECT) {
+         DBG_print(DBG_LEVEL_WARN, "zmql client %s:%u exceeded its high "
+               "water mark, disconnecting", inet_ntoa(client->addr.sin_addr),
+               ntohs(client->addr.sin_port));
+         zmql_client_fail(client);
+      }
+      else
+         DBG_print(DBG_LEVEL_INFO, "zmql client %s:%u exceeded its high "
+               "water mark, dropping message",
+               inet_ntoa(client->addr.sin_addr),
+               ntohs(client->addr.sin_port));
+      return -1;
+   }
+
+   node = (struct ZMQLOutNode*)malloc(sizeof(*node));
+   if (!node)
+      return -1;
+   node->msg = msg;
+   node->next = NULL;
+   msg->refcnt++;
+
+   if (client->outTail)
+      client->outTail->next = node;
+   else
+      client->outHead = node;
+   client->outTail = node;
+   client->outBytes += msg->len;
+
+   if (client->writeArmed)
+      return 0;
+
+   if (zmql_client_flush(client) < 0)
+      return -1;
+   if (client->outHead) {
+      client->writeArmed = 1;
+      EVT_fd_add(server->evt, client->socket, EVENT_FD_WRITE,
+            zmql_client_write_cb, client);
+   }
+
+   return 0;
+}
+
+static struct ZMQLTopicNode *zmql_topic_child(struct ZMQLTopicNode *node,
+      unsigned char ch, int create)
+{
+   struct ZMQLTopicNode **itr, *child;
+
+   for (itr = &node->children; *itr && (*itr)->ch < ch;
+         itr = &(*itr)->sibling)
+      ;
+   if (*itr && (*itr)->ch == ch)
+      return *itr;
+   if (!create)
+      return NULL;
+
+   child = (struct ZMQLTopicNode*)calloc(1, sizeof(*child));
+   if (!child)
+      return NULL;
+   child->ch = ch;
+   child->sibling = *itr;
+   *itr = child;
+
+   return child;
+}
+
+// Unlinks and frees child once no subscription or longer prefix uses it
+static void zmql_topic_prune(struct ZMQLTopicNode *parent,
+      struct ZMQLTopicNode *child)
+{
+   struct ZMQLTopicNode **itr;
+
+   if (child->subs || child->children)
+      return;
+
+   for (itr = &parent->children; *itr; itr = &(*itr)->sibling) {
+      if (*itr == child) {
+         *itr = child->sibling;
+         free(child);
+         return;
+      }
+   }
+}
+
+// Drops one of the client's subscriptions to node, or all of them
+static void zmql_topic_drop_sub(struct ZMQLTopicNode *node,
+      struct ZMQLClient *client, int all)
+{
+   struct ZMQLTopicSub **itr, *sub;
+
+   for (itr = &node->subs; *itr; itr = &(*itr)->next) {
+      if ((*itr)->client != client)
+         continue;
+
+      sub = *itr;
+      if (all) {
+         client->subCount -= sub->count;
+         sub->count = 0;
+      }
+      else {
+         client->subCount--;
+         sub->count--;
+      }
+      if (sub->count <= 0) {
+         *itr = sub->next;
+         free(sub);
+      }
+      return;
+   }
+}
+
+static int zmql_topic_subscribe(struct ZMQLServer *server,
+      struct ZMQLClient *client, const unsigned char *prefix, size_t len)
+{
+   struct ZMQLTopicNode *node = &server->topics;
+   struct ZMQLTopicSub *sub;
+   size_t i;
+
+   // Any empty nodes left behind by a failed allocation are pruned when
+   //  the client goes away
+   for (i = 0; i < len; i++)
+      if (!(node = zmql_topic_child(node, prefix[i], 1)))
+         return -1;
+
+   for (sub = node->subs; sub && sub->client != client; sub = sub->next)
+      ;
+   if (!sub) {
+      sub = (struct ZMQLTopicSub*)calloc(1, sizeof(*sub));
+      if (!sub)
+         return -1;
+      sub->client = client;
+      sub->next = node->subs;
+      node->subs = sub;
+   }
+   sub->count++;
+   client->subCount++;
+
+   return 0;
+}
+
+static void zmql_topic_unsubscribe(struct ZMQLTopicNode *node,
+      struct ZMQLClient *client, const unsigned char *prefix, size_t len)
+{
+   struct ZMQLTopicNode *child;
+
+   if (!len) {
+      zmql_topic_drop_sub(node, client, 0);
+      return;
+   }
+
+   child = zmql_topic_child(node, prefix[0], 0);
+   if (!child)
+      return;
+   zmql_topic_unsubscribe(child, client, prefix + 1, len - 1);
+   zmql_topic_prune(node, child);
+}
+
+// Removes every subscription held by the client
+static void zmql_topic_purge(struct ZMQLTopicNode *node,
+      struct ZMQLClient *client)
+{
+   struct ZMQLTopicNode *child, *next;
+
+   zmql_topic_drop_sub(node, client, 1);
+   for (child = node->children; child; child = next) {
+      next = child->sibling;
+      zmql_topic_purge(child, client);
+      zmql_topic_prune(node, child);
+   }
+}
+
+// Handles a subscribe (on) or cancel request for prefix from the client
+static void zmql_client_subscribe(struct ZMQLClient *client,
+      const unsigned char *prefix, size_t len, int on)
+{
+   if (len > ZMQL_MAX_TOPIC_LEN) {
+      DBG_print(DBG_LEVEL_WARN, "zmql client %s:%u sent a %lu byte topic, "
+            "ignoring", inet_ntoa(client->addr.sin_addr),
+            ntohs(client->addr.sin_port), (unsigned long)len);
+      return;
+   }
+
+   if (on) {
+      if (zmql_topic_subscribe(client->server, client, prefix, len) < 0)
+         DBG_print(DBG_LEVEL_WARN, "Failed to record zmql subscription");
+   }
+   else
+      zmql_topic_unsubscribe(&client->server->topics, client, prefix, len);
+}
+
+// ZMTP 3.1 SUBSCRIBE and CANCEL commands.  Any other command is ignored.
+static void zmql_client_command(struct ZMQLClient *client,
+      const unsigned char *body, size_t len)
+{
+   size_t nameLen;
+
+   if (len < 1)
+      return;
+   nameLen = body[0];
+   if (len < 1 + nameLen)
+      return;
+
+   if (nameLen == 9 && 0 == memcmp(&body[1], "SUBSCRIBE", 9))
+      zmql_client_subscribe(client, &body[10], len - 10, 1);
+   else if (nameLen == 6 && 0 == memcmp(&body[1], "CANCEL", 6))
+      zmql_client_subscribe(client, &body[7], len - 7, 0);
+}
+
+// Queues framed on every client with a subscription matching the start of
+//  key, and on every PAIR client that never subscribed to anything
+static void zmql_deliver(struct ZMQLServer *server, struct ZMQLMsg *framed,
+      const unsigned char *key, size_t keyLen)
+{
+   struct ZMQLTopicNode *node = &server->topics;
+   struct ZMQLTopicSub *sub;
+   struct ZMQLClient *client;
+   unsigned int gen;
+   size_t i = 0;
+
+   // A client with several matching prefixes only gets one copy
+   if (++server->pubGen == 0)
+      server->pubGen = 1;
+   gen = server->pubGen;
+
+   while (node) {
+      for (sub = node->subs; sub; sub = sub->next) {
+         if (sub->client->pubGen == gen)
+            continue;
+         sub->client->pubGen = gen;
+         zmql_client_enqueue(sub->client, framed);
+      }
+      if (i >= keyLen)
+         break;
+      node = zmql_topic_child(node, key[i++], 0);
+   }
+
+   for (client = server->clients; client; client = client->next)
+      if (client->state == ZMQL_DATA && client->type == ZMQL_SOCKET_PAIR &&
+            !client->subCount)
+         zmql_client_enqueue(client, framed);
+}
+
+void zmql_set_socket_type(struct ZMQLServer *server,
+      enum ZMQLSocketType type)
+{
+   if (server)
+      server->type = type;
+}
+
+void zmql_set_high_water_mark(struct ZMQLServer *server, size_t bytes,
+      enum ZMQLHwmPolicy policy)
+{
+   if (!server)
+      return;
+
+   server->hwm = bytes;
+   server->hwmPolicy = policy;
+}
+
 int zmql_server_socket(struct ZMQLServer *server)
 {
    if (server)
@@ -110,7 +582,13 @@ static size_t zmql_client_process(const char *data, size_t dataLen, void *arg)
       if (dataLen < ZMQ_AUTH_LEN)
          return 0;
       if (0 == memcmp(data, ZMQ_AUTH_DATA, ZMQ_AUTH_LEN)) {
-         zmql_client_raw_write(client, ZMQ_HANDSHAKE_DATA, ZMQ_HANDSHAKE_LEN);
+         client->type = client->server->type;
+         if (client->type == ZMQL_SOCKET_PUB)
+            zmql_client_raw_write(client, ZMQ_PUB_HANDSHAKE_DATA,
+                  ZMQ_PUB_HANDSHAKE_LEN);
+         else
+            zmql_client_raw_write(client, ZMQ_HANDSHAKE_DATA,
+                  ZMQ_HANDSHAKE_LEN);
          client->state = ZMQL_DATA;
          if (client->connectCb)
             client->connectCb(client, client->msgArg);
@@ -139,14 +617,24 @@ static size_t zmql_client_process(const char *data, size_t dataLen, void *arg)
          dataOffset = 2;
          if (dataLen < dataOffset)
             return 0;
-         payloadLen = data[1];
+         payloadLen = (unsigned char)data[1];
       }
 
       // Make sure we have the entire message buffered
       if (dataLen < (dataOffset + payloadLen))
          return 0;
 
-      if (!(flags & ZMQ_COMMAND)) {
+      if (flags & ZMQ_COMMAND)
+         zmql_client_command(client,
+               (const unsigned char*)&data[dataOffset], payloadLen);
+      // ZMTP 3.0 subscribers send subscriptions as messages starting with
+      //  a 1 (subscribe) or 0 (cancel) byte
+      else if (client->type == ZMQL_SOCKET_PUB && payloadLen > 0 &&
+            (data[dataOffset] == 0 || data[dataOffset] == 1))
+         zmql_client_subscribe(client,
+               (const unsigned char*)&data[dataOffset + 1], payloadLen - 1,
+               data[dataOffset]);
+      else {
          if (client->msgCb)
             client->msgCb(client, &data[dataOffset], payloadLen,
                           client->msgArg);
@@ -251,6 +739,8 @@ struct ZMQLServer *zmql_create_tcp_server(EVTHandler *evt, int port,
       return NULL;
    }
    server->evt = evt;
+   server->hwm = ZMQL_DEFAULT_HWM;
+   server->hwmPolicy = ZMQL_HWM_DROP;
    server->msgCb = cb;
    server->msgArg = arg;
    server->connectCb = con_cb;
@@ -308,6 +798,11 @@ void zmql_destroy_client(struct ZMQLClient **goner)
       DBG_print(DBG_LEVEL_INFO, "Removing FD event for %p.", client);
       EVT_fd_remove(client->server->evt, client->socket, EVENT_FD_READ);
    }
+   if (client->writeArmed)
+      EVT_fd_remove(client->server->evt, client->socket, EVENT_FD_WRITE);
+   zmql_client_free_queue(client);
+   if (client->subCount)
+      zmql_topic_purge(&client->server->topics, client);
    if (client->state == ZMQL_DATA && client->disconnectCb)
       client->disconnectCb(client, client->msgArg);
 
@@ -325,50 +820,64 @@ void zmql_destroy_client(struct ZMQLClient **goner)
 static int zmql_client_raw_write(struct ZMQLClient *client, const void *data,
       int dlen)
 {
-   int len;
+   struct ZMQLMsg *msg;
+   int res;
 
-   len = write(client->socket, data, dlen);
+   msg = zmql_msg_alloc(dlen);
+   if (!msg)
+      return -1;
+   memcpy(msg->data, data, dlen);
 
-   if (len != dlen)
-      DBG_print(DBG_LEVEL_WARN, "Short ZMQ write");
+   res = zmql_client_enqueue(client, msg);
+   zmql_msg_release(msg);
 
-   return len;
+   return res < 0 ? res : dlen;
 }
 
 int zmql_write_buffer(struct ZMQLClient *client, struct IPCBuffer *msg)
 {
-   uint64_t len;
-   char header[10];
-   int hlen = 2;
+   struct ZMQLMsg *framed;
 
    if (client->state != ZMQL_DATA)
       return 0;
 
-   len = ipc_buffer_size(msg);
+   framed = zmql_msg_frame(NULL, 0, msg);
+   if (!framed)
+      return -1;
 
-   if (len <= 255) {
-      header[0] = 0;
-      header[1] = len;
-   }
-   else {
-      header[0] = ZMQ_LONG_SIZE;
-      len = htonll(len);
-      memcpy(&header[1], &len, sizeof(len));
-      hlen = 9;
-   }
-
-   zmql_client_raw_write(client, header, hlen);
-   ipc_write_buffer_sync(client->socket, msg);
+   zmql_client_enqueue(client, framed);
+   zmql_msg_release(framed);
 
    return 0;
 }
 
 void zmql_broadcast_buffer(struct ZMQLServer *server, struct IPCBuffer *msg)
 {
-   struct ZMQLClient *client;
+   struct ZMQLMsg *framed;
 
-   for (client = server->clients; client; client = client->next)
-      zmql_write_buffer(client, msg);
+   // Frame the message once and share it between all the clients
+   framed = zmql_msg_frame(NULL, 0, msg);
+   if (!framed)
+      return;
+
+   zmql_deliver(server, framed, (const unsigned char*)ipc_buffer_data(msg),
+         ipc_buffer_size(msg));
+   zmql_msg_release(framed);
+}
+
+int zmql_publish_buffer(struct ZMQLServer *server, const void *topic,
+      size_t topicLen, struct IPCBuffer *msg)
+{
+   struct ZMQLMsg *framed;
+
+   framed = zmql_msg_frame(topic, topicLen, msg);
+   if (!framed)
+      return -1;
+
+   zmql_deliver(server, framed, (const unsigned char*)topic, topicLen);
+   zmql_msg_release(framed);
+
+   return 0;
 }
 
 int zmql_client_count(struct ZMQLServer *server)
@@ -3,11 +3,27 @@
 
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct ZMQLServer;
 struct ZMQLClient;
 struct EventState;
 struct IPCBuffer;
 
+// What to do with a client whose unsent data exceeds the high water mark
+enum ZMQLHwmPolicy { ZMQL_HWM_DROP, ZMQL_HWM_DISCONNECT };
+
+/**
+ * Socket type advertised to clients during the handshake.  A PAIR server
+ *  sends every message to clients that have not subscribed to anything.
+ *  A PUB server only sends to subscribed clients and treats messages that
+ *  start with a 0 or 1 byte as ZMTP 3.0 unsubscribe and subscribe
+ *  requests.  Both accept ZMTP 3.1 SUBSCRIBE and CANCEL commands.
+ */
+enum ZMQLSocketType { ZMQL_SOCKET_PAIR, ZMQL_SOCKET_PUB };
+
 typedef int (*zmql_client_message_cb)(struct ZMQLClient *client,
       const void *data, size_t dataLen, void *arg);
 typedef void (*zmql_client_status_cb)(struct ZMQLClient *client, void *arg);
@@ -19,8 +35,23 @@ void zmql_destroy_tcp_server(struct ZMQLServer **goner);
 void zmql_destroy_client(struct ZMQLClient **goner);
 void zmql_broadcast_buffer(struct ZMQLServer *server, struct IPCBuffer *msg);
 int zmql_write_buffer(struct ZMQLClient *client, struct IPCBuffer *msg);
+/**
+ * Sends msg as a two frame message, topic then msg, to every client
+ *  subscribed to a prefix of the topic.  The message is framed once and
+ *  shared between all the recipients.
+ */
+int zmql_publish_buffer(struct ZMQLServer *server, const void *topic,
+      size_t topicLen, struct IPCBuffer *msg);
 int zmql_client_count(struct ZMQLServer *server);
+void zmql_set_socket_type(struct ZMQLServer *server,
+      enum ZMQLSocketType type);
+void zmql_set_high_water_mark(struct ZMQLServer *server, size_t bytes,
+      enum ZMQLHwmPolicy policy);
 int zmql_server_socket(struct ZMQLServer *server);
 struct ZMQLServer *zmql_server_for_client(struct ZMQLClient *client);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif